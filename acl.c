@@ -0,0 +1,242 @@
+/*
+ * acl.c:
+ * Access control by client address.
+ *
+ * The access-allow and access-deny directives give lists of networks from
+ * which connections are allowed or refused. These are compiled, when the
+ * configuration is read, into a binary trie for each listener, so that
+ * checking a new connection is a walk of at most 32 nodes, rather than the
+ * parsing of hosts.allow and hosts.deny (and possible DNS lookups) which TCP
+ * Wrappers does for each connection. A connection is governed by the most
+ * specific network which contains the client's address; one which is in no
+ * listed network is allowed.
+ *
+ * Copyright (c) 2026 the tpop3d contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#include "configuration.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "acl.h"
+#include "config.h"
+#include "listener.h"
+#include "tokenise.h"
+#include "util.h"
+
+/* acl_new
+ * Create a new access-control list, which allows everything. */
+acl acl_new(void) {
+    acl A;
+    alloc_struct(_acl, A);
+    A->nalloc = 16;
+    A->nodes = xcalloc(A->nalloc, sizeof *A->nodes);
+    A->nnodes = 1;      /* root, which stands for 0.0.0.0/0 */
+    return A;
+}
+
+/* acl_delete ACL
+ * Free ACL. */
+void acl_delete(acl A) {
+    if (!A) return;
+    xfree(A->nodes);
+    xfree(A);
+}
+
+/* acl_add ACL NETWORK BITS ACTION LEVEL
+ * Record in ACL that connections from NETWORK/BITS should be treated according
+ * to ACTION. A rule of a higher LEVEL replaces one for the same network of a
+ * lower level; where rules of the same level conflict, deny wins. */
+void acl_add(acl A, const struct in_addr net, const int bits, const enum acl_action action, const int level) {
+    unsigned long x = ntohl(net.s_addr);
+    struct aclnode *N;
+    int i, n = 0;
+
+    for (i = 0; i < bits; ++i) {
+        int b = (x >> (31 - i)) & 1;
+        if (!A->nodes[n].child[b]) {
+            if (A->nnodes == A->nalloc) {
+                A->nodes = xrealloc(A->nodes, 2 * A->nalloc * sizeof *A->nodes);
+                memset(A->nodes + A->nalloc, 0, A->nalloc * sizeof *A->nodes);
+                A->nalloc *= 2;
+            }
+            A->nodes[n].child[b] = A->nnodes++;
+        }
+        n = A->nodes[n].child[b];
+    }
+
+    N = A->nodes + n;
+    if (N->action == acl_none || N->level < level) {
+        N->action = action;
+        N->level = level;
+    } else if (N->level == level && N->action != action)
+        N->action = acl_deny;
+}
+
+/* acl_permits ACL ADDRESS
+ * Is a connection from ADDRESS allowed by ACL? A NULL ACL allows everything. */
+int acl_permits(const acl A, const struct in_addr addr) {
+    unsigned long x = ntohl(addr.s_addr);
+    enum acl_action action = acl_none;
+    int i = 0, n = 0;
+
+    if (!A)
+        return 1;
+
+    /* Walk down the trie, remembering the most specific rule we pass. */
+    do {
+        if (A->nodes[n].action != acl_none)
+            action = A->nodes[n].action;
+        if (i == 32)
+            break;
+        n = A->nodes[n].child[(x >> (31 - i++)) & 1];
+    } while (n);
+
+    return action != acl_deny;
+}
+
+/* A rule from the configuration file, before it is compiled. */
+struct rule {
+    struct in_addr net;
+    int bits;
+    enum acl_action action;
+    int have_local;             /* applies only on the listener below */
+    struct in_addr local;
+    unsigned short port;        /* network byte order; 0 for any */
+};
+
+/* parse_rule RULE ACTION TEXT
+ * Parse TEXT, of the form network[/bits][@address[:port]], into RULE, returning
+ * 1 on success or 0 on failure. */
+static int parse_rule(struct rule *R, const enum acl_action action, const char *text) {
+    char *s, *p, *q;
+    int ret = 0;
+
+    memset(R, 0, sizeof *R);
+    R->action = action;
+    R->bits = 32;
+    s = xstrdup(text);
+
+    if ((p = strchr(s, '@'))) {
+        *p++ = 0;
+        if ((q = strchr(p, ':'))) {
+            char *e;
+            long l;
+            *q++ = 0;
+            l = strtol(q, &e, 10);
+            if (!*q || *e || l < 1 || l > 65535)
+                goto fail;
+            R->port = htons((unsigned short)l);
+        }
+        if (!inet_aton(p, &R->local))
+            goto fail;
+        R->have_local = 1;
+    }
+
+    if ((p = strchr(s, '/'))) {
+        char *e;
+        *p++ = 0;
+        R->bits = (int)strtol(p, &e, 10);
+        if (!*p || *e || R->bits < 0 || R->bits > 32)
+            goto fail;
+    }
+
+    if (!inet_aton(s, &R->net))
+        goto fail;
+
+    /* Ignore any bits set beyond the prefix. */
+    if (R->bits < 32)
+        R->net.s_addr &= htonl(R->bits ? ~0UL << (32 - R->bits) : 0);
+
+    ret = 1;
+
+fail:
+    xfree(s);
+    return ret;
+}
+
+/* acl_configure LISTENERS
+ * Compile the access-allow and access-deny directives into an access-control
+ * list for each of LISTENERS. Returns the number of rules, or -1 if any of them
+ * is not understood. */
+int acl_configure(vector listeners) {
+    static const struct {
+        char *directive;
+        enum acl_action action;
+    } lists[] = {{"access-allow", acl_allow}, {"access-deny", acl_deny}};
+    struct rule *rules = NULL;
+    int nrules = 0, i, j;
+    item *t;
+
+    for (i = 0; i < sizeof lists / sizeof *lists; ++i) {
+        char *s;
+        tokens T;
+        if (!(s = config_get_string(lists[i].directive)))
+            continue;
+        T = tokens_new(s, " \t,");
+        rules = xrealloc(rules, (nrules + T->num) * sizeof *rules);
+        for (j = 0; j < T->num; ++j) {
+            if (!parse_rule(rules + nrules, lists[i].action, T->toks[j])) {
+                log_print(LOG_ERR, _("acl_configure: %s: `%s' is not of the form network[/bits][@address[:port]]"), lists[i].directive, T->toks[j]);
+                tokens_delete(T);
+                xfree(rules);
+                return -1;
+            }
+            ++nrules;
+        }
+        tokens_delete(T);
+    }
+
+    if (!nrules)
+        return 0;
+
+    for (j = 0; j < nrules; ++j) {
+        int used = !rules[j].have_local;
+        vector_iterate(listeners, t) {
+            listener L = (listener)t->v;
+            if (!L->acl)
+                L->acl = acl_new();
+            if (!rules[j].have_local)
+                acl_add(L->acl, rules[j].net, rules[j].bits, rules[j].action, 0);
+            else if (rules[j].local.s_addr == L->sin.sin_addr.s_addr
+                     && (!rules[j].port || rules[j].port == L->sin.sin_port)) {
+                acl_add(L->acl, rules[j].net, rules[j].bits, rules[j].action, 1);
+                used = 1;
+            }
+        }
+        if (!used) {
+            char net[16];
+            strcpy(net, inet_ntoa(rules[j].net));
+            log_print(LOG_WARNING, _("acl_configure: rule for %s/%d applies to %s, which is not a listen address"), net, rules[j].bits, inet_ntoa(rules[j].local));
+        }
+    }
+
+    xfree(rules);
+    return nrules;
+}
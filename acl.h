@@ -0,0 +1,52 @@
+/*
+ * acl.h:
+ * access control by client address
+ *
+ * Copyright (c) 2026 the tpop3d contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __ACL_H_ /* include guard */
+#define __ACL_H_
+
+#include <sys/types.h>
+
+#include <netinet/in.h>
+
+#include "vector.h"
+
+enum acl_action { acl_none = 0, acl_allow, acl_deny };
+
+/* An access-control list is a binary trie of networks, in which each node
+ * which ends a network given in a rule records whether that network is allowed
+ * or denied. */
+typedef struct _acl {
+    struct aclnode {
+        int child[2];               /* index of child for 0 and 1 bits, or 0 */
+        unsigned char action;       /* enum acl_action */
+        unsigned char level;        /* 0 for a global rule, 1 per-listener */
+    } *nodes;
+    int nnodes, nalloc;
+} *acl;
+
+acl acl_new(void);
+void acl_delete(acl A);
+void acl_add(acl A, const struct in_addr net, const int bits, const enum acl_action action, const int level);
+int acl_permits(const acl A, const struct in_addr addr);
+
+int acl_configure(vector listeners);
+
+#endif /* __ACL_H_ */
@@ -0,0 +1,364 @@
+/*
+ * auth_cdb.c:
+ * Authenticate users using a constant database (cdb) file
+ *
+ * Copyright (c) 2026 the tpop3d contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "configuration.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifdef AUTH_CDB
+
+#include <sys/types.h>
+
+#ifdef HAVE_CRYPT_H /* XXX */
+#include <crypt.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "auth_cdb.h"
+#include "authswitch.h"
+#include "password.h"
+#include "config.h"
+#include "util.h"
+
+static gid_t virtual_gid;
+static uid_t virtual_uid;
+static char *user_passwd_file;
+
+/* The database is read into memory and lookups are made in that copy, so a
+ * file which is rewritten under us cannot fault the process as a shared
+ * mapping would. A cdb file is normally never modified once written -- tools
+ * which build them write a temporary file and rename(2) it over the old one --
+ * so a change of device, inode, size or modification time tells us that there
+ * is a new file to read. */
+static struct {
+    unsigned char *data;
+    size_t len;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+} db;
+
+/* CDB_HEADER_LEN
+ * Length of the fixed table of 256 (position, length) pairs at the start of
+ * every cdb file. */
+#define CDB_HEADER_LEN      2048
+
+/* cdb_unpack P
+ * Return the little-endian 32-bit quantity at P. */
+static unsigned long cdb_unpack(const unsigned char *p) {
+    return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* cdb_hash KEY LEN
+ * The 32-bit hash function used by cdb. */
+static unsigned long cdb_hash(const char *key, size_t len) {
+    unsigned long h = 5381;
+    while (len-- > 0)
+        h = (((h << 5) + h) ^ (unsigned char)*key++) & 0xffffffffUL;
+    return h;
+}
+
+/* cdb_unload
+ * Release any copy of the database. */
+static void cdb_unload(void) {
+    if (db.data)
+        xfree(db.data);
+    db.data = NULL;
+    db.len = 0;
+}
+
+/* cdb_load
+ * Ensure that the current version of the database file is loaded. Returns 1
+ * on success or 0 on failure, in which case any older copy is retained. */
+static int cdb_load(void) {
+    struct stat st;
+    unsigned char *p;
+    size_t len = 0;
+    int fd;
+
+    if (stat(user_passwd_file, &st) == -1) {
+        log_print(LOG_ERR, "cdb_load: %s: %m", user_passwd_file);
+        return db.data != NULL;
+    }
+
+    if (db.data && st.st_dev == db.dev && st.st_ino == db.ino) {
+        if ((size_t)st.st_size == db.len && st.st_mtime == db.mtime)
+            return 1;
+        /* Someone has rewritten the file in place; we may see it half
+         * written, but our old copy is at least self-consistent. */
+        log_print(LOG_WARNING, _("cdb_load: %s: file was modified in place; it should be replaced by renaming a new file over it"), user_passwd_file);
+    }
+
+    if ((fd = open(user_passwd_file, O_RDONLY)) == -1) {
+        log_print(LOG_ERR, "cdb_load: %s: %m", user_passwd_file);
+        return db.data != NULL;
+    }
+
+    /* Stat the descriptor we actually have, in case the file was replaced
+     * between the stat and the open. */
+    if (fstat(fd, &st) == -1) {
+        log_print(LOG_ERR, "cdb_load: %s: fstat: %m", user_passwd_file);
+        close(fd);
+        return db.data != NULL;
+    } else if (st.st_size < CDB_HEADER_LEN) {
+        log_print(LOG_ERR, _("cdb_load: %s: file is not a cdb database"), user_passwd_file);
+        close(fd);
+        return db.data != NULL;
+    }
+
+    p = xmalloc((size_t)st.st_size);
+    while (len < (size_t)st.st_size) {
+        ssize_t n;
+        if ((n = read(fd, p + len, (size_t)st.st_size - len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            log_print(LOG_ERR, "cdb_load: %s: read: %m", user_passwd_file);
+            break;
+        } else if (n == 0)
+            break;
+        len += n;
+    }
+
+    close(fd);
+
+    if (len != (size_t)st.st_size) {
+        /* Error, or the file was truncated under us. */
+        if (len < (size_t)st.st_size)
+            log_print(LOG_ERR, _("cdb_load: %s: file changed while it was being read"), user_passwd_file);
+        xfree(p);
+        return db.data != NULL;
+    }
+
+    if (db.data)
+        log_print(LOG_INFO, _("cdb_load: %s: file has changed; using new version"), user_passwd_file);
+
+    cdb_unload();
+    db.data = p;
+    db.len = len;
+    db.dev = st.st_dev;
+    db.ino = st.st_ino;
+    db.mtime = st.st_mtime;
+
+    return 1;
+}
+
+/* cdb_find KEY VALUELEN
+ * Look up KEY in the database, returning a pointer to the value and saving
+ * its length in VALUELEN, or NULL if the key is not present. The result points
+ * into the loaded copy and is valid only until the next call to cdb_load. */
+static const unsigned char *cdb_find(const char *key, size_t *valuelen) {
+    unsigned long h, tpos, tslots, slot, i, klen, rpos;
+    size_t keylen;
+
+    keylen = strlen(key);
+    h = cdb_hash(key, keylen);
+
+    tpos = cdb_unpack(db.data + (h & 0xff) * 8);
+    tslots = cdb_unpack(db.data + (h & 0xff) * 8 + 4);
+    if (tslots == 0)
+        return NULL;
+    else if (tpos > db.len || tslots > (db.len - tpos) / 8)
+        goto corrupt;
+
+    /* Linear probing from the slot given by the rest of the hash. An empty
+     * slot ends the search. */
+    slot = (h >> 8) % tslots;
+    for (i = 0; i < tslots; ++i) {
+        const unsigned char *s;
+
+        s = db.data + tpos + 8 * slot;
+        if ((rpos = cdb_unpack(s + 4)) == 0)
+            return NULL;
+
+        if (cdb_unpack(s) == h) {
+            if (rpos > db.len - 8)
+                goto corrupt;
+            klen = cdb_unpack(db.data + rpos);
+            *valuelen = cdb_unpack(db.data + rpos + 4);
+            if (klen > db.len - rpos - 8 || *valuelen > db.len - rpos - 8 - klen)
+                goto corrupt;
+            if (klen == keylen && memcmp(db.data + rpos + 8, key, keylen) == 0)
+                return db.data + rpos + 8 + klen;
+        }
+
+        if (++slot == tslots)
+            slot = 0;
+    }
+
+    return NULL;
+
+corrupt:
+    log_print(LOG_ERR, _("cdb_find: %s: database is corrupt"), user_passwd_file);
+    return NULL;
+}
+
+/* read_user_passwd LOCALPART DOMAIN
+ * Return the password hash stored for LOCALPART@DOMAIN, in a buffer which
+ * the caller must free, or NULL if the user is not found. */
+static char *read_user_passwd(const char *local_part, const char *domain) {
+    const unsigned char *v;
+    char *address, *pwhash = NULL;
+    size_t len;
+
+    if (!cdb_load())
+        return NULL;
+
+    address = xmalloc(strlen(local_part) + strlen(domain) + 2);
+    sprintf(address, "%s@%s", local_part, domain);
+
+    if ((v = cdb_find(address, &len))) {
+        /* Values may or may not include a terminating NUL. */
+        if (len > 0 && v[len - 1] == 0)
+            --len;
+        pwhash = xmalloc(len + 1);
+        memcpy(pwhash, v, len);
+        pwhash[len] = 0;
+    }
+
+    xfree(address);
+
+    return pwhash;
+}
+
+/* auth_cdb_init:
+ * Initialise the driver. Reads the config directives and reads the
+ * database. */
+int auth_cdb_init() {
+    char *s;
+
+    /* Obtain uid to use */
+    if ((s = config_get_string("auth-cdb-mail-user"))) {
+        if (!parse_uid(s, &virtual_uid)) {
+            log_print(LOG_ERR, _("auth_cdb_init: auth-cdb-mail-user directive `%s' does not make sense"), s);
+            return 0;
+        }
+    } else {
+        log_print(LOG_ERR, _("auth_cdb_init: no auth-cdb-mail-user directive in config"));
+        return 0;
+    }
+
+    /* Obtain gid to use */
+    if ((s = config_get_string("auth-cdb-mail-group"))) {
+        if (!parse_gid(s, &virtual_gid)) {
+            log_print(LOG_ERR, _("auth_cdb_init: auth-cdb-mail-group directive `%s' does not make sense"), s);
+            return 0;
+        }
+    } else {
+        log_print(LOG_ERR, _("auth_cdb_init: no auth-cdb-mail-group directive in config"));
+        return 0;
+    }
+
+    /* Obtain path to database */
+    if ((s = config_get_string("auth-cdb-passwd-file")))
+        user_passwd_file = s;
+    else {
+        log_print(LOG_ERR, _("auth_cdb_init: no auth-cdb-passwd-file directive in config"));
+        return 0;
+    }
+
+    if (!cdb_load()) {
+        log_print(LOG_ERR, _("auth_cdb_init: could not open cdb file"));
+        return 0;
+    }
+
+    return 1;
+}
+
+/* auth_cdb_new_user_pass:
+ * Attempt to authenticate user and pass using a cdb file. This is a
+ * virtual-domains authenticator. */
+authcontext auth_cdb_new_user_pass(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost /* unused */, const char *serverhost /* unused */) {
+    authcontext a = NULL;
+    char *who, *pwhash;
+
+    if (!local_part) {
+        auth_rejected = 1;  /* not a virtual-domain user */
+        return NULL;
+    }
+
+    who = username_string(user, local_part, domain);
+
+    if (!(pwhash = read_user_passwd(local_part, domain))) {
+        log_print(LOG_ERR, _("auth_cdb_new_user_pass: could not find user %s"), who);
+        auth_rejected = (db.data != NULL);  /* else we have no database at all */
+        return NULL;
+    }
+
+    if (check_password(who, pwhash, pass, "{crypt}"))
+        a = authcontext_new(virtual_uid, virtual_gid, NULL, NULL, NULL);
+    else {
+        log_print(LOG_ERR, _("auth_cdb_new_user_pass: failed login for %s"), who);
+        auth_rejected = 1;
+    }
+
+    xfree(pwhash);
+
+    return a;
+}
+
+/* auth_cdb_new_apop:
+ * Attempt to authenticate user via APOP using a cdb file. This is a
+ * virtual-domains authenticator. */
+authcontext auth_cdb_new_apop(const char *user, const char *local_part, const char *domain, const char *timestamp, const unsigned char *digest, const char *clienthost /* unused */, const char *serverhost /* unused */) {
+    authcontext a = NULL;
+    char *who, *pwhash;
+
+    if (!local_part) return NULL;
+
+    who = username_string(user, local_part, domain);
+
+    if (!(pwhash = read_user_passwd(local_part, domain))) {
+        log_print(LOG_ERR, _("auth_cdb_new_apop: could not find user %s"), who);
+        return NULL;
+    }
+
+    if (check_password_apop(who, pwhash, timestamp, digest))
+        a = authcontext_new(virtual_uid, virtual_gid, NULL, NULL, NULL);
+    else
+        log_print(LOG_ERR, _("auth_cdb_new_apop: failed login for %s"), who);
+
+    xfree(pwhash);
+
+    return a;
+}
+
+/* auth_cdb_postfork:
+ * Drop the copy of the database in a child process, which has no further use for it. */
+void auth_cdb_postfork() {
+    cdb_unload();
+}
+
+/* auth_cdb_close:
+ * Shut down the driver. */
+void auth_cdb_close() {
+    cdb_unload();
+}
+
+#endif /* AUTH_CDB */
@@ -28,12 +28,15 @@
 static const char rcsid[] = "$Id$";
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_CRYPT_H /* XXX */
 #include <crypt.h>
 #endif
 
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
 #include <stdio.h>
@@ -93,85 +96,255 @@ fail:
     return ret;
 }
 
-/* read_user_passwd LOCALPART DOMAIN
- * Read the password hash from the proper flat file for the given LOCALPART and
- * DOMAIN. Returns the password or NULL if not found. The files are structured
- * with colon-separated fields, where the first field is the local-part and the
- * second field to the password hash. Any subsequent fields are ignored. */
-static char *read_user_passwd(const char *local_part, const char *domain) {
-    FILE *fp = NULL;
-    char *filename = NULL, *result = NULL;
-    struct sverr err;
-    static char *buf, *pwhash;
-    static size_t buflen;
-    size_t i, linenum;
-    int c;
+/*
+ * Index of password files. Each file is read into memory and indexed by local
+ * part the first time it is used, and again whenever it is replaced or
+ * modified, so that looking up a user costs a stat(2) and a hash lookup rather
+ * than a scan of the file. The most recently used FLATFILE_MAX_CACHED files
+ * are kept.
+ *
+ * A file rewritten in place within the same second, and to the same size,
+ * looks unchanged if only whole-second times are compared. Where the system
+ * records finer times we compare those too; where it does not, we don't trust
+ * a file modified within a second of when we read it, and read it again.
+ */
+#define FLATFILE_MAX_CACHED     64
+
+struct ffentry {
+    char *local_part, *pwhash;  /* point into data */
+    int next;                   /* next in hash chain, or -1 */
+};
+
+static struct flatfile {
+    char *name;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime, ctime;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM) && defined(HAVE_STRUCT_STAT_ST_CTIM)
+    long mtime_ns, ctime_ns;
+#else
+    time_t loaded;              /* when we read the file */
+#endif
+    off_t size;
+    char *data;
+    struct ffentry *entries;
+    int nentries, *buckets;
+    unsigned int nbuckets;      /* a power of two */
+    struct flatfile *next;
+} *flatfiles;
+
+static int nflatfiles;
+
+/* hash_string STRING
+ * Return a hash of STRING. */
+static unsigned int hash_string(const char *s) {
+    unsigned int h = 0;
+    for (; *s; ++s)
+        h = h * 31 + (unsigned char)*s;
+    return h;
+}
 
-    if (!(filename = substitute_variables(user_passwd_file_template, &err, 1, "domain", domain))) {
-        log_print(LOG_ERR, _("read_user_passwd: %s near `%.16s'"), err.msg, user_passwd_file_template + err.offset);
-        goto fail;
+/* flatfile_free FILE
+ * Free FILE and its index. */
+static void flatfile_free(struct flatfile *F) {
+    xfree(F->name);
+    xfree(F->data);
+    xfree(F->entries);
+    xfree(F->buckets);
+    xfree(F);
+}
+
+/* flatfile_find FILE LOCALPART
+ * Return the index entry for LOCALPART in FILE, or NULL if there is none. */
+static struct ffentry *flatfile_find(const struct flatfile *F, const char *local_part) {
+    int i;
+    for (i = F->buckets[hash_string(local_part) & (F->nbuckets - 1)]; i != -1; i = F->entries[i].next)
+        if (strcmp(F->entries[i].local_part, local_part) == 0)
+            return F->entries + i;
+    return NULL;
+}
+
+/* flatfile_load FILE FD
+ * Read the contents of FD, which is FILE->size bytes long, into FILE and index
+ * them. The files are structured with colon-separated fields, where the first
+ * field is the local-part and the second field the password hash. Any
+ * subsequent fields are ignored. Returns 1 on success or 0 on failure. */
+static int flatfile_load(struct flatfile *F, int fd) {
+    char *line, *p, *end;
+    size_t len = 0, nlines;
+    unsigned int linenum;
+    unsigned int i;
+
+    F->data = xmalloc(F->size + 1);
+    while (len < (size_t)F->size) {
+        ssize_t n;
+        if ((n = read(fd, F->data + len, F->size - len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            log_print(LOG_ERR, _("flatfile_load: flat file %s: %m"), F->name);
+            return 0;
+        } else if (n == 0)
+            break;  /* file has been truncated under us */
+        len += n;
     }
+    end = F->data + len;
+    *end = 0;
+
+    for (p = F->data, nlines = 1; p < end; ++p)
+        if (*p == '\n')
+            ++nlines;
+
+    F->entries = xcalloc(nlines, sizeof *F->entries);
+    for (F->nbuckets = 16; F->nbuckets < nlines; F->nbuckets <<= 1);
+    F->buckets = xmalloc(F->nbuckets * sizeof *F->buckets);
+    for (i = 0; i < F->nbuckets; ++i)
+        F->buckets[i] = -1;
+
+    for (line = F->data, linenum = 1; line < end; line = p + 1, ++linenum) {
+        struct ffentry *E;
+        char *pwhash, *q;
+        unsigned int b;
+
+        if (!(p = memchr(line, '\n', end - line)))
+            p = end;
+        *p = 0;
+
+        if (!(pwhash = strchr(line, ':'))) {
+            log_print(LOG_WARNING, _("flatfile_load: flat file %s: line %u: bad format (missing :)"), F->name, linenum);
+            continue;
+        }
 
-    if (!(fp = fopen(filename, "rt"))) {
-        log_print(LOG_ERR, _("read_user_passwd: flat file %s: %m"), filename);
-        goto fail;
+        *pwhash++ = 0;
+        if ((q = strchr(pwhash, ':')))
+            *q = 0;
+
+        /* If a local part appears more than once, the first line counts. */
+        if (flatfile_find(F, line))
+            continue;
+
+        E = F->entries + F->nentries;
+        E->local_part = line;
+        E->pwhash = pwhash;
+        b = hash_string(line) & (F->nbuckets - 1);
+        E->next = F->buckets[b];
+        F->buckets[b] = F->nentries++;
     }
 
-    /* Read lines from the file. */
-    if (!buf)
-        buf = xmalloc(buflen = 1024);
-    
-    linenum = 0;
-    while (1) {
-        char *user, *end;
-        
-        i = 0;
-        while ((c = getc(fp)) != EOF) {
-            if (c == '\n')
-                break;
-            buf[i++] = (char)c;
-            if (i == buflen)
-                buf = xrealloc(buf, buflen *= 2);
-        }
+    return 1;
+}
 
-        buf[i] = 0;
+/* flatfile_changed FLATFILE STAT
+ * Does STAT, for the file from which FLATFILE was read, suggest that the file
+ * may have been replaced or modified since? */
+static int flatfile_changed(const struct flatfile *F, const struct stat *st) {
+    if (st->st_dev != F->dev || st->st_ino != F->ino || st->st_mtime != F->mtime || st->st_ctime != F->ctime || st->st_size != F->size)
+        return 1;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM) && defined(HAVE_STRUCT_STAT_ST_CTIM)
+    return st->st_mtim.tv_nsec != F->mtime_ns || st->st_ctim.tv_nsec != F->ctime_ns;
+#else
+    return st->st_mtime >= F->loaded - 1;
+#endif
+}
 
-        if (c == EOF) {
-            if (ferror(fp)) {
-                /* Read error. */
-                log_print(LOG_ERR, _("read_user_passwd: flat file %s: %m"), filename);
-                goto fail;
-            } else if (i == 0)
-                /* Read nothing at end of file. */
-                break;
+/* flatfile_get FILENAME
+ * Return the index for FILENAME, building it if we have not seen the file
+ * before or if it has changed since we last did. Returns NULL on failure. */
+static struct flatfile *flatfile_get(const char *filename) {
+    struct flatfile *F, **pF;
+    struct stat st;
+    int fd;
+
+    for (pF = &flatfiles; *pF; pF = &(*pF)->next)
+        if (strcmp((*pF)->name, filename) == 0)
+            break;
+
+    if ((F = *pF)) {
+        /* Take it off the list; it will go back at the front. */
+        *pF = F->next;
+        --nflatfiles;
+
+        if (stat(filename, &st) == -1) {
+            log_print(LOG_ERR, _("flatfile_get: flat file %s: %m"), filename);
+            flatfile_free(F);
+            return NULL;
+        } else if (flatfile_changed(F, &st)) {
+            log_print(LOG_DEBUG, _("flatfile_get: flat file %s has changed; reloading it"), filename);
+            flatfile_free(F);
+            F = NULL;
         }
+    }
 
-        /* OK, have a line. */
-        user = buf;
-        pwhash = strchr(buf, ':');
-        if (!pwhash) {
-            log_print(LOG_WARNING, _("read_user_passwd: flat file %s: line %u: bad format (missing :)"), filename, (unsigned)linenum);
-            continue;
+    if (!F) {
+        if ((fd = open(filename, O_RDONLY)) == -1) {
+            log_print(LOG_ERR, _("flatfile_get: flat file %s: %m"), filename);
+            return NULL;
+        } else if (fstat(fd, &st) == -1) {
+            log_print(LOG_ERR, _("flatfile_get: flat file %s: %m"), filename);
+            close(fd);
+            return NULL;
         }
-        
-        *pwhash++ = 0;
 
-        /* Check username. */
-        if (strcmp(user, local_part) != 0)
-            continue;
+        alloc_struct(flatfile, F);
+        F->name = xstrdup(filename);
+        F->dev = st.st_dev;
+        F->ino = st.st_ino;
+        F->mtime = st.st_mtime;
+        F->ctime = st.st_ctime;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM) && defined(HAVE_STRUCT_STAT_ST_CTIM)
+        F->mtime_ns = st.st_mtim.tv_nsec;
+        F->ctime_ns = st.st_ctim.tv_nsec;
+#else
+        time(&F->loaded);
+#endif
+        F->size = st.st_size;
 
-        if ((end = strchr(pwhash, ':')))
-            *end = 0;
+        if (!flatfile_load(F, fd)) {
+            close(fd);
+            flatfile_free(F);
+            return NULL;
+        }
+        close(fd);
+    }
 
-        result = pwhash;
+    F->next = flatfiles;
+    flatfiles = F;
 
-        break;
+    if (++nflatfiles > FLATFILE_MAX_CACHED) {
+        /* Forget the least recently used file. */
+        for (pF = &flatfiles; (*pF)->next; pF = &(*pF)->next);
+        flatfile_free(*pF);
+        *pF = NULL;
+        --nflatfiles;
     }
-    
+
+    return F;
+}
+
+/* read_user_passwd LOCALPART DOMAIN
+ * Read the password hash from the proper flat file for the given LOCALPART and
+ * DOMAIN. Returns the password or NULL if not found, setting auth_rejected if
+ * the file could be read but does not list the user. The value points into the
+ * cached index for the file, so it remains valid until that file is reloaded or
+ * dropped from the cache by a later call. */
+static char *read_user_passwd(const char *local_part, const char *domain) {
+    char *filename = NULL, *result = NULL;
+    struct flatfile *F;
+    struct ffentry *E;
+    struct sverr err;
+
+    if (!(filename = substitute_variables(user_passwd_file_template, &err, 1, "domain", domain))) {
+        log_print(LOG_ERR, _("read_user_passwd: %s near `%.16s'"), err.msg, user_passwd_file_template + err.offset);
+        goto fail;
+    }
+
+    if ((F = flatfile_get(filename))) {
+        if ((E = flatfile_find(F, local_part)))
+            result = E->pwhash;
+        else
+            auth_rejected = 1;
+    }
+
 fail:
-    if (fp)
-        fclose(fp);
-    
     if (filename)
         xfree(filename);
 
@@ -185,7 +358,10 @@ authcontext auth_flatfile_new_user_pass(const char *user, const char *local_part
     authcontext a = NULL;
     char *pwhash, *who;
 
-    if (!local_part) return NULL;
+    if (!local_part) {
+        auth_rejected = 1;  /* not a virtual-domain user */
+        return NULL;
+    }
     
     who = username_string(user, local_part, domain);
 
@@ -193,8 +369,10 @@ authcontext auth_flatfile_new_user_pass(const char *user, const char *local_part
     if (pwhash) {
         if (check_password(who, pwhash, pass, "{crypt}"))
             a = authcontext_new(virtual_uid, virtual_gid, NULL, NULL, NULL);
-        else
+        else {
             log_print(LOG_ERR, _("auth_flatfile_new_user_pass: failed login for %s"), who);
+            auth_rejected = 1;
+        }
     }
 
     return a;
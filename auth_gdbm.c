@@ -113,7 +113,10 @@ authcontext auth_gdbm_new_user_pass(const char *user, const char *local_part, co
     char *who, *address;
     datum key, value;
 
-    if (!local_part) return NULL;
+    if (!local_part) {
+        auth_rejected = 1;  /* not a virtual-domain user */
+        return NULL;
+    }
     
     who = username_string(user, local_part, domain);
 
@@ -136,13 +139,16 @@ authcontext auth_gdbm_new_user_pass(const char *user, const char *local_part, co
     xfree(address);
     if(value.dptr == NULL) {
         log_print(LOG_ERR, _("auth_gdbm_new_user_pass: could not find user %s"), who);
+        auth_rejected = 1;
         return a;
     }
 
     if (check_password(who, value.dptr, pass, "{crypt}"))
         a = authcontext_new(virtual_uid, virtual_gid, NULL, NULL, NULL);
-    else
+    else {
         log_print(LOG_ERR, _("auth_gdbm_new_user_pass: failed login for %s"), who);
+        auth_rejected = 1;
+    }
 
     xfree(value.dptr);
 
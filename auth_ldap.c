@@ -41,14 +41,27 @@ static const char rcsid[] = "$Id$";
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "auth_ldap.h"
 #include "authswitch.h"
 #include "config.h"
+#include "md5.h"
 #include "stringmap.h"
 #include "util.h"
 
+#ifndef LDAP_NO_ATTRS
+#define LDAP_NO_ATTRS   "1.1"
+#endif
+
+/* How long we wait for the server to answer a request. */
+#define DEFAULT_LDAP_TIMEOUT    10      /* seconds */
+
+/* Defaults for the user cache. */
+#define DEFAULT_USERCACHE_LIFETIME  600     /* seconds */
+#define DEFAULT_USERCACHE_SIZE      1024    /* users */
+
 /* ldapinfo:
  * Information relating to the LDAP server and queries against same. */
 static struct {
@@ -63,7 +76,9 @@ static struct {
     struct {
         char *mailbox, *mboxtype, *user, *group;
     } attr;
-    LDAP *ldap;
+    LDAP *ldap;         /* connection bound as the search user */
+    LDAP *userldap;     /* connection used to bind as users */
+    struct timeval timeout;
 } ldapinfo = {
         NULL,               /* no default host */
         LDAP_PORT,          /* default port */
@@ -82,50 +97,478 @@ static struct {
             NULL,           /*    user id */
             NULL,           /*    group id */
         },
-        NULL
+        NULL, NULL,
+        {DEFAULT_LDAP_TIMEOUT, 0}
     };
 
+extern int verbose; /* in main.c */
+
 static char *substitute_filter_params(const char *template, const char *user, const char *local_part, const char *domain);
 
+/* Attributes to fetch when searching for a user; NULL-terminated. */
+static char *search_attrs[5];
+
+/* ldapuser:
+ * What a search tells us about a user. */
+struct ldapuser {
+    unsigned char key[16];      /* hash of search base and filter */
+    char *dn;
+    char *mailbox, *mboxtype, *user, *group;
+    int confirmed;              /* DN checked by a search after a failed bind */
+};
+
+/*
+ * User cache. Users' DNs and attributes change rarely, so we can remember
+ * what a search told us about a user for a while and skip the search next
+ * time, so that a login needs only the bind. This is independent of the
+ * authcache, which is keyed on the user's password too and so can't help
+ * when a user changes their password or types it wrongly. Entries are found by
+ * a hash of the search base and filter, in a fixed number of small buckets.
+ * If a bind with an entry's DN fails, the search is made again in case the DN
+ * has changed, but for a wrong password only once for each entry.
+ */
+#define USERCACHE_BUCKET_SLOTS  4
+
+static struct {
+    int enabled;
+    int lifetime;
+    size_t nbuckets;
+    struct usercacheentry {
+        time_t when;            /* 0 for an empty slot */
+        struct ldapuser u;
+    } *slots;
+    unsigned long hits, misses, invalidations;
+} usercache;
+
+/* ldap_strerror CONNECTION
+ * Return the current error string from the LDAP library for CONNECTION. */
+static char *ldap_strerror(LDAP *ld) {
+    int ld_errno;
+    ldap_get_option(ld, LDAP_OPT_ERROR_NUMBER, &ld_errno);
+    return ldap_err2string(ld_errno);
+}
+
 /* auth_ldap_connect:
- * Try to connect to the LDAP server. */
-static int auth_ldap_connect(void) {
+ * Try to connect to the LDAP server, returning a new connection or NULL. */
+static LDAP *auth_ldap_connect(void) {
+    LDAP *ld;
     int r = 1;
 
-    if (!(ldapinfo.ldap = ldap_open(ldapinfo.hostname, ldapinfo.port))) {
+    if (!(ld = ldap_open(ldapinfo.hostname, ldapinfo.port))) {
         log_print(LOG_ERR, "auth_ldap_connect: ldap_open: %m");
-        return 0;
+        return NULL;
     }
     
     if (ldapinfo.tls) {
         int vers, ret;
 
         vers = LDAP_VERSION3;
-        if ((ret = ldap_set_option(ldapinfo.ldap, LDAP_OPT_PROTOCOL_VERSION, &vers)) != LDAP_OPT_SUCCESS) {
+        if ((ret = ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &vers)) != LDAP_OPT_SUCCESS) {
             log_print(LOG_ERR, "auth_ldap_connect: ldap_set_option(LDAP_VERSION3): %s", ldap_err2string(ret));
             r = 0;
-        } else if ((ret = ldap_start_tls_s(ldapinfo.ldap, NULL, NULL)) != LDAP_SUCCESS) {
+        } else if ((ret = ldap_start_tls_s(ld, NULL, NULL)) != LDAP_SUCCESS) {
             log_print(LOG_ERR, "auth_ldap_connect: ldap_start_tls_s: %s", ldap_err2string(ret));
             r = 0;
         }
     }
 
     if (!r) {
-        ldap_unbind(ldapinfo.ldap);
-        ldapinfo.ldap = NULL;
+        ldap_unbind_ext(ld, NULL, NULL);
+        ld = NULL;
     }
     
-    return r;
+    return ld;
+}
+
+/* drop_connection CONNECTION
+ * Close *CONNECTION, if it is open, and set it to NULL. */
+static void drop_connection(LDAP **ld) {
+    if (*ld) {
+        ldap_unbind_ext(*ld, NULL, NULL);
+        *ld = NULL;
+    }
+}
+
+/* wait_result CONNECTION MSGID RESULT
+ * Wait up to the configured timeout for the complete result of the operation
+ * MSGID on CONNECTION, saving it in *RESULT. If none arrives in time, abandon
+ * the operation. Returns an LDAP error code. */
+static int wait_result(LDAP *ld, int msgid, LDAPMessage **res) {
+    struct timeval tv;
+    int err = LDAP_OTHER;
+    
+    tv = ldapinfo.timeout;
+    switch (ldap_result(ld, msgid, LDAP_MSG_ALL, &tv, res)) {
+        case -1:
+            *res = NULL;
+            ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &err);
+            return err == LDAP_SUCCESS ? LDAP_OTHER : err;
+
+        case 0:
+            *res = NULL;
+            ldap_abandon_ext(ld, msgid, NULL, NULL);
+            return LDAP_TIMEOUT;
+
+        default:
+            return LDAP_SUCCESS;
+    }
+}
+
+/* do_bind CONNECTION DN PASSWORD
+ * Make a simple bind as DN with PASSWORD on CONNECTION. Returns an LDAP error
+ * code. */
+static int do_bind(LDAP *ld, const char *dn, const char *pass) {
+    struct berval cred;
+    LDAPMessage *res;
+    int msgid, ret, err;
+
+    cred.bv_val = (char*)pass;
+    cred.bv_len = strlen(pass);
+
+    if ((ret = ldap_sasl_bind(ld, dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &msgid)) != LDAP_SUCCESS
+        || (ret = wait_result(ld, msgid, &res)) != LDAP_SUCCESS)
+        return ret;
+    
+    /* This frees the result. */
+    if ((ret = ldap_parse_result(ld, res, &err, NULL, NULL, NULL, NULL, 1)) != LDAP_SUCCESS)
+        return ret;
+
+    return err;
+}
+
+/* connection_lost ERROR
+ * Does the LDAP ERROR code mean that we should reconnect and try again? A
+ * timeout doesn't; trying again would only make the client wait twice as long
+ * for a slow server. */
+static int connection_lost(const int e) {
+    return e == LDAP_SERVER_DOWN || e == LDAP_CONNECT_ERROR;
+}
+
+/* service_connection:
+ * Return the connection bound as the search user, connecting and binding if
+ * necessary. It stays bound as the search user, since user binds happen on a
+ * separate connection, so normally this costs nothing. */
+static LDAP *service_connection(void) {
+    int ret;
+
+    if (ldapinfo.ldap)
+        return ldapinfo.ldap;
+
+    if (!(ldapinfo.ldap = auth_ldap_connect()))
+        return NULL;
+
+    if ((ret = do_bind(ldapinfo.ldap, ldapinfo.searchdn, ldapinfo.password)) != LDAP_SUCCESS) {
+        log_print(LOG_ERR, "service_connection: bind as %s: %s", ldapinfo.searchdn, ldap_err2string(ret));
+        drop_connection(&ldapinfo.ldap);
+    }
+
+    return ldapinfo.ldap;
+}
+
+/* ldapuser_free USER
+ * Free the contents of USER. */
+static void ldapuser_free(struct ldapuser *u) {
+    xfree(u->dn);
+    xfree(u->mailbox);
+    xfree(u->mboxtype);
+    xfree(u->user);
+    xfree(u->group);
+    memset(u, 0, sizeof *u);
+}
+
+/* ldapuser_copy TO FROM
+ * Copy the contents of FROM into TO. */
+static void ldapuser_copy(struct ldapuser *to, const struct ldapuser *from) {
+#define COPYS(x)        to->x = from->x ? xstrdup(from->x) : NULL
+    memcpy(to->key, from->key, sizeof to->key);
+    COPYS(dn);
+    COPYS(mailbox);
+    COPYS(mboxtype);
+    COPYS(user);
+    COPYS(group);
+#undef COPYS
+    to->confirmed = from->confirmed;
+}
+
+/* usercache_bucket KEY
+ * Return the first slot in the user cache bucket for KEY. */
+static struct usercacheentry *usercache_bucket(const unsigned char key[16]) {
+    unsigned long h;
+    h = key[0] | (key[1] << 8) | (key[2] << 16) | ((unsigned long)key[3] << 24);
+    return usercache.slots + (h % usercache.nbuckets) * USERCACHE_BUCKET_SLOTS;
+}
+
+/* usercache_find U
+ * If there is a current cache entry with U's key, copy it into U and return
+ * 1; otherwise return 0. */
+static int usercache_find(struct ldapuser *u) {
+    struct usercacheentry *E, *Eend;
+    time_t now;
+
+    if (!usercache.enabled)
+        return 0;
+
+    time(&now);
+    for (E = usercache_bucket(u->key), Eend = E + USERCACHE_BUCKET_SLOTS; E < Eend; ++E)
+        if (E->when && E->when >= now - usercache.lifetime && memcmp(E->u.key, u->key, 16) == 0) {
+            ldapuser_copy(u, &E->u);
+            ++usercache.hits;
+            return 1;
+        }
+
+    ++usercache.misses;
+    return 0;
+}
+
+/* usercache_save U
+ * Save a copy of U in the user cache, in place of any existing entry with the
+ * same key or else an empty, expired or the oldest slot in its bucket. */
+static void usercache_save(const struct ldapuser *u) {
+    struct usercacheentry *E, *Eend, *victim = NULL;
+    time_t now;
+
+    if (!usercache.enabled)
+        return;
+
+    time(&now);
+    for (E = usercache_bucket(u->key), Eend = E + USERCACHE_BUCKET_SLOTS; E < Eend; ++E) {
+        if (E->when && memcmp(E->u.key, u->key, 16) == 0) {
+            victim = E;
+            break;
+        } else if (!victim || E->when < victim->when)
+            victim = E;
+    }
+
+    if (victim->when)
+        ldapuser_free(&victim->u);
+    ldapuser_copy(&victim->u, u);
+    victim->when = now;
+}
+
+/* usercache_invalidate KEY
+ * Discard any cache entry with the given KEY. */
+static void usercache_invalidate(const unsigned char key[16]) {
+    struct usercacheentry *E, *Eend;
+
+    if (!usercache.enabled)
+        return;
+
+    for (E = usercache_bucket(key), Eend = E + USERCACHE_BUCKET_SLOTS; E < Eend; ++E)
+        if (E->when && memcmp(E->u.key, key, 16) == 0) {
+            ldapuser_free(&E->u);
+            E->when = 0;
+            ++usercache.invalidations;
+        }
+}
+
+/* usercache_confirm KEY
+ * Note that a search has confirmed the DN in any cache entry with the given
+ * KEY, so that a failed bind with it need not cause another search. */
+static void usercache_confirm(const unsigned char key[16]) {
+    struct usercacheentry *E, *Eend;
+
+    if (!usercache.enabled)
+        return;
+
+    for (E = usercache_bucket(key), Eend = E + USERCACHE_BUCKET_SLOTS; E < Eend; ++E)
+        if (E->when && memcmp(E->u.key, key, 16) == 0)
+            E->u.confirmed = 1;
+}
+
+/* usercache_close
+ * Discard the user cache, logging some statistics. */
+static void usercache_close(void) {
+    size_t i;
+
+    if (!usercache.slots)
+        return;
+
+    log_print(LOG_INFO, _("usercache_close: %lu hits, %lu misses, %lu invalidations"), usercache.hits, usercache.misses, usercache.invalidations);
+    for (i = 0; i < usercache.nbuckets * USERCACHE_BUCKET_SLOTS; ++i)
+        if (usercache.slots[i].when)
+            ldapuser_free(&usercache.slots[i].u);
+    xfree(usercache.slots);
+    usercache.slots = NULL;
+    usercache.enabled = 0;
+}
+
+/* find_user USER LOCAL-PART DOMAIN WHO U USECACHE
+ * Find out about the user, saving its DN and attributes in U; if USECACHE is
+ * nonzero, from the user cache if possible, and otherwise by searching the
+ * directory on the service connection. Returns 2 if the user was found in the
+ * cache, 1 if by searching, 0 if the user was not found, or -1 on error. */
+static int find_user(const char *username, const char *local_part, const char *domain, const char *who, struct ldapuser *u, const int usecache) {
+    char *filter = NULL, *base = NULL;
+    LDAPMessage *ldapres = NULL, *entry;
+    LDAP *ld = NULL;
+    int ret = -1, r, msgid, nentries, tries;
+    char *attr, *dn;
+    BerElement *ber;
+    md5_ctx ctx;
+
+    /* Obtain search filter. */
+    if (!(filter = substitute_filter_params(ldapinfo.filter_spec, username, local_part, domain)))
+        goto fail;
+    
+    if (verbose)
+        log_print(LOG_DEBUG, _("find_user: LDAP search filter: %s"), filter);
+
+    /* Obtain search base. */
+    if (!(base = substitute_filter_params(ldapinfo.dn, username, local_part, domain)))
+        goto fail;
+
+    /* Perhaps we already know about this user. */
+    MD5Init(&ctx);
+    MD5Update(&ctx, (unsigned char*)base, strlen(base) + 1);
+    MD5Update(&ctx, (unsigned char*)filter, strlen(filter));
+    MD5Final(u->key, &ctx);
+
+    if (usecache && usercache_find(u)) {
+        ret = 2;
+        goto fail;
+    }
+
+    /* Look for DN of user in the directory. If the server has gone away
+     * since we last used it, reconnect and try again once. */
+    for (tries = 0; tries < 2; ++tries) {
+        if (!(ld = service_connection())) {
+            log_print(LOG_ERR, _("find_user: unable to connect and bind to LDAP server"));
+            goto fail;
+        }
+
+        if ((r = ldap_search_ext(ld, base, ldapinfo.scope, filter, search_attrs, 0, NULL, NULL, &ldapinfo.timeout, 0, &msgid)) == LDAP_SUCCESS
+            && (r = wait_result(ld, msgid, &ldapres)) == LDAP_SUCCESS)
+            r = ldap_result2error(ld, ldapres, 0);
+
+        if (r == LDAP_SUCCESS)
+            break;
+
+        log_print(LOG_ERR, "find_user: ldap_search_ext: %s", ldap_err2string(r));
+        if (ldapres)
+            ldap_msgfree(ldapres);
+        ldapres = NULL;
+        if (!connection_lost(r)) {
+            /* The request has been abandoned, but a server which is stuck may
+             * never answer on this connection again; start afresh next time. */
+            if (r == LDAP_TIMEOUT)
+                drop_connection(&ldapinfo.ldap);
+            goto fail;
+        }
+        drop_connection(&ldapinfo.ldap);
+    }
+
+    if (!ldapres)
+        goto fail;
+
+    /* There must be only one result. */
+    switch (nentries = ldap_count_entries(ld, ldapres)) {
+        case 1:
+            break;
+
+        default:
+            log_print(LOG_ERR, _("find_user: search returned %d entries, should be 0 or 1"), nentries);
+            goto fail;
+
+        case 0:
+            ret = 0;
+            goto fail;
+    }
+
+    if (!(entry = ldap_first_entry(ld, ldapres))) {
+        log_print(LOG_ERR, "find_user: ldap_first_entry: %s", ldap_strerror(ld));
+        goto fail;
+    }
+
+    /* Get the dn string from the current entry */
+    if (!(dn = ldap_get_dn(ld, entry))) {
+        log_print(LOG_ERR, "find_user: ldap_get_dn: %s", ldap_strerror(ld));
+        goto fail;
+    }
+    u->dn = xstrdup(dn);
+    ldap_memfree(dn);
+
+    /* Collect the attributes we want. */
+    for (attr = ldap_first_attribute(ld, entry, &ber); attr; attr = ldap_next_attribute(ld, entry, ber)) {
+        char **vals;
+
+        if (!(vals = ldap_get_values(ld, entry, attr))) {
+            log_print(LOG_WARNING, "find_user: ldap_get_values(`%s', `%s'): %s", u->dn, attr, ldap_strerror(ld));
+            ldap_memfree(attr);
+            continue;
+        }
+
+        /* XXX case? */
+        if (ldapinfo.attr.mailbox && strcasecmp(attr, ldapinfo.attr.mailbox) == 0)
+            u->mailbox = xstrdup(*vals);
+        else if (ldapinfo.attr.mboxtype && strcasecmp(attr, ldapinfo.attr.mboxtype) == 0)
+            u->mboxtype = xstrdup(*vals);
+        else if (ldapinfo.attr.user && strcasecmp(attr, ldapinfo.attr.user) == 0)
+            u->user = xstrdup(*vals);
+        else if (ldapinfo.attr.group && strcasecmp(attr, ldapinfo.attr.group) == 0)
+            u->group = xstrdup(*vals);
+
+        ldap_value_free(vals);
+        ldap_memfree(attr);
+    }
+
+    if (ber)
+        ber_free(ber, 0);
+
+    /* Check that we've retrieved all the attributes we need. */
+#define GOT_ATTR(a)     if (ldapinfo.attr.a && !u->a) { \
+                            log_print(LOG_ERR, _("find_user: did not find required attribute `%s' for %s"), \
+                                      ldapinfo.attr.a, who); \
+                            goto fail; \
+                        }
+    GOT_ATTR(mailbox);
+    GOT_ATTR(mboxtype);
+    GOT_ATTR(user);
+    GOT_ATTR(group);
+#undef GOT_ATTR
+
+    usercache_save(u);
+
+    ret = 1;
+
+fail:
+    if (ret <= 0)
+        ldapuser_free(u);
+    if (ldapres) ldap_msgfree(ldapres);
+
+    xfree(filter);
+    xfree(base);
+
+    return ret;
+}
+
+/* bind_user DN PASSWORD
+ * Try to bind as DN with PASSWORD on the user connection, reconnecting once
+ * if the server has gone away. Returns an LDAP error code. */
+static int bind_user(const char *dn, const char *pass) {
+    int ret = LDAP_SERVER_DOWN, tries;
+
+    for (tries = 0; tries < 2; ++tries) {
+        if (!ldapinfo.userldap && !(ldapinfo.userldap = auth_ldap_connect()))
+            return LDAP_SERVER_DOWN;
+
+        if (!connection_lost(ret = do_bind(ldapinfo.userldap, dn, pass))) {
+            if (ret == LDAP_TIMEOUT)
+                drop_connection(&ldapinfo.userldap);
+            break;
+        }
+
+        drop_connection(&ldapinfo.userldap);
+    }
+
+    return ret;
 }
 
 /* auth_ldap_init:
  * Read configuration directives relating to LDAP and save them in the
  * ldapinfo structure. */
-extern int verbose; /* in main.c */
-
 int auth_ldap_init(void) {
     char *ldap_url = NULL, *s, *t;
-    int ret = 0, r = 0;
+    int ret = 0, r = 0, n;
     LDAPURLDesc *urldesc = NULL;
 
     /* get the data from an ldap_url string */
@@ -238,54 +681,71 @@ int auth_ldap_init(void) {
     if (config_get_bool("auth-ldap-use-tls"))
         ldapinfo.tls = 1;
 
-    r = 1;
-
-fail:
-    return r;
-}
+    /* How long to wait for the server. */
+    switch (config_get_int("auth-ldap-timeout", &n)) {
+        case -1:
+            log_print(LOG_WARNING, _("auth_ldap_init: bad value for auth-ldap-timeout; using default"));
+            break;
 
-extern int verbose; /* in main.c */
+        case 1:
+            if (n > 0)
+                ldapinfo.timeout.tv_sec = n;
+            else
+                log_print(LOG_WARNING, _("auth_ldap_init: auth-ldap-timeout must be positive; using default"));
+            break;
+    }
 
-/* ldap_strerror:
- * Return the current error string from the LDAP library. */
-static char *ldap_strerror(void) {
-    int ld_errno;
-    ldap_get_option(ldapinfo.ldap, LDAP_OPT_ERROR_NUMBER, &ld_errno);
-    return ldap_err2string(ld_errno);
-}
+    /* Optionally, remember what searches tell us about users. */
+    if ((usercache.enabled = config_get_bool("auth-ldap-cache-enable"))) {
+        switch (config_get_int("auth-ldap-cache-lifetime", &usercache.lifetime)) {
+            case -1:
+                log_print(LOG_WARNING, _("auth_ldap_init: bad value for auth-ldap-cache-lifetime; using default"));
+                /* fall through */
+            case 0:
+                usercache.lifetime = DEFAULT_USERCACHE_LIFETIME;
+                break;
+
+            case 1:
+                if (usercache.lifetime <= 0) {
+                    log_print(LOG_WARNING, _("auth_ldap_init: auth-ldap-cache-lifetime must be positive; using default"));
+                    usercache.lifetime = DEFAULT_USERCACHE_LIFETIME;
+                }
+                break;
+        }
 
-/* try_ldap_connect_bind:
- * Try to connect to the LDAP server and bind. */
-static int try_ldap_connect_bind(const char *who, const char *passwd) {
-    int ret = LDAP_OTHER, i;    /* XXX */
-    for (i = 0; i < 3; ++i) {
-        if (ldapinfo.ldap || auth_ldap_connect()) {
-            ret = ldap_simple_bind_s(ldapinfo.ldap, who, passwd);
-            if (ret == LDAP_SUCCESS)
-                return LDAP_SUCCESS;
-            else {
-                log_print(LOG_ERR, "try_ldap_connect_bind: ldap_simple_bind_s: %s", ldap_err2string(ret));
-                ldap_unbind(ldapinfo.ldap);
-                ldapinfo.ldap = NULL;
-            }
-        } else
-            ldapinfo.ldap = NULL;
+        switch (config_get_int("auth-ldap-cache-size", &n)) {
+            case -1:
+                log_print(LOG_WARNING, _("auth_ldap_init: bad value for auth-ldap-cache-size; using default"));
+                /* fall through */
+            case 0:
+                n = DEFAULT_USERCACHE_SIZE;
+                break;
+
+            case 1:
+                if (n <= 0) {
+                    log_print(LOG_WARNING, _("auth_ldap_init: auth-ldap-cache-size must be positive; using default"));
+                    n = DEFAULT_USERCACHE_SIZE;
+                }
+                break;
+        }
+        usercache.nbuckets = (n + USERCACHE_BUCKET_SLOTS - 1) / USERCACHE_BUCKET_SLOTS;
+        usercache.slots = xcalloc(usercache.nbuckets * USERCACHE_BUCKET_SLOTS, sizeof *usercache.slots);
     }
 
-    /* OK, didn't succeed. */
-    return ret;
-}
+    /* Fetch only the attributes we use when searching for a user. */
+    n = 0;
+    if (ldapinfo.attr.mailbox)  search_attrs[n++] = ldapinfo.attr.mailbox;
+    if (ldapinfo.attr.mboxtype) search_attrs[n++] = ldapinfo.attr.mboxtype;
+    if (ldapinfo.attr.user)     search_attrs[n++] = ldapinfo.attr.user;
+    if (ldapinfo.attr.group)    search_attrs[n++] = ldapinfo.attr.group;
+    if (n == 0)
+        search_attrs[n++] = LDAP_NO_ATTRS;
+    search_attrs[n] = NULL;
 
-/* try_ldap_bind:
- * Try a bind against the LDAP server. */
-static int try_ldap_bind(LDAP *ld, const char *who, const char *passwd) {
-    int ret, i;
-    for (i = 0; i < 3; ++i) {
-        ret = ldap_simple_bind_s(ld, who, passwd);
-        if (ret == LDAP_SUCCESS)
-            return LDAP_SUCCESS;
-    }
-    return ret;
+    r = 1;
+
+fail:
+    return r;
 }
 
 /* auth_ldap_new_user_pass:
@@ -293,157 +753,95 @@ static int try_ldap_bind(LDAP *ld, const char *who, const char *passwd) {
  * search/bind process. */
 authcontext auth_ldap_new_user_pass(const char *username, const char *local_part, const char *domain, const char *pass, const char *clienthost /* unused */, const char *serverhost /* unused */) {
     authcontext a = NULL;
-    char *filter = NULL, *base = NULL, *who;
-    LDAPMessage *ldapres = NULL, *user_attr = NULL;
-    char *user_dn = NULL;
-    int nentries, ret;
+    struct ldapuser u = {0};
+    char *who;
+    int ret, found;
 
     who = username_string(username, local_part, domain);
 
-    /* Connect to the server. */
-    if (try_ldap_connect_bind(ldapinfo.searchdn, ldapinfo.password) != LDAP_SUCCESS) {
-        log_print(LOG_ERR, _("auth_ldap_new_user_pass: unable to connect and bind to LDAP server"));
-        goto fail;
+    /* A simple bind with an empty password is an unauthenticated bind, which
+     * some servers accept. */
+    if (!*pass) {
+        auth_rejected = 1;
+        return NULL;
     }
 
-    /* Obtain search filter. */
-    if (!(filter = substitute_filter_params(ldapinfo.filter_spec, username, local_part, domain)))
-        goto fail;
-    
-    if (verbose)
-        log_print(LOG_DEBUG, _("auth_ldap_new_user_pass: LDAP search filter: %s"), filter);
-
-    /* Obtain search base. */
-    if (!(base = substitute_filter_params(ldapinfo.dn, username, local_part, domain)))
-        goto fail;
-
-    /* Look for DN of user in the directory. */
-    if ((ret = ldap_search_s(ldapinfo.ldap, base, LDAP_SCOPE_SUBTREE, filter, NULL, 0, &ldapres)) != LDAP_SUCCESS) {
-        log_print(LOG_ERR, "auth_ldap_new_user_pass: ldap_search_s: %s", ldap_err2string(ret));
+    if ((found = find_user(username, local_part, domain, who, &u, 1)) <= 0) {
+        auth_rejected = (found == 0);
         goto fail;
     }
 
-    /* There must be only one result. */
-    switch (nentries = ldap_count_entries(ldapinfo.ldap, ldapres)) {
-        case 1:
-            break;
-
-        default:
-            log_print(LOG_ERR, _("auth_ldap_new_user_pass: search returned %d entries, should be 0 or 1"), nentries);
-            /* fall through */
-
-        case 0:
+    /* Now attempt authentication by binding with the user's credentials. */
+    ret = bind_user(u.dn, pass);
+
+    if (found == 2 && (ret == LDAP_NO_SUCH_OBJECT || (ret == LDAP_INVALID_CREDENTIALS && !u.confirmed))) {
+        /* The cached entry may be out of date; if the directory now gives a
+         * different DN for the user, try that instead. Invalid credentials
+         * more often mean a mistyped password, so if the DN is unchanged we
+         * mark the entry, and later failures with it cost only the bind. */
+        unsigned char key[16];
+        char *olddn;
+        memcpy(key, u.key, sizeof key);
+        olddn = u.dn;
+        u.dn = NULL;
+        ldapuser_free(&u);
+        if ((found = find_user(username, local_part, domain, who, &u, 0)) <= 0)
+            usercache_invalidate(key);
+        else if (strcmp(olddn, u.dn) != 0)
+            ret = bind_user(u.dn, pass);
+        else if (ret == LDAP_INVALID_CREDENTIALS)
+            usercache_confirm(u.key);
+        xfree(olddn);
+        if (found <= 0) {
+            auth_rejected = (found == 0);
             goto fail;
+        }
     }
 
-    if (!(user_attr = ldap_first_entry(ldapinfo.ldap, ldapres))) {
-        log_print(LOG_ERR, "auth_ldap_new_user_pass: ldap_first_entry: %s", ldap_strerror());
-        goto fail;
-    }
-
-    /* Get the dn string from the current entry */
-    if (!(user_dn = ldap_get_dn(ldapinfo.ldap, user_attr))) {
-        log_print(LOG_ERR, "auth_ldap_new_user_pass: ldap_get_dn: %s", ldap_strerror());
-        goto fail;
-    }
-
-    /* Now attempt authentication by binding with the user's credentials. */
-    if ((ret = try_ldap_bind(ldapinfo.ldap, user_dn, pass)) != LDAP_SUCCESS) {
+    if (ret != LDAP_SUCCESS) {
         /* Bind failed; user has failed to log in. */
-        if (ret == LDAP_INVALID_CREDENTIALS)
+        if (ret == LDAP_INVALID_CREDENTIALS) {
             log_print(LOG_ERR, _("auth_ldap_new_user_pass: failed login for %s"), who);
-        else
-            log_print(LOG_ERR, "auth_ldap_new_user_pass: try_ldap_bind: %s", ldap_err2string(ret));
+            auth_rejected = 1;
+        } else
+            log_print(LOG_ERR, "auth_ldap_new_user_pass: bind_user: %s", ldap_err2string(ret));
         goto fail;
     } else {
-        /* Bind OK; accumulate information about this user and generate an
-         * authcontext. Collect attributes and off we go. */
+        /* Bind OK; generate an authcontext from what we found out about the
+         * user. */
         uid_t uid = -1;
         gid_t gid = -1;
-        char *mailbox = NULL, *mboxtype = NULL, *user = NULL, *group = NULL;
-        char *attr;
-        BerElement *ber;
-
-        for (attr = ldap_first_attribute(ldapinfo.ldap, user_attr, &ber); attr; attr = ldap_next_attribute(ldapinfo.ldap, user_attr, ber)) {
-            char **vals;
-
-            if (!(vals = ldap_get_values(ldapinfo.ldap, user_attr, attr))) {
-                log_print(LOG_WARNING, "auth_ldap_new_user_pass: ldap_get_values(`%s', `%s'): %s", user_attr, attr, ldap_strerror());
-                continue;
-            }
-
-            /* XXX case? */
-            if (ldapinfo.attr.mailbox && strcasecmp(attr, ldapinfo.attr.mailbox) == 0)
-                mailbox = xstrdup(*vals);
-            else if (ldapinfo.attr.mboxtype && strcasecmp(attr, ldapinfo.attr.mboxtype) == 0)
-                mboxtype = xstrdup(*vals);
-            else if (ldapinfo.attr.user && strcasecmp(attr, ldapinfo.attr.user) == 0)
-                user = xstrdup(*vals);
-            else if (ldapinfo.attr.group && strcasecmp(attr, ldapinfo.attr.group) == 0)
-                group = xstrdup(*vals);
-
-            ldap_value_free(vals);
-            ldap_memfree(attr);
-        }
-
-        ber_free(ber, 0);
-
-        /* Check that we've retrieved all the attributes we need. */
-#define GOT_ATTR(a)     if (ldapinfo.attr.a && !a) { \
-                            log_print(LOG_ERR, _("auth_ldap_new_user_pass: did not find required attribute `%s' for %s"), \
-                                      ldapinfo.attr.a, who); \
-                            goto fail; \
-                        }
-        GOT_ATTR(mailbox);
-        GOT_ATTR(mboxtype);
-        GOT_ATTR(user);
-        GOT_ATTR(group);
-#undef GOT_ATTR
 
         /* Test user/group. XXX values specified in LDAP override those in config. */
         uid = ldapinfo.uid;
         gid = ldapinfo.gid;
-        if (user && !parse_uid(user, &uid))
-            log_print(LOG_ERR, _("auth_ldap_new_user_pass: unix user `%s' for %s does not make sense"), user, who);
-        else if (group && !parse_gid(group, &gid))
-            log_print(LOG_ERR, _("auth_ldap_new_user_pass: unix group `%s' for %s does not make sense"), group, who);
+        if (u.user && !parse_uid(u.user, &uid))
+            log_print(LOG_ERR, _("auth_ldap_new_user_pass: unix user `%s' for %s does not make sense"), u.user, who);
+        else if (u.group && !parse_gid(u.group, &gid))
+            log_print(LOG_ERR, _("auth_ldap_new_user_pass: unix group `%s' for %s does not make sense"), u.group, who);
         else {
             struct passwd *pw;
             char *home = NULL;
             pw = getpwuid(uid);
             if (pw) home = pw->pw_dir;
             /* OK, looks like we can actually do the authentication. */
-            if (mailbox && !mboxtype) {
+            if (u.mailbox && !u.mboxtype) {
                 /* Guess mailbox type based upon name of mailbox. */
-                if (mailbox[strlen(mailbox) - 1] == '/')
-                    a = authcontext_new(uid, gid, "maildir", mailbox, home);
+                if (u.mailbox[strlen(u.mailbox) - 1] == '/')
+                    a = authcontext_new(uid, gid, "maildir", u.mailbox, home);
                 else
-                    a = authcontext_new(uid, gid, "bsd", mailbox, home);
-            } else if (mailbox)
+                    a = authcontext_new(uid, gid, "bsd", u.mailbox, home);
+            } else if (u.mailbox)
                 /* Fully specified. */
-                a = authcontext_new(uid, gid, mboxtype, mailbox, home);
+                a = authcontext_new(uid, gid, u.mboxtype, u.mailbox, home);
             else
                 /* Let the mailbox sort itself out.... */
                 a = authcontext_new(uid, gid, NULL, NULL, home);
         }
-
-        xfree(mailbox);
-        xfree(mboxtype);
-        xfree(user);
-        xfree(group);
     }
 
 fail:
-    /* Ugly: force the LDAP library to free user_addr. */
-    if (user_attr) while (ldap_next_entry(ldapinfo.ldap, ldapres));
-    
-    if (ldapres) ldap_msgfree(ldapres);
-    if (user_dn) ldap_memfree(user_dn);
-
-    xfree(filter);
-    xfree(base);
-
-/*    auth_ldap_close();*/
+    ldapuser_free(&u);
 
     return a;
 }
@@ -451,16 +849,15 @@ fail:
 /* auth_ldap_close:
  * Close the ldap connection. */
 void auth_ldap_close() {
-    if (ldapinfo.ldap) {
-        ldap_unbind(ldapinfo.ldap);
-        ldapinfo.ldap = NULL;
-    }
+    drop_connection(&ldapinfo.ldap);
+    drop_connection(&ldapinfo.userldap);
+    usercache_close();
 }
 
 /* auth_ldap_postfork:
  * Post-fork cleanup. */
 void auth_ldap_postfork() {
-    ldapinfo.ldap = NULL; /* XXX */
+    ldapinfo.ldap = ldapinfo.userldap = NULL; /* XXX */
 }
 
 /* ldap_escape:
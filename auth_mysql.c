@@ -36,10 +36,12 @@ static const char rcsid[] = "$Id$";
 #include <grp.h>
 #include <pwd.h>
 #include <mysql.h>
+#include <errmsg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "auth_mysql.h"
@@ -76,12 +78,38 @@ static char *apop_query_template =
 
 static char *onlogin_query_template = NULL;
 
+
 /* GID used to access mail spool (if any). */
 static int use_gid;
 static gid_t mail_gid;
 
+extern int verbose; /* in main.c */
+
 static char *substitute_query_params(const char *temp, const char *user, const char *local_part, const char *domain, const char *clienthost, const char *serverhost);
 
+/*
+ * Prepared statements. A query template which uses variables only as whole
+ * values -- '$(local_part)', say, rather than '$(local_part)%' -- is prepared
+ * on the server once per connection, and each login then executes it with the
+ * variables bound as parameters, so the server doesn't parse and plan the
+ * query every time. Other templates are substituted and sent as text.
+ */
+#define MAX_QUERY_PARAMS    16
+#define MAX_FIELD_LEN       1024
+
+static const char *query_vars[] = {"user", "local_part", "domain", "clienthost", "serverhost"};
+#define NUM_QUERY_VARS      (sizeof(query_vars) / sizeof(*query_vars))
+
+struct mysqlquery {
+    char *template;                     /* template, or NULL for none */
+    char *sql;                          /* with placeholders, or NULL */
+    int params[MAX_QUERY_PARAMS], nparams;
+    MYSQL_STMT *stmt;                   /* prepared statement, if any */
+};
+
+static struct mysqlquery user_pass_query, apop_query, onlogin_query;
+static struct mysqlquery *all_queries[] = {&user_pass_query, &apop_query, &onlogin_query, NULL};
+
 /*
  * Connection to the MySQL server.
  */
@@ -89,25 +117,83 @@ static MYSQL *mysql = NULL;
 static tokens mysql_servers;
 static char mysql_driver_active = 0;
 
+/* Rather than pinging the server before every query, which doubles the number
+ * of round trips for each login, we ping it only if the connection has been
+ * idle for a while. Otherwise we find out that the server has gone away from
+ * the query itself, in which case we reconnect and try again once. */
+#define DEFAULT_PING_INTERVAL   60      /* seconds */
+static int ping_interval;
+static time_t mysql_lastused;
+
+/* server_gone ERROR
+ * Does the MySQL ERROR code mean that the connection to the server was lost? */
+static int server_gone(const unsigned int e) {
+    return e == CR_SERVER_GONE_ERROR || e == CR_SERVER_LOST;
+}
+
+/* prepare_query QUERY
+ * Prepare QUERY on the current connection, if possible. */
+static void prepare_query(struct mysqlquery *q) {
+    if (!q->sql)
+        return;
+
+    if (!(q->stmt = mysql_stmt_init(mysql))) {
+        log_print(LOG_ERR, _("prepare_query: mysql_stmt_init: failed"));
+        return;
+    }
+
+    if (mysql_stmt_prepare(q->stmt, q->sql, strlen(q->sql)) != 0) {
+        log_print(LOG_WARNING, _("prepare_query: mysql_stmt_prepare: %s; will substitute values into query instead"), mysql_stmt_error(q->stmt));
+        mysql_stmt_close(q->stmt);
+        q->stmt = NULL;
+        /* Don't bother trying again when we reconnect. */
+        xfree(q->sql);
+        q->sql = NULL;
+    }
+}
+
+/* drop_mysql_server:
+ * Close the connection to the current server, if any. */
+static void drop_mysql_server(void) {
+    struct mysqlquery **qq;
+
+    for (qq = all_queries; *qq; ++qq)
+        if ((*qq)->stmt) {
+            mysql_stmt_close((*qq)->stmt);
+            (*qq)->stmt = NULL;
+        }
+
+    if (mysql)
+        mysql_close(mysql);
+    mysql = NULL;
+}
+
 /* get_mysql_server:
  * If we are not currently connected to a MySQL server, or if the current MySQL
- * server doesn't respond any more, try to connect to all defined MySQL
- * servers. If none work, we give up.  Return 0 if OK, -1 if we can't connect
- * to any server. */
+ * server has been idle for a while and doesn't respond any more, try to
+ * connect to all defined MySQL servers. If none work, we give up.  Return 0 if
+ * OK, -1 if we can't connect to any server. */
 static int get_mysql_server(void) {
     int n;
     static MYSQL mysql_handle;
     char *password;
     unsigned int timeout;
     my_bool want_reconnect = 0;
+    struct mysqlquery **qq;
 
-    if (mysql && mysql_ping(mysql) == 0)
-        /* The current server is up and running. */
-        return 0;
+    if (mysql) {
+        if (time(NULL) < mysql_lastused + ping_interval)
+            /* The current server was working a moment ago. */
+            return 0;
+        else if (mysql_ping(mysql) == 0) {
+            /* The current server is up and running. */
+            time(&mysql_lastused);
+            return 0;
+        }
 
-    if (mysql)
         /* The current server doesn't respond anymore. */
-        mysql_close(mysql);
+        drop_mysql_server();
+    }
 
     mysql = mysql_init(&mysql_handle);
 
@@ -143,6 +229,11 @@ static int get_mysql_server(void) {
         }
 
         log_print(LOG_DEBUG, _("get_mysql_server: now using server %s"), mysql_servers->toks[n]);
+
+        for (qq = all_queries; *qq; ++qq)
+            prepare_query(*qq);
+        time(&mysql_lastused);
+
         return 0;
     }
 
@@ -153,6 +244,215 @@ static int get_mysql_server(void) {
     return -1;
 }
 
+/* run_text_query QUERY FUNC VALUES FIELDS NROWS
+ * Substitute VALUES into QUERY and run it on behalf of FUNC; see do_query.
+ * Returns 0 on success, -1 on failure or -2 if the server has gone away. */
+static int run_text_query(struct mysqlquery *q, const char *func, const char **v, char **fields, int *nrows) {
+    char *query;
+    MYSQL_RES *result;
+    int ret = -1;
+
+    /* Obtain the actual query to use. */
+    if (!(query = substitute_query_params(q->template, v[0], v[1], v[2], v[3], v[4])))
+        return -1;
+
+    if (verbose)
+        log_print(LOG_DEBUG, _("%s: SQL query: %s"), func, query);
+
+    if (mysql_query(mysql, query) != 0) {
+        log_print(LOG_ERR, "%s: mysql_query: %s", func, mysql_error(mysql));
+        if (server_gone(mysql_errno(mysql)))
+            ret = -2;
+        goto fail;
+    }
+
+    result = mysql_store_result(mysql);
+
+    if (!fields) {
+        /* It's possible that the user put a query in which returned some
+         * rows. This is bogus but there's not a lot we can do; to avoid
+         * leaking memory or confusing the database, we obtain and free a
+         * result, and log a warning. */
+        if (result) {
+            log_print(LOG_WARNING, _("%s: supplied SQL query returned %d rows, which is dubious"), func, (int)mysql_num_rows(result));
+            mysql_free_result(result);
+        }
+        ret = 0;
+        goto fail;
+    }
+
+    if (!result) {
+        log_print(LOG_ERR, _("%s: mysql_store_result: %s"), func, mysql_error(mysql));
+        goto fail;
+    }
+
+    if (mysql_field_count(mysql) != 4)
+        log_print(LOG_ERR, _("%s: %d fields returned by query, should be 4: mailbox location, password hash, unix user, mailbox type"), func, mysql_field_count(mysql));
+    else if ((*nrows = mysql_num_rows(result)) != 1)
+        ret = 0;
+    else {
+        MYSQL_ROW row;
+        unsigned long *lengths;
+        int i;
+
+        /* These are "can't happen" errors */
+        if ((row = mysql_fetch_row(result)) && (lengths = mysql_fetch_lengths(result))) {
+            for (i = 0; i < 4; ++i)
+                if (row[i])
+                    fields[i] = xstrdup(row[i]);
+            ret = 0;
+        }
+    }
+
+    mysql_free_result(result);
+
+fail:
+    xfree(query);
+
+    return ret;
+}
+
+/* run_prepared_query QUERY FUNC VALUES FIELDS NROWS
+ * Execute the prepared statement for QUERY with VALUES as parameters, on
+ * behalf of FUNC; see do_query. Returns 0 on success, -1 on failure or -2 if
+ * the server has gone away. */
+static int run_prepared_query(struct mysqlquery *q, const char *func, const char **v, char **fields, int *nrows) {
+    MYSQL_BIND param[MAX_QUERY_PARAMS], res[4];
+    unsigned long paramlen[MAX_QUERY_PARAMS], len[4];
+    char buf[4][MAX_FIELD_LEN];
+    my_bool isnull[4];
+    int i, ret = -1;
+
+    memset(param, 0, sizeof param);
+    for (i = 0; i < q->nparams; ++i) {
+        const char *s;
+        /* As substitute_variables, refuse to run a query with a missing
+         * value. */
+        if (!(s = v[q->params[i]]))
+            return -1;
+        param[i].buffer_type = MYSQL_TYPE_STRING;
+        param[i].buffer = (char*)s;
+        param[i].buffer_length = paramlen[i] = strlen(s);
+        param[i].length = paramlen + i;
+    }
+
+    if (verbose)
+        log_print(LOG_DEBUG, _("%s: SQL prepared statement: %s"), func, q->sql);
+
+    if (mysql_stmt_bind_param(q->stmt, param) != 0 || mysql_stmt_execute(q->stmt) != 0) {
+        log_print(LOG_ERR, "%s: mysql_stmt_execute: %s", func, mysql_stmt_error(q->stmt));
+        return server_gone(mysql_stmt_errno(q->stmt)) ? -2 : -1;
+    }
+
+    if (!fields) {
+        /* See above. */
+        if (mysql_stmt_field_count(q->stmt) > 0) {
+            if (mysql_stmt_store_result(q->stmt) == 0)
+                log_print(LOG_WARNING, _("%s: supplied SQL query returned %d rows, which is dubious"), func, (int)mysql_stmt_num_rows(q->stmt));
+            mysql_stmt_free_result(q->stmt);
+        }
+        return 0;
+    }
+
+    if (mysql_stmt_field_count(q->stmt) != 4) {
+        log_print(LOG_ERR, _("%s: %d fields returned by query, should be 4: mailbox location, password hash, unix user, mailbox type"), func, mysql_stmt_field_count(q->stmt));
+        mysql_stmt_store_result(q->stmt);
+        goto fail;
+    }
+
+    memset(res, 0, sizeof res);
+    for (i = 0; i < 4; ++i) {
+        res[i].buffer_type = MYSQL_TYPE_STRING;
+        res[i].buffer = buf[i];
+        res[i].buffer_length = sizeof buf[i];
+        res[i].length = len + i;
+        res[i].is_null = isnull + i;
+    }
+
+    if (mysql_stmt_bind_result(q->stmt, res) != 0 || mysql_stmt_store_result(q->stmt) != 0) {
+        log_print(LOG_ERR, "%s: mysql_stmt_store_result: %s", func, mysql_stmt_error(q->stmt));
+        if (server_gone(mysql_stmt_errno(q->stmt)))
+            ret = -2;
+        goto fail;
+    }
+
+    if ((*nrows = (int)mysql_stmt_num_rows(q->stmt)) == 1) {
+        switch (mysql_stmt_fetch(q->stmt)) {
+            case 0:
+                break;
+
+            case MYSQL_DATA_TRUNCATED:
+                log_print(LOG_ERR, _("%s: a field returned by query is longer than %d bytes"), func, MAX_FIELD_LEN);
+                goto fail;
+
+            default:
+                log_print(LOG_ERR, "%s: mysql_stmt_fetch: %s", func, mysql_stmt_error(q->stmt));
+                goto fail;
+        }
+
+        for (i = 0; i < 4; ++i)
+            if (!isnull[i]) {
+                fields[i] = xmalloc(len[i] + 1);
+                memcpy(fields[i], buf[i], len[i]);
+                fields[i][len[i]] = 0;
+            }
+    }
+
+    ret = 0;
+
+fail:
+    mysql_stmt_free_result(q->stmt);
+
+    return ret;
+}
+
+/* do_query QUERY FUNC USER LOCAL_PART DOMAIN CLIENTHOST SERVERHOST FIELDS NROWS
+ * Run QUERY with the given values on behalf of FUNC. If FIELDS is not NULL,
+ * the query should return four fields; the number of rows is saved in *NROWS
+ * and, if it is one, copies of the fields in FIELDS. Returns 0 on success or
+ * -1 on failure. */
+static int do_query(struct mysqlquery *q, const char *func, const char *user, const char *local_part, const char *domain, const char *clienthost, const char *serverhost, char **fields, int *nrows) {
+    const char *v[NUM_QUERY_VARS];
+    int i, r = -1;
+
+    v[0] = user;
+    v[1] = local_part;
+    v[2] = domain;
+    v[3] = clienthost;
+    v[4] = serverhost;
+
+    for (i = 0; i < 2; ++i) {
+        if (get_mysql_server() == -1) {
+            log_print(LOG_ERR, _("%s: aborting"), func);
+            return -1;
+        }
+
+        if (q->stmt)
+            r = run_prepared_query(q, func, v, fields, nrows);
+        else
+            r = run_text_query(q, func, v, fields, nrows);
+
+        if (r != -2)
+            break;
+
+        /* Lost the connection; try again with a fresh one. */
+        drop_mysql_server();
+    }
+
+    if (r == 0)
+        time(&mysql_lastused);
+
+    return r == 0 ? 0 : -1;
+}
+
+/* setup_query QUERY TEMPLATE
+ * Set up QUERY to use TEMPLATE, as a prepared statement if possible. */
+static void setup_query(struct mysqlquery *q, char *template) {
+    q->template = template;
+    if (template && !(q->sql = parameterise_query(template, '?', NUM_QUERY_VARS, query_vars, q->params, &q->nparams, MAX_QUERY_PARAMS)))
+        log_print(LOG_INFO, _("setup_query: query `%.40s...' cannot be prepared; values will be substituted into it"), template);
+}
+
 /* auth_mysql_init:
  * Initialise the database connection driver. */
 int auth_mysql_init() {
@@ -193,6 +493,10 @@ int auth_mysql_init() {
     if ((s = config_get_string("auth-mysql-onlogin-query")))
         onlogin_query_template = s;
 
+    setup_query(&user_pass_query, user_pass_query_template);
+    setup_query(&apop_query, apop_query_template);
+    setup_query(&onlogin_query, onlogin_query_template);
+
     /* Obtain gid to use */
     if ((s = config_get_string("auth-mysql-mail-group"))) {
         if (!parse_gid(s, &mail_gid)) {
@@ -202,6 +506,22 @@ int auth_mysql_init() {
         use_gid = 1;
     }
 
+    /* How long the connection may be idle before we check it's still up. */
+    switch (config_get_int("auth-mysql-ping-interval", &ping_interval)) {
+        case -1:
+            log_print(LOG_WARNING, _("auth_mysql_init: bad value for auth-mysql-ping-interval; using default"));
+            /* fall through */
+        case 0:
+            ping_interval = DEFAULT_PING_INTERVAL;
+            break;
+
+        default:
+            if (ping_interval < 0) {
+                log_print(LOG_WARNING, _("auth_mysql_init: auth-mysql-ping-interval may not be negative; using default"));
+                ping_interval = DEFAULT_PING_INTERVAL;
+            }
+    }
+
     mysql_servers = tokens_new(hostname, " \t");
 
     if (get_mysql_server() == -1) {
@@ -216,105 +536,70 @@ int auth_mysql_init() {
     return 1;
 }
 
-extern int verbose; /* in main.c */
-
 /* auth_mysql_new_apop:
  * Attempt to authenticate a user via APOP, using the template SELECT query in
  * the config file or the default defined above otherwise. */
 authcontext auth_mysql_new_apop(const char *name, const char *local_part, const char *domain, const char *timestamp, const unsigned char *digest, const char *clienthost /* unused */, const char *serverhost) {
-    char *query = NULL;
+    char *row[4] = {0};
     authcontext a = NULL;
     char *who;
+    int i, nrows;
 
     who = username_string(name, local_part, domain);
 
-    if (!mysql_driver_active || !apop_query_template) return NULL;
-
-    if (get_mysql_server() == -1) {
-        log_print(LOG_ERR, _("auth_mysql_new_apop: aborting"));
-        return NULL;
-    }
+    if (!mysql_driver_active || !apop_query.template) return NULL;
 
-    /* Obtain the actual query to use. */
-    if (!(query = substitute_query_params(apop_query_template, name, local_part, domain, NULL, serverhost)))
+    if (do_query(&apop_query, "auth_mysql_new_apop", name, local_part, domain, NULL, serverhost, row, &nrows) == -1)
         goto fail;
 
-    if (verbose)
-        log_print(LOG_DEBUG, _("auth_mysql_new_apop: SQL query: %s"), query);
-
-    if (mysql_query(mysql, query) == 0) {
-        MYSQL_RES *result;
-        int i;
+    switch (nrows) {
+    case 0:
+        break;
+    case 1: {
+            struct passwd *pw;
+            uid_t uid;
+            
+            /* Sanity check. Verify that user has UID and password. */
+            if (!row[2]) {
+                log_print(LOG_ERR, _("auth_mysql_new_apop: UID for user %s is NULL"), who);
+                break;
+            } else if (!row[1]) {
+                log_print(LOG_ERR, _("auth_mysql_new_apop: password hash for user %s is NULL"), who);
+                break;
+            }
 
-        result = mysql_store_result(mysql);
-        if (!result) {
-            log_print(LOG_ERR, "auth_mysql_new_apop: mysql_store_result: %s", mysql_error(mysql));
-            goto fail;
-        }
+            /* Actually check the password. */
+            if (!check_password_apop(who, row[1], timestamp, digest)) {
+                log_print(LOG_WARNING, _("auth_mysql_new_apop: failed login for %s"), who);
+                break;
+            }
 
-        if (mysql_field_count(mysql) != 4) {
-            log_print(LOG_ERR, _("auth_mysql_new_apop: %d fields returned by query, should be 4: mailbox location, password hash, unix user, mailbox type"), mysql_field_count(mysql));
-            goto fail;
-        }
+            /* User was not lying (about her password) */
+            if (!parse_uid((const char*)row[2], &uid)) {
+                log_print(LOG_ERR, _("auth_mysql_new_apop: unix user `%s' for %s does not make sense"), row[2], who);
+                break;
+            }
 
-        switch (i = mysql_num_rows(result)) {
-        case 0:
-            break;
-        case 1: {
-                MYSQL_ROW row;
-                unsigned long *lengths;
-                struct passwd *pw;
-                uid_t uid;
-                
-                row = mysql_fetch_row(result);
-                /* These are "can't happen" errors */
-                if (!row || !(lengths = mysql_fetch_lengths(result))) break;
-
-                /* Sanity check. Verify that user has UID and password. */
-                if (!row[2]) {
-                    log_print(LOG_ERR, _("auth_mysql_new_apop: UID for user %s is NULL"), who);
-                    goto fail;
-                } else if (!row[1]) {
-                    log_print(LOG_ERR, _("auth_mysql_new_apop: password hash for user %s is NULL"), who);
-                    goto fail;
-                }
- 
-                /* Actually check the password. */
-                if (!check_password_apop(who, row[1], timestamp, digest)) {
-                    log_print(LOG_WARNING, _("auth_mysql_new_apop: failed login for %s"), who);
-                    break;
-                }
-
-                /* User was not lying (about her password) */
-                if (!parse_uid((const char*)row[2], &uid)) {
-                    log_print(LOG_ERR, _("auth_mysql_new_apop: unix user `%s' for %s does not make sense"), row[2], who);
-                    break;
-                }
-
-                pw = getpwuid(uid);
-
-                if (!pw) {
-                    log_print(LOG_ERR, "auth_mysql_new_apop: getpwuid(%d): %m", (int)uid);
-                    break;
-                }
-
-                a = authcontext_new(pw->pw_uid, use_gid ? mail_gid : pw->pw_gid, row[3], row[0], pw->pw_dir);
+            pw = getpwuid(uid);
 
+            if (!pw) {
+                log_print(LOG_ERR, "auth_mysql_new_apop: getpwuid(%d): %m", (int)uid);
                 break;
             }
 
-        default:
-            log_print(LOG_ERR, _("auth_mysql_new_apop: database inconsistency: query for %s returned %d rows, should be 0 or 1"), name, i);
+            a = authcontext_new(pw->pw_uid, use_gid ? mail_gid : pw->pw_gid, row[3], row[0], pw->pw_dir);
+
             break;
         }
 
-        mysql_free_result(result);
-        
-    } else
-        log_print(LOG_ERR, "auth_mysql_new_apop: mysql_query: %s", mysql_error(mysql));
+    default:
+        log_print(LOG_ERR, _("auth_mysql_new_apop: database inconsistency: query for %s returned %d rows, should be 0 or 1"), name, nrows);
+        break;
+    }
 
 fail:
-    if (query) xfree(query);
+    for (i = 0; i < 4; ++i)
+        xfree(row[i]);
 
     return a;
 }
@@ -323,96 +608,69 @@ fail:
  * Attempt to authenticate a user via USER/PASS, using the template SELECT
  * query in the config file or the default defined above otherwise. */
 authcontext auth_mysql_new_user_pass(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost /* unused */, const char *serverhost) {
-    char *query = NULL, *who;
+    char *row[4] = {0}, *who;
     authcontext a = NULL;
+    int i, nrows;
 
     who = username_string(user, local_part, domain);
     
-    if (!mysql_driver_active || !user_pass_query_template) return NULL;
-
-    if (get_mysql_server() == -1) {
-        log_print(LOG_ERR, _("auth_mysql_new_user_pass: aborting"));
+    if (!user_pass_query.template) {
+        auth_rejected = 1;  /* we never accept USER/PASS */
+        return NULL;
+    } else if (!mysql_driver_active)
         return NULL;
-    }
 
-    /* Obtain the actual query to use. */
-    if (!(query = substitute_query_params(user_pass_query_template, user, local_part, domain, NULL, serverhost)))
+    if (do_query(&user_pass_query, "auth_mysql_new_user_pass", user, local_part, domain, NULL, serverhost, row, &nrows) == -1)
         goto fail;
 
-    if (verbose)
-        log_print(LOG_DEBUG, _("auth_mysql_new_user_pass: SQL query: %s"), query);
+    switch (nrows) {
+    case 0:
+        auth_rejected = 1;
+        break;
+    case 1: {
+            struct passwd *pw;
+            uid_t uid;
+            
+            /* Sanity check. Verify that user has UID and password. */
+            if (!row[2]) {
+                log_print(LOG_ERR, _("auth_mysql_new_user_pass: UID for user %s is NULL"), who);
+                break;
+            } else if (!row[1]) {
+                log_print(LOG_ERR, _("auth_mysql_new_user_pass: password hash for user %s is NULL"), who);
+                break;
+            }
 
-    if (mysql_query(mysql, query) == 0) {
-        MYSQL_RES *result;
-        int i;
+            /* Verify the password. */
+            if (!check_password(who, row[1], pass, "{md5}")) {
+                log_print(LOG_ERR, _("auth_mysql_new_user_pass: %s failed login with wrong password"), who);
+                auth_rejected = 1;
+                break;
+            }
 
-        result = mysql_store_result(mysql);
-        if (!result) {
-            log_print(LOG_ERR, _("auth_mysql_new_user_pass: mysql_store_result: %s"), mysql_error(mysql));
-            goto fail;
-        }
+            if (!parse_uid((const char*)row[2], &uid)) {
+                log_print(LOG_ERR, _("auth_mysql_new_user_pass: unix user `%s' for %s does not make sense"), row[2], who);
+                break;
+            }
 
-        if (mysql_field_count(mysql) != 4) {
-            log_print(LOG_ERR, _("auth_mysql_new_user_pass: %d fields returned by query, should be 4: mailbox location, password hash, unix user, mailbox type"), mysql_field_count(mysql));
-            goto fail;
-        }
+            pw = getpwuid(uid);
 
-        switch (i = mysql_num_rows(result)) {
-        case 0:
-            break;
-        case 1: {
-                MYSQL_ROW row;
-                unsigned long *lengths;
-                struct passwd *pw;
-                uid_t uid;
-                
-                row = mysql_fetch_row(result);
-
-                /* These are "can't happen" errors */
-                if (!row || !(lengths = mysql_fetch_lengths(result))) break;
-
-                /* Sanity check. Verify that user has UID and password. */
-                if (!row[2]) {
-                    log_print(LOG_ERR, _("auth_mysql_new_user_pass: UID for user %s is NULL"), who);
-                    goto fail;
-                } else if (!row[1]) {
-                    log_print(LOG_ERR, _("auth_mysql_new_user_pass: password hash for user %s is NULL"), who);
-                    break;
-                }
-
-                /* Verify the password. */
-                if (!check_password(who, row[1], pass, "{md5}")) {
-                    log_print(LOG_ERR, _("auth_mysql_new_user_pass: %s failed login with wrong password"), who);
-                    break;
-                }
-
-                if (!parse_uid((const char*)row[2], &uid)) {
-                    log_print(LOG_ERR, _("auth_mysql_new_user_pass: unix user `%s' for %s does not make sense"), row[2], who);
-                    break;
-                }
-
-                pw = getpwuid(uid);
-
-                if (!pw) {
-                    log_print(LOG_ERR, "auth_mysql_new_user_pass: getpwuid(%d): %m", (int)uid);
-                    break;
-                }
-
-                a = authcontext_new(pw->pw_uid, use_gid ? mail_gid : pw->pw_gid, row[3], row[0], pw->pw_dir);
+            if (!pw) {
+                log_print(LOG_ERR, "auth_mysql_new_user_pass: getpwuid(%d): %m", (int)uid);
                 break;
             }
 
-        default:
-            log_print(LOG_ERR, _("auth_mysql_new_user_pass: database inconsistency: query for %s returned %d rows, should be 0 or 1"), who, i);
+            a = authcontext_new(pw->pw_uid, use_gid ? mail_gid : pw->pw_gid, row[3], row[0], pw->pw_dir);
             break;
         }
 
-        mysql_free_result(result);
-    } else
-        log_print(LOG_ERR, "auth_mysql_new_user_pass: mysql_query: %s", mysql_error(mysql));
+    default:
+        log_print(LOG_ERR, _("auth_mysql_new_user_pass: database inconsistency: query for %s returned %d rows, should be 0 or 1"), who, nrows);
+        break;
+    }
 
 fail:
-    xfree(query);
+    for (i = 0; i < 4; ++i)
+        xfree(row[i]);
 
     return a;
 }
@@ -422,42 +680,18 @@ fail:
  * variables substituted in the template are $(local_part), $(domain) and
  * $(clienthost), the username, domain, and connecting client host. */
 void auth_mysql_onlogin(const authcontext A, const char *clienthost, const char *serverhost) {
-    char *query;
-
-    if (!mysql_driver_active || !onlogin_query_template) return;
-
-    if (get_mysql_server() == -1) {
-        log_print(LOG_ERR, _("auth_mysql_onlogin: aborting"));
-        return;
-    }
-
-    query = substitute_query_params(onlogin_query_template, A->user, A->local_part, A->domain, clienthost, serverhost);
-    if (!query)
-        return;
+    if (!mysql_driver_active || !onlogin_query.template) return;
 
-    if (verbose)
-        log_print(LOG_DEBUG, _("auth_mysql_onlogin: SQL query: %s"), query);
-
-    if (mysql_query(mysql, query) == 0) {
-        MYSQL_RES *result;
-        /* It's possible that the user put a query in which returned some rows.
-         * This is bogus but there's not a lot we can do; to avoid leaking
-         * memory or confusing the database, we obtain and free a result, and
-         * log a warning. */
-        result = mysql_store_result(mysql);
-        if (result) {
-            log_print(LOG_WARNING, _("auth_mysql_onlogin: supplied SQL query returned %d rows, which is dubious"), mysql_num_rows(result));
-            mysql_free_result(result);
-        }
-    } else
-        log_print(LOG_ERR, "auth_mysql_onlogin: mysql_query: %s", mysql_error(mysql));
-
-    xfree(query);
+    do_query(&onlogin_query, "auth_mysql_onlogin", A->user, A->local_part, A->domain, clienthost, serverhost, NULL, NULL);
 }
 
 /* auth_mysql_postfork:
  * Post-fork cleanup. */
 void auth_mysql_postfork() {
+    struct mysqlquery **qq;
+    /* The connection and its statements belong to the parent. */
+    for (qq = all_queries; *qq; ++qq)
+        (*qq)->stmt = NULL;
     mysql = NULL;
     mysql_driver_active = 0;
 }
@@ -465,11 +699,15 @@ void auth_mysql_postfork() {
 /* auth_mysql_close:
  * Close the database connection. */
 void auth_mysql_close() {
+    struct mysqlquery **qq;
     if (mysql) {
-        mysql_close(mysql);
-        mysql = NULL;
+        drop_mysql_server();
         tokens_delete(mysql_servers);
     }
+    for (qq = all_queries; *qq; ++qq) {
+        xfree((*qq)->sql);
+        (*qq)->sql = NULL;
+    }
 }
 
 /* substitute_query_params
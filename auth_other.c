@@ -23,6 +23,7 @@
  * terminated by a \0. Variables sent:
  *
  *  key         value
+ *  id          number identifying this request
  *  method      PASS or APOP
  *  timestamp   server's RFC1939 timestamp
  *  user        client's username sent with USER or APOP command
@@ -42,6 +43,10 @@
  *  mailbox     (optional) location of mailbox
  *  mboxtype    (optional) name of mailbox driver
  *  logmsg      (optional) message to log
+ *  id          (optional) id of the request to which this is the response
+ *
+ * If the program returns an id, it must be that of the request; this lets us
+ * tell when a response has been muddled with another.
  *
  * The called program will be sent SIGTERM when the authentication driver
  * closes, or in the event that there is a protocol failure. At present,
@@ -96,6 +101,10 @@ struct timeval auth_other_childtimeout;
 /* File descriptors used to talk to child. */
 volatile int auth_other_childwr = -1, auth_other_childrd = -1;
 
+/* ID of the last request sent to the child, and whether to send it. */
+static unsigned long auth_other_request_id;
+static int auth_other_send_id;
+
 /* dump:
  * Debugging method. */
 void dump(unsigned char *b, size_t len) {
@@ -297,6 +306,9 @@ int auth_other_init() {
     auth_other_childtimeout.tv_sec  = (long)floor(f);
     auth_other_childtimeout.tv_usec = (long)((f - floor(f)) * 1e6);
 
+    /* Programs written before requests were tagged may not expect an id. */
+    auth_other_send_id = config_get_bool("auth-other-send-id");
+
     /* Find out user and group under which program will run. */
     if (!(s = config_get_string("auth-other-user"))) {
         log_print(LOG_ERR, _("auth_other_init: no user specified"));
@@ -351,7 +363,15 @@ int auth_other_send_request(const int nvars, ...) {
 
     va_start(ap, nvars);
 
-    for (i = 0, p = buffer, nn = 0; i < nvars; ++i) {
+    /* Tag the request, if the program expects it. */
+    ++auth_other_request_id;
+    if (auth_other_send_id)
+        p = buffer + sprintf(buffer, "id%c%lu", 0, auth_other_request_id) + 1;
+    else
+        p = buffer;
+    nn = p - buffer;
+
+    for (i = 0; i < nvars; ++i) {
         const char *key, *val;
         key = va_arg(ap, const char *);
         nn += strlen(key) + 1;
@@ -480,6 +500,16 @@ formaterror:
         S = NULL;
     }
 
+    /* If the child tagged its response, check it's the one we want. */
+    if (S) {
+        item *I;
+        if ((I = stringmap_find(S, "id")) && strtoul((char*)I->v, NULL, 10) != auth_other_request_id) {
+            log_print(LOG_ERR, _("auth_other_recv_response: response is for request %s, not %lu; killing child"), (char*)I->v, auth_other_request_id);
+            stringmap_delete_free(S);
+            S = NULL;
+        }
+    }
+
 fail:
     if (!S) auth_other_kill_child();
     return S;
@@ -605,7 +635,9 @@ authcontext auth_other_new_user_pass(const char *user, const char *local_part, c
         if (I) domain = (char*)I->v;
 
         a = authcontext_new(uid, gid, mboxdrv, mailbox, pw->pw_dir);
-    } else if (strcmp((char*)I->v, "NO") != 0) INVALID("result", (char*)I->v);
+    } else if (strcmp((char*)I->v, "NO") == 0)
+        auth_rejected = 1;
+    else if (strcmp((char*)I->v, "ERROR") != 0) INVALID("result", (char*)I->v);
         
 fail:
     stringmap_delete_free(S);
@@ -42,6 +42,7 @@ static const char rcsid[] = "$Id$";
 
 #include "auth_pam.h"
 #include "authswitch.h"
+#include "authworker.h"
 #include "config.h"
 #include "util.h"
 
@@ -105,12 +106,19 @@ static int auth_pam_do_authentication(const char *facility, const char *user, co
         if (r == PAM_SUCCESS)
             /* Succeeded. */
             result = 1;
-        else
+        else {
             /* Failed; account is disabled or something. */
             log_print(LOG_ERR, "auth_pam_new_user_pass: pam_acct_mgmt(%s): %s", user, pam_strerror(pamh, r));
-    } else
-        /* User did not authenticate. */
+            if (r == PAM_ACCT_EXPIRED || r == PAM_PERM_DENIED || r == PAM_USER_UNKNOWN)
+                auth_rejected = 1;
+        }
+    } else {
+        /* User did not authenticate. Other failures mean that the PAM stack
+         * could not find out, not that the user is wrong. */
         log_print(LOG_ERR, "auth_pam_new_user_pass: pam_authenticate(%s): %s", user, pam_strerror(pamh, r));
+        if (r == PAM_AUTH_ERR || r == PAM_USER_UNKNOWN)
+            auth_rejected = 1;
+    }
 
     r = pam_end(pamh, r);
     if (r != PAM_SUCCESS) log_print(LOG_ERR, "auth_pam_new_user_pass: pam_end: %s", pam_strerror(pamh, r));
@@ -133,14 +141,19 @@ authcontext auth_pam_new_user_pass(const char *user, const char *local_part, con
     int authenticated = 0;
 
     /* Check the this isn't a virtual-domain user. */
-    if (local_part) return NULL;
+    if (local_part) {
+        auth_rejected = 1;
+        return NULL;
+    }
 
     /* It is possible to use PAM to authenticate users who do not exist as
      * system users. We support this by defining an auth-pam-mail-user
      * configuration option which is used to obtain the user information
      * for a non-system user to be authenticated against PAM. */
+    errno = 0;
     if (!(pw2 = getpwnam(user))) {
         char *s;
+        int e = errno;
         if ((s = config_get_string("auth-pam-mail-user"))) {
             uid_t u;
             if (parse_uid(s, &u)) {
@@ -148,7 +161,8 @@ authcontext auth_pam_new_user_pass(const char *user, const char *local_part, con
                     log_print(LOG_ERR, _("auth_pam_new_user_pass: auth-pam-mail-user directive `%s' does not correspond to a real user"), s);
             } else
                 log_print(LOG_ERR, _("auth_pam_new_user_pass: auth-pam-mail-user directive `%s' does not make sense"), s);
-        }
+        } else if (e == 0)
+            auth_rejected = 1;  /* no such user, and no stand-in */
 
         if (!pw2)
             return NULL;
@@ -178,19 +192,24 @@ authcontext auth_pam_new_user_pass(const char *user, const char *local_part, con
      * On many systems, PAM leaks memory, which is a problem for a daemon like
      * tpop3d which does all authentication in the main daemon. So we
      * optionally implement a really ugly hack where we fork a process in
-     * which to interact with PAM.
+     * which to interact with PAM. An authentication worker is already such a
+     * process, and is replaced after auth-worker-max-requests requests, so
+     * there we talk to PAM directly.
      */
 
 #ifdef REALLY_UGLY_PAM_HACK
-    {
+    if (auth_worker_process)
+        authenticated = auth_pam_do_authentication(facility, user, pass, clienthost);
+    else {
         int pfd[2];
         char res = 0;
         ssize_t n;
         
         /* 
-         * The child process writes a byte zero into the pipe on failure or a
-         * one on success. Don't use the exit value because we don't want to
-         * have to piss about with the SIGCHLD handler.
+         * The child process writes a byte zero into the pipe on failure, a
+         * one on success or a two if PAM rejected the user. Don't use the exit
+         * value because we don't want to have to piss about with the SIGCHLD
+         * handler.
          */
         
         if (pipe(pfd) == -1)
@@ -199,7 +218,8 @@ authcontext auth_pam_new_user_pass(const char *user, const char *local_part, con
             switch (auth_pam_child_pid = fork()) {
                 case 0:
                     close(pfd[0]);
-                    if (xwrite(pfd[1], auth_pam_do_authentication(facility, user, pass, clienthost) ? "\001" : "\0", 1) == -1)
+                    res = auth_pam_do_authentication(facility, user, pass, clienthost) ? 1 : auth_rejected ? 2 : 0;
+                    if (xwrite(pfd[1], &res, 1) == -1)
                         /* This is really bad. The parent may hang waiting for us. */
                         log_print(LOG_ERR, _("auth_pam_new_user_pass: (child process): write: %m"));
                     close(pfd[1]);
@@ -222,7 +242,9 @@ authcontext auth_pam_new_user_pass(const char *user, const char *local_part, con
                         else 
                             log_print(LOG_ERR, _("auth_pam_new_user_pass: authentication child did not send status (shouldn't happen)"));
                         authenticated = 0;
-                    } else
+                    } else if (res == 2)
+                        auth_rejected = 1;
+                    else
                         /* Good. Byte returned. */
                         authenticated = res;
                     break;
@@ -39,6 +39,8 @@ static const char rcsid[] = "$Id$";
 #ifdef AUTH_PASSWD_SHADOW
 #include <shadow.h>
 #endif /* AUTH_PASSWD_SHADOW */
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,6 +55,295 @@ static const char rcsid[] = "$Id$";
 #include "util.h"
 #include "mailbox.h"
 
+#ifndef PASSWD_FILE
+#define PASSWD_FILE "/etc/passwd"
+#endif
+#ifndef SHADOW_FILE
+#define SHADOW_FILE "/etc/shadow"
+#endif
+
+/*
+ * Snapshot of the password files. If auth-passwd-cache is set, we read
+ * /etc/passwd (and /etc/shadow) into a hash table keyed on user name, and
+ * look users up there before asking the system, whose getpwnam(3) may mean a
+ * scan of the file or a round trip to a directory server for every login.
+ * The files are stat(2)ed before each lookup and the snapshot rebuilt if
+ * either has changed. Users not in the snapshot -- including NIS `+' entries
+ * and anyone in /etc/passwd without a shadow entry -- are looked up through
+ * the system as before.
+ */
+struct pwfile {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime, ctime;
+    off_t size;
+    char *data;
+    size_t len;
+};
+
+struct pwentry {
+    char *name, *passwd, *dir;  /* point into file data */
+    uid_t uid;
+    gid_t gid;
+    int next;                   /* next in hash chain, or -1 */
+};
+
+static int use_snapshot;
+static struct {
+    struct pwfile passwd;
+#ifdef AUTH_PASSWD_SHADOW
+    struct pwfile shadow;
+#endif /* AUTH_PASSWD_SHADOW */
+    struct pwentry *entries;
+    int nentries, *buckets;
+    unsigned int nbuckets;      /* a power of two */
+    int valid;
+} snap;
+
+/* hash_string STRING
+ * Return a hash of STRING. */
+static unsigned int hash_string(const char *s) {
+    unsigned int h = 0;
+    for (; *s; ++s)
+        h = h * 31 + (unsigned char)*s;
+    return h;
+}
+
+/* pwfile_changed FILE NAME
+ * Has the file NAME changed since FILE was read from it? */
+static int pwfile_changed(const struct pwfile *F, const char *name) {
+    struct stat st;
+    if (stat(name, &st) == -1)
+        return 1;
+    return st.st_dev != F->dev || st.st_ino != F->ino || st.st_mtime != F->mtime || st.st_ctime != F->ctime || st.st_size != F->size;
+}
+
+/* pwfile_read FILE NAME
+ * Read the whole of the file NAME into FILE, NUL-terminating it. Returns 1 on
+ * success or 0 on failure. */
+static int pwfile_read(struct pwfile *F, const char *name) {
+    struct stat st;
+    int fd;
+
+    if ((fd = open(name, O_RDONLY)) == -1) {
+        log_print(LOG_ERR, "pwfile_read: %s: %m", name);
+        return 0;
+    } else if (fstat(fd, &st) == -1) {
+        log_print(LOG_ERR, "pwfile_read: %s: fstat: %m", name);
+        close(fd);
+        return 0;
+    }
+
+    F->dev = st.st_dev;
+    F->ino = st.st_ino;
+    F->mtime = st.st_mtime;
+    F->ctime = st.st_ctime;
+    F->size = st.st_size;
+    F->data = xmalloc(st.st_size + 1);
+    F->len = 0;
+
+    while (F->len < (size_t)st.st_size) {
+        ssize_t n;
+        if ((n = read(fd, F->data + F->len, st.st_size - F->len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            log_print(LOG_ERR, "pwfile_read: %s: %m", name);
+            close(fd);
+            return 0;
+        } else if (n == 0)
+            break;
+        F->len += n;
+    }
+
+    close(fd);
+    F->data[F->len] = 0;
+
+    return 1;
+}
+
+/* pwfile_free FILE
+ * Free the contents of FILE, first overwriting them, since they may contain
+ * password hashes. */
+static void pwfile_free(struct pwfile *F) {
+    if (F->data) {
+        memset(F->data, 0, F->len);
+        xfree(F->data);
+    }
+    memset(F, 0, sizeof *F);
+}
+
+/* next_field STRING
+ * Terminate the colon-separated field at the start of STRING, returning a
+ * pointer to the next field, or NULL if there is none. */
+static char *next_field(char *s) {
+    if ((s = strchr(s, ':')))
+        *s++ = 0;
+    return s;
+}
+
+/* snapshot_find NAME
+ * Return the snapshot entry for the user NAME, or NULL if there is none. */
+static struct pwentry *snapshot_find(const char *name) {
+    int i;
+    for (i = snap.buckets[hash_string(name) & (snap.nbuckets - 1)]; i != -1; i = snap.entries[i].next)
+        if (strcmp(snap.entries[i].name, name) == 0)
+            return snap.entries + i;
+    return NULL;
+}
+
+/* snapshot_free
+ * Discard the snapshot. */
+static void snapshot_free(void) {
+    pwfile_free(&snap.passwd);
+#ifdef AUTH_PASSWD_SHADOW
+    pwfile_free(&snap.shadow);
+#endif /* AUTH_PASSWD_SHADOW */
+    xfree(snap.entries);
+    xfree(snap.buckets);
+    memset(&snap, 0, sizeof snap);
+}
+
+/* snapshot_load
+ * (Re)build the snapshot from the password files. Returns 1 on success or 0
+ * on failure, in which case there is no snapshot. */
+static int snapshot_load(void) {
+    char *line, *p, *end;
+    size_t nlines;
+    unsigned int i;
+
+    snapshot_free();
+
+    if (!pwfile_read(&snap.passwd, PASSWD_FILE))
+        goto fail;
+#ifdef AUTH_PASSWD_SHADOW
+    if (!pwfile_read(&snap.shadow, SHADOW_FILE))
+        goto fail;
+#endif /* AUTH_PASSWD_SHADOW */
+
+    end = snap.passwd.data + snap.passwd.len;
+    for (p = snap.passwd.data, nlines = 1; p < end; ++p)
+        if (*p == '\n')
+            ++nlines;
+
+    snap.entries = xcalloc(nlines, sizeof *snap.entries);
+    for (snap.nbuckets = 16; snap.nbuckets < nlines; snap.nbuckets <<= 1);
+    snap.buckets = xmalloc(snap.nbuckets * sizeof *snap.buckets);
+    for (i = 0; i < snap.nbuckets; ++i)
+        snap.buckets[i] = -1;
+
+    /* name:passwd:uid:gid:gecos:dir:shell */
+    for (line = snap.passwd.data; line < end; line = p + 1) {
+        struct pwentry *E;
+        char *f[7], *q;
+        unsigned long uid, gid;
+        unsigned int b;
+        int n;
+
+        if (!(p = memchr(line, '\n', end - line)))
+            p = end;
+        *p = 0;
+
+        /* Skip blank lines, comments and NIS compatibility entries; users
+         * named by the latter will be looked up through the system. */
+        if (!*line || *line == '#' || *line == '+' || *line == '-')
+            continue;
+
+        for (f[0] = line, n = 1; n < 7 && (f[n] = next_field(f[n - 1])); ++n);
+        if (n < 7)
+            continue;
+
+        uid = strtoul(f[2], &q, 10);
+        if (!*f[2] || *q)
+            continue;
+        gid = strtoul(f[3], &q, 10);
+        if (!*f[3] || *q)
+            continue;
+
+        /* As with getpwnam(3), the first entry for a name counts. */
+        if (snapshot_find(f[0]))
+            continue;
+
+        E = snap.entries + snap.nentries;
+        E->name = f[0];
+#ifdef AUTH_PASSWD_SHADOW
+        E->passwd = NULL;   /* filled in from the shadow file */
+#else
+        E->passwd = f[1];
+#endif /* AUTH_PASSWD_SHADOW */
+        E->uid = (uid_t)uid;
+        E->gid = (gid_t)gid;
+        E->dir = f[5];
+        b = hash_string(E->name) & (snap.nbuckets - 1);
+        E->next = snap.buckets[b];
+        snap.buckets[b] = snap.nentries++;
+    }
+
+#ifdef AUTH_PASSWD_SHADOW
+    /* name:passwd:... */
+    end = snap.shadow.data + snap.shadow.len;
+    for (line = snap.shadow.data; line < end; line = p + 1) {
+        struct pwentry *E;
+        char *pw;
+
+        if (!(p = memchr(line, '\n', end - line)))
+            p = end;
+        *p = 0;
+
+        if (!(pw = next_field(line)))
+            continue;
+        next_field(pw);
+
+        if ((E = snapshot_find(line)) && !E->passwd)
+            E->passwd = pw;
+    }
+#endif /* AUTH_PASSWD_SHADOW */
+
+    snap.valid = 1;
+    log_print(LOG_DEBUG, _("snapshot_load: read %d users from password files"), snap.nentries);
+    return 1;
+
+fail:
+    snapshot_free();
+    return 0;
+}
+
+/* snapshot_lookup NAME
+ * Return the snapshot entry for the user NAME, reloading the snapshot first if
+ * the password files have changed, or NULL if the user is not in it. */
+static struct pwentry *snapshot_lookup(const char *name) {
+    struct pwentry *E;
+
+    if (!snap.valid
+        || pwfile_changed(&snap.passwd, PASSWD_FILE)
+#ifdef AUTH_PASSWD_SHADOW
+        || pwfile_changed(&snap.shadow, SHADOW_FILE)
+#endif /* AUTH_PASSWD_SHADOW */
+        ) {
+        if (snap.valid)
+            log_print(LOG_INFO, _("snapshot_lookup: password files have changed; reloading them"));
+        if (!snapshot_load())
+            return NULL;
+    }
+
+    if ((E = snapshot_find(name)) && E->passwd)
+        return E;
+    else
+        return NULL;
+}
+
+/* auth_passwd_init:
+ * Initialise the driver, reading the password files if the snapshot is
+ * enabled. */
+int auth_passwd_init(void) {
+    if ((use_snapshot = config_get_bool("auth-passwd-cache"))) {
+        if (snapshot_load())
+            log_print(LOG_INFO, _("auth_passwd_init: cached %d users from password files"), snap.nentries);
+        else
+            log_print(LOG_WARNING, _("auth_passwd_init: could not read password files; will try again at next login"));
+    }
+    return 1;
+}
+
 /* auth_passwd_new_user_pass:
  * Attempt to authenticate user and pass using /etc/passwd or /etc/shadow,
  * as configured at compile-time. This is not a virtual-domains authenticator,
@@ -62,24 +353,49 @@ authcontext auth_passwd_new_user_pass(const char *user, const char *local_part,
 #ifdef AUTH_PASSWD_SHADOW
     struct spwd *spw;
 #endif /* AUTH_PASSWD_SHADOW */
-    char *user_passwd;
+    struct pwentry *E = NULL;
+    char *user_passwd, *dir;
     char *s;
     int use_gid = 0;
-    gid_t gid = 99;
+    uid_t uid;
+    gid_t gid = 99, user_gid;
     authcontext a = NULL;
 
     /* Check the this isn't a virtual-domain user. */
-    if (local_part) return NULL;
+    if (local_part) {
+        auth_rejected = 1;
+        return NULL;
+    }
 
-    pw = getpwnam(user);
-    if (!pw) return NULL;
+    if (use_snapshot && (E = snapshot_lookup(user))) {
+        user_passwd = E->passwd;
+        uid = E->uid;
+        user_gid = E->gid;
+        dir = E->dir;
+    } else {
+        /* A lookup which fails without setting errno means there is no such
+         * user, rather than that we couldn't read the password database. */
+        errno = 0;
+        pw = getpwnam(user);
+        if (!pw) {
+            auth_rejected = (errno == 0);
+            return NULL;
+        }
 #ifdef AUTH_PASSWD_SHADOW
-    spw = getspnam(user);
-    if (!spw) return NULL;
-    user_passwd = spw->sp_pwdp;
+        errno = 0;
+        spw = getspnam(user);
+        if (!spw) {
+            auth_rejected = (errno == 0);
+            return NULL;
+        }
+        user_passwd = spw->sp_pwdp;
 #else
-    user_passwd = pw->pw_passwd;
+        user_passwd = pw->pw_passwd;
 #endif /* AUTH_PASSWD_SHADOW */
+        uid = pw->pw_uid;
+        user_gid = pw->pw_gid;
+        dir = pw->pw_dir;
+    }
 
     /* Obtain gid to use */
     if ((s = config_get_string("auth-passwd-mail-group"))) {
@@ -92,11 +408,25 @@ authcontext auth_passwd_new_user_pass(const char *user, const char *local_part,
 
     /* Now we need to authenticate the user; we will leave finding the
      * mailspool for later. */
-    if (!strcmp(crypt(pass, user_passwd), user_passwd)) {
-        a = authcontext_new(pw->pw_uid, use_gid ? gid : pw->pw_gid, NULL, NULL, pw->pw_dir);
-    }
+    if ((s = crypt(pass, user_passwd)) && !strcmp(s, user_passwd)) {
+        a = authcontext_new(uid, use_gid ? gid : user_gid, NULL, NULL, dir);
+    } else if (s)
+        auth_rejected = 1;
     
     return a;
 }
 
+/* auth_passwd_postfork:
+ * Discard the snapshot in a child process, so that the password hashes do not
+ * stay in the memory of a process running as some other user. */
+void auth_passwd_postfork(void) {
+    snapshot_free();
+}
+
+/* auth_passwd_close:
+ * Shut down the driver. */
+void auth_passwd_close(void) {
+    snapshot_free();
+}
+
 #endif /* AUTH_PASSWD */
@@ -31,7 +31,10 @@
 #include "authswitch.h"
 
 /* auth_passwd.c */
+int auth_passwd_init(void);
 authcontext auth_passwd_new_user_pass(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost);
+void auth_passwd_postfork(void);
+void auth_passwd_close(void);
 
 #endif /* AUTH_PASSWD */
 
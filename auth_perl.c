@@ -318,8 +318,10 @@ authcontext auth_perl_new_user_pass(const char *user, const char *local_part, co
     item *I;
     authcontext a = NULL;
 
-    if (!pass_sub)
+    if (!pass_sub) {
+        auth_rejected = 1;  /* we never accept USER/PASS */
         return NULL;
+    }
 
     if (local_part && domain) {
         if (!(S = auth_perl_callfn(pass_sub, 7, "method", "PASS", "user", user, "local_part", local_part, "domain", domain, "pass", pass, "clienthost", clienthost, "serverhost", serverhost)))
@@ -359,7 +361,9 @@ authcontext auth_perl_new_user_pass(const char *user, const char *local_part, co
         if (I) domain = (char*)I->v;
 
         a = authcontext_new(uid, gid, mboxdrv, mailbox, pw->pw_dir);
-    } else if (strcmp((char*)I->v, "NO") != 0) INVALID("result", (char*)I->v);
+    } else if (strcmp((char*)I->v, "NO") == 0)
+        auth_rejected = 1;
+    else if (strcmp((char*)I->v, "ERROR") != 0) INVALID("result", (char*)I->v);
         
 fail:
     stringmap_delete_free(S);
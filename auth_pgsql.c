@@ -2,8 +2,6 @@
  * auth_pgsql.c:
  * Authenticate users against a Postgres database.
  *
- * XXX should have the connection retrying behaviour of auth-mysql.
- *
  * Copyright (c) 2003 Chris Lightfoot, Stephen White.
  *
  * This program is free software; you can redistribute it and/or modify
@@ -142,12 +140,37 @@ static gid_t mail_gid;
 
 static char *substitute_query_params(const char *temp, const char *user, const char *local_part, const char *domain, const char *clienthost, const char *serverhost);
 
+/*
+ * Prepared statements. As in auth-mysql, a query template whose variables all
+ * appear as whole quoted values is prepared on the server with PQprepare once
+ * per connection, and run with PQexecPrepared with the values passed as
+ * parameters; other templates are substituted and sent as text.
+ */
+#define MAX_QUERY_PARAMS    16
+
+static const char *query_vars[] = {"user", "local_part", "domain", "clienthost", "serverhost"};
+#define NUM_QUERY_VARS      (sizeof(query_vars) / sizeof(*query_vars))
+
+struct pgquery {
+    char *template;                     /* template, or NULL for none */
+    const char *name;                   /* name of prepared statement */
+    char *sql;                          /* with placeholders, or NULL */
+    int params[MAX_QUERY_PARAMS], nparams;
+    int prepared;
+};
+
+static struct pgquery user_pass_query = {NULL, "tpop3d_user_pass", NULL, {0}, 0, 0},
+                      apop_query      = {NULL, "tpop3d_apop",      NULL, {0}, 0, 0},
+                      onlogin_query   = {NULL, "tpop3d_onlogin",   NULL, {0}, 0, 0};
+static struct pgquery *all_queries[] = {&user_pass_query, &apop_query, &onlogin_query, NULL};
+
 /* pg_strerror CONNECTION
  * Wrapper for PQerrorMessage which removes any trailing newline (aargh). */
 static char *pg_strerror(const PGconn *conn) {
     static char *s;
     s = PQerrorMessage(conn);
-    s[strlen(s) - 1] = 0;   /* ugh */
+    if (*s && s[strlen(s) - 1] == '\n')
+        s[strlen(s) - 1] = 0;   /* ugh */
     return s;
 }
 
@@ -157,12 +180,126 @@ static void strclr(char *s) {
     memset(s, 0, strlen(s));
 }
 
+static PGconn *pg_conn;
+
+extern int verbose; /* in main.c */
+
+/* setup_query QUERY TEMPLATE
+ * Set up QUERY to use TEMPLATE, as a prepared statement if possible. */
+static void setup_query(struct pgquery *q, char *template) {
+    q->template = template;
+    if (template && !(q->sql = parameterise_query(template, '$', NUM_QUERY_VARS, query_vars, q->params, &q->nparams, MAX_QUERY_PARAMS)))
+        log_print(LOG_INFO, _("setup_query: query `%.40s...' cannot be prepared; values will be substituted into it"), template);
+}
+
+/* prepare_queries
+ * Prepare those queries which can be on the current connection. */
+static void prepare_queries(void) {
+    struct pgquery **qq;
+
+    for (qq = all_queries; *qq; ++qq) {
+        struct pgquery *q = *qq;
+        PGresult *res;
+
+        q->prepared = 0;
+        if (!q->sql)
+            continue;
+
+        if ((res = PQprepare(pg_conn, q->name, q->sql, 0, NULL)) && PQresultStatus(res) == PGRES_COMMAND_OK)
+            q->prepared = 1;
+        else {
+            log_print(LOG_WARNING, _("prepare_queries: PQprepare: %s; will substitute values into query instead"), res ? PQresultErrorMessage(res) : pg_strerror(pg_conn));
+            /* Don't bother trying again when we reconnect. */
+            xfree(q->sql);
+            q->sql = NULL;
+        }
+
+        if (res)
+            PQclear(res);
+    }
+}
+
+/* reconnect FUNC
+ * Try to re-establish the connection to the database on behalf of FUNC. The
+ * connection parameters were wiped from the config, but libpq remembers them.
+ * Returns 1 on success or 0 on failure. */
+static int reconnect(const char *func) {
+    PQreset(pg_conn);
+    if (PQstatus(pg_conn) == CONNECTION_BAD) {
+        log_print(LOG_ERR, _("%s: PQreset: %s"), func, pg_strerror(pg_conn));
+        return 0;
+    }
+
+    log_print(LOG_INFO, _("%s: reconnected to database"), func);
+    prepare_queries();
+
+    return 1;
+}
+
+/* exec_query QUERY FUNC USER LOCAL-PART DOMAIN CLIENTHOST SERVERHOST
+ * Run QUERY with the given values on behalf of FUNC, reconnecting and trying
+ * again once if the connection to the database has been lost. Returns the
+ * result, which the caller must check and PQclear, or NULL if the query could
+ * not be run. */
+static PGresult *exec_query(struct pgquery *q, const char *func, const char *user, const char *local_part, const char *domain, const char *clienthost, const char *serverhost) {
+    const char *v[NUM_QUERY_VARS], *values[MAX_QUERY_PARAMS];
+    char *query = NULL;
+    PGresult *res = NULL;
+    int i, tries;
+
+    v[0] = user;
+    v[1] = local_part;
+    v[2] = domain;
+    v[3] = clienthost;
+    v[4] = serverhost;
+
+    for (tries = 0; tries < 2; ++tries) {
+        if (PQstatus(pg_conn) == CONNECTION_BAD && !reconnect(func))
+            break;
+
+        if (q->prepared) {
+            for (i = 0; i < q->nparams; ++i)
+                /* As substitute_variables, refuse to run a query with a
+                 * missing value. */
+                if (!(values[i] = v[q->params[i]]))
+                    return NULL;
+
+            if (verbose)
+                log_print(LOG_DEBUG, _("%s: SQL prepared statement: %s"), func, q->sql);
+
+            res = PQexecPrepared(pg_conn, q->name, q->nparams, values, NULL, NULL, 0);
+        } else {
+            /* Obtain the actual query to use. */
+            if (!query && !(query = substitute_query_params(q->template, user, local_part, domain, clienthost, serverhost)))
+                return NULL;
+
+            if (verbose)
+                log_print(LOG_DEBUG, _("%s: SQL query: %s"), func, query);
+
+            res = PQexec(pg_conn, query);
+        }
+
+        if (PQstatus(pg_conn) != CONNECTION_BAD)
+            break;
+
+        log_print(LOG_WARNING, _("%s: lost connection to database: %s"), func, pg_strerror(pg_conn));
+        if (res)
+            PQclear(res);
+        res = NULL;
+    }
+
+    if (!res && PQstatus(pg_conn) != CONNECTION_BAD)
+        log_print(LOG_ERR, _("%s: PQexec: %s"), func, pg_strerror(pg_conn));
+
+    xfree(query);
+
+    return res;
+}
+
 /* auth_pgsql_init
  * Initialise the database connection driver. Clears the config directives
  * associated with the database so that a user cannot recover them with a
  * debugger. */
-static PGconn *pg_conn;
-
 int auth_pgsql_init(void) {
     char *username = NULL, *password = NULL, *hostname = NULL, *database = NULL, *localhost = "localhost", *s;
     char *dbconnect = NULL;
@@ -210,6 +347,10 @@ int auth_pgsql_init(void) {
     if ((s = config_get_string("auth-pgsql-onlogin-query")))
         onlogin_query_template = s;
 
+    setup_query(&user_pass_query, user_pass_query_template);
+    setup_query(&apop_query, apop_query_template);
+    setup_query(&onlogin_query, onlogin_query_template);
+
     /* Obtain gid to use */
     if ((s = config_get_string("auth-pgsql-mail-group"))) {
         if (!parse_gid(s, &mail_gid)) {
@@ -238,6 +379,8 @@ int auth_pgsql_init(void) {
         goto fail;
     }
 
+    prepare_queries();
+
     ret = 1;
 
 fail:
@@ -250,29 +393,19 @@ fail:
     return ret;
 }
 
-extern int verbose; /* in main.c */
-
 /* auth_pgsql_new_apop NAME LOCAL-PART DOMAIN TIMESTAMP DIGEST CLIENTHOST SERVERHOST
  * Attempt to authenticate a user via APOP, using the template SELECT query in
  * the config file or the default defined above otherwise. */
 authcontext auth_pgsql_new_apop(const char *name, const char *local_part, const char *domain, const char *timestamp, const unsigned char *digest, const char *clienthost /* unused */, const char *serverhost) {
-    char *query = NULL;
     authcontext a = NULL;
     char *who;
     PGresult *res = NULL;
 
     who = username_string(name, local_part, domain);
 
-    if (!pg_conn || !apop_query_template) return NULL;
+    if (!pg_conn || !apop_query.template) return NULL;
 
-    /* Obtain the actual query to use. */
-    if (!(query = substitute_query_params(apop_query_template, name, local_part, domain, NULL, serverhost)))
-        goto fail;
-
-    if (verbose)
-        log_print(LOG_DEBUG, "auth_pgsql_new_apop: SQL query: %s", query);
-
-    if ((res = PQexec(pg_conn, query))) {
+    if ((res = exec_query(&apop_query, "auth_pgsql_new_apop", name, local_part, domain, NULL, serverhost))) {
         int i;
 
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
@@ -337,12 +470,11 @@ authcontext auth_pgsql_new_apop(const char *name, const char *local_part, const
             break;
         }
 
-        PQclear(res);
-    } else
-        log_print(LOG_ERR, _("auth_pgsql_new_apop: PQexec: %s"), pg_strerror(pg_conn));
+    }
 
 fail:
-    xfree(query);
+    if (res)
+        PQclear(res);
     
     return a;
 }
@@ -351,22 +483,19 @@ fail:
  * Attempt to authenticate a user via USER/PASS, using the template SELECT
  * query in the config file or the default defined above otherwise. */
 authcontext auth_pgsql_new_user_pass(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost /* unused */, const char *serverhost) {
-    char *query = NULL, *who;
+    char *who;
     authcontext a = NULL;
     PGresult *res = NULL;
 
     who = username_string(user, local_part, domain);
     
-    if (!pg_conn || !user_pass_query_template) return NULL;
-
-    /* Obtain the actual query to use. */
-    if (!(query = substitute_query_params(user_pass_query_template, user, local_part, domain, NULL, serverhost)))
-        goto fail;
+    if (!user_pass_query.template) {
+        auth_rejected = 1;  /* we never accept USER/PASS */
+        return NULL;
+    } else if (!pg_conn)
+        return NULL;
 
-    if (verbose)
-        log_print(LOG_DEBUG, "auth_pgsql_new_user_pass: SQL query: %s", query);
-
-    if ((res = PQexec(pg_conn, query))) {
+    if ((res = exec_query(&user_pass_query, "auth_pgsql_new_user_pass", user, local_part, domain, NULL, serverhost))) {
         int i;
 
         if (PQresultStatus(res) != PGRES_TUPLES_OK) {
@@ -381,6 +510,7 @@ authcontext auth_pgsql_new_user_pass(const char *user, const char *local_part, c
 
         switch (i = PQntuples(res)) {
         case 0:
+            auth_rejected = 1;
             break;
         case 1: {
                 struct passwd *pw;
@@ -405,6 +535,7 @@ authcontext auth_pgsql_new_user_pass(const char *user, const char *local_part, c
 
                 if (!check_password(who, pwhash, pass, "{md5}")) {
                     log_print(LOG_ERR, _("auth_pgsql_new_user_pass: %s failed login with wrong password"), who);
+                    auth_rejected = 1;
                     break;
                 }
 
@@ -429,12 +560,11 @@ authcontext auth_pgsql_new_user_pass(const char *user, const char *local_part, c
             break;
         }
 
-        PQclear(res);
-    } else
-        log_print(LOG_ERR, _("auth_pgsql_new_apop: PQexec: %s"), pg_strerror(pg_conn));
+    }
 
 fail:
-    xfree(query);
+    if (res)
+        PQclear(res);
 
     return a;
 }
@@ -444,31 +574,20 @@ fail:
  * variables substituted in the template are $(local_part), $(domain) and
  * $(clienthost), the username, domain, and connecting client host. */
 void auth_pgsql_onlogin(const authcontext A, const char *clienthost, const char *serverhost) {
-    char *query;
-    PGresult *res = NULL;
-
-    if (!pg_conn || !onlogin_query_template) return;
-
-    query = substitute_query_params(onlogin_query_template, A->user, A->local_part, A->domain, clienthost, serverhost);
-    if (!query)
-        return;
+    PGresult *res;
 
-    if (verbose)
-        log_print(LOG_DEBUG, _("auth_pgsql_onlogin: SQL query: %s"), query);
+    if (!pg_conn || !onlogin_query.template) return;
 
-    if ((res = PQexec(pg_conn, query))) { /* XXX transactions? */
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            log_print(LOG_ERR, "auth_pgsql_onlogin: bad status after PQexec: %s", pg_strerror(pg_conn));
+    if ((res = exec_query(&onlogin_query, "auth_pgsql_onlogin", A->user, A->local_part, A->domain, clienthost, serverhost))) { /* XXX transactions? */
+        if (PQresultStatus(res) != PGRES_TUPLES_OK && PQresultStatus(res) != PGRES_COMMAND_OK) {
+            log_print(LOG_ERR, "auth_pgsql_onlogin: bad status after PQexec: %s", PQresultErrorMessage(res));
         } else if (PQntuples(res)) {
           /* It's possible that the user put a query in which returned some rows
            * This is bogus but there's not a lot we can do */
             log_print(LOG_WARNING, _("auth_pgsql_onlogin: supplied SQL query returned %d rows, which is dubious"), PQntuples(res));
         }
         PQclear(res);
-    } else
-        log_print(LOG_ERR, _("auth_pgsql_onlogin: PQexec: %s"), pg_strerror(pg_conn));
-
-    xfree(query);
+    }
 }
 
 /* auth_pgsql_postfork
@@ -480,7 +599,13 @@ void auth_pgsql_postfork(void) {
 /* auth_pgsql_close
  * Close the database connection. */
 void auth_pgsql_close(void) {
+    struct pgquery **qq;
     if (pg_conn) PQfinish(pg_conn);
+    pg_conn = NULL;
+    for (qq = all_queries; *qq; ++qq) {
+        xfree((*qq)->sql);
+        (*qq)->sql = NULL;
+    }
 }
 
 /* substitute_query_params TEMPLATE USER LOCAL-PART DOMAIN CLIENTHOST SERVERHOST
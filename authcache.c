@@ -23,10 +23,17 @@ static const char rcsid[] = "$Id$";
 
 #include <sys/types.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "authswitch.h"
 #include "config.h"
@@ -43,6 +50,13 @@ static const char rcsid[] = "$Id$";
  * cached authentication information, unless it's older than a certain
  * threshold, in which case it's discarded. We don't cache negative
  * authentication results.
+ *
+ * Entries are also kept on a list in order of last use, so that when the
+ * cache grows beyond a certain size, those least recently used can be
+ * evicted; and the main loop calls authcache_expire periodically to discard
+ * old entries, so that the memory of users who don't log in again is
+ * reclaimed. This matters because every child process inherits a copy of the
+ * cache.
  */
 
 /* Is the cache enabled? */
@@ -56,6 +70,33 @@ static int key_by_client_host;
 /* How long an entry persists in the cache. */
 static int entry_lifetime;
 
+/* Approximately how much memory, in bytes, the cache may use. */
+static int max_size;
+
+/* Are failed authentication attempts cached, and for how long? */
+static int use_negative_cache;
+static int negative_lifetime;
+
+/* How many different failing passwords are remembered for each user. */
+static int negative_per_user;
+
+/* AUTHCACHE_DEFAULT_MAX_SIZE
+ * Default limit on the approximate number of bytes used by the cache. */
+#define AUTHCACHE_DEFAULT_MAX_SIZE      (4 * 1024 * 1024)
+
+/* AUTHCACHE_SWEEP_INTERVAL, AUTHCACHE_REPORT_INTERVAL
+ * How often, in seconds, old entries are discarded from the cache, and how
+ * often statistics about the cache are logged. */
+#define AUTHCACHE_SWEEP_INTERVAL        60
+#define AUTHCACHE_REPORT_INTERVAL       3600
+
+/* NEGATIVE_BUCKETS, NEGATIVE_BUCKET_SLOTS
+ * Dimensions of the negative cache. All entries for a given user are kept in
+ * the same bucket, so no more than NEGATIVE_BUCKET_SLOTS failing passwords
+ * can be remembered for any one user. */
+#define NEGATIVE_BUCKETS                256
+#define NEGATIVE_BUCKET_SLOTS           8
+
 /* authcontext_copy CONTEXT
  * Return a copy of the passed authentication CONTEXT. */
 static authcontext authcontext_copy(const authcontext A) {
@@ -77,20 +118,28 @@ static authcontext authcontext_copy(const authcontext A) {
     return B;
 }
 
+struct cacheentry {
+    time_t when;
+    unsigned char hash[16];
+    authcontext A;
+    size_t size;                        /* Approximate memory used.    */
+    struct cacheentry *prev, *next;     /* Most recently used first.   */
+};
+
 static struct {
     size_t nbits;
     size_t nfilled;
-    struct cacheentry {
-        time_t when;
-        unsigned char hash[16];
-        authcontext A;          /* NULL == slot empty */
-    } *slots;
+    struct cacheentry **slots;          /* NULL == slot empty */
+    struct cacheentry *head, *tail;
+    size_t size;
+    unsigned long hits, misses, expiries, evictions;
+    time_t lastsweep, lastreport;
 } authcache;
 
 #define CACHESLOTS      (1 << authcache.nbits)
 
 /* hashval MD5 NUM
- * Return a hash formed from the first NUM bytes of the MD5 hash. */
+ * Return a hash formed from the first NUM bits of the MD5 hash. */
 static unsigned long hashval(const unsigned char hash[16], const size_t nbits) {
     unsigned long u;
     size_t i;
@@ -100,23 +149,21 @@ static unsigned long hashval(const unsigned char hash[16], const size_t nbits) {
 }
 
 /* resize_cache NUM
- * Resize the hash table so that it uses the first NUM bytes of the argument
+ * Resize the hash table so that it uses the first NUM bits of the argument
  * digest as a hash key. */
 static void resize_cache(const size_t nbits) {
-    struct cacheentry *newslots;
+    struct cacheentry **newslots;
     size_t N, i;
     N = 1 << nbits;
-    newslots = xmalloc(N * sizeof *newslots);
-    for (i = 0; i < N; ++i)
-        newslots[i].A = NULL;
+    newslots = xcalloc(N, sizeof *newslots);
 
     if (authcache.slots) {
         /* Copy old cache entries into new. */
         for (i = 0; i < CACHESLOTS; ++i) {
-            if (authcache.slots[i].A) {
+            if (authcache.slots[i]) {
                 unsigned long u;
-                u = hashval(authcache.slots[i].hash, nbits);
-                while (newslots[u].A)
+                u = hashval(authcache.slots[i]->hash, nbits);
+                while (newslots[u])
                     u = (u + 1) % N;
                 newslots[u] = authcache.slots[i];
             }
@@ -129,9 +176,415 @@ static void resize_cache(const size_t nbits) {
     authcache.nbits = nbits;
 }
 
+/* entry_size CONTEXT
+ * Return the approximate amount of memory used by a cache entry for CONTEXT,
+ * including an allowance for the overhead of each allocation. */
+static size_t entry_size(const authcontext A) {
+    size_t n;
+    n = sizeof(struct cacheentry) + sizeof *A + 2 * sizeof(struct cacheentry*) + 16;
+#define ADDS(x)         if (A->x) n += strlen(A->x) + 1 + 16
+    ADDS(mboxdrv);
+    ADDS(mailbox);
+    ADDS(auth);
+    ADDS(user);
+    ADDS(home);
+    ADDS(local_part);
+    ADDS(domain);
+#undef ADDS
+    return n;
+}
+
+/* lru_unlink ENTRY
+ * Remove ENTRY from the list of entries in order of use. */
+static void lru_unlink(struct cacheentry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else authcache.head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else authcache.tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+/* lru_push ENTRY
+ * Put ENTRY at the head of the list of entries in order of use. */
+static void lru_push(struct cacheentry *e) {
+    e->prev = NULL;
+    e->next = authcache.head;
+    if (authcache.head) authcache.head->prev = e;
+    else authcache.tail = e;
+    authcache.head = e;
+}
+
+/*
+ * Optionally the cache is kept instead in a file, authcache-file, which is
+ * mapped into memory and shared by every tpop3d master process on the host.
+ * Since the file outlives any one process, the cache survives the re-exec on
+ * SIGHUP. The file consists of a header followed by fixed-size slots; each key
+ * selects a bucket of SHARED_BUCKET_SLOTS consecutive slots, and when a bucket
+ * is full its oldest entry is replaced. Keys are salted with random data chosen
+ * when the file is created, and access to each bucket is serialised with
+ * fcntl(2) locks on the corresponding part of the file.
+ */
+
+/* SHARED_MAGIC, SHARED_VERSION
+ * Identify the format of the cache file. */
+#define SHARED_MAGIC            "tpop3d authcache"
+#define SHARED_VERSION          1
+
+/* SHARED_SLOT_SIZE, SHARED_BUCKET_SLOTS
+ * Size of each slot in the cache file, and number of slots in each bucket. */
+#define SHARED_SLOT_SIZE        512
+#define SHARED_BUCKET_SLOTS     4
+
+struct sharedheader {
+    char magic[16];
+    unsigned int version, slotsize, nslots;
+    unsigned char salt[16];
+};
+
+struct sharedslot {
+    unsigned char hash[16];
+    time_t when;                /* 0 == slot empty */
+    uid_t uid;
+    gid_t gid;
+    /* Strings from the authentication context, each preceded by a byte which
+     * is 0 if the string is NULL. */
+    char data[SHARED_SLOT_SIZE - 16 - sizeof(time_t) - sizeof(uid_t) - sizeof(gid_t)];
+};
+
+static struct {
+    int fd;
+    char *mem;
+    size_t len;
+    struct sharedheader *hdr;
+    struct sharedslot *slots;
+    unsigned int nbuckets;
+} shared = {-1, NULL, 0, NULL, NULL, 0};
+
+/* shared_lock START LENGTH TYPE
+ * Lock, or with TYPE F_UNLCK unlock, LENGTH bytes from START in the cache file.
+ * Returns 0 on success or -1 on failure. */
+static int shared_lock(const off_t start, const off_t len, const short type) {
+    struct flock fl = {0};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    while (fcntl(shared.fd, F_SETLKW, &fl) == -1)
+        if (errno != EINTR) {
+            log_print(LOG_ERR, "shared_lock: fcntl: %m");
+            return -1;
+        }
+    return 0;
+}
+
+/* shared_lock_bucket BUCKET TYPE
+ * Lock or unlock the given BUCKET of the cache file. */
+static int shared_lock_bucket(const unsigned int b, const short type) {
+    return shared_lock(SHARED_SLOT_SIZE + (off_t)b * SHARED_BUCKET_SLOTS * sizeof(struct sharedslot),
+                       SHARED_BUCKET_SLOTS * sizeof(struct sharedslot), type);
+}
+
+/* shared_bucket HASH
+ * Return the bucket in which entries with the given HASH are stored. */
+static unsigned int shared_bucket(const unsigned char hash[16]) {
+    unsigned long u;
+    size_t i;
+    for (i = 4, u = 0; i < 8; ++i)
+        u = (u << 8) | hash[i];
+    return (unsigned int)(u % shared.nbuckets);
+}
+
+/* shared_create FILE
+ * Create a new, empty, cache file of about max_size bytes and move it into
+ * place as FILE. The file is built under a temporary name, so that a process
+ * which has the old FILE mapped keeps a valid mapping of it. Returns 0 on
+ * success or -1 on failure. */
+static int shared_create(const char *file) {
+    struct sharedheader h;
+    char *tmp;
+    int fd;
+    ssize_t n = 0;
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, SHARED_MAGIC, sizeof h.magic);
+    h.version = SHARED_VERSION;
+    h.slotsize = sizeof(struct sharedslot);
+    h.nslots = (max_size / sizeof(struct sharedslot)) / SHARED_BUCKET_SLOTS * SHARED_BUCKET_SLOTS;
+    if (h.nslots < SHARED_BUCKET_SLOTS)
+        h.nslots = SHARED_BUCKET_SLOTS;
+
+    /* Start with a fresh salt. */
+    if ((fd = open("/dev/urandom", O_RDONLY)) != -1) {
+        do
+            n = read(fd, h.salt, sizeof h.salt);
+        while (n == -1 && errno == EINTR);
+        close(fd);
+    }
+    if (n != sizeof h.salt) {
+        log_print(LOG_ERR, "shared_create: unable to read random data for salt");
+        return -1;
+    }
+
+    tmp = xmalloc(strlen(file) + 8);
+    sprintf(tmp, "%s.XXXXXX", file);
+    if ((fd = mkstemp(tmp)) == -1) {
+        log_print(LOG_ERR, "shared_create: %s: %m", tmp);
+        xfree(tmp);
+        return -1;
+    }
+
+    if (ftruncate(fd, SHARED_SLOT_SIZE + (off_t)h.nslots * sizeof(struct sharedslot)) == -1
+        || pwrite(fd, &h, sizeof h, 0) != sizeof h
+        || rename(tmp, file) == -1) {
+        log_print(LOG_ERR, "shared_create: %s: %m", tmp);
+        close(fd);
+        unlink(tmp);
+        xfree(tmp);
+        return -1;
+    }
+
+    close(fd);
+    xfree(tmp);
+    log_print(LOG_INFO, _("shared_create: %s: created new cache file with %u slots"), file, h.nslots);
+    return 0;
+}
+
+/* shared_open FILE
+ * Open and map the cache FILE, creating it if it doesn't exist or isn't a
+ * valid cache file. The number of slots in a new file is chosen so that it is
+ * about max_size bytes long; an existing file, which may be in use by other
+ * processes, is used at whatever size it has. Returns 0 on success or -1 on
+ * failure. */
+static int shared_open(const char *file) {
+    struct sharedheader h;
+    struct stat st, st2;
+    size_t len;
+    int tries = 0;
+
+retry:
+    if ((shared.fd = open(file, O_RDWR | O_CREAT, 0600)) == -1) {
+        log_print(LOG_ERR, "shared_open: %s: %m", file);
+        return -1;
+    }
+
+    /* Examine the header with the whole file locked. */
+    if (shared_lock(0, 0, F_WRLCK) == -1)
+        goto fail;
+
+    if (fstat(shared.fd, &st) == -1 || stat(file, &st2) == -1) {
+        log_print(LOG_ERR, "shared_open: %s: stat: %m", file);
+        goto fail;
+    }
+
+    if (st.st_dev != st2.st_dev || st.st_ino != st2.st_ino
+        || st.st_size < SHARED_SLOT_SIZE
+        || pread(shared.fd, &h, sizeof h, 0) != sizeof h
+        || memcmp(h.magic, SHARED_MAGIC, sizeof h.magic) || h.version != SHARED_VERSION
+        || h.slotsize != sizeof(struct sharedslot) || h.nslots < SHARED_BUCKET_SLOTS || h.nslots % SHARED_BUCKET_SLOTS
+        || st.st_size < SHARED_SLOT_SIZE + (off_t)h.nslots * sizeof(struct sharedslot)) {
+        /* Either another process replaced the file while we waited for the
+         * lock, or it is new or unusable and we must replace it; either way,
+         * open it again. Never truncate a file which is in use, since anyone
+         * who had it mapped would get SIGBUS. */
+        if (++tries > 5) {
+            log_print(LOG_ERR, _("shared_open: %s: unable to obtain a usable cache file"), file);
+            goto fail;
+        }
+        if ((st.st_dev == st2.st_dev && st.st_ino == st2.st_ino) && shared_create(file) == -1)
+            goto fail;
+        close(shared.fd);
+        goto retry;
+    } else if (h.nslots != (max_size / sizeof(struct sharedslot)) / SHARED_BUCKET_SLOTS * SHARED_BUCKET_SLOTS)
+        log_print(LOG_NOTICE, _("shared_open: %s: using existing cache file with %u slots; remove it to change its size"), file, h.nslots);
+
+    len = SHARED_SLOT_SIZE + (size_t)h.nslots * sizeof(struct sharedslot);
+    if (MAP_FAILED == (shared.mem = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, shared.fd, 0))) {
+        log_print(LOG_ERR, "shared_open: %s: mmap: %m", file);
+        shared.mem = NULL;
+        goto fail;
+    }
+    shared.len = len;
+    shared.hdr = (struct sharedheader*)shared.mem;
+    shared.slots = (struct sharedslot*)(shared.mem + SHARED_SLOT_SIZE);
+    shared.nbuckets = h.nslots / SHARED_BUCKET_SLOTS;
+
+    shared_lock(0, 0, F_UNLCK);
+    return 0;
+
+fail:
+    close(shared.fd);
+    shared.fd = -1;
+    return -1;
+}
+
+/* shared_close
+ * Unmap and close the cache file. */
+static void shared_close(void) {
+    if (shared.mem) {
+        munmap(shared.mem, shared.len);
+        shared.mem = NULL;
+        shared.hdr = NULL;
+        shared.slots = NULL;
+    }
+    if (shared.fd != -1) {
+        close(shared.fd);
+        shared.fd = -1;
+    }
+}
+
+/* shared_pack SLOT CONTEXT
+ * Store CONTEXT in SLOT, other than its hash and time. Returns 0 on success,
+ * or -1 if it doesn't fit. */
+static int shared_pack(struct sharedslot *S, const authcontext A) {
+    char *p = S->data, *end = S->data + sizeof S->data;
+    S->uid = A->uid;
+    S->gid = A->gid;
+#define PACKS(x)        do { \
+                            if (p == end) return -1; \
+                            if ((*p++ = (A->x != NULL))) { \
+                                size_t l = strlen(A->x) + 1; \
+                                if (l > (size_t)(end - p)) return -1; \
+                                memcpy(p, A->x, l); \
+                                p += l; \
+                            } \
+                        } while (0)
+    PACKS(mboxdrv);
+    PACKS(mailbox);
+    PACKS(auth);
+    PACKS(user);
+    PACKS(home);
+    PACKS(local_part);
+    PACKS(domain);
+#undef PACKS
+    return 0;
+}
+
+/* shared_unpack SLOT
+ * Return a new authentication context made from SLOT, or NULL if its contents
+ * don't make sense. */
+static authcontext shared_unpack(const struct sharedslot *S) {
+    authcontext A;
+    const char *p = S->data, *end = S->data + sizeof S->data;
+    alloc_struct(_authcontext, A);
+    A->uid = S->uid;
+    A->gid = S->gid;
+#define UNPACKS(x)      do { \
+                            if (p == end) goto fail; \
+                            if (*p++) { \
+                                const char *q; \
+                                if (!(q = memchr(p, 0, end - p))) goto fail; \
+                                A->x = xstrdup(p); \
+                                p = q + 1; \
+                            } \
+                        } while (0)
+    UNPACKS(mboxdrv);
+    UNPACKS(mailbox);
+    UNPACKS(auth);
+    UNPACKS(user);
+    UNPACKS(home);
+    UNPACKS(local_part);
+    UNPACKS(domain);
+#undef UNPACKS
+    return A;
+
+fail:
+    authcontext_delete(A);
+    return NULL;
+}
+
+/* shared_find HASH
+ * Return a copy of the authentication context stored in the cache file under
+ * HASH, or NULL if there is none or it is too old. */
+static authcontext shared_find(const unsigned char hash[16]) {
+    struct sharedslot *S;
+    unsigned int b;
+    authcontext A = NULL;
+
+    b = shared_bucket(hash);
+    if (shared_lock_bucket(b, F_RDLCK) == -1)
+        return NULL;
+    for (S = shared.slots + b * SHARED_BUCKET_SLOTS; S < shared.slots + (b + 1) * SHARED_BUCKET_SLOTS; ++S)
+        if (S->when && 0 == memcmp(S->hash, hash, 16)) {
+            if (S->when < time(NULL) - entry_lifetime)
+                ++authcache.expiries;
+            else
+                A = shared_unpack(S);
+            break;
+        }
+    shared_lock_bucket(b, F_UNLCK);
+
+    return A;
+}
+
+/* shared_save HASH CONTEXT
+ * Store CONTEXT in the cache file under HASH, replacing any entry with the
+ * same HASH or else the oldest in its bucket. */
+static void shared_save(const unsigned char hash[16], const authcontext A) {
+    struct sharedslot *S, *T = NULL, tmp;
+    unsigned int b;
+
+    memset(&tmp, 0, sizeof tmp);
+    if (shared_pack(&tmp, A) == -1) {
+        log_print(LOG_DEBUG, _("shared_save: entry for %s too large for cache file"), A->user);
+        return;
+    }
+    memcpy(tmp.hash, hash, 16);
+    time(&tmp.when);
+
+    b = shared_bucket(hash);
+    if (shared_lock_bucket(b, F_WRLCK) == -1)
+        return;
+    for (S = shared.slots + b * SHARED_BUCKET_SLOTS; S < shared.slots + (b + 1) * SHARED_BUCKET_SLOTS; ++S) {
+        if (!S->when || 0 == memcmp(S->hash, hash, 16)) {
+            T = S;
+            break;
+        } else if (!T || S->when < T->when)
+            T = S;
+    }
+    if (T->when && memcmp(T->hash, hash, 16)) {
+        if (T->when >= tmp.when - entry_lifetime)
+            ++authcache.evictions;
+    }
+    *T = tmp;
+    shared_lock_bucket(b, F_UNLCK);
+}
+
+/*
+ * The negative cache remembers, for a short time, combinations of user name
+ * and password which have failed to authenticate, so that a client which is
+ * configured with the wrong password and retries every few seconds doesn't
+ * cause a round of queries to every authentication driver each time. It is a
+ * fixed-size table, so that it can't be made to grow without limit by a
+ * password-guessing attack.
+ */
+static struct {
+    struct negentry {
+        unsigned char userhash[16];     /* Hash of user name alone. */
+        unsigned char hash[16];         /* Hash of user name and password. */
+        time_t when;                    /* 0 == slot empty */
+    } *slots;
+    unsigned long hits, saves;
+} negcache;
+
 /* authcache_init
  * Initialise the authentication cache. */
 void authcache_init(void) {
+    char *s;
+    time(&authcache.lastsweep);
+    authcache.lastreport = authcache.lastsweep;
+
+    if ((use_negative_cache = config_get_bool("authcache-negative-enable"))) {
+        if (!config_get_int("authcache-negative-lifetime", &negative_lifetime) || negative_lifetime <= 0)
+            /* Long enough to absorb a client retrying a bad password, short
+             * enough that nobody notices after correcting one. */
+            negative_lifetime = 60;
+        if (!config_get_int("authcache-negative-per-user", &negative_per_user) || negative_per_user <= 0)
+            negative_per_user = 4;
+        else if (negative_per_user > NEGATIVE_BUCKET_SLOTS)
+            negative_per_user = NEGATIVE_BUCKET_SLOTS;
+        negcache.slots = xcalloc(NEGATIVE_BUCKETS * NEGATIVE_BUCKET_SLOTS, sizeof *negcache.slots);
+    }
+
     if ((use_cache = config_get_bool("authcache-enable"))) {
         key_by_client_host = config_get_bool("authcache-use-client-host");
         if (!config_get_int("authcache-entry-lifetime", &entry_lifetime) || entry_lifetime <= 0)
@@ -141,23 +594,38 @@ void authcache_init(void) {
              * longer than the interval between sessions. As a default, assume
              * one hour. */
             entry_lifetime = 3600;
-        resize_cache(8);
+        if (!config_get_int("authcache-max-size", &max_size) || max_size <= 0)
+            max_size = AUTHCACHE_DEFAULT_MAX_SIZE;
+        if ((s = config_get_string("authcache-file")) && shared_open(s) == -1)
+            log_print(LOG_WARNING, _("authcache_init: unable to use cache file %s; using private cache instead"), s);
+        if (!shared.slots)
+            resize_cache(8);
     }
 }
 
 /* authcache_close
  * Close down the authentication cache. */
 void authcache_close(void) {
-    size_t i;
+    struct cacheentry *e, *enext;
+    if (negcache.slots) {
+        xfree(negcache.slots);
+        negcache.slots = NULL;
+    }
+    use_negative_cache = 0;
     if (!use_cache)
         return;
+    for (e = authcache.head; e; e = enext) {
+        enext = e->next;
+        authcontext_delete(e->A);
+        xfree(e);
+    }
+    authcache.head = authcache.tail = NULL;
+    authcache.nfilled = authcache.size = 0;
     if (authcache.slots) {
-        for (i = 0; i < CACHESLOTS; ++i)
-            if (authcache.slots[i].A)
-                authcontext_delete(authcache.slots[i].A);
         xfree(authcache.slots);
         authcache.slots = NULL;
     }
+    shared_close();
 }
 
 /* make_arg_hash HASH USER LOCALPART DOMAIN PASSWORD CLIENTHOST SERVERHOST
@@ -165,6 +633,8 @@ void authcache_close(void) {
 static void make_arg_hash(unsigned char hash[16], const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost) {
     md5_ctx c;
     MD5Init(&c);
+    if (shared.hdr)
+        MD5Update(&c, shared.hdr->salt, sizeof shared.hdr->salt);
 #define ADDTOHASH(a)        if ((a)) MD5Update(&c, (unsigned char*)(a), strlen((a)) + 1)
     ADDTOHASH(user);
     ADDTOHASH(local_part);
@@ -177,54 +647,106 @@ static void make_arg_hash(unsigned char hash[16], const char *user, const char *
     MD5Final(hash, &c);
 }
 
+/* find_cache_entry HASH
+ * Return the index of the slot holding the entry with the given HASH, or -1
+ * if there is none. */
+static long find_cache_entry(const unsigned char hash[16]) {
+    unsigned long u, u0;
+    u = u0 = hashval(hash, authcache.nbits);
+    do {
+        if (!authcache.slots[u])
+            break;
+        else if (0 == memcmp(authcache.slots[u]->hash, hash, 16))
+            return (long)u;
+        else
+            u = (u + 1) % CACHESLOTS;
+    } while (u != u0);
+    return -1;
+}
+
 /* remove_cache_entry INDEX
  * Remove the cache entry with the given INDEX. */
 static void remove_cache_entry(unsigned long u0) {
-    unsigned long u, uprev;
-    authcontext_delete(authcache.slots[u0].A);
-    authcache.slots[u0].A = NULL;
-    /* Need to close up any other entries in the table. */
-    for (uprev = u0, u = (u0 + 1) % CACHESLOTS; hashval(authcache.slots[u].hash, authcache.nbits) == u0; uprev = u, u = (u + 1) % CACHESLOTS) {
-        authcache.slots[uprev] = authcache.slots[u];
-        authcache.slots[u].A = NULL;
-    }
+    struct cacheentry *e;
+    unsigned long u;
+
+    e = authcache.slots[u0];
+    lru_unlink(e);
+    authcache.size -= e->size;
+    authcontext_delete(e->A);
+    xfree(e);
+    authcache.slots[u0] = NULL;
     --authcache.nfilled;
+
+    /* Need to close up any other entries in the table. Any entry in the run
+     * following the empty slot which would not be found by a search from its
+     * hash value is moved back into the gap, which then moves on to where
+     * that entry was. An entry may stay put only if its hash value lies
+     * cyclically between the gap and its current slot. */
+    for (u = (u0 + 1) % CACHESLOTS; authcache.slots[u]; u = (u + 1) % CACHESLOTS) {
+        unsigned long h;
+        h = hashval(authcache.slots[u]->hash, authcache.nbits);
+        if (u0 < u ? (u0 < h && h <= u) : (u0 < h || h <= u))
+            continue;
+        authcache.slots[u0] = authcache.slots[u];
+        authcache.slots[u] = NULL;
+        u0 = u;
+    }
+}
+
+/* evict_cache_entry ENTRY
+ * Remove ENTRY, which must be in the cache. */
+static void evict_cache_entry(struct cacheentry *e) {
+    long u;
+    if ((u = find_cache_entry(e->hash)) != -1)
+        remove_cache_entry((unsigned long)u);
 }
 
 /* authcache_new_user_pass USER LOCALPART DOMAIN PASSWORD CLIENTHOST SERVERHOST
  * Return any cached authentication context for the given arguments. */
 authcontext authcache_new_user_pass(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost) {
     unsigned char hash[16];
-    unsigned long u, u0;
+    struct cacheentry *e;
+    long u;
     if (!use_cache)
         return NULL;
     make_arg_hash(hash, user, local_part, domain, pass, clienthost, serverhost);
-    u = u0 = hashval(hash, authcache.nbits);
-    do {
-        if (!authcache.slots[u].A)
-            break;
-        else if (0 == memcmp(authcache.slots[u].hash, hash, 16)) {
-            if (authcache.slots[u].when < time(NULL) - entry_lifetime) {
-                log_print(LOG_DEBUG, _("authcache_new_user_pass: dropped old cache entry for %s from slot %u"), username_string(user, local_part, domain), u);
-                remove_cache_entry(u);
-                return NULL;
-            } else {
-                log_print(LOG_DEBUG, _("authcache_new_user_pass: returning saved entry for %s (%ds old) from slot %u"), username_string(user, local_part, domain), (int)(time(NULL) - authcache.slots[u].when), u);
-                return authcontext_copy(authcache.slots[u].A);
-            }
-        } else
-            u = (u + 1) % CACHESLOTS;
-    } while (u != u0);
-    log_print(LOG_DEBUG, _("authcache_new_user_pass: no entry for %s"), username_string(user, local_part, domain));
+    if (shared.slots) {
+        authcontext a;
+        if ((a = shared_find(hash))) {
+            log_print(LOG_DEBUG, _("authcache_new_user_pass: returning entry for %s from cache file"), username_string(user, local_part, domain));
+            ++authcache.hits;
+            return a;
+        }
+        log_print(LOG_DEBUG, _("authcache_new_user_pass: no entry for %s in cache file"), username_string(user, local_part, domain));
+    } else if ((u = find_cache_entry(hash)) != -1) {
+        e = authcache.slots[u];
+        if (e->when < time(NULL) - entry_lifetime) {
+            log_print(LOG_DEBUG, _("authcache_new_user_pass: dropped old cache entry for %s from slot %u"), username_string(user, local_part, domain), (unsigned)u);
+            remove_cache_entry((unsigned long)u);
+            ++authcache.expiries;
+        } else {
+            log_print(LOG_DEBUG, _("authcache_new_user_pass: returning saved entry for %s (%ds old) from slot %u"), username_string(user, local_part, domain), (int)(time(NULL) - e->when), (unsigned)u);
+            lru_unlink(e);
+            lru_push(e);
+            ++authcache.hits;
+            return authcontext_copy(e->A);
+        }
+    } else
+        log_print(LOG_DEBUG, _("authcache_new_user_pass: no entry for %s"), username_string(user, local_part, domain));
+    ++authcache.misses;
     return NULL;
 }
 
 /* authcache_save CONTEXT USER LOCALPART DOMAIN PASSWORD CLIENTHOST SERVERHOST
- * Save the given authentication CONTEXT under the given arguments. */
+ * Save the given authentication CONTEXT under the given arguments. If the
+ * cache is then too big, evict the entries least recently used. */
 void authcache_save(authcontext A, const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost) {
     unsigned char hash[16];
     unsigned long u;
+    long v;
     authcontext Acopy;
+    struct cacheentry *e;
 
     if (!use_cache)
         return;
@@ -235,18 +757,154 @@ void authcache_save(authcontext A, const char *user, const char *local_part, con
     Acopy->auth = xmalloc(strlen(A->auth) + sizeof "+cache");
     sprintf(Acopy->auth, "%s+cache", A->auth);
 
-    /* Find a free hash slot. */
     make_arg_hash(hash, user, local_part, domain, pass, clienthost, serverhost);
+    if (shared.slots) {
+        shared_save(hash, Acopy);
+        authcontext_delete(Acopy);
+        return;
+    }
+
+    /* Replace any existing entry. */
+    if ((v = find_cache_entry(hash)) != -1)
+        remove_cache_entry((unsigned long)v);
     
-    if (authcache.nfilled + 1 == CACHESLOTS) {
+    /* Keep the table no more than half full, so that runs are short. */
+    if (2 * (authcache.nfilled + 1) > CACHESLOTS) {
         resize_cache(authcache.nbits + 1);
-        log_print(LOG_DEBUG, _("authcache_save: resized cache to %u byte key"), (unsigned)authcache.nbits);
+        log_print(LOG_DEBUG, _("authcache_save: resized cache to %u bit key"), (unsigned)authcache.nbits);
     }
 
-    for (u = hashval(hash, authcache.nbits); authcache.slots[u].A; u = (u + 1) % CACHESLOTS);
-    log_print(LOG_DEBUG, _("authcache_save: saved entry for %s in slot %u"), username_string(user, local_part, domain), u);
-    memcpy(authcache.slots[u].hash, hash, 16);
-    authcache.slots[u].A = Acopy;
-    time(&authcache.slots[u].when);
+    /* Find a free hash slot. */
+    for (u = hashval(hash, authcache.nbits); authcache.slots[u]; u = (u + 1) % CACHESLOTS);
+    log_print(LOG_DEBUG, _("authcache_save: saved entry for %s in slot %u"), username_string(user, local_part, domain), (unsigned)u);
+    alloc_struct(cacheentry, e);
+    memcpy(e->hash, hash, 16);
+    e->A = Acopy;
+    time(&e->when);
+    e->size = entry_size(Acopy);
+    authcache.slots[u] = e;
+    lru_push(e);
     ++authcache.nfilled;
+    authcache.size += e->size;
+
+    while (authcache.size > (size_t)max_size && authcache.tail != e) {
+        log_print(LOG_DEBUG, _("authcache_save: evicting least recently used entry (%ds old)"), (int)(time(NULL) - authcache.tail->when));
+        evict_cache_entry(authcache.tail);
+        ++authcache.evictions;
+    }
+}
+
+/* negative_bucket USERHASH
+ * Return the first entry of the negative cache bucket for USERHASH. */
+static struct negentry *negative_bucket(const unsigned char userhash[16]) {
+    return negcache.slots + (hashval(userhash, 8) % NEGATIVE_BUCKETS) * NEGATIVE_BUCKET_SLOTS;
+}
+
+/* authcache_negative_find USER LOCALPART DOMAIN PASSWORD CLIENTHOST SERVERHOST
+ * Return nonzero if the given arguments have recently failed to
+ * authenticate. */
+int authcache_negative_find(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost) {
+    unsigned char userhash[16], hash[16];
+    struct negentry *N, *Nend;
+    time_t now;
+
+    if (!use_negative_cache)
+        return 0;
+
+    make_arg_hash(userhash, user, local_part, domain, NULL, clienthost, serverhost);
+    make_arg_hash(hash, user, local_part, domain, pass, clienthost, serverhost);
+    time(&now);
+    for (N = negative_bucket(userhash), Nend = N + NEGATIVE_BUCKET_SLOTS; N < Nend; ++N)
+        if (N->when && N->when >= now - negative_lifetime && 0 == memcmp(N->hash, hash, 16)) {
+            ++negcache.hits;
+            return 1;
+        }
+
+    return 0;
+}
+
+/* authcache_negative_save USER LOCALPART DOMAIN PASSWORD CLIENTHOST SERVERHOST
+ * Record that the given arguments have failed to authenticate. If
+ * negative_per_user passwords are already recorded for this user, the oldest
+ * of them is forgotten; otherwise an empty or expired slot, or the oldest
+ * entry, in the bucket is used. */
+void authcache_negative_save(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost) {
+    unsigned char userhash[16];
+    struct negentry *N, *Nend, *oldest = NULL, *oldest_user = NULL;
+    int nuser = 0;
+    time_t now;
+
+    if (!use_negative_cache)
+        return;
+
+    make_arg_hash(userhash, user, local_part, domain, NULL, clienthost, serverhost);
+    time(&now);
+    for (N = negative_bucket(userhash), Nend = N + NEGATIVE_BUCKET_SLOTS; N < Nend; ++N) {
+        if (!N->when || N->when < now - negative_lifetime) {
+            N->when = 0;
+            if (!oldest || oldest->when)
+                oldest = N;
+        } else {
+            if (0 == memcmp(N->userhash, userhash, 16)) {
+                ++nuser;
+                if (!oldest_user || N->when < oldest_user->when)
+                    oldest_user = N;
+            }
+            if (!oldest || (oldest->when && N->when < oldest->when))
+                oldest = N;
+        }
+    }
+
+    N = nuser >= negative_per_user ? oldest_user : oldest;
+    memcpy(N->userhash, userhash, 16);
+    make_arg_hash(N->hash, user, local_part, domain, pass, clienthost, serverhost);
+    N->when = now;
+    ++negcache.saves;
+}
+
+/* authcache_expire
+ * Called periodically from the main loop. Every AUTHCACHE_SWEEP_INTERVAL
+ * seconds, discard entries which have passed their lifetime, and shrink the
+ * hash table if it has become very empty; every AUTHCACHE_REPORT_INTERVAL
+ * seconds, log statistics about the cache. */
+void authcache_expire(void) {
+    struct cacheentry *e, *enext;
+    time_t now;
+
+    if (!use_cache && !use_negative_cache)
+        return;
+
+    time(&now);
+    if (now >= authcache.lastsweep && now < authcache.lastsweep + AUTHCACHE_SWEEP_INTERVAL)
+        return;
+    authcache.lastsweep = now;
+
+    for (e = authcache.head; e; e = enext) {
+        enext = e->next;
+        if (e->when < now - entry_lifetime) {
+            evict_cache_entry(e);
+            ++authcache.expiries;
+        }
+    }
+
+    if (authcache.nbits > 8 && 8 * authcache.nfilled < CACHESLOTS) {
+        size_t nbits;
+        for (nbits = authcache.nbits - 1; nbits > 8 && 8 * authcache.nfilled < (1 << nbits); --nbits);
+        resize_cache(nbits);
+        log_print(LOG_DEBUG, _("authcache_expire: resized cache to %u bit key"), (unsigned)authcache.nbits);
+    }
+
+    if (now >= authcache.lastreport + AUTHCACHE_REPORT_INTERVAL || now < authcache.lastreport) {
+        if (shared.slots)
+            log_print(LOG_INFO, _("authcache_expire: using cache file with %u slots; %lu hits, %lu misses, %lu expired, %lu evicted"),
+                    shared.hdr->nslots, authcache.hits, authcache.misses, authcache.expiries, authcache.evictions);
+        else if (use_cache)
+            log_print(LOG_INFO, _("authcache_expire: %u entries using about %u bytes; %lu hits, %lu misses, %lu expired, %lu evicted"),
+                    (unsigned)authcache.nfilled, (unsigned)authcache.size,
+                    authcache.hits, authcache.misses, authcache.expiries, authcache.evictions);
+        if (use_negative_cache)
+            log_print(LOG_INFO, _("authcache_expire: negative cache: %lu failed logins recorded; %lu rejected from cache"),
+                    negcache.saves, negcache.hits);
+        authcache.lastreport = now;
+    }
 }
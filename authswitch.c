@@ -70,6 +70,10 @@ static const char rcsid[] = "$Id$";
 #include "auth_gdbm.h"
 #endif /* AUTH_GDBM */
 
+#ifdef AUTH_CDB
+#include "auth_cdb.h"
+#endif /* AUTH_CDB */
+
 #ifdef USE_WHOSON
 #include <whoson.h>
 #endif
@@ -94,7 +98,7 @@ struct authdrv auth_drivers[] = {
             
 #ifdef AUTH_PASSWD
         /* This is the old-style unix authentication driver. */
-        {NULL, NULL, auth_passwd_new_user_pass, NULL, NULL, NULL,
+        {auth_passwd_init, NULL, auth_passwd_new_user_pass, NULL, auth_passwd_postfork, auth_passwd_close,
             "passwd",
             _X("Uses /etc/passwd or /etc/shadow")},
 #endif /* AUTH_PASSWD */
@@ -147,9 +151,21 @@ struct authdrv auth_drivers[] = {
             "gdbm",
             _X("Uses GNU dbm files")},
 #endif /* AUTH_GDBM */
+
+#ifdef AUTH_CDB
+        /* Authenticate against constant databases. */
+        {auth_cdb_init, auth_cdb_new_apop, auth_cdb_new_user_pass, NULL, auth_cdb_postfork, auth_cdb_close,
+            "cdb",
+            _X("Uses constant database (cdb) files")},
+#endif /* AUTH_CDB */
 };
 
 int *auth_drivers_running;
+
+/* Set by a driver's auth_new_user_pass when it fails a login definitely --
+ * because it does not know the user, or the password is wrong -- rather than
+ * because it could not find out, for instance when its database is down. */
+int auth_rejected;
     
 #define NUM_AUTH_DRIVERS    (sizeof(auth_drivers) / sizeof(struct authdrv))
 #define auth_drivers_end    auth_drivers + NUM_AUTH_DRIVERS
@@ -291,7 +307,7 @@ authcontext authcontext_new_apop(const char *user, const char *local_part, const
 authcontext authcontext_new_user_pass(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost) {
     authcontext a = NULL;
     const struct authdrv *aa;
-    int *aar;
+    int *aar, definite = 1;
     char *x = NULL;
     const char *l = NULL, *d = NULL;
 
@@ -321,24 +337,37 @@ authcontext authcontext_new_user_pass(const char *user, const char *local_part,
             l = NULL;
     }
 
-    /* Try auth cache, then actual auth drivers. */
+    /* Try auth cache, then negative cache, then actual auth drivers. */
     if (!(a = authcache_new_user_pass(user, l, d, pass, clienthost, serverhost))) {
-        for (aa = auth_drivers, aar = auth_drivers_running; aa < auth_drivers_end; ++aa, ++aar) {
-            if (*aar && aa->auth_new_user_pass && (a = aa->auth_new_user_pass(user, l, d, pass, clienthost, serverhost))) {
-                a->auth = xstrdup(aa->name);
-                a->user = xstrdup(user);
-                if (!a->local_part) {
-                    if (l)
-                        a->local_part = xstrdup(l);
-                    else
-                        a->local_part = xstrdup(user);
-                }
-                if (!a->domain && d)
-                    a->domain = xstrdup(d);
-                authcache_save(a, user, l, d, pass, clienthost, serverhost);
-                log_print(LOG_INFO, _("authcontext_new_user_pass: began session for `%s' with %s; uid %d, gid %d"), a->user, a->auth, a->uid, a->gid);
-                break;
+        if (authcache_negative_find(user, l, d, pass, clienthost, serverhost))
+            log_print(LOG_INFO, _("authcontext_new_user_pass: rejecting login attempt by `%s' which recently failed"), user);
+        else {
+            for (aa = auth_drivers, aar = auth_drivers_running; aa < auth_drivers_end; ++aa, ++aar) {
+                if (!*aar || !aa->auth_new_user_pass)
+                    continue;
+                auth_rejected = 0;
+                if ((a = aa->auth_new_user_pass(user, l, d, pass, clienthost, serverhost))) {
+                    a->auth = xstrdup(aa->name);
+                    a->user = xstrdup(user);
+                    if (!a->local_part) {
+                        if (l)
+                            a->local_part = xstrdup(l);
+                        else
+                            a->local_part = xstrdup(user);
+                    }
+                    if (!a->domain && d)
+                        a->domain = xstrdup(d);
+                    authcache_save(a, user, l, d, pass, clienthost, serverhost);
+                    log_print(LOG_INFO, _("authcontext_new_user_pass: began session for `%s' with %s; uid %d, gid %d"), a->user, a->auth, a->uid, a->gid);
+                    break;
+                } else if (!auth_rejected)
+                    definite = 0;
             }
+            /* Only remember the failure if no driver failed for some reason
+             * other than a wrong password or unknown user, so that an outage
+             * doesn't lock out users who gave the right password. */
+            if (!a && definite)
+                authcache_negative_save(user, l, d, pass, clienthost, serverhost);
         }
     }
 
@@ -377,6 +406,9 @@ void authswitch_onlogin(const authcontext A, const char *clienthost, const char
     }
 #endif /* USE_DRAC */
 
+    if (!auth_drivers_running)
+        return; /* drivers are running in authentication workers */
+
     for (aa = auth_drivers, aar = auth_drivers_running; aa < auth_drivers_end; ++aa, ++aar)
         if (*aar && aa->auth_onlogin)
             aa->auth_onlogin(A, clienthost, serverhost);
@@ -388,6 +420,9 @@ void authswitch_postfork() {
     const struct authdrv *aa;
     int *aar;
 
+    if (!auth_drivers_running)
+        return;
+
     for (aa = auth_drivers, aar = auth_drivers_running; aa < auth_drivers_end; ++aa, ++aar)
         if (*aar && aa->auth_postfork) aa->auth_postfork();
 
@@ -399,10 +434,14 @@ void authswitch_close() {
     const struct authdrv *aa;
     int *aar;
 
+    if (!auth_drivers_running)
+        return;
+
     for (aa = auth_drivers, aar = auth_drivers_running; aa < auth_drivers_end; ++aa, ++aar)
         if (*aar && aa->auth_close) aa->auth_close();
 
     xfree(auth_drivers_running);
+    auth_drivers_running = NULL;
 }
 
 /* authcontext_new:
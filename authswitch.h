@@ -73,6 +73,8 @@ struct authdrv {
     char *description;
 };
 
+extern int auth_rejected;       /* Driver failed a login definitely. */
+
 char *username_string(const char *user, const char *local_part, const char *domain);
 
 void authswitch_describe(FILE *fp);
@@ -96,5 +98,8 @@ void authcache_init(void);
 void authcache_close(void);
 authcontext authcache_new_user_pass(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost);
 void authcache_save(authcontext A, const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost);
+void authcache_expire(void);
+int  authcache_negative_find(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost);
+void authcache_negative_save(const char *user, const char *local_part, const char *domain, const char *pass, const char *clienthost, const char *serverhost);
 
 #endif /* __AUTHSWITCH_H_ */
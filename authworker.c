@@ -0,0 +1,1094 @@
+/*
+ * authworker.c:
+ * Run the authentication drivers in a pool of worker processes, so that a
+ * slow database or directory server doesn't stall the main loop.
+ *
+ * Copyright (c) 2026 the tpop3d contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#include "configuration.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "authswitch.h"
+#include "authworker.h"
+#include "config.h"
+#include "connection.h"
+#include "listener.h"
+#include "tlsworker.h"
+#include "util.h"
+#include "vector.h"
+
+#ifdef USE_TLS
+#include "tls.h"
+#endif /* USE_TLS */
+
+/*
+ * Theory of operation:
+ *
+ * When auth-workers is set, the master does not start the authentication
+ * drivers itself. Instead it forks that many worker processes, each of which
+ * starts the drivers, and talks to each of them over a socketpair. A client
+ * which gives USER/PASS or APOP is frozen while a request is queued for the
+ * next idle worker; when the worker replies, the result is attached to the
+ * connection and connections_post_select carries on where connection_do left
+ * off. Each worker handles one request at a time, so a database query which
+ * stalls holds up only the clients queued behind it, and the master keeps
+ * accepting connections and serving other requests.
+ *
+ * Messages in either direction consist of a length word followed by that
+ * many bytes. A request is an ID, a type character and the arguments; a reply
+ * is the ID, a flag saying whether authentication succeeded and, if so, the
+ * authentication context. On startup each worker sends a single message
+ * giving the number of drivers it managed to start.
+ *
+ * Workers which exceed auth-worker-timeout are killed, failing their current
+ * request, and dead workers are replaced from the main loop. A worker which
+ * has handled auth-worker-max-requests requests is retired by closing its
+ * socket, so that it exits cleanly, and is replaced in the same way. Every
+ * WORKER_REPORT_INTERVAL seconds the length of the queue, and what each worker
+ * has been doing, is logged.
+ */
+
+#define DEFAULT_WORKER_TIMEOUT  20      /* seconds */
+#define WORKER_STARTUP_TIMEOUT  60      /* seconds */
+#define WORKER_RESPAWN_INTERVAL 1       /* seconds */
+#define MAX_FRAME_LEN           65536
+#define WORKER_REPORT_INTERVAL  3600    /* seconds */
+
+/* With the PAM hack, each PAM conversation would normally run in a process of
+ * its own to contain leaks in PAM modules; workers call PAM directly, so by
+ * default they are replaced after this many requests instead. */
+#if defined(AUTH_PAM) && defined(REALLY_UGLY_PAM_HACK)
+#   define DEFAULT_WORKER_MAX_REQUESTS  (config_get_bool("auth-pam-enable") ? 100 : 0)
+#else
+#   define DEFAULT_WORKER_MAX_REQUESTS  0
+#endif
+
+int num_auth_workers = 0;
+int auth_worker_process = 0;
+
+static int worker_timeout = -1;
+static int worker_max_requests;         /* 0 means no limit */
+
+extern int post_fork;                   /* in netloop.c */
+extern vector listeners;
+extern connection *connections;
+extern size_t max_connections;
+
+/* struct frame:
+ * A message being built, with room for its length at the start. */
+struct frame {
+    char *buf;
+    size_t len, size;
+};
+
+/* struct cursor:
+ * Position in a message being decoded. */
+struct cursor {
+    const char *p, *end;
+};
+
+/* struct authrequest:
+ * A request waiting for, or being handled by, a worker. */
+struct authrequest {
+    unsigned int id;
+    connection c;               /* waiting connection, or NULL */
+    int notifyfd;               /* written to on completion, or -1 */
+    unsigned int affinity;      /* hash of user name */
+    struct frame f;
+    struct authrequest *next;
+};
+
+static struct authworker {
+    volatile pid_t pid;
+    volatile sig_atomic_t died;
+    volatile int status;
+    int fd, pfd_index;
+    int ready, ndrivers;
+    time_t spawned, busysince;
+    struct timeval started;     /* when the current request was sent */
+    struct authrequest *cur;
+    char *rbuf;
+    size_t rlen, rsize;
+    unsigned long nrequests;    /* handled by this process */
+    int retiring;
+    unsigned long nserved, nkilled, nfailed;
+    double totaltime;           /* milliseconds spent on requests */
+} *workers;
+
+static struct authrequest *queue_head, *queue_tail;
+static unsigned int queue_len, queue_peak;
+static unsigned int next_request_id = 1;
+static time_t lastreport;
+
+/* frame_init FRAME
+ * Start a new message in FRAME. */
+static void frame_init(struct frame *f) {
+    f->size = 256;
+    f->buf = xmalloc(f->size);
+    f->len = sizeof(unsigned int);
+}
+
+/* frame_put FRAME DATA COUNT
+ * Append COUNT bytes of DATA to FRAME. */
+static void frame_put(struct frame *f, const void *p, const size_t n) {
+    if (f->len + n > f->size)
+        f->buf = xrealloc(f->buf, f->size = 2 * (f->len + n));
+    memcpy(f->buf + f->len, p, n);
+    f->len += n;
+}
+
+static void frame_put_int(struct frame *f, const unsigned int i) {
+    frame_put(f, &i, sizeof i);
+}
+
+/* frame_put_string FRAME STRING
+ * Append STRING, which may be NULL, to FRAME. */
+static void frame_put_string(struct frame *f, const char *s) {
+    char flag;
+    flag = (s != NULL);
+    frame_put(f, &flag, 1);
+    if (s)
+        frame_put(f, s, strlen(s) + 1);
+}
+
+static void frame_put_authcontext(struct frame *f, const authcontext A) {
+    frame_put_int(f, (unsigned int)A->uid);
+    frame_put_int(f, (unsigned int)A->gid);
+    frame_put_string(f, A->mboxdrv);
+    frame_put_string(f, A->mailbox);
+    frame_put_string(f, A->auth);
+    frame_put_string(f, A->user);
+    frame_put_string(f, A->home);
+    frame_put_string(f, A->local_part);
+    frame_put_string(f, A->domain);
+}
+
+/* frame_finish FRAME
+ * Fill in the length of FRAME. */
+static void frame_finish(struct frame *f) {
+    unsigned int l;
+    l = f->len - sizeof l;
+    memcpy(f->buf, &l, sizeof l);
+}
+
+/* frame_free FRAME
+ * Free FRAME, wiping it first since it may contain a password. */
+static void frame_free(struct frame *f) {
+    if (f->buf) {
+        memset(f->buf, 0, f->len);
+        xfree(f->buf);
+    }
+    f->buf = NULL;
+    f->len = f->size = 0;
+}
+
+static int get_bytes(struct cursor *C, void *q, const size_t n) {
+    if ((size_t)(C->end - C->p) < n)
+        return 0;
+    memcpy(q, C->p, n);
+    C->p += n;
+    return 1;
+}
+
+static int get_int(struct cursor *C, unsigned int *i) {
+    return get_bytes(C, i, sizeof *i);
+}
+
+/* get_string CURSOR STRING
+ * Save in *STRING a copy of the next string, or NULL if it was absent.
+ * Returns 1 on success or 0 if the message is malformed. */
+static int get_string(struct cursor *C, char **s) {
+    const char *q;
+    char flag;
+    *s = NULL;
+    if (!get_bytes(C, &flag, 1))
+        return 0;
+    else if (!flag)
+        return 1;
+    else if (!(q = memchr(C->p, 0, C->end - C->p)))
+        return 0;
+    *s = xstrdup(C->p);
+    C->p = q + 1;
+    return 1;
+}
+
+/* get_authcontext CURSOR
+ * Return a new authentication context decoded from CURSOR, or NULL if the
+ * message is malformed. */
+static authcontext get_authcontext(struct cursor *C) {
+    authcontext A;
+    unsigned int uid, gid;
+    alloc_struct(_authcontext, A);
+    if (!get_int(C, &uid) || !get_int(C, &gid)
+        || !get_string(C, &A->mboxdrv)
+        || !get_string(C, &A->mailbox)
+        || !get_string(C, &A->auth)
+        || !get_string(C, &A->user)
+        || !get_string(C, &A->home)
+        || !get_string(C, &A->local_part)
+        || !get_string(C, &A->domain)) {
+        authcontext_delete(A);
+        return NULL;
+    }
+    A->uid = (uid_t)uid;
+    A->gid = (gid_t)gid;
+    return A;
+}
+
+/* read_frame FD FRAME
+ * Read a message from FD, which must be blocking, into FRAME. Returns 1 on
+ * success, 0 on end-of-file or -1 on error. */
+static int read_frame(int fd, struct frame *f) {
+    unsigned int l;
+    size_t n = 0;
+    char *p = (char*)&l;
+
+    while (n < sizeof l) {
+        ssize_t r;
+        if ((r = read(fd, p + n, sizeof l - n)) == 0)
+            return 0;
+        else if (r == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        n += r;
+    }
+
+    if (l > MAX_FRAME_LEN) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    frame_free(f);
+    f->buf = xmalloc(f->size = l ? l : 1);
+    for (f->len = 0; f->len < l; ) {
+        ssize_t r;
+        if ((r = read(fd, f->buf + f->len, l - f->len)) == 0)
+            return 0;
+        else if (r == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        f->len += r;
+    }
+
+    return 1;
+}
+
+/* worker_handle REQUEST REPLY
+ * Carry out the request in REQUEST, and write a reply into REPLY. */
+static void worker_handle(const struct frame *req, struct frame *rep) {
+    struct cursor C;
+    unsigned int id = 0;
+    char type = 0;
+    char *user = NULL, *domain = NULL, *pass = NULL, *timestamp = NULL, *clienthost = NULL, *serverhost = NULL;
+    unsigned char digest[16];
+    authcontext a = NULL, A = NULL;
+    int ok = 0;
+
+    C.p = req->buf;
+    C.end = req->buf + req->len;
+
+    if (get_int(&C, &id) && get_bytes(&C, &type, 1)) {
+        switch (type) {
+            case 'P':
+                if ((ok = get_string(&C, &user) && user && get_string(&C, &domain)
+                          && get_string(&C, &pass) && pass
+                          && get_string(&C, &clienthost) && get_string(&C, &serverhost)))
+                    a = authenticate_user_pass(user, domain, pass, clienthost, serverhost);
+                break;
+
+            case 'A':
+                if ((ok = get_string(&C, &user) && user && get_string(&C, &domain)
+                          && get_string(&C, &timestamp) && timestamp && get_bytes(&C, digest, sizeof digest)
+                          && get_string(&C, &clienthost) && get_string(&C, &serverhost)))
+                    a = authenticate_apop(user, domain, timestamp, digest, clienthost, serverhost);
+                break;
+
+            case 'O':
+                if ((ok = (A = get_authcontext(&C)) && get_string(&C, &clienthost) && get_string(&C, &serverhost)))
+                    authswitch_onlogin(A, clienthost, serverhost);
+                break;
+        }
+    }
+
+    if (!ok)
+        log_print(LOG_ERR, _("worker_handle: malformed request of type `%c' from master"), type ? type : '?');
+
+    rep->len = sizeof(unsigned int);
+    frame_put_int(rep, id);
+    frame_put_int(rep, a != NULL);
+    if (a) {
+        frame_put_authcontext(rep, a);
+        authcontext_delete(a);
+    }
+    frame_finish(rep);
+
+    if (pass) {
+        memset(pass, 0, strlen(pass));
+        xfree(pass);
+    }
+    xfree(user);
+    xfree(domain);
+    xfree(timestamp);
+    xfree(clienthost);
+    xfree(serverhost);
+    if (A) authcontext_delete(A);
+}
+
+/* worker_main FD
+ * Main loop of a worker, which talks to the master on FD. Does not return. */
+static NORETURN void worker_main(int fd) {
+    struct frame req = {0}, rep;
+    int na;
+
+    post_fork = 1;  /* Don't remove the PID file if we crash. */
+    auth_worker_process = 1;
+    xsignal(SIGINT, SIG_DFL);
+    xsignal(SIGTERM, SIG_DFL);
+    xsignal(SIGHUP, SIG_IGN);
+
+    /* Tell the master how many drivers we managed to start. */
+    na = authswitch_init();
+    frame_init(&rep);
+    frame_put_int(&rep, (unsigned int)na);
+    frame_finish(&rep);
+    if (xwrite(fd, rep.buf, rep.len) == -1) {
+        log_print(LOG_ERR, "worker_main: write: %m");
+        _exit(1);
+    }
+
+    while (1) {
+        struct pollfd pfd;
+        int r;
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        r = poll(&pfd, 1, 1000);
+
+        /* Workers keep their own authentication caches. */
+        authcache_expire();
+
+        if (r == -1 && errno != EINTR) {
+            log_print(LOG_ERR, "worker_main: poll: %m");
+            break;
+        } else if (r <= 0)
+            continue;
+
+        if ((r = read_frame(fd, &req)) == 0)
+            break;  /* master has gone away */
+        else if (r == -1) {
+            log_print(LOG_ERR, "worker_main: read: %m");
+            break;
+        }
+
+        worker_handle(&req, &rep);
+        frame_free(&req);
+
+        if (xwrite(fd, rep.buf, rep.len) == -1) {
+            log_print(LOG_ERR, "worker_main: write: %m");
+            break;
+        }
+    }
+
+    authswitch_close();
+    authcache_close();
+    _exit(0);
+}
+
+/* fork_worker PID FD DISCARD RUN
+ * Fork a worker process, for this file or tlsworker.c, which talks to the
+ * master over a socketpair. In the child, close the listening sockets, client
+ * connections and other workers, none of which are its business, call
+ * DISCARD, if given, to drop anything else of the master's, and then call RUN,
+ * which must not return, on the child's end of the socketpair. In the parent,
+ * save the child's PID and our end of the socketpair, which is non-blocking
+ * and closed on exec, in FD. Returns 1 on success or 0 on failure. */
+int fork_worker(volatile pid_t *pid, int *fd, void (*discard)(void), void (*run)(int)) {
+    int sv[2];
+    sigset_t chmask;
+    connection *J;
+    item *t;
+    pid_t p;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        log_print(LOG_ERR, "fork_worker: socketpair: %m");
+        return 0;
+    }
+
+    /* Block SIGCHLD so that a worker which exits immediately is still
+     * recognised as one by the signal handler. */
+    sigemptyset(&chmask);
+    sigaddset(&chmask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chmask, NULL);
+
+    switch ((p = fork())) {
+        case 0:
+            sigprocmask(SIG_UNBLOCK, &chmask, NULL);
+            close(sv[0]);
+
+            /* Just close the sockets; shutdown(2) would affect the master's
+             * copies. */
+            if (listeners)
+                vector_iterate(listeners, t) {
+                    listener L = (listener)t->v;
+                    if (L->s != -1) close(L->s);
+                    L->s = -1;
+                }
+
+            if (connections)
+                for (J = connections; J < connections + max_connections; ++J)
+                    if (*J && (*J)->s != -1) {
+                        close((*J)->s);
+                        (*J)->s = -1;
+                    }
+
+            authworker_postfork();
+#ifdef USE_TLS
+            tlsworker_postfork();
+#endif /* USE_TLS */
+#ifdef MASS_HOSTING
+            listener_domains_postfork();
+#endif /* MASS_HOSTING */
+
+            if (discard)
+                discard();
+            run(sv[1]);
+            _exit(1);   /* not reached */
+
+        case -1:
+            log_print(LOG_ERR, "fork_worker: fork: %m");
+            close(sv[0]);
+            close(sv[1]);
+            sigprocmask(SIG_UNBLOCK, &chmask, NULL);
+            return 0;
+
+        default:
+            close(sv[1]);
+            /* The worker should see end-of-file if we re-exec ourselves. */
+            fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+            fcntl(sv[0], F_SETFL, O_NONBLOCK);
+            *pid = p;
+            *fd = sv[0];
+            sigprocmask(SIG_UNBLOCK, &chmask, NULL);
+            return 1;
+    }
+}
+
+/* discard_listeners
+ * In a new authentication worker, free the listeners, which it has no use
+ * for, and wipe the session ticket keys. */
+static void discard_listeners(void) {
+    item *t;
+    vector_iterate(listeners, t) listener_delete((listener)t->v);
+    vector_delete(listeners);
+    listeners = NULL;
+#ifdef USE_TLS
+    tls_postfork();
+#endif /* USE_TLS */
+}
+
+/* spawn_worker WORKER
+ * Start a new process for WORKER. Returns 1 on success or 0 on failure. */
+static int spawn_worker(struct authworker *w) {
+    time(&w->spawned);
+    w->died = 0;
+    w->ready = 0;
+    w->rlen = 0;
+    w->cur = NULL;
+    w->nrequests = 0;
+    w->retiring = 0;
+
+    if (!fork_worker(&w->pid, &w->fd, discard_listeners, worker_main))
+        return 0;
+
+    log_print(LOG_DEBUG, _("spawn_worker: started authentication worker %d"), (int)w->pid);
+    return 1;
+}
+
+/* complete_request REQUEST CONTEXT
+ * Deliver the authentication context CONTEXT, which may be NULL, to whoever
+ * is waiting for REQUEST, and free it. */
+static void complete_request(struct authrequest *R, authcontext a) {
+    if (R->c) {
+        R->c->a = a;
+        R->c->authpending = 0;
+        R->c->authdone = 1;
+    } else if (a)
+        authcontext_delete(a);
+
+    if (R->notifyfd != -1) {
+        if (xwrite(R->notifyfd, "\0", 1) == -1)
+            log_print(LOG_ERR, "complete_request: write: %m");
+        close(R->notifyfd);
+    }
+
+    frame_free(&R->f);
+    xfree(R);
+}
+
+/* worker_fail WORKER
+ * Kill WORKER, failing any request it is handling. It will be replaced once
+ * it has been reaped. */
+static void worker_fail(struct authworker *w) {
+    if (w->pid)
+        kill(w->pid, SIGKILL);
+    if (w->fd != -1)
+        close(w->fd);
+    w->fd = -1;
+    w->ready = 0;
+    w->rlen = 0;
+    if (w->cur) {
+        ++w->nfailed;
+        complete_request(w->cur, NULL);
+        w->cur = NULL;
+    }
+}
+
+/* worker_reply WORKER DATA COUNT
+ * Handle a message of COUNT bytes at DATA from WORKER. */
+static void worker_reply(struct authworker *w, const char *p, const size_t len) {
+    struct timeval now;
+    struct cursor C;
+    unsigned int id, ok;
+    authcontext a = NULL;
+    struct authrequest *R;
+
+    C.p = p;
+    C.end = p + len;
+
+    if (!w->ready) {
+        unsigned int na;
+        if (!get_int(&C, &na)) {
+            log_print(LOG_ERR, _("worker_reply: worker %d: malformed startup message"), (int)w->pid);
+            worker_fail(w);
+            return;
+        }
+        w->ready = 1;
+        w->ndrivers = (int)na;
+        if (!na)
+            log_print(LOG_ERR, _("worker_reply: worker %d: no authentication drivers were loaded"), (int)w->pid);
+        return;
+    }
+
+    if (!get_int(&C, &id) || !get_int(&C, &ok) || (ok && !(a = get_authcontext(&C)))) {
+        log_print(LOG_ERR, _("worker_reply: worker %d: malformed reply"), (int)w->pid);
+        worker_fail(w);
+        return;
+    } else if (!w->cur || w->cur->id != id) {
+        log_print(LOG_ERR, _("worker_reply: worker %d: reply to unknown request %u"), (int)w->pid, id);
+        if (a) authcontext_delete(a);
+        worker_fail(w);
+        return;
+    }
+
+    R = w->cur;
+    w->cur = NULL;
+    ++w->nserved;
+    gettimeofday(&now, NULL);
+    w->totaltime += (now.tv_sec - w->started.tv_sec) * 1000.0 + (now.tv_usec - w->started.tv_usec) / 1000.0;
+    complete_request(R, a);
+
+    if (worker_max_requests && ++w->nrequests >= (unsigned long)worker_max_requests) {
+        /* The worker exits when it sees end-of-file, and is replaced once
+         * it has been reaped. */
+        close(w->fd);
+        w->fd = -1;
+        w->ready = 0;
+        w->rlen = 0;
+        w->retiring = 1;
+        time(&w->busysince);
+    }
+}
+
+/* worker_read WORKER
+ * Read whatever is available from WORKER, handling any complete messages. */
+static void worker_read(struct authworker *w) {
+    while (w->fd != -1) {
+        ssize_t n;
+        size_t off = 0;
+
+        if (w->rsize - w->rlen < 4096)
+            w->rbuf = xrealloc(w->rbuf, w->rsize = w->rlen + 8192);
+
+        if ((n = read(w->fd, w->rbuf + w->rlen, w->rsize - w->rlen)) == 0) {
+            log_print(LOG_ERR, _("worker_read: worker %d closed its connection"), (int)w->pid);
+            worker_fail(w);
+            return;
+        } else if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            else if (errno != EAGAIN) {
+                log_print(LOG_ERR, "worker_read: read: %m");
+                worker_fail(w);
+            }
+            return;
+        }
+
+        w->rlen += n;
+
+        while (w->fd != -1 && w->rlen - off >= sizeof(unsigned int)) {
+            unsigned int l;
+            memcpy(&l, w->rbuf + off, sizeof l);
+            if (l > MAX_FRAME_LEN) {
+                log_print(LOG_ERR, _("worker_read: worker %d: oversized message"), (int)w->pid);
+                worker_fail(w);
+                return;
+            } else if (w->rlen - off < sizeof l + l)
+                break;
+            worker_reply(w, w->rbuf + off + sizeof l, l);
+            off += sizeof l + l;
+        }
+
+        if (w->fd == -1)
+            return;
+
+        memmove(w->rbuf, w->rbuf + off, w->rlen - off);
+        w->rlen -= off;
+    }
+}
+
+/* worker_is_idle WORKER
+ * Can WORKER accept a request now? */
+static int worker_is_idle(const struct authworker *w) {
+    return w->fd != -1 && w->ready && !w->cur;
+}
+
+/* dispatch
+ * Hand queued requests to idle workers. A user's requests go, where possible,
+ * to the same worker, so that its authentication cache is some use. */
+static void dispatch(void) {
+    while (queue_head) {
+        struct authrequest *R;
+        struct authworker *w;
+
+        R = queue_head;
+        w = workers + R->affinity % num_auth_workers;
+        if (!worker_is_idle(w))
+            for (w = workers; w < workers + num_auth_workers && !worker_is_idle(w); ++w);
+        if (w == workers + num_auth_workers)
+            return;
+
+        if (!(queue_head = R->next))
+            queue_tail = NULL;
+        R->next = NULL;
+        --queue_len;
+
+        /* The worker has nothing outstanding, so this won't block. */
+        w->cur = R;
+        time(&w->busysince);
+        gettimeofday(&w->started, NULL);
+        if (xwrite(w->fd, R->f.buf, R->f.len) == -1) {
+            log_print(LOG_ERR, "dispatch: write: %m");
+            worker_fail(w);
+        }
+    }
+}
+
+/* request_new TYPE CONNECTION USER
+ * Start a new request of TYPE on behalf of CONNECTION for USER. */
+static struct authrequest *request_new(const char type, connection c, const char *user) {
+    struct authrequest *R;
+    const unsigned char *p;
+
+    alloc_struct(authrequest, R);
+    R->id = next_request_id++;
+    R->c = c;
+    R->notifyfd = -1;
+    for (p = (const unsigned char*)user; *p; ++p)
+        R->affinity = R->affinity * 31 + *p;
+
+    frame_init(&R->f);
+    frame_put_int(&R->f, R->id);
+    frame_put(&R->f, &type, 1);
+
+    return R;
+}
+
+/* queue_request REQUEST
+ * Queue REQUEST and try to hand it to a worker straight away. */
+static void queue_request(struct authrequest *R) {
+    frame_finish(&R->f);
+    if (R->c)
+        R->c->authpending = 1;
+    if (queue_tail)
+        queue_tail->next = R;
+    else
+        queue_head = R;
+    queue_tail = R;
+    if (++queue_len > queue_peak)
+        queue_peak = queue_len;
+    dispatch();
+}
+
+/* authworker_init:
+ * Start the worker processes and wait for them to load the authentication
+ * drivers. Returns the number of drivers loaded, or 0 on failure. */
+int authworker_init(void) {
+    struct authworker *w;
+    struct pollfd *pfds;
+    time_t start;
+    int na;
+
+    switch (config_get_int("auth-worker-timeout", &worker_timeout)) {
+        case -1:
+            log_print(LOG_WARNING, _("authworker_init: bad value for auth-worker-timeout; using default"));
+            /* fall through */
+        case 0:
+            worker_timeout = DEFAULT_WORKER_TIMEOUT;
+            break;
+
+        default:
+            if (worker_timeout < 1) {
+                log_print(LOG_WARNING, _("authworker_init: auth-worker-timeout must be 1 or greater; using default"));
+                worker_timeout = DEFAULT_WORKER_TIMEOUT;
+            }
+    }
+
+    switch (config_get_int("auth-worker-max-requests", &worker_max_requests)) {
+        case -1:
+            log_print(LOG_WARNING, _("authworker_init: bad value for auth-worker-max-requests; using default"));
+            /* fall through */
+        case 0:
+            worker_max_requests = DEFAULT_WORKER_MAX_REQUESTS;
+            break;
+
+        default:
+            if (worker_max_requests < 0) {
+                log_print(LOG_WARNING, _("authworker_init: auth-worker-max-requests may not be negative; using default"));
+                worker_max_requests = DEFAULT_WORKER_MAX_REQUESTS;
+            }
+    }
+
+    workers = xcalloc(num_auth_workers, sizeof *workers);
+    for (w = workers; w < workers + num_auth_workers; ++w) {
+        w->fd = w->pfd_index = -1;
+        if (!spawn_worker(w))
+            return 0;
+    }
+
+    pfds = xcalloc(num_auth_workers, sizeof *pfds);
+
+    time(&start);
+    while (1) {
+        int n = 0, nready = 0;
+
+        for (w = workers; w < workers + num_auth_workers; ++w) {
+            if (w->fd == -1) {
+                xfree(pfds);
+                return 0;   /* worker died during startup */
+            }
+            else if (w->ready)
+                ++nready;
+            else {
+                pfds[n].fd = w->fd;
+                pfds[n].events = POLLIN;
+                pfds[n].revents = 0;
+                w->pfd_index = n++;
+            }
+        }
+
+        if (nready == num_auth_workers)
+            break;
+        else if (time(NULL) > start + WORKER_STARTUP_TIMEOUT) {
+            log_print(LOG_ERR, _("authworker_init: timed out waiting for authentication workers to start"));
+            xfree(pfds);
+            return 0;
+        }
+
+        if (poll(pfds, n, 1000) > 0)
+            for (w = workers; w < workers + num_auth_workers; ++w)
+                if (!w->ready && w->fd != -1 && (pfds[w->pfd_index].revents & (POLLIN | POLLHUP | POLLERR)))
+                    worker_read(w);
+    }
+
+    xfree(pfds);
+
+    na = workers->ndrivers;
+    for (w = workers; w < workers + num_auth_workers; ++w)
+        if (w->ndrivers < na)
+            na = w->ndrivers;
+
+    if (na)
+        log_print(LOG_INFO, _("authworker_init: started %d authentication workers"), num_auth_workers);
+
+    time(&lastreport);
+
+    return na;
+}
+
+/* authworker_user_pass CONNECTION
+ * Queue a USER/PASS authentication for CONNECTION, using its user, pass and
+ * domain fields. Returns 1 if the request was queued, or 0 if workers are not
+ * in use. */
+int authworker_user_pass(connection c) {
+    struct authrequest *R;
+
+    if (!num_auth_workers)
+        return 0;
+
+    R = request_new('P', c, c->user);
+    frame_put_string(&R->f, c->user);
+    frame_put_string(&R->f, c->domain);
+    frame_put_string(&R->f, c->pass);
+    frame_put_string(&R->f, c->remote_ip);
+    frame_put_string(&R->f, c->local_ip);
+    queue_request(R);
+
+    return 1;
+}
+
+/* authworker_apop CONNECTION DIGEST
+ * Queue an APOP authentication for CONNECTION, using its apopname, timestamp
+ * and domain fields and DIGEST. Returns 1 if the request was queued, or 0 if
+ * workers are not in use. */
+int authworker_apop(connection c, const unsigned char *digest) {
+    struct authrequest *R;
+
+    if (!num_auth_workers)
+        return 0;
+
+    R = request_new('A', c, c->apopname);
+    frame_put_string(&R->f, c->apopname);
+    frame_put_string(&R->f, c->domain);
+    frame_put_string(&R->f, c->timestamp);
+    frame_put(&R->f, digest, 16);
+    frame_put_string(&R->f, c->remote_ip);
+    frame_put_string(&R->f, c->local_ip);
+    queue_request(R);
+
+    return 1;
+}
+
+/* authworker_onlogin CONTEXT CLIENTHOST SERVERHOST NOTIFYFD
+ * Queue a call to the drivers' onlogin handlers for CONTEXT. If NOTIFYFD is
+ * not -1, a byte is written to it and it is closed once the handlers have
+ * run. Returns 1 if the request was queued, or 0 if workers are not in use. */
+int authworker_onlogin(const authcontext A, const char *clienthost, const char *serverhost, int notifyfd) {
+    struct authrequest *R;
+
+    if (!num_auth_workers)
+        return 0;
+
+    R = request_new('O', NULL, A->user);
+    R->notifyfd = notifyfd;
+    frame_put_authcontext(&R->f, A);
+    frame_put_string(&R->f, clienthost);
+    frame_put_string(&R->f, serverhost);
+    queue_request(R);
+
+    return 1;
+}
+
+/* authworker_cancel CONNECTION
+ * CONNECTION is going away; forget that it is waiting for a request. */
+void authworker_cancel(connection c) {
+    struct authrequest *R, *prev = NULL, *next;
+    struct authworker *w;
+
+    for (w = workers; w < workers + num_auth_workers; ++w)
+        if (w->cur && w->cur->c == c)
+            w->cur->c = NULL;   /* let the worker finish */
+
+    for (R = queue_head; R; R = next) {
+        next = R->next;
+        if (R->c == c) {
+            if (prev)
+                prev->next = next;
+            else
+                queue_head = next;
+            if (queue_tail == R)
+                queue_tail = prev;
+            --queue_len;
+            R->c = NULL;
+            complete_request(R, NULL);
+        } else
+            prev = R;
+    }
+
+    c->authpending = 0;
+}
+
+/* report_stats
+ * Log the length of the request queue and what each worker has been doing
+ * since the last report. */
+static void report_stats(void) {
+    struct authworker *w;
+
+    log_print(LOG_INFO, _("report_stats: %u requests queued for %d workers; at most %u since last report"), queue_len, num_auth_workers, queue_peak);
+    for (w = workers; w < workers + num_auth_workers; ++w) {
+        log_print(LOG_INFO, _("report_stats: worker %d (%s): %lu requests served, average %.1fms; %lu failed, %lu killed for taking too long"),
+                    (int)(w - workers), w->cur ? "busy" : "idle", w->nserved, w->nserved ? w->totaltime / w->nserved : 0.0, w->nfailed, w->nkilled);
+        w->nserved = w->nfailed = w->nkilled = 0;
+        w->totaltime = 0;
+    }
+
+    queue_peak = queue_len;
+    time(&lastreport);
+}
+
+/* authworker_pre_select N PFDS
+ * Called before the main poll(2) so that workers can be polled. */
+void authworker_pre_select(int *n, struct pollfd *pfds) {
+    struct authworker *w;
+    for (w = workers; w < workers + num_auth_workers; ++w) {
+        w->pfd_index = -1;
+        if (w->fd != -1) {
+            pfds[*n].fd = w->fd;
+            pfds[*n].events = POLLIN;
+            w->pfd_index = (*n)++;
+        }
+    }
+}
+
+/* authworker_post_select PFDS
+ * Called after the main poll(2) to read replies from workers, kill any which
+ * have taken too long, replace any which have died, and hand out queued
+ * requests. */
+void authworker_post_select(struct pollfd *pfds) {
+    struct authworker *w;
+    time_t now;
+
+    time(&now);
+    for (w = workers; w < workers + num_auth_workers; ++w) {
+        if (w->fd != -1 && w->pfd_index != -1 && (pfds[w->pfd_index].revents & (POLLIN | POLLHUP | POLLERR)))
+            worker_read(w);
+
+        if (w->fd != -1 && w->cur && now > w->busysince + worker_timeout) {
+            log_print(LOG_ERR, _("authworker_post_select: worker %d took more than %d seconds over a request; killing it"), (int)w->pid, worker_timeout);
+            /* Count the request as killed, not also as failed. */
+            ++w->nkilled;
+            complete_request(w->cur, NULL);
+            w->cur = NULL;
+            worker_fail(w);
+        } else if (w->retiring && w->pid && !w->died && now > w->busysince + worker_timeout) {
+            log_print(LOG_ERR, _("authworker_post_select: retired worker %d took more than %d seconds to exit; killing it"), (int)w->pid, worker_timeout);
+            kill(w->pid, SIGKILL);
+        }
+
+        if (w->died) {
+            if (w->retiring && WIFEXITED(w->status) && WEXITSTATUS(w->status) == 0)
+                log_print(LOG_DEBUG, _("authworker_post_select: worker %d retired after %lu requests"), (int)w->pid, w->nrequests);
+            else if (WIFSIGNALED(w->status))
+                log_print(LOG_ERR, _("authworker_post_select: worker %d killed by signal %d"), (int)w->pid, WTERMSIG(w->status));
+            else
+                log_print(LOG_ERR, _("authworker_post_select: worker %d exited with status %d"), (int)w->pid, WEXITSTATUS(w->status));
+            w->pid = 0;
+            w->died = 0;
+            worker_fail(w);
+        }
+
+        if (!w->pid && now >= w->spawned + WORKER_RESPAWN_INTERVAL)
+            spawn_worker(w);
+    }
+
+    dispatch();
+
+    if (num_auth_workers && (now >= lastreport + WORKER_REPORT_INTERVAL || now < lastreport))
+        report_stats();
+}
+
+/* authworker_child_died PID STATUS
+ * Called from the SIGCHLD handler; if PID is a worker, note that it has died
+ * and return 1, otherwise return 0. */
+int authworker_child_died(pid_t pid, int status) {
+    struct authworker *w;
+    for (w = workers; w < workers + num_auth_workers; ++w)
+        if (w->pid == pid) {
+            w->status = status;
+            w->died = 1;
+            return 1;
+        }
+    return 0;
+}
+
+/* authworker_postfork:
+ * In a session child, close our ends of the workers' sockets. */
+void authworker_postfork(void) {
+    struct authworker *w;
+    struct authrequest *R;
+
+    /* TLS workers are forked before ours have been started. */
+    if (workers)
+        for (w = workers; w < workers + num_auth_workers; ++w) {
+            if (w->fd != -1) close(w->fd);
+            if (w->cur && w->cur->notifyfd != -1) close(w->cur->notifyfd);
+        }
+    for (R = queue_head; R; R = R->next)
+        if (R->notifyfd != -1) close(R->notifyfd);
+
+    workers = NULL;
+    num_auth_workers = 0;
+    queue_head = queue_tail = NULL;
+    queue_len = 0;
+}
+
+/* authworker_close:
+ * Shut down the workers and discard any outstanding requests. */
+void authworker_close(void) {
+    struct authworker *w;
+    struct authrequest *R;
+
+    if (workers)
+        report_stats();
+
+    for (w = workers; w < workers + num_auth_workers; ++w) {
+        if (w->cur) {
+            w->cur->c = NULL;
+            complete_request(w->cur, NULL);
+        }
+        if (w->fd != -1) close(w->fd);
+        /* Reap the worker here, so that a re-exec'd server doesn't count it
+         * as a session child. */
+        if (w->pid && !w->died) {
+            kill(w->pid, SIGTERM);
+            waitpid(w->pid, NULL, 0);
+        }
+        xfree(w->rbuf);
+    }
+
+    while ((R = queue_head)) {
+        queue_head = R->next;
+        R->c = NULL;
+        complete_request(R, NULL);
+    }
+    queue_tail = NULL;
+    queue_len = 0;
+
+    xfree(workers);
+    workers = NULL;
+    num_auth_workers = 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * authworker.h:
+ * pool of processes which run the authentication drivers
+ *
+ * Copyright (c) 2026 the tpop3d contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __AUTHWORKER_H_ /* include guard */
+#define __AUTHWORKER_H_
+
+#include <sys/types.h>
+
+#include "poll.h"
+
+#include "authswitch.h"
+#include "connection.h"
+
+extern int num_auth_workers;    /* Number of workers; 0 means none. */
+extern int auth_worker_process; /* Nonzero in a worker process. */
+
+/* authworker.c */
+int authworker_init(void);
+int authworker_user_pass(connection c);
+int authworker_apop(connection c, const unsigned char *digest);
+int authworker_onlogin(const authcontext A, const char *clienthost, const char *serverhost, int notifyfd);
+void authworker_cancel(connection c);
+void authworker_pre_select(int *n, struct pollfd *pfds);
+void authworker_post_select(struct pollfd *pfds);
+int authworker_child_died(pid_t pid, int status);
+void authworker_postfork(void);
+void authworker_close(void);
+int fork_worker(volatile pid_t *pid, int *fd, void (*discard)(void), void (*run)(int));
+
+#endif /* __AUTHWORKER_H_ */
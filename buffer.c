@@ -214,7 +214,12 @@ void buffer_push_data(buffer B, const char *data, const size_t dlen) {
  * return, LEN indicates how many contiguous bytes may be written. */
 char *buffer_get_push_ptr(buffer B, size_t *len) {
     assert(B);
-    *len = B->len - B->put;
+    /* Don't run into data not yet consumed, and never fill the buffer
+     * completely, since then it would look empty. */
+    if (B->put < B->get)
+        *len = B->get - B->put - 1;
+    else
+        *len = B->len - B->put - (B->get == 0 ? 1 : 0);
     return B->buf + B->put;
 }
 
@@ -39,6 +39,10 @@ char *cfgdirectives[] = {
     "strip-domain",
     "timeout-seconds",
     "tcp-send-buffer",
+    "message-mmap-threshold",
+    "message-read-size",
+    "retr-prefetch-messages",
+    "retr-prefetch-bytes",
     "log-facility",
     "log-stderr",
     "log-level",
@@ -53,6 +57,8 @@ char *cfgdirectives[] = {
     "lowercase-mailbox",
     "uidl-style",
     "domain-separators",
+    "access-allow",
+    "access-deny",
  
 #if defined(MBOX_BSD) && defined(MBOX_BSD_SAVE_INDICES)
     "mailspool-index",
@@ -62,6 +68,10 @@ char *cfgdirectives[] = {
     "mailspool-no-dotfile-locking",
 #endif
     
+#ifdef MASS_HOSTING
+    "domain-refresh-interval",
+#endif
+
 #ifdef USE_TCP_WRAPPERS
     "tcp-wrappers-name",
 #endif
@@ -84,11 +94,26 @@ char *cfgdirectives[] = {
 
 #ifdef USE_TLS
     "tls-no-bug-workarounds",
+    "tls-session-cache-size",
+    "tls-session-timeout",
+    "tls-no-session-tickets",
+    "tls-ticket-key-rotation",
+    "tls-kernel-offload",
+    "tls-workers",
 #endif
 
     "authcache-enable",
     "authcache-use-client-host",
     "authcache-entry-lifetime",
+    "authcache-max-size",
+    "authcache-file",
+    "authcache-negative-enable",
+    "authcache-negative-lifetime",
+    "authcache-negative-per-user",
+
+    "auth-workers",
+    "auth-worker-timeout",
+    "auth-worker-max-requests",
 
 #ifdef AUTH_PAM
     /* auth-pam options */
@@ -104,6 +129,7 @@ char *cfgdirectives[] = {
     "auth-passwd-enable",
     "auth-passwd-mailbox",
     "auth-passwd-mail-group",
+    "auth-passwd-cache",
 #endif
 
 #ifdef AUTH_MYSQL
@@ -117,6 +143,7 @@ char *cfgdirectives[] = {
     "auth-mysql-pass-query",
     "auth-mysql-apop-query",
     "auth-mysql-onlogin-query",
+    "auth-mysql-ping-interval",
 #endif /* AUTH_MYSQL */
 
 #ifdef AUTH_PGSQL
@@ -147,6 +174,10 @@ char *cfgdirectives[] = {
     "auth-ldap-mail-user-attr",
     "auth-ldap-mail-group",
     "auth-ldap-mail-group-attr",
+    "auth-ldap-timeout",
+    "auth-ldap-cache-enable",
+    "auth-ldap-cache-lifetime",
+    "auth-ldap-cache-size",
 #endif /* AUTH_LDAP */
     
 #ifdef AUTH_OTHER
@@ -155,6 +186,7 @@ char *cfgdirectives[] = {
     "auth-other-user",
     "auth-other-group",
     "auth-other-timeout",
+    "auth-other-send-id",
 #endif /* AUTH_OTHER */
  
 #ifdef AUTH_PERL
@@ -181,6 +213,13 @@ char *cfgdirectives[] = {
     "auth-gdbm-persistent",
 #endif
 
+#ifdef AUTH_CDB
+    "auth-cdb-enable",
+    "auth-cdb-mail-user",
+    "auth-cdb-mail-group",
+    "auth-cdb-passwd-file",
+#endif /* AUTH_CDB */
+
     /* final entry must be NULL */
     NULL};
 
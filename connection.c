@@ -44,9 +44,12 @@ static const char rcsid[] = "$Id$";
 #include <sys/socket.h>
 #include <sys/utsname.h>
 
+#include "authworker.h"
 #include "buffer.h"
+#include "config.h"
 #include "connection.h"
 #include "listener.h"
+#include "tlsworker.h"
 #include "util.h"
 
 extern int verbose;
@@ -125,7 +128,7 @@ connection connection_new(int s, const struct sockaddr_in *sin, listener L) {
 
 #ifdef MASS_HOSTING
     if (L->have_re)
-        c->domain = listener_obtain_domain(L, s);
+        c->domain = listener_obtain_domain(L, &c->sin_local.sin_addr);
 #endif
     if (!c->domain) {
         if (L->domain)
@@ -147,7 +150,7 @@ connection connection_new(int s, const struct sockaddr_in *sin, listener L) {
 
     /* I/O abstraction layer */
 #ifdef USE_TLS
-    if (L->tls.mode == immediate) {
+    if (L->tls.mode == immediate && !tlsworker_handoff(c, L)) {
         if (!(c->io = (struct ioabs*)ioabs_tls_create(c, L))) {
             log_print(LOG_ERR, _("connection_new: could not set up TLS I/O abstraction layer for `%s'"), c->idstr);
             goto fail;
@@ -189,6 +192,7 @@ void connection_delete(connection c) {
         close(c->s);
     }
 
+    if (c->authpending) authworker_cancel(c);
     if (c->a) authcontext_delete(c->a);
     if (c->m) (c->m)->delete(c->m);
 
@@ -202,13 +206,15 @@ void connection_delete(connection c) {
     if (c->timestamp)  xfree(c->timestamp);
     if (c->user)       xfree(c->user);
     if (c->pass)       xfree(c->pass);
+    if (c->apopname)   xfree(c->apopname);
     xfree(c);
 }
 
 /* connection_isfrozen CONNECTION
- * Is CONNECTION frozen? */
+ * Is CONNECTION frozen? Connections waiting for an authentication worker are
+ * treated as frozen. */
 int connection_isfrozen(connection c) {
-    return c->frozenuntil && c->frozenuntil > time(NULL);
+    return c->authpending || (c->frozenuntil && c->frozenuntil > time(NULL));
 }
 
 /* connection_shutdown CONNECTION
@@ -446,12 +452,163 @@ int connection_sendline(connection c, const char *s) {
     return connection_send(c, buf, l);
 }
 
-/* connection_sendmessage:
- * Send to the connected peer a +OK response followed by the header and up to n
- * lines of the body of a message which begins at offset msgoffset + skip in
- * the file referenced by fd, which is assumed to be a mappable object. Lines
- * which begin . are escaped as required by RFC1939, and each line is
- * terminated with `\r\n'. If n is -1, the whole message is sent.
+/* struct sendstate:
+ * State of a message being sent by connection_sendmessage, which may be
+ * presented to send_chunk in pieces. */
+struct sendstate {
+    connection c;
+    char *buffer, *bufptr;  /* output buffer, see connection_sendmessage */
+    size_t buflen;
+    ssize_t nwritten;       /* bytes sent or buffered so far            */
+    int inbody;             /* have we seen the end of the headers?     */
+    int atlinestart;        /* is the next byte at the start of a line? */
+    int n;                  /* body lines still to send, or -1 for all  */
+    size_t pos;             /* bytes of message consumed so far         */
+    size_t hdrlength;       /* length of headers, once known, or 0      */
+};
+
+/* send_push STATE DATA COUNT
+ * Buffer COUNT bytes of DATA for sending to the connection in STATE. Returns
+ * 1 on success or 0 on failure. */
+static int send_push(struct sendstate *S, const char *s, const size_t n) {
+    if (n > S->buflen) {
+        /* Unlikely but must deal with this case. */
+        if (S->bufptr > S->buffer && !connection_send(S->c, S->buffer, S->bufptr - S->buffer))
+            return 0;
+        S->bufptr = S->buffer;
+        if (!connection_send(S->c, s, n))
+            return 0;
+    } else {
+        if ((S->bufptr + n) > (S->buffer + S->buflen)) {
+            if (!connection_send(S->c, S->buffer, S->bufptr - S->buffer))
+                return 0;
+            S->bufptr = S->buffer;
+        }
+        memcpy(S->bufptr, s, n);
+        S->bufptr += n;
+    }
+    S->nwritten += n;
+    return 1;
+}
+
+/* send_chunk STATE DATA COUNT
+ * Send the next COUNT bytes of DATA of the message described by STATE,
+ * converting line endings to `\r\n' and escaping lines which begin `.'.
+ * Returns 1 if more of the message should be sent, 0 if the required number
+ * of lines has been sent, or -1 on failure. */
+static int send_chunk(struct sendstate *S, const char *data, const size_t len) {
+    const char *p, *q, *r;
+
+    for (p = data, r = data + len; p < r; ) {
+        if (S->atlinestart) {
+            if (!S->inbody && *p == '\n') {
+                /* Blank line marking the end of the headers. */
+                if (!send_push(S, "\r\n", 2)) return -1;
+                S->inbody = 1;
+                ++p;
+                S->hdrlength = S->pos + (p - data);
+                continue;
+            } else if (S->inbody) {
+                if (S->n == 0) {
+                    S->pos += p - data;
+                    return 0;
+                } else if (S->n > 0)
+                    --S->n;
+            }
+
+            /* Escape a leading ., if present. */
+            if (*p == '.' && !send_push(S, ".", 1)) return -1;
+            S->atlinestart = 0;
+        }
+
+        /* Send (the rest of) the line itself. */
+        if (!(q = memchr(p, '\n', r - p))) {
+            if (!send_push(S, p, r - p)) return -1;
+            break;
+        }
+
+        if (!send_push(S, p, q - p) || !send_push(S, "\r\n", 2)) return -1;
+        S->atlinestart = 1;
+        p = q + 1;
+    }
+
+    S->pos += len;
+    return 1;
+}
+
+/* send_finish STATE
+ * Terminate any partial line, and the headers if the message has no body,
+ * send the final `.' and flush the buffer. Returns 1 on success or 0 on
+ * failure. */
+static int send_finish(struct sendstate *S) {
+    if (!S->atlinestart && !send_push(S, "\r\n", 2))
+        return 0;
+    if (!S->inbody) {
+        if (!send_push(S, "\r\n", 2))
+            return 0;
+        S->hdrlength = S->pos;
+    }
+    if (!send_push(S, ".\r\n", 3))
+        return 0;
+    if (S->bufptr > S->buffer && !connection_send(S->c, S->buffer, S->bufptr - S->buffer))
+        return 0;
+    return 1;
+}
+
+/* TOP_READ_SIZE
+ * How much of the body of a message we read at a time when sending only part
+ * of it, in response to TOP. */
+#define TOP_READ_SIZE   8192
+
+/*
+ * For whole messages there is a choice of how to get at the data. Mapping a
+ * message and unmapping it afterwards costs a couple of system calls, the
+ * manipulation of the process's address space and a TLB flush, which for a
+ * small message is much more expensive than copying it into a buffer with
+ * pread(2). For a large message the copy dominates, so there we use mmap(2)
+ * and tell the kernel that we'll read the message sequentially. The crossover
+ * depends on the host; the iobench program, built with `make iobench', will
+ * suggest values. (sendfile(2) isn't an option, since every line must be
+ * rewritten with `\r\n' and possibly escaped on the way out, and the same is
+ * true whatever the transport.)
+ */
+
+/* DEFAULT_MESSAGE_MMAP_THRESHOLD
+ * Size above which whole messages are mapped rather than read. */
+#define DEFAULT_MESSAGE_MMAP_THRESHOLD  131072
+
+/* DEFAULT_MESSAGE_READ_SIZE
+ * How much of a message to read at a time when not mapping it. */
+#define DEFAULT_MESSAGE_READ_SIZE       65536
+
+/* get_size_option DIRECTIVE VALUE DEFAULT
+ * Obtain in VALUE, if it is not already known, the positive size given by
+ * DIRECTIVE, or DEFAULT if there is none or it makes no sense. */
+static void get_size_option(const char *directive, int *value, const int def) {
+    int q;
+    if (*value != -1)
+        return;
+    q = config_get_int(directive, value);
+    if (q <= 0 || *value <= 0) {
+        if (q == -1 || (q == 1 && *value <= 0))
+            log_print(LOG_WARNING, _("connection_sendmessage: bad value for %s; using default"), directive);
+        *value = def;
+    }
+}
+
+/* connection_sendmessage CONNECTION FD OFFSET SKIP LENGTH N HEADERLENGTH
+ * Send to the connected peer a +OK response followed by the header and up to N
+ * lines of the body of a message which begins at OFFSET + SKIP in the file
+ * referenced by FD, which is assumed to be a mappable object, and is LENGTH
+ * bytes long, including the SKIP bytes. Lines which begin . are escaped as
+ * required by RFC1939, and each line is terminated with `\r\n'. If N is -1,
+ * the whole message is sent.
+ *
+ * If HEADERLENGTH is not NULL, it points to the length of the message headers
+ * including the blank line which terminates them, or to 0 if that is not yet
+ * known, in which case it is filled in if possible. When only part of the
+ * message is wanted, we read the header and as much of the body as is needed,
+ * rather than the whole message.
  *
  * RFC1939 doesn't define what a server which encounters an error half-way
  * through sending a message should do. In any case it's clear that we mustn't
@@ -461,125 +618,133 @@ int connection_sendline(connection c, const char *s) {
  * response was sent, or the number of bytes written on success.
  *
  * Assumes the message on disk uses only `\n' to indicate EOL. */
-int connection_sendmessage(connection c, int fd, size_t msgoffset, size_t skip, size_t msglength, int n) {
-    char *filemem;
-    char *p, *q, *r;
-    size_t length, offset;
-    ssize_t nwritten = 0;
+int connection_sendmessage(connection c, int fd, size_t msgoffset, size_t skip, size_t msglength, int n, size_t *hdrlength) {
+    struct sendstate S = {0};
+    char *filemem = NULL, *msg;
+    size_t length = 0, offset;
     /* Doing lots of small writes is bad for performance, so buffer here and
      * only write data when we've accumulated a large chunk of data. Use our
      * own buffer here, rather than the connection IO buffer, since we don't
      * want to use as much memory as a single message. */
     static char *buffer;
     static size_t buflen;
-    char *bufptr, *msg = NULL;
+    /* Buffer into which parts of messages are read for TOP. */
+    static char *rdbuf;
+    static size_t rdbuflen;
+    static int mmap_threshold = -1, read_size = -1;
+
+    get_size_option("message-mmap-threshold", &mmap_threshold, DEFAULT_MESSAGE_MMAP_THRESHOLD);
+    get_size_option("message-read-size", &read_size, DEFAULT_MESSAGE_READ_SIZE);
 
     if (!buffer) buffer = xmalloc(buflen = 32768);
-    bufptr = buffer;
-
-#define buffer_push(sa, na) \
-        do { \
-            char *s; \
-            size_t n; \
-            s = sa; \
-            n = na; \
-            /* Unlikely but must deal with this case. */ \
-            if (n > buflen) { \
-                if (bufptr > buffer && !connection_send(c, buffer, bufptr - buffer)) \
-                    goto write_failure; \
-                bufptr = buffer; \
-                if (!connection_send(c, s, n)) \
-                    goto write_failure; \
-            } else { \
-                if ((bufptr + n) > (buffer + buflen)) { \
-                    if (!connection_send(c, buffer, bufptr - buffer)) \
-                        goto write_failure; \
-                    bufptr = buffer; \
-                } \
-                memcpy(bufptr, s, n); \
-                bufptr += n; \
-            } \
-            nwritten += n; \
-        } while (0)
-
-    offset = msgoffset - (msgoffset % PAGESIZE);
-    length = (msgoffset + msglength + PAGESIZE) ;
-    length -= length % PAGESIZE;
-
-    filemem = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, offset);
-    if (filemem == MAP_FAILED) {
-        log_print(LOG_ERR, "connection_sendmessage: mmap: %m");
-        connection_sendresponse(c, 0, _("Cannot send message"));
-        return -1; /* Failure before +OK sent. */
-    }
+    S.c = c;
+    S.buffer = S.bufptr = buffer;
+    S.buflen = buflen;
+    S.atlinestart = 1;
+    S.n = n;
 
     msg = _("+OK Message follows\r\n");
-    buffer_push(msg, strlen(msg));
-
-    /* Find the beginning of the message headers */
-    p = filemem + (msgoffset % PAGESIZE);
-    r = p + msglength;
-    p += skip;
-
-    /* Send the message headers */
-    while (p < r && *p != '\n') {
-        q = memchr(p, '\n', r - p);
-        if (!q) q = r;
-        errno = 0;
-        
-        /* Escape a leading ., if present. */
-        if (*p == '.')
-            buffer_push(".", 1);
-        
-        /* Send line itself. */
-        buffer_push(p, q - p);
-        buffer_push("\r\n", 2);
 
-        p = q + 1;
-    }
+    if (n >= 0 || msglength - skip <= (size_t)mmap_threshold) {
+        /* Read only as much of the message as we need, or the whole of a
+         * small message, using our own buffer. */
+        size_t want, got = 0, chunk;
+
+        msgoffset += skip;
+        msglength -= skip;
+
+        if (n == -1)
+            want = chunk = read_size;
+        else {
+            chunk = TOP_READ_SIZE;
+            if (hdrlength && *hdrlength)
+                want = *hdrlength + (n > 0 ? chunk : 0);
+            else
+                want = chunk;
+        }
 
-    ++p;
+        do {
+            ssize_t r;
+
+            if (want > msglength - got)
+                want = msglength - got;
+            if (rdbuflen < want)
+                rdbuf = xrealloc(rdbuf, rdbuflen = want);
+
+            do
+                r = pread(fd, rdbuf, want, msgoffset + got);
+            while (r == -1 && errno == EINTR);
+
+            if (r <= 0) {
+                if (r == -1)
+                    log_print(LOG_ERR, "connection_sendmessage: read: %m");
+                else
+                    log_print(LOG_ERR, _("connection_sendmessage: message truncated"));
+                if (got == 0) {
+                    connection_sendresponse(c, 0, _("Cannot send message"));
+                    return -1; /* Failure before +OK sent. */
+                } else
+                    goto write_failure;
+            }
 
-    errno = 0;
-    buffer_push("\r\n", 2);
-    
-    /* Now send the message itself */
-    while (p < r && n) {
-        if (n > 0) --n;
+            if (got == 0 && !send_push(&S, msg, strlen(msg)))
+                goto write_failure;
+            
+            got += r;
+
+            switch (send_chunk(&S, rdbuf, r)) {
+                case -1:
+                    goto write_failure;
+                case 0:
+                    got = msglength;    /* sent all we need */
+                    break;
+            }
 
-        q = memchr(p, '\n', r - p);
-        if (!q) q = r;
-        errno = 0;
+            /* Don't read any more if the chunk ended exactly where we are
+             * due to stop. */
+            if (S.inbody && S.atlinestart && S.n == 0)
+                break;
+
+            want = chunk;
+        } while (got < msglength);
+    } else {
+        offset = msgoffset - (msgoffset % PAGESIZE);
+        length = (msgoffset + msglength + PAGESIZE) ;
+        length -= length % PAGESIZE;
+
+        filemem = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, offset);
+        if (filemem == MAP_FAILED) {
+            log_print(LOG_ERR, "connection_sendmessage: mmap: %m");
+            connection_sendresponse(c, 0, _("Cannot send message"));
+            return -1; /* Failure before +OK sent. */
+        }
 
-        /* Escape a leading ., if present. */
-        if (*p == '.')
-            buffer_push(".", 1);
-        
-        /* Send line itself. */
-        buffer_push(p, q - p);
-        buffer_push("\r\n", 2);
+#ifdef MADV_SEQUENTIAL
+        madvise(filemem, length, MADV_SEQUENTIAL);
+#endif
 
-        p = q + 1;
+        if (!send_push(&S, msg, strlen(msg))
+            || send_chunk(&S, filemem + (msgoffset % PAGESIZE) + skip, msglength - skip) == -1)
+            goto write_failure;
     }
 
     /* Finish up. */
-    buffer_push(".\r\n", 3);
-
-    if (bufptr > buffer && !connection_send(c, buffer, bufptr - buffer))
+    if (!send_finish(&S))
         goto write_failure;
-    
-    if (munmap(filemem, length) == -1)
+
+    if (filemem && munmap(filemem, length) == -1)
         log_print(LOG_ERR, "connection_sendmessage: munmap: %m");
     
-    errno = 0;
+    if (hdrlength && S.hdrlength)
+        *hdrlength = S.hdrlength;
 
-    return nwritten + 3;
+    errno = 0;
 
-#undef buffer_push
+    return S.nwritten;
     
 write_failure:
     log_print(LOG_ERR, _("connection_sendmessage: send failure"));
-    munmap(filemem, length);
+    if (filemem) munmap(filemem, length);
     return -2;
 }
 
@@ -76,6 +76,9 @@ typedef struct _connection {
 
     int n_auth_tries, n_errors;
     char *user, *pass;      /* authentication state accumulated */
+    char *apopname;         /* name given with APOP                 */
+    int authpending;        /* waiting for an authentication worker */
+    int authdone;           /* ... which has now replied            */
     authcontext a;
     mailbox m;
 
@@ -202,6 +205,14 @@ enum connection_action { do_nothing, close_connection, fork_and_setuid };
 /* Do a command */
 enum connection_action connection_do(connection c, const pop3command p);
 
+/* Authenticate a client, retrying with an added or removed domain if so
+ * configured. */
+authcontext authenticate_user_pass(const char *user, const char *domain, const char *pass, const char *clienthost, const char *serverhost);
+authcontext authenticate_apop(const char *name, const char *domain, const char *timestamp, const unsigned char *digest, const char *clienthost, const char *serverhost);
+
+/* Act on the result of an authentication attempt. */
+enum connection_action connection_auth_done(connection c);
+
 /* Open the mailspool etc. */
 int connection_start_transaction(connection c);
 
@@ -210,6 +221,6 @@ pop3command pop3command_new(const char *s);
 void        pop3command_delete(pop3command p);
 
 /* Send a message from a file to a peer. */
-int connection_sendmessage(connection c, int fd, size_t msgoffset, size_t skip, size_t msglength, int n);
+int connection_sendmessage(connection c, int fd, size_t msgoffset, size_t skip, size_t msglength, int n, size_t *hdrlength);
 
 #endif /* __CONNECTION_H_ */
@@ -0,0 +1,162 @@
+/*
+ * hashbench.c:
+ * Benchmark to show what each password-hashing scheme costs at login.
+ *
+ * Every USER/PASS login ends in a call to check_password in password.c, which
+ * hashes the password given by the client in the same way as the one stored
+ * for the user. For the deliberately slow crypt(3) schemes that is most of the
+ * work of a login. This program times check_password for each scheme (or for
+ * hashes given on the command line, which may carry a {scheme} prefix) and
+ * reports how many logins per second a single process could verify.
+ *
+ * With auth-workers set, hashing happens in the workers, so a server with
+ * enough processors can verify up to that many times as many logins.
+ *
+ * Copyright (c) 2026 the tpop3d contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#include "configuration.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifdef HAVE_CRYPT_H
+#include <crypt.h>
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/time.h>
+
+#include "password.h"
+#include "util.h"
+
+/* Hashes to try by default. Only the settings (scheme and salt) of the
+ * crypt(3) ones matter, since the time taken doesn't depend on whether the
+ * password matches. */
+static const char *default_hashes[] = {
+    "{plaintext}secret",
+    "{md5}5ebe2294ecd0e0f08eab7690d2a6ee69",
+#ifdef SHA1_PASSWORDS
+    "{sha1}e5e9fa1ba31ecd1ae84f75caaa474f3a663f05f4",
+#endif /* SHA1_PASSWORDS */
+    "{mysql}428567f408994404",
+    "{crypt_md5}$1$saltsalt$",
+    "{crypt}ab",                            /* traditional DES */
+    "{crypt}$1$saltsalt$",                  /* MD5 */
+    "{crypt}$5$saltsalt$",                  /* SHA-256, 5000 rounds */
+    "{crypt}$6$saltsalt$",                  /* SHA-512, 5000 rounds */
+    "{crypt}$6$rounds=50000$saltsalt$",
+    "{crypt}$2b$10$abcdefghijklmnopqrstuu", /* bcrypt, cost 10 */
+    "{crypt}$y$j9T$HjXTzpjlkP6juLAP8of9P.", /* yescrypt */
+    NULL
+};
+
+/* log_print PRIORITY FORMAT ...
+ * Stand-in for the function in logging.c, which needs the configuration file;
+ * check_password uses it to complain about malformed hashes. */
+void log_print(int priority, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "hashbench: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+/* now
+ * Return the time in seconds. */
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+/* supported HASH
+ * Can this system compute HASH at all? */
+static int supported(const char *hash) {
+    const char *h;
+    if (strncmp(hash, "{crypt}", 7) != 0)
+        return 1;
+    /* crypt(3) returns NULL, or a string starting `*', for schemes it does
+     * not know. */
+    h = crypt("password", hash + 7);
+    return h && *h != '*';
+}
+
+/* run_test HASH SECONDS
+ * Verify a password against HASH repeatedly for about SECONDS seconds,
+ * returning the time taken per verification in seconds. */
+static double run_test(const char *hash, double seconds) {
+    double t0, t;
+    unsigned long n = 0, batch = 1, i;
+
+    t0 = now();
+    do {
+        for (i = 0; i < batch; ++i)
+            check_password("hashbench", hash, "password", "{crypt}");
+        n += batch;
+        t = now() - t0;
+        /* Fast schemes shouldn't be timed one call at a time. */
+        if (t < seconds / 100)
+            batch *= 2;
+    } while (t < seconds);
+
+    return t / n;
+}
+
+int main(int argc, char *argv[]) {
+    const char **hashes = default_hashes;
+    double seconds = 1;
+    int i;
+
+    while ((i = getopt(argc, argv, "t:")) != -1) {
+        switch (i) {
+            case 't':
+                if ((seconds = atof(optarg)) > 0)
+                    break;
+                /* fall through */
+            default:
+                fprintf(stderr, "hashbench: usage: hashbench [-t seconds] [hash ...]\n");
+                return 1;
+        }
+    }
+
+    if (optind < argc)
+        hashes = (const char**)argv + optind;
+
+    printf("%-40s %12s %12s\n", "hash", "ms/login", "logins/s");
+    for (; *hashes; ++hashes) {
+        double t;
+        if (!supported(*hashes)) {
+            printf("%-40.40s %12s %12s\n", *hashes, "-", "unsupported");
+            continue;
+        }
+        t = run_test(*hashes, seconds);
+        printf("%-40.40s %12.3f %12.0f\n", *hashes, t * 1000, 1 / t);
+    }
+
+    printf("\nThese figures are for one process; with auth-workers, each worker\n"
+           "can verify this many logins per second given a processor to itself.\n");
+
+    return 0;
+}
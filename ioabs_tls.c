@@ -38,6 +38,7 @@ static const char rcsid[] = "$Id$";
 
 #include "connection.h"
 #include "listener.h"
+#include "tls.h"
 #include "util.h"
 
 /* 
@@ -63,6 +64,13 @@ static void underlying_shutdown(connection c) {
     c->cstate = closed;
 }
 
+/* handshake_done CONNECTION SSL
+ * Log the parameters of the TLS session SSL on CONNECTION once the handshake
+ * has completed. */
+static void handshake_done(connection c, SSL *ssl) {
+    log_print(LOG_DEBUG, _("ioabs_tls: client %s: %s"), c->idstr, tls_describe_session(ssl));
+}
+
 /* ioabs_tls_shutdown CONNECTION
  * Start the TLS shutdown in motion. */
 static int ioabs_tls_shutdown(connection c) {
@@ -304,7 +312,8 @@ static int ioabs_tls_post_select(connection c, struct pollfd *pfds) {
                     underlying_shutdown(c);
                     return 0;
             }
-        }
+        } else
+            handshake_done(c, io->ssl);
     } else if (io->accept_blocked_on_read || io->accept_blocked_on_write) return 0;
     
     /* Next, shutdown processing. */
@@ -364,6 +373,11 @@ static int ioabs_tls_post_select(connection c, struct pollfd *pfds) {
 static void ioabs_tls_destroy(connection c) {
     struct ioabs_tls *io;
     io = (struct ioabs_tls*)c->io;
+    /* If the connection is still up but we have closed our socket, it has
+     * been handed to a child process. SSL_free would remove the session from
+     * the cache, as if it had failed, so mark it as properly shut down. */
+    if (c->s == -1 && c->cstate == running && SSL_is_init_finished(io->ssl))
+        SSL_set_shutdown(io->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
     SSL_free(io->ssl);
     xfree(c->io);
 }
@@ -411,6 +425,8 @@ struct ioabs_tls *ioabs_tls_create(connection c, listener l) {
                 xfree(io);
                 return NULL;
         }
+    else
+        handshake_done(c, io->ssl);
     
     io->und.immediate_write = ioabs_tls_immediate_write;
     io->und.pre_select      = ioabs_tls_pre_select;
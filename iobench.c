@@ -0,0 +1,235 @@
+/*
+ * iobench.c:
+ * Benchmark to choose how tpop3d should read messages it sends to clients.
+ *
+ * tpop3d reads small messages into a buffer with pread(2) and maps large ones
+ * with mmap(2); see connection_sendmessage in connection.c. This program times
+ * both strategies for a range of message sizes, on a file in a directory of
+ * your choosing (ideally on the filesystem where the mail is kept), and
+ * suggests a value for the message-mmap-threshold directive.
+ *
+ * The file is read from the page cache, which is the common case for
+ * messages which have recently been delivered, and the case in which the
+ * fixed costs of mmap(2) matter most.
+ *
+ * Copyright (c) 2026 the tpop3d contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#include "configuration.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+/* FILE_SIZE
+ * Size of the test file; messages are taken from successive offsets in it. */
+#define FILE_SIZE       (32 * 1024 * 1024)
+
+/* BYTES_PER_TEST
+ * Approximate amount of data to send in each test. */
+#define BYTES_PER_TEST  (256 * 1024 * 1024)
+
+/* READ_SIZE, OUTPUT_SIZE
+ * Sizes of the read buffer and the output buffer, as in connection.c. */
+#define READ_SIZE       65536
+#define OUTPUT_SIZE     32768
+
+static char rdbuf[READ_SIZE], outbuf[OUTPUT_SIZE + 2];
+static size_t outlen;
+static unsigned long checksum;
+
+/* emit DATA LENGTH
+ * Do roughly what connection_sendmessage does to a message: split it into
+ * lines and copy them, with `\r\n' line endings, into an output buffer. */
+static void emit(const char *p, size_t len) {
+    const char *q, *r = p + len;
+    while (p < r) {
+        size_t l;
+        if (!(q = memchr(p, '\n', r - p)))
+            q = r;
+        l = q - p;
+        while (l > 0) {
+            size_t n = l;
+            if (outlen + n > OUTPUT_SIZE) n = OUTPUT_SIZE - outlen;
+            memcpy(outbuf + outlen, p, n);
+            outlen += n;
+            p += n;
+            l -= n;
+            if (outlen == OUTPUT_SIZE) {
+                checksum += outbuf[0];
+                outlen = 0;
+            }
+        }
+        memcpy(outbuf + outlen, "\r\n", 2);
+        outlen += 2;
+        if (outlen >= OUTPUT_SIZE) {
+            checksum += outbuf[0];
+            outlen = 0;
+        }
+        p = q + 1;
+    }
+}
+
+/* send_pread FD OFFSET LENGTH
+ * Send a message using pread(2). */
+static int send_pread(int fd, off_t offset, size_t length) {
+    while (length > 0) {
+        ssize_t n;
+        n = pread(fd, rdbuf, length > READ_SIZE ? READ_SIZE : length, offset);
+        if (n <= 0) return -1;
+        emit(rdbuf, n);
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/* send_mmap FD OFFSET LENGTH
+ * Send a message using mmap(2). */
+static int send_mmap(int fd, off_t offset, size_t length) {
+    off_t start;
+    size_t maplen;
+    char *p;
+    long pagesize;
+
+    pagesize = sysconf(_SC_PAGESIZE);
+    start = offset - (offset % pagesize);
+    maplen = length + (offset - start);
+    if (MAP_FAILED == (p = mmap(0, maplen, PROT_READ, MAP_PRIVATE, fd, start)))
+        return -1;
+#ifdef MADV_SEQUENTIAL
+    madvise(p, maplen, MADV_SEQUENTIAL);
+#endif
+    emit(p + (offset - start), length);
+    munmap(p, maplen);
+    return 0;
+}
+
+/* run_test FD SIZE FUNCTION
+ * Send messages of SIZE bytes using FUNCTION, returning the time taken per
+ * megabyte sent, in seconds, or -1 on error. */
+static double run_test(int fd, size_t size, int (*f)(int, off_t, size_t)) {
+    struct timeval tv1, tv2;
+    size_t i, n;
+    off_t offset = 0;
+
+    n = BYTES_PER_TEST / size;
+    if (n < 16) n = 16;
+
+    gettimeofday(&tv1, NULL);
+    for (i = 0; i < n; ++i) {
+        if (f(fd, offset, size) == -1)
+            return -1;
+        /* Messages don't start on page boundaries. */
+        offset += size + 97;
+        if (offset + size > FILE_SIZE)
+            offset = (offset % 4096);
+    }
+    gettimeofday(&tv2, NULL);
+
+    return ((tv2.tv_sec - tv1.tv_sec) + 1e-6 * (tv2.tv_usec - tv1.tv_usec)) * (1024. * 1024.) / ((double)n * size);
+}
+
+/* make_file DIRECTORY
+ * Create and fill a test file in DIRECTORY, returning a file descriptor open
+ * on it, or -1 on error. The file is unlinked immediately. */
+static int make_file(const char *dir) {
+    char *name, line[80];
+    int fd;
+    size_t i;
+
+    name = malloc(strlen(dir) + sizeof "/iobench.XXXXXX");
+    sprintf(name, "%s/iobench.XXXXXX", dir);
+    if ((fd = mkstemp(name)) == -1) {
+        fprintf(stderr, "iobench: %s: %s\n", name, strerror(errno));
+        free(name);
+        return -1;
+    }
+    unlink(name);
+    free(name);
+
+    /* Typical message text: lines of 60-odd characters. */
+    memset(line, 'x', sizeof line);
+    for (i = 0; i < FILE_SIZE; i += 64) {
+        line[61 + (i / 64) % 6] = '\n';
+        if (write(fd, line, 64) != 64) {
+            fprintf(stderr, "iobench: write: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        line[61 + (i / 64) % 6] = 'x';
+    }
+
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size, threshold = 0;
+    int fd;
+
+    if (argc > 2 || (argc == 2 && *argv[1] == '-')) {
+        fprintf(stderr, "iobench: usage: iobench [directory]\n");
+        return 1;
+    }
+
+    if ((fd = make_file(argc == 2 ? argv[1] : ".")) == -1)
+        return 1;
+
+    /* Get the file into the page cache. */
+    run_test(fd, FILE_SIZE / 2, send_pread);
+
+    printf("%10s %12s %12s\n", "size", "pread ms/MB", "mmap ms/MB");
+    for (size = 1024; size <= 16 * 1024 * 1024; size *= 2) {
+        double tr, tm;
+        if ((tr = run_test(fd, size, send_pread)) < 0 || (tm = run_test(fd, size, send_mmap)) < 0) {
+            fprintf(stderr, "iobench: test failed: %s\n", strerror(errno));
+            return 1;
+        }
+        printf("%10lu %12.3f %12.3f\n", (unsigned long)size, tr * 1000, tm * 1000);
+
+        /* The threshold is the largest size below which pread(2) always
+         * wins. */
+        if (tr > tm && !threshold)
+            threshold = size / 2;
+        else if (tr <= tm)
+            threshold = 0;
+    }
+
+    close(fd);
+
+    if (!threshold) {
+        printf("\npread(2) was faster at every size tested; suggest\n");
+        threshold = 16 * 1024 * 1024;
+    } else
+        printf("\nsuggest\n");
+    printf("  message-mmap-threshold: %lu\n", (unsigned long)threshold);
+
+    /* Stop the compiler optimising away the copying. */
+    return checksum == 1;
+}
@@ -25,12 +25,19 @@ static const char rcsid[] = "$Id$";
 #include "configuration.h"
 #endif /* HAVE_CONFIG_H */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 
 #ifdef MASS_HOSTING
 #include <regex.h>
-#endif
+#include <signal.h>
+#include <time.h>
+
+#ifdef HAVE_GETIFADDRS
+#include <ifaddrs.h>
+#endif /* HAVE_GETIFADDRS */
+#endif /* MASS_HOSTING */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,6 +54,7 @@ static const char rcsid[] = "$Id$";
 #include <sys/utsname.h>
 #include <sys/wait.h>
 
+#include "acl.h"
 #include "listener.h"
 
 #ifdef USE_TLS
@@ -54,6 +62,11 @@ static const char rcsid[] = "$Id$";
 #endif
 
 #include "util.h"
+#include "vector.h"
+
+#ifdef MASS_HOSTING
+static void domainmap_delete(struct domainmap *M);
+#endif
 
 /* listener_new:
  * Create a new listener object, listening on the specified address. */
@@ -190,10 +203,12 @@ void listener_delete(listener L) {
     if (!L) return;
     if (L->s != -1) close(L->s); /* Do not shutdown(2). */
     xfree(L->domain);
+    acl_delete(L->acl);
 #ifdef MASS_HOSTING
     if (L->have_re)
         regfree(&L->re);
     xfree(L->regex);
+    domainmap_delete(L->domains);
 #endif
 #ifdef USE_TLS
     if (L->tls.ctx)
@@ -202,48 +217,421 @@ void listener_delete(listener L) {
     xfree(L);
 }
 
+
 #ifdef MASS_HOSTING
-/* listener_obtain_domain:
- * Use the regular expression specified for the listener to obtain a domain
- * name from the address to which the given socket is connected. */
-char *listener_obtain_domain(listener L, int s) {
-    struct sockaddr_in sin;
-    size_t l = sizeof sin;
-    struct hostent *he;
-    regmatch_t match[2];
-    int err;
+/* Obtaining a domain from a listener's regex needs a reverse lookup of the
+ * local address to which the client connected. Rather than do that (and wait
+ * for the DNS) every time a connection is accepted, each such listener keeps a
+ * table mapping local addresses to the domains obtained from them. The tables
+ * are filled in at startup, and refreshed every domain-refresh-interval
+ * seconds by a separate process which does the lookups and sends the results
+ * back down a pipe, so that the main loop never waits for the resolver. */
+struct domainmap {
+    struct domainmap_entry {
+        struct in_addr addr;
+        char *domain;           /* NULL if none could be obtained */
+        int next;               /* next in hash chain, or -1 */
+    } *entries;
+    int nentries, *buckets;
+    unsigned int nbuckets;      /* a power of two */
+};
 
-    if (!L->have_re)
-        return NULL;
+int domain_refresh_interval = 3600;
+
+extern vector listeners;        /* in netloop.c */
+
+/* State of the refresh process, if one is running. */
+static int refresh_fd = -1, refresh_pfd_index = -1;
+static time_t refresh_started, last_refresh;
+static int refresh_wanted;      /* a connection arrived on an unknown address */
+static char *refresh_buf;
+static size_t refresh_len, refresh_alloc;
 
-    if (getsockname(s, (struct sockaddr*)&sin, (int*)&l) == -1) {
-        /* Shouldn't happen. */
-        log_print(LOG_ERR, "listener_obtain_domain: getsockname: %m");
+/* hash_addr ADDRESS
+ * Return a hash of ADDRESS. */
+static unsigned int hash_addr(const struct in_addr addr) {
+    unsigned int u = ntohl(addr.s_addr);
+    u ^= u >> 16;
+    u *= 0x45d9f3b;
+    u ^= u >> 16;
+    return u;
+}
+
+/* domainmap_delete MAP
+ * Free MAP and the domains in it. */
+static void domainmap_delete(struct domainmap *M) {
+    int i;
+    if (!M) return;
+    for (i = 0; i < M->nentries; ++i)
+        xfree(M->entries[i].domain);
+    xfree(M->entries);
+    xfree(M->buckets);
+    xfree(M);
+}
+
+/* domainmap_find MAP ADDRESS
+ * Return the entry for ADDRESS in MAP, or NULL if there is none. */
+static struct domainmap_entry *domainmap_find(const struct domainmap *M, const struct in_addr addr) {
+    int i;
+    if (!M || !M->nbuckets)
         return NULL;
+    for (i = M->buckets[hash_addr(addr) & (M->nbuckets - 1)]; i != -1; i = M->entries[i].next)
+        if (M->entries[i].addr.s_addr == addr.s_addr)
+            return M->entries + i;
+    return NULL;
+}
+
+/* domainmap_insert MAP ADDRESS DOMAIN
+ * Record in MAP that ADDRESS gives DOMAIN, which MAP now owns, replacing any
+ * existing entry. */
+static void domainmap_insert(struct domainmap *M, const struct in_addr addr, char *domain) {
+    struct domainmap_entry *E;
+    unsigned int b;
+
+    if ((E = domainmap_find(M, addr))) {
+        xfree(E->domain);
+        E->domain = domain;
+        return;
     }
 
-    if (!(he = gethostbyaddr((char*)&(sin.sin_addr), sizeof(sin.sin_addr), AF_INET))) {
-        log_print(LOG_WARNING, _("listener_obtain_domain(%s): cannot resolve name"), inet_ntoa(sin.sin_addr));
-        return NULL;
+    /* Keep the table at most full; the entries array has room for as many
+     * entries as there are buckets. */
+    if (M->nentries == M->nbuckets) {
+        int i;
+        M->nbuckets = M->nbuckets ? 2 * M->nbuckets : 16;
+        M->entries = xrealloc(M->entries, M->nbuckets * sizeof *M->entries);
+        M->buckets = xrealloc(M->buckets, M->nbuckets * sizeof *M->buckets);
+        for (b = 0; b < M->nbuckets; ++b)
+            M->buckets[b] = -1;
+        for (i = 0; i < M->nentries; ++i) {
+            b = hash_addr(M->entries[i].addr) & (M->nbuckets - 1);
+            M->entries[i].next = M->buckets[b];
+            M->buckets[b] = i;
+        }
     }
 
+    E = M->entries + M->nentries;
+    E->addr = addr;
+    E->domain = domain;
+    b = hash_addr(addr) & (M->nbuckets - 1);
+    E->next = M->buckets[b];
+    M->buckets[b] = M->nentries++;
+}
+
+/* domain_from_name LISTENER ADDRESS NAME
+ * Use the regular expression specified for LISTENER to obtain a domain from
+ * NAME, the name of local ADDRESS, returning it in allocated storage, or NULL
+ * if it does not match. */
+static char *domain_from_name(listener L, const struct in_addr addr, const char *name) {
+    regmatch_t match[2];
+
     /* OK, we have a name; we need to run the regular expression against it and
      * check that we get one match exactly. */
-    if ((err = regexec(&L->re, he->h_name, 2, match, 0)) == REG_NOMATCH) {
-        log_print(LOG_WARNING, _("listener_obtain_domain: /%s/: %s: no regex match"), L->regex, he->h_name);
+    if (regexec(&L->re, name, 2, match, 0) == REG_NOMATCH) {
+        log_print(LOG_WARNING, _("domain_from_name(%s): /%s/: %s: no regex match"), inet_ntoa(addr), L->regex, name);
         return NULL;
     } else if (match[1].rm_so == -1) {
-        log_print(LOG_WARNING, _("listener_obtain_domain: /%s/: %s: regex failed to match any subexpression"), L->regex, he->h_name);
+        log_print(LOG_WARNING, _("domain_from_name(%s): /%s/: %s: regex failed to match any subexpression"), inet_ntoa(addr), L->regex, name);
         return NULL;
     } else if (match[1].rm_so == match[1].rm_eo) {
-        log_print(LOG_WARNING, _("listener_obtain_domain: /%s/: %s: zero-length subexpression"), L->regex, he->h_name);
+        log_print(LOG_WARNING, _("domain_from_name(%s): /%s/: %s: zero-length subexpression"), inet_ntoa(addr), L->regex, name);
         return NULL;
     } else {
         char *x;
         int l;
         x = xcalloc((l = match[1].rm_eo - match[1].rm_so) + 1, 1);
-        memcpy(x, he->h_name + match[1].rm_so, l);
+        memcpy(x, name + match[1].rm_so, l);
         return x;
     }
 }
-#endif
+
+/* resolve_address FD ADDRESS
+ * Look up the name of ADDRESS and write a line giving the address and the
+ * name, if any, to FD. Exits on error. */
+static void resolve_address(int fd, const struct in_addr addr) {
+    struct hostent *he;
+    char line[1024];
+    
+    if ((he = gethostbyaddr((char*)&addr, sizeof addr, AF_INET)) && strlen(he->h_name) < sizeof line - 32
+        && !he->h_name[strcspn(he->h_name, " \t\r\n")])
+        sprintf(line, "%s %s\n", inet_ntoa(addr), he->h_name);
+    else
+        sprintf(line, "%s\n", inet_ntoa(addr));
+
+    if (!try_write(fd, line, strlen(line)))
+        _exit(1);
+}
+
+/* refresh_main FD
+ * Body of the refresh process. Look up the names of the local addresses of
+ * interest to listeners with regexes, and write them to FD. For a listener
+ * bound to a particular address, that is just its own address; for one bound
+ * to the wildcard address, it is the address of every interface, and any
+ * address on which a connection has arrived. */
+static void refresh_main(int fd) {
+    item *t;
+    int i, j = sysconf(_SC_OPEN_MAX);
+
+    /* This may take a while, and we don't want to hold open any client
+     * connections or the other ends of any workers' pipes meanwhile. */
+    for (i = 3; i < j; ++i)
+        if (i != fd) close(i);
+
+    vector_iterate(listeners, t) {
+        listener L = (listener)t->v;
+        if (!L->have_re)
+            continue;
+        else if (L->sin.sin_addr.s_addr != htonl(INADDR_ANY))
+            resolve_address(fd, L->sin.sin_addr);
+        else {
+#ifdef HAVE_GETIFADDRS
+            struct ifaddrs *ifa, *I;
+            if (getifaddrs(&ifa) == 0) {
+                for (I = ifa; I; I = I->ifa_next)
+                    if (I->ifa_addr && I->ifa_addr->sa_family == AF_INET)
+                        resolve_address(fd, ((struct sockaddr_in*)I->ifa_addr)->sin_addr);
+                freeifaddrs(ifa);
+            }
+#endif /* HAVE_GETIFADDRS */
+            if (L->domains)
+                for (i = 0; i < L->domains->nentries; ++i)
+                    resolve_address(fd, L->domains->entries[i].addr);
+        }
+    }
+
+    _exit(0);
+}
+
+/* start_refresh
+ * Start a process to look up the names of local addresses. Returns 1 on
+ * success or 0 on failure. */
+static int start_refresh(void) {
+    int p[2];
+    sigset_t chmask;
+    pid_t pid;
+
+    if (pipe(p) == -1) {
+        log_print(LOG_ERR, "start_refresh: pipe: %m");
+        return 0;
+    }
+
+    /* The refresh process is the grandchild of this one, so that it is never
+     * mistaken for a session child when it exits; block SIGCHLD so that the
+     * signal handler doesn't reap the intermediate child before we do. */
+    sigemptyset(&chmask);
+    sigaddset(&chmask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chmask, NULL);
+
+    switch (pid = fork()) {
+        case 0:
+            close(p[0]);
+            if (fork() == 0)
+                refresh_main(p[1]);
+            _exit(0);
+
+        case -1:
+            log_print(LOG_ERR, "start_refresh: fork: %m");
+            close(p[0]);
+            close(p[1]);
+            sigprocmask(SIG_UNBLOCK, &chmask, NULL);
+            return 0;
+
+        default:
+            close(p[1]);
+            waitpid(pid, NULL, 0);
+            sigprocmask(SIG_UNBLOCK, &chmask, NULL);
+            refresh_fd = p[0];
+            fcntl(refresh_fd, F_SETFL, O_NONBLOCK);
+            refresh_len = 0;
+            time(&refresh_started);
+            return 1;
+    }
+}
+
+/* finish_refresh
+ * Replace the listeners' maps with ones built from the names which the
+ * refresh process has sent us. */
+static void finish_refresh(void) {
+    struct {
+        struct in_addr addr;
+        char *name;             /* NULL if the lookup failed */
+    } *res;
+    int nres = 0, n = 0, i;
+    char *line, *next;
+    item *t;
+
+    close(refresh_fd);
+    refresh_fd = -1;
+    time(&last_refresh);
+
+    /* Each line is an address, optionally followed by a space and its name. */
+    if (refresh_len == refresh_alloc)
+        refresh_buf = xrealloc(refresh_buf, ++refresh_alloc);
+    refresh_buf[refresh_len] = 0;
+    res = xmalloc((refresh_len / 8 + 1) * sizeof *res);
+    for (line = refresh_buf; *line; line = next) {
+        if ((next = strchr(line, '\n')))
+            *next++ = 0;
+        else
+            next = line + strlen(line);
+        if ((res[nres].name = strchr(line, ' ')))
+            *res[nres].name++ = 0;
+        if (inet_aton(line, &res[nres].addr))
+            ++nres;
+    }
+
+    vector_iterate(listeners, t) {
+        listener L = (listener)t->v;
+        struct domainmap *M;
+        if (!L->have_re)
+            continue;
+        alloc_struct(domainmap, M);
+        for (i = 0; i < nres; ++i) {
+            struct domainmap_entry *E;
+            char *domain = NULL;
+
+            if ((L->sin.sin_addr.s_addr != htonl(INADDR_ANY) && res[i].addr.s_addr != L->sin.sin_addr.s_addr)
+                || domainmap_find(M, res[i].addr))
+                continue;
+
+            if (res[i].name)
+                domain = domain_from_name(L, res[i].addr, res[i].name);
+            else {
+                log_print(LOG_WARNING, _("finish_refresh(%s): cannot resolve name"), inet_ntoa(res[i].addr));
+                /* It may well work next time; meanwhile, carry on using any
+                 * domain we had before. */
+                if ((E = domainmap_find(L->domains, res[i].addr)) && E->domain)
+                    domain = xstrdup(E->domain);
+            }
+
+            domainmap_insert(M, res[i].addr, domain);
+            ++n;
+        }
+        domainmap_delete(L->domains);
+        L->domains = M;
+    }
+
+    xfree(res);
+    log_print(LOG_INFO, _("finish_refresh: %d local addresses mapped to domains"), n);
+}
+
+/* read_refresh
+ * Read whatever the refresh process has sent us, and finish the refresh if
+ * it has sent everything. */
+static void read_refresh(void) {
+    ssize_t r;
+
+    do {
+        if (refresh_alloc - refresh_len < 1024)
+            refresh_buf = xrealloc(refresh_buf, refresh_alloc += 4096);
+        r = read(refresh_fd, refresh_buf + refresh_len, refresh_alloc - refresh_len);
+        if (r > 0)
+            refresh_len += r;
+    } while (r > 0 || (r == -1 && errno == EINTR));
+
+    if (r == 0)
+        finish_refresh();
+    else if (errno != EAGAIN) {
+        log_print(LOG_ERR, "read_refresh: read: %m");
+        close(refresh_fd);
+        refresh_fd = -1;
+        time(&last_refresh);
+    }
+}
+
+/* listener_domains_init
+ * Fill in the domain maps of any listeners with regexes, waiting for the
+ * lookups to finish. */
+void listener_domains_init(void) {
+    struct pollfd pfd;
+    item *t;
+    int any = 0;
+
+    vector_iterate(listeners, t)
+        if (((listener)t->v)->have_re)
+            any = 1;
+    if (!any)
+        return;
+    else if (!start_refresh()) {
+        time(&last_refresh);    /* try again later */
+        return;
+    }
+    
+    pfd.fd = refresh_fd;
+    pfd.events = POLLIN;
+    while (refresh_fd != -1) {
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            break;
+        read_refresh();
+    }
+}
+
+/* listener_domains_pre_select N PFDS
+ * Called before the main poll(2) so that the refresh process can be polled. */
+void listener_domains_pre_select(int *n, struct pollfd *pfds) {
+    refresh_pfd_index = -1;
+    if (refresh_fd != -1) {
+        pfds[*n].fd = refresh_fd;
+        pfds[*n].events = POLLIN;
+        refresh_pfd_index = (*n)++;
+    }
+}
+
+/* listener_domains_post_select PFDS
+ * Called after the main poll(2) to collect the results of any refresh, and to
+ * start a new one when one is due. */
+void listener_domains_post_select(struct pollfd *pfds) {
+    time_t now;
+
+    time(&now);
+    if (refresh_fd != -1) {
+        if (refresh_pfd_index != -1 && (pfds[refresh_pfd_index].revents & (POLLIN | POLLHUP | POLLERR)))
+            read_refresh();
+        /* Give up on a refresh which is still going when the next one is due;
+         * the process will die when it next writes to the pipe. */
+        if (refresh_fd != -1 && now > refresh_started + domain_refresh_interval) {
+            log_print(LOG_WARNING, _("listener_domains_post_select: lookups of local addresses taking too long; abandoning them"));
+            close(refresh_fd);
+            refresh_fd = -1;
+            last_refresh = now;
+        }
+    } else if (last_refresh && (now >= last_refresh + domain_refresh_interval
+                                || (refresh_wanted && now >= last_refresh + 60))) {
+        /* A connection on an unknown address prompts an early refresh, but
+         * not more than once a minute. */
+        refresh_wanted = 0;
+        if (!start_refresh())
+            last_refresh = now;
+    }
+}
+
+/* listener_domains_postfork
+ * Close the pipe from any refresh process in a newly-forked child. */
+void listener_domains_postfork(void) {
+    if (refresh_fd != -1)
+        close(refresh_fd);
+    refresh_fd = -1;
+}
+
+/* listener_obtain_domain LISTENER ADDRESS
+ * Return, in allocated storage, the domain which the regex of LISTENER gives
+ * for local ADDRESS, or NULL if there is none. An address we have not seen
+ * before is looked up by the next refresh; meanwhile it has no domain. */
+char *listener_obtain_domain(listener L, const struct in_addr *addr) {
+    struct domainmap_entry *E;
+
+    if (!L->have_re)
+        return NULL;
+
+    if (!(E = domainmap_find(L->domains, *addr))) {
+        log_print(LOG_WARNING, _("listener_obtain_domain(%s): no domain known for this address yet"), inet_ntoa(*addr));
+        if (!L->domains)
+            alloc_struct(domainmap, L->domains);
+        domainmap_insert(L->domains, *addr, NULL);
+        refresh_wanted = 1;
+        return NULL;
+    }
+
+    return E->domain ? xstrdup(E->domain) : NULL;
+}
+#endif /* MASS_HOSTING */
@@ -26,6 +26,8 @@
 
 #ifdef MASS_HOSTING
 #include <regex.h>
+
+#include "poll.h"
 #endif
 
 #ifdef USE_TLS
@@ -43,6 +45,7 @@ typedef struct _listener {
     int have_re;
     regex_t re;
     char *regex;    /* string form of RE */
+    struct domainmap *domains;  /* local address -> domain; see listener.c */
 #endif
 #ifdef USE_TLS
     struct {
@@ -50,6 +53,7 @@ typedef struct _listener {
         SSL_CTX *ctx;
     } tls;
 #endif
+    struct _acl *acl;   /* access-control list, or NULL to allow everyone */
     int s;
     int s_index;
 } *listener;
@@ -67,7 +71,13 @@ listener listener_new(const struct sockaddr_in *addr, const char *domain
                         );
 
 #ifdef MASS_HOSTING
-char *listener_obtain_domain(listener L, int s);
+extern int domain_refresh_interval;     /* How often to look up local addresses again. */
+
+void listener_domains_init(void);
+void listener_domains_pre_select(int *n, struct pollfd *pfds);
+void listener_domains_post_select(struct pollfd *pfds);
+void listener_domains_postfork(void);
+char *listener_obtain_domain(listener L, const struct in_addr *addr);
 #endif
 
 void listener_delete(listener L);
@@ -28,6 +28,8 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include <sys/time.h>
+
 #include "authswitch.h"
 #include "config.h"
 #include "mailbox.h"
@@ -102,24 +104,316 @@ mailbox mailbox_new(const char *filename, const char *type) {
  * destructors for each type of mailbox. */
 void mailbox_delete(mailbox m) {
     if (!m) return;
-    if (m->index) {
-        struct indexpoint *i;
-        for (i = m->index; i < m->index + m->num; ++i)
-            if (i->filename) xfree(i->filename);     /* should this be in a maildir-specific destructor? */
-        xfree(m->index);
-    }
+    if (m->msglength) xfree(m->msglength);
+    if (m->flags) xfree(m->flags);
+    if (m->hash) xfree(m->hash);
+    if (m->hdrlength) xfree(m->hdrlength);
+    if (m->offset) xfree(m->offset);
+    if (m->length) xfree(m->length);
+    if (m->nameoff) xfree(m->nameoff);
+    if (m->mtime) xfree(m->mtime);
+    if (m->names) xfree(m->names);
     if (m->name) xfree(m->name);
     xfree(m);
 }
 
-/* mailbox_add_indexpoint:
- * Add an indexpoint to a mailbox. */
-void mailbox_add_indexpoint(mailbox m, const struct indexpoint *i) {
+/* mailbox_init_index MAILBOX PARTS
+ * Allocate space for the index of MAILBOX. PARTS is a combination of
+ * MBOX_INDEX_OFFSETS and MBOX_INDEX_NAMES, saying which of the optional parts
+ * of the index the driver will use. */
+void mailbox_init_index(mailbox m, const int parts) {
+    m->size = 32;
+    m->num = 0;
+    m->msglength = xcalloc(m->size, sizeof *m->msglength);
+    m->flags = xcalloc(m->size, sizeof *m->flags);
+    m->hdrlength = xcalloc(m->size, sizeof *m->hdrlength);
+    if (parts & MBOX_INDEX_OFFSETS) {
+        m->offset = xcalloc(m->size, sizeof *m->offset);
+        m->length = xcalloc(m->size, sizeof *m->length);
+    }
+    if (parts & MBOX_INDEX_NAMES) {
+        m->nameoff = xcalloc(m->size, sizeof *m->nameoff);
+        m->mtime = xcalloc(m->size, sizeof *m->mtime);
+        m->names = xmalloc(m->namessize = 1024);
+        m->namesused = 0;
+    }
+}
+
+/* grow_array ARRAY ELEMENTSIZE OLD NEW
+ * Grow the index ARRAY, if it is in use, from OLD to NEW elements. */
+static void *grow_array(void *a, const size_t elsize, const int oldsize, const int newsize) {
+    if (!a) return NULL;
+    a = xrealloc(a, elsize * newsize);
+    memset((char*)a + elsize * oldsize, 0, elsize * (newsize - oldsize));
+    return a;
+}
+
+/* add_name MAILBOX NAME
+ * Copy NAME into the file name arena of MAILBOX, returning its offset. */
+static unsigned int add_name(mailbox m, const char *name) {
+    size_t l, off;
+    l = strlen(name) + 1;
+    if (m->namesused + l > m->namessize) {
+        while (m->namesused + l > m->namessize) m->namessize *= 2;
+        m->names = xrealloc(m->names, m->namessize);
+    }
+    off = m->namesused;
+    memcpy(m->names + off, name, l);
+    m->namesused += l;
+    return (unsigned int)off;
+}
+
+/* mailbox_add_message MAILBOX OFFSET LENGTH MSGLENGTH FILENAME MTIME
+ * Add a message to the index of MAILBOX. OFFSET and LENGTH are the offset of
+ * the message and the length of its `From ' line in a mailspool; FILENAME and
+ * MTIME are the name and modification time of the file containing a message;
+ * those which the driver does not use are ignored. MSGLENGTH is the length of
+ * the message. Returns the number of the new message. */
+int mailbox_add_message(mailbox m, const size_t offset, const size_t length, const size_t msglength, const char *filename, const time_t mtime) {
+    int i;
+    
     if (m->num == m->size) {
-        m->index = xrealloc(m->index, m->size * sizeof(struct indexpoint) * 2);
-        m->size *= 2;
+        int n = m->size * 2;
+        m->msglength = grow_array(m->msglength, sizeof *m->msglength, m->size, n);
+        m->flags     = grow_array(m->flags, sizeof *m->flags, m->size, n);
+        m->hash      = grow_array(m->hash, sizeof *m->hash, m->size, n);
+        m->hdrlength = grow_array(m->hdrlength, sizeof *m->hdrlength, m->size, n);
+        m->offset    = grow_array(m->offset, sizeof *m->offset, m->size, n);
+        m->length    = grow_array(m->length, sizeof *m->length, m->size, n);
+        m->nameoff   = grow_array(m->nameoff, sizeof *m->nameoff, m->size, n);
+        m->mtime     = grow_array(m->mtime, sizeof *m->mtime, m->size, n);
+        m->size = n;
+    }
+
+    i = m->num++;
+    m->msglength[i] = msglength;
+    m->flags[i] = 0;
+    m->hdrlength[i] = 0;
+    if (m->offset) {
+        m->offset[i] = offset;
+        m->length[i] = (unsigned int)length;
+    }
+    if (m->nameoff) {
+        m->nameoff[i] = add_name(m, filename);
+        m->mtime[i] = mtime;
     }
-    m->index[m->num++] = *i;
+
+    return i;
+}
+
+/* mailbox_remove_message MAILBOX I
+ * Remove message I from the index of MAILBOX, renumbering those after it. */
+void mailbox_remove_message(mailbox m, const int i) {
+    int n;
+    if (i < 0 || i >= m->num) return;
+    n = m->num - i - 1;
+#define shift(a)    do { if (a) memmove(a + i, a + i + 1, n * sizeof *a); } while (0)
+    shift(m->msglength);
+    shift(m->flags);
+    shift(m->hash);
+    shift(m->hdrlength);
+    shift(m->offset);
+    shift(m->length);
+    shift(m->nameoff);
+    shift(m->mtime);
+#undef shift
+    --m->num;
+}
+
+/* permute_array ARRAY ELEMENTSIZE PERM NUM
+ * Reorder the NUM elements of ARRAY so that element J is element PERM[J] of
+ * the original. */
+static void permute_array(void *a, const size_t elsize, const int *perm, const int num) {
+    char *tmp;
+    int j;
+    if (!a || !num) return;
+    tmp = xmalloc(elsize * num);
+    for (j = 0; j < num; ++j)
+        memcpy(tmp + j * elsize, (char*)a + perm[j] * elsize, elsize);
+    memcpy(a, tmp, elsize * num);
+    xfree(tmp);
+}
+
+/* mailbox_permute MAILBOX PERM
+ * Reorder the messages in MAILBOX so that message J becomes what was message
+ * PERM[J]. */
+void mailbox_permute(mailbox m, const int *perm) {
+    permute_array(m->msglength, sizeof *m->msglength, perm, m->num);
+    permute_array(m->flags, sizeof *m->flags, perm, m->num);
+    permute_array(m->hash, sizeof *m->hash, perm, m->num);
+    permute_array(m->hdrlength, sizeof *m->hdrlength, perm, m->num);
+    permute_array(m->offset, sizeof *m->offset, perm, m->num);
+    permute_array(m->length, sizeof *m->length, perm, m->num);
+    permute_array(m->nameoff, sizeof *m->nameoff, perm, m->num);
+    permute_array(m->mtime, sizeof *m->mtime, perm, m->num);
+}
+
+/* mailbox_set_filename MAILBOX I FILENAME
+ * Record that message I in MAILBOX is now in the file FILENAME. The space
+ * used by the old name is not reclaimed, but this doesn't happen often. */
+void mailbox_set_filename(mailbox m, const int i, const char *filename) {
+    m->nameoff[i] = add_name(m, filename);
+}
+
+/* mailbox_set_hash MAILBOX I HASH
+ * Record the 16-byte unique ID HASH of message I in MAILBOX. */
+void mailbox_set_hash(mailbox m, const int i, const unsigned char *hash) {
+    if (!m->hash)
+        m->hash = xcalloc(m->size, sizeof *m->hash);
+    memcpy(m->hash[i], hash, sizeof *m->hash);
+    m->flags[i] |= MSG_HASHED;
+}
+
+/* mailbox_message_hash MAILBOX I
+ * Return the 16-byte hash from which the unique ID of message I in MAILBOX is
+ * formed, computing it first if that has not already been done, or NULL on
+ * error. Most sessions never issue UIDL, so drivers don't compute hashes while
+ * indexing the mailbox. */
+const unsigned char *mailbox_message_hash(mailbox m, const int i) {
+    if (!m || i < 0 || i >= m->num) return NULL;
+
+    if (!mailbox_msg_hashed(m, i) && (!m->make_hashes || m->make_hashes(m, i, i + 1) == -1 || !mailbox_msg_hashed(m, i)))
+        return NULL;
+
+    return m->hash[i];
+}
+
+/* mailbox_make_hashes MAILBOX
+ * Compute, in a single batch, the hashes of any messages in MAILBOX for which
+ * they are not yet known. Returns 0 on success or -1 on failure. */
+int mailbox_make_hashes(mailbox m) {
+    int i;
+
+    if (!m) return -1;
+
+    /* Only bother the driver if there is something for it to do. */
+    for (i = 0; i < m->num && mailbox_msg_hashed(m, i); ++i);
+    if (i == m->num)
+        return 0;
+    else if (!m->make_hashes)
+        return -1;
+    else
+        return m->make_hashes(m, i, m->num);
+}
+
+/* DEFAULT_PREFETCH_MESSAGES, DEFAULT_PREFETCH_BYTES
+ * Default limits on how far ahead of a client we read. */
+#define DEFAULT_PREFETCH_MESSAGES   8
+#define DEFAULT_PREFETCH_BYTES      (4 * 1024 * 1024)
+
+/* PREFETCH_HORIZON
+ * We try to have read ahead as much as the client will retrieve in this many
+ * seconds, judged by how fast it has retrieved messages so far. */
+#define PREFETCH_HORIZON            2
+
+/* mailbox_prefetch_retr MAILBOX I
+ * Called before message I of MAILBOX is sent in response to RETR. Most clients
+ * retrieve messages 1, 2, ... n in order; when we see that happening, we ask
+ * the driver to have the kernel start reading the next few messages, so that
+ * the disk or file server can get on with it while this message is sent.
+ *
+ * The number of messages read ahead is doubled, up to retr-prefetch-messages,
+ * each time the client asks for a message we have already read ahead, and
+ * halved when it breaks the sequence. The amount of data read ahead is limited
+ * to what the client, at the speed it has managed so far, will retrieve in
+ * PREFETCH_HORIZON seconds, and by retr-prefetch-bytes. */
+void mailbox_prefetch_retr(mailbox m, const int i) {
+    static int max_messages = -1, max_bytes = -1;
+    struct retrprefetch *P;
+    struct timeval tv;
+    double now, budget;
+    size_t total;
+    int j, start;
+
+    if (!m || !m->prefetch || i < 0 || i >= m->num) return;
+
+    if (max_messages == -1) {
+        int q;
+        q = config_get_int("retr-prefetch-messages", &max_messages);
+        if (q <= 0 || max_messages < 0) {
+            if (q == -1 || (q == 1 && max_messages < 0))
+                log_print(LOG_WARNING, _("mailbox_prefetch_retr: bad value for retr-prefetch-messages; using default"));
+            max_messages = DEFAULT_PREFETCH_MESSAGES;
+        }
+        q = config_get_int("retr-prefetch-bytes", &max_bytes);
+        if (q <= 0 || max_bytes <= 0) {
+            if (q == -1 || (q == 1 && max_bytes <= 0))
+                log_print(LOG_WARNING, _("mailbox_prefetch_retr: bad value for retr-prefetch-bytes; using default"));
+            max_bytes = DEFAULT_PREFETCH_BYTES;
+        }
+    }
+    if (max_messages == 0) return;
+
+    P = &m->prefetch_state;
+    gettimeofday(&tv, NULL);
+    now = tv.tv_sec + 1e-6 * tv.tv_usec;
+
+    if (P->next && i >= P->next && i < P->upto) {
+        /* We read this message ahead. The client may have skipped some,
+         * perhaps because it has them already; those were read needlessly. */
+        ++P->hits;
+        P->wasted += i - P->next;
+        P->window *= 2;
+    } else if (P->next && i == P->next)
+        ++P->misses;
+    else {
+        /* Not part of a sequence; anything we read ahead was wasted. */
+        if (P->upto > P->next) {
+            P->wasted += P->upto - P->next;
+            P->window /= 2;
+        }
+        P->upto = 0;
+        P->next = i + 1;
+        P->when = now;
+        return;
+    }
+
+    /* The client has retrieved the previous message since the last RETR. */
+    if (now > P->when) {
+        double r;
+        r = m->msglength[P->next - 1] / (now - P->when);
+        P->rate = P->rate ? (P->rate + r) / 2 : r;
+    }
+
+    if (P->window < 1) P->window = 1;
+    if (P->window > max_messages) P->window = max_messages;
+
+    P->next = i + 1;
+    P->when = now;
+
+    budget = P->rate * PREFETCH_HORIZON;
+    if (budget > max_bytes) budget = max_bytes;
+
+    /* Always read ahead at least one message. */
+    for (j = i + 1, total = 0; j < m->num && j <= i + P->window; ++j) {
+        if (j > i + 1 && total + m->msglength[j] > budget)
+            break;
+        total += m->msglength[j];
+    }
+
+    start = P->upto > i + 1 ? P->upto : i + 1;
+    if (j > start) {
+        if (m->prefetch(m, start, j) == -1) {
+            /* Not supported here; don't try again. */
+            m->prefetch = NULL;
+            return;
+        }
+        P->upto = j;
+    }
+}
+
+/* mailbox_prefetch_report MAILBOX IDSTR
+ * Log how successful read-ahead was during the session with the client
+ * described by IDSTR. */
+void mailbox_prefetch_report(mailbox m, const char *idstr) {
+    struct retrprefetch *P;
+    if (!m) return;
+    P = &m->prefetch_state;
+    if (P->upto > P->next)
+        P->wasted += P->upto - P->next;
+    if (P->hits || P->misses || P->wasted)
+        log_print(LOG_INFO, _("mailbox_prefetch_report: client %s: RETR prefetch: %d hits, %d misses, %d messages read ahead needlessly"),
+                idstr, P->hits, P->misses, P->wasted);
 }
 
 /* emptymbox_new:
@@ -136,7 +430,6 @@ mailbox emptymbox_new(const char *unused) {
     M->sendmessage = NULL;                     /* should never be called */
 
     M->name = xstrdup(_("[empty mailbox]"));
-    M->index = NULL;
 
     return M;
 }
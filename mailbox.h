@@ -58,15 +58,24 @@
 /* Ugh. Forward references. Should fix. */
 struct _connection;
 
-/* struct indexpoint:
- * Individual messages which appear as files on FS for maildir or sections of
- * a file in a BSD mailspool. */
-struct indexpoint {
-    char    *filename;
-    size_t  offset, length, msglength;  /* Offsets, length for mailspools.  */
-    time_t  mtime;                      /* Modified time used for maildirs. */
-    char    deleted;
-    unsigned char hash[16];
+/* Flags describing individual messages. */
+#define MSG_DELETED     0x01            /* Marked for deletion by client.   */
+#define MSG_HASHED      0x02            /* Unique ID hash has been computed.*/
+
+/* Optional parts of the message index, passed to mailbox_init_index. */
+#define MBOX_INDEX_OFFSETS  0x01        /* Offsets within a mailspool.      */
+#define MBOX_INDEX_NAMES    0x02        /* File names, as for maildirs.     */
+
+/* struct retrprefetch:
+ * State of the read-ahead done for clients which retrieve messages in order;
+ * see mailbox_prefetch_retr. */
+struct retrprefetch {
+    int next;                   /* Message after the last one retrieved.     */
+    int upto;                   /* Messages before upto have been advised.   */
+    int window;                 /* Number of messages to read ahead.         */
+    double rate;                /* Estimated client speed, bytes/second.     */
+    double when;                /* Time of the last RETR.                    */
+    int hits, misses, wasted;   /* Counters reported at end of session.      */
 };
 
 /* mailbox:
@@ -78,18 +87,42 @@ struct _mailbox {
     int fd;                     /* File descriptor for open mailspool.       */
     char isempty;               /* Boolean for mailspool.                    */
     struct stat st;             /* stat(2) buffer for file/directory.        */
-    struct indexpoint *index;   /* Array of message lengths/offsets.         */
     int num, size;              /* Number of messages, and space allocated.  */
     int numdeleted;             /* Number of messages deleted by client.     */
     int totalsize;              /* Sum of message sizes.                     */
     int sizedeleted;            /* Sum of deleted message sizes.             */
 
+    /* The index of messages is stored as parallel arrays, indexed by message
+     * number, rather than as an array of structures, so that it is compact
+     * and so that the loops over the whole mailbox in LIST, STAT and UIDL
+     * touch only the data they need. Arrays a driver doesn't use are NULL. */
+    size_t *msglength;          /* Lengths of messages.                      */
+    unsigned char *flags;       /* MSG_DELETED, MSG_HASHED.                  */
+    unsigned char (*hash)[16];  /* Unique ID hashes; allocated when needed.  */
+    unsigned int *hdrlength;    /* Lengths of headers, or 0 if not known.    */
+    size_t *offset;             /* Offsets of messages in a mailspool.       */
+    unsigned int *length;       /* Lengths of mailspool `From ' lines.       */
+    unsigned int *nameoff;      /* Offsets of file names in names.           */
+    time_t *mtime;              /* Modification times, used while sorting.   */
+    char *names;                /* Arena containing message file names.      */
+    size_t namesused, namessize;
+
+    struct retrprefetch prefetch_state;
+
     /* function pointers for pseudo OO-ness */
     void    (*delete)(mailbox m);
     int     (*sendmessage)(mailbox m, struct _connection* c, const int i, int n);
     int     (*apply_changes)(mailbox m);
+    int     (*make_hashes)(mailbox m, const int first, const int last);
+    int     (*prefetch)(mailbox m, const int first, const int last);
 };
 
+/* Accessors for the message index. */
+#define mailbox_msg_deleted(m, i)   ((m)->flags[(i)] & MSG_DELETED)
+#define mailbox_msg_hashed(m, i)    ((m)->flags[(i)] & MSG_HASHED)
+#define mailbox_msg_filename(m, i)  ((m)->names + (m)->nameoff[(i)])
+#define mailbox_msg_fromlength(m, i) ((m)->length ? (m)->length[(i)] : 0)
+
 /* Return code from a mailbox constructor used to indicate non-presence of the
  * mailbox. */
 #define MBOX_NOENT      ((mailbox)-1)
@@ -107,7 +140,18 @@ void    mailbox_describe(FILE *fp);
 mailbox mailbox_new(const char *filename, const char *type);
 void    mailbox_delete(mailbox m);
 
-void    mailbox_add_indexpoint(mailbox m, const struct indexpoint *i);
+void    mailbox_init_index(mailbox m, const int parts);
+int     mailbox_add_message(mailbox m, const size_t offset, const size_t length, const size_t msglength, const char *filename, const time_t mtime);
+void    mailbox_remove_message(mailbox m, const int i);
+void    mailbox_permute(mailbox m, const int *perm);
+void    mailbox_set_filename(mailbox m, const int i, const char *filename);
+void    mailbox_set_hash(mailbox m, const int i, const unsigned char *hash);
+
+const unsigned char *mailbox_message_hash(mailbox m, const int i);
+int     mailbox_make_hashes(mailbox m);
+
+void    mailbox_prefetch_retr(mailbox m, const int i);
+void    mailbox_prefetch_report(mailbox m, const char *idstr);
 
 /* Empty mailbox implementation. */
 mailbox emptymbox_new(const char *filename);
@@ -120,6 +164,8 @@ void    mailspool_delete(mailbox m);
 int     mailspool_build_index(mailbox m, char *filemem);
 int     mailspool_sendmessage(mailbox m, struct _connection* c, const int i, int n);
 int     mailspool_apply_changes(mailbox m);
+int     mailspool_make_hashes(mailbox m, const int first, const int last);
+int     mailspool_prefetch(mailbox m, const int first, const int last);
 
 /* How long we wait between trying to lock the mailspool */
 #define MAILSPOOL_LOCK_WAIT           2
@@ -134,6 +180,8 @@ mailbox maildir_new(const char *filename);
 void    maildir_delete(mailbox m);
 int     maildir_sendmessage(mailbox m, struct _connection* c, const int i, int n);
 int     maildir_apply_changes(mailbox m);
+int     maildir_make_hashes(mailbox m, const int first, const int last);
+int     maildir_prefetch(mailbox m, const int first, const int last);
 #endif /* MBOX_MAILDIR */
 
 #endif /* __MAILBOX_H_ */
@@ -130,31 +130,55 @@ static void maildir_unlock(const char *dirname) {
 }
 
 
-/* maildir_make_indexpoint:
- * Make an indexpoint to put in a maildir. */
-static void maildir_make_indexpoint(struct indexpoint *m, const char *filename, off_t size, time_t mtime) {
-    memset(m, 0, sizeof(struct indexpoint));
+/* maildir_make_hashes MAILDIR FIRST LAST
+ * Compute the hashes used to form unique IDs for messages FIRST .. LAST - 1 in
+ * MAILDIR. Returns 0 on success or -1 on failure. */
+int maildir_make_hashes(mailbox M, const int first, const int last) {
+    int i;
+
+    for (i = first; i < last; ++i) {
+        const char *filename;
+        unsigned char hash[16];
+
+        if (mailbox_msg_hashed(M, i)) continue;
+        filename = mailbox_msg_filename(M, i);
+        /* In previous versions of tpop3d, the first 16 characters of the file
+         * name of a maildir message were used to form a unique ID.
+         * Unfortunately, this is not a good strategy, especially now that
+         * time_t's are 10 characters long. So now we form an MD5 hash of the
+         * file name; obviously, these unique IDs are not compatible with the
+         * old ones, so optionally you can retain the old scheme by replacing
+         * the following line with
+         *     strncpy(hash, filename+4, sizeof(hash));
+         */
+        md5_digest(filename + 4, strcspn(filename + 4, ":"), hash); /* +4: skip cur/ or new/ subdir; ignore flags at end. */
+        mailbox_set_hash(M, i, hash);
+    }
 
-    m->filename = xstrdup(filename);
-    if (!m->filename) {
-        return;
+    return 0;
+}
+
+/* maildir_prefetch MAILDIR FIRST LAST
+ * Ask the kernel to start reading the files of messages FIRST .. LAST - 1 in
+ * MAILDIR, which we expect the client to retrieve soon. Messages which have
+ * been renamed are skipped; maildir_sendmessage will find them. Returns 0 on
+ * success or -1 if this isn't possible. */
+int maildir_prefetch(mailbox M, const int first, const int last) {
+#ifdef POSIX_FADV_WILLNEED
+    int i;
+
+    for (i = first; i < last; ++i) {
+        int fd;
+        if ((fd = open(mailbox_msg_filename(M, i), O_RDONLY)) == -1)
+            continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
     }
-    m->offset = 0;    /* not used */
-    m->length = 0;    /* "\n\nFrom " delimiter not used */
-    m->deleted = 0;
-    m->msglength = size;
-
-    /* In previous versions of tpop3d, the first 16 characters of the file name
-     * of a maildir message were used to form a unique ID. Unfortunately, this
-     * is not a good strategy, especially now that time_t's are 10 characters
-     * long. So now we form an MD5 hash of the file name; obviously, these
-     * unique IDs are not compatible with the old ones, so optionally you can
-     * retain the old scheme by replacing the following line with
-     *     strncpy(m->hash, filename+4, sizeof(m->hash));
-     */
-    md5_digest(filename + 4, strcspn(filename + 4, ":"), m->hash); /* +4: skip cur/ or new/ subdir; ignore flags at end. */
-    
-    m->mtime = mtime;
+
+    return 0;
+#else
+    return -1;
+#endif /* POSIX_FADV_WILLNEED */
 }
 
 /* maildir_build_index MAILDIR SUBDIR TIME
@@ -204,17 +228,15 @@ int maildir_build_index(mailbox M, const char *subdir, time_t T) {
         }
 
         if (0 == ret) {
-            struct indexpoint pt;
-
             /* XXX Previously, we ignored messages from the future, since
              * that's what qmail-pop3d does. But it's not clear why this is
              * useful, so turn the check into a warning. */
             if (st.st_mtime > T)
                 log_print(LOG_WARNING, _("maildir_build_index: %s: mtime is %d seconds in the future; this condition may indicate that you have a clock synchronisation error, especially if you are using NFS-mounted mail directories"), filename, (int)(st.st_mtime - T));
             
-            /* These get sorted by mtime later. */
-            maildir_make_indexpoint(&pt, filename, st.st_size, st.st_mtime);
-            mailbox_add_indexpoint(M, &pt);
+            /* These get sorted by mtime later. The unique ID hash is
+             * computed only if it is needed; see maildir_make_hashes. */
+            mailbox_add_message(M, 0, 0, st.st_size, filename, st.st_mtime);
 
             /* Accumulate size of messages. */
             M->totalsize += st.st_size;
@@ -322,13 +344,44 @@ static int maildir_recurse(mailbox M, char *current, time_t time, tokens ignoref
 }
 
 
+/* struct sortkey:
+ * Message number and modification time, used in sorting a maildir. */
+struct sortkey {
+    time_t mtime;
+    int i;
+};
+
 /* maildir_sort_callback A B
  * qsort(3) callback for ordering messages in a maildir. */
-int maildir_sort_callback(const void *a, const void *b) {
-    const struct indexpoint *A = a, *B = b;
+static int maildir_sort_callback(const void *a, const void *b) {
+    const struct sortkey *A = a, *B = b;
     return A->mtime - B->mtime;
 }
 
+/* maildir_sort MAILDIR
+ * Sort the messages in MAILDIR into order of modification time. Afterwards
+ * the modification times are not needed, so free them. */
+static void maildir_sort(mailbox M) {
+    struct sortkey *k;
+    int *perm, i;
+
+    k = xmalloc((M->num + 1) * sizeof *k);
+    perm = xmalloc((M->num + 1) * sizeof *perm);
+    for (i = 0; i < M->num; ++i) {
+        k[i].mtime = M->mtime[i];
+        k[i].i = i;
+    }
+    qsort(k, M->num, sizeof *k, maildir_sort_callback);
+    for (i = 0; i < M->num; ++i)
+        perm[i] = k[i].i;
+    mailbox_permute(M, perm);
+    xfree(k);
+    xfree(perm);
+
+    xfree(M->mtime);
+    M->mtime = NULL;
+}
+
 /* maildir_new DIRECTORY
  * Create a mailbox object from the named DIRECTORY. */
 mailbox maildir_new(const char *dirname) {
@@ -342,10 +395,11 @@ mailbox maildir_new(const char *dirname) {
     M->delete = maildir_delete;                 /* generic destructor */
     M->apply_changes = maildir_apply_changes;
     M->sendmessage = maildir_sendmessage;
+    M->make_hashes = maildir_make_hashes;
+    M->prefetch = maildir_prefetch;
 
     /* Allocate space for the index. */
-    M->index = (struct indexpoint*)xcalloc(32, sizeof(struct indexpoint));
-    M->size = 32;
+    mailbox_init_index(M, MBOX_INDEX_NAMES);
     
     if (chdir(dirname) == -1) {
         if (errno == ENOENT) failM = MBOX_NOENT;
@@ -380,7 +434,7 @@ mailbox maildir_new(const char *dirname) {
     }
 
     /* Now sort the messages. */
-    qsort(M->index, M->num, sizeof(struct indexpoint), maildir_sort_callback);
+    maildir_sort(M);
 
     gettimeofday(&tv2, NULL);
     f = (float)(tv2.tv_sec - tv1.tv_sec) + 1e-6 * (float)(tv2.tv_usec - tv1.tv_usec);
@@ -390,12 +444,8 @@ mailbox maildir_new(const char *dirname) {
 
 fail:
     if (M) {
-        if (M->name) {
-            if (locked) maildir_unlock(M->name);
-            xfree(M->name);
-        }
-        if (M->index) xfree(M->index);
-        xfree(M);
+        if (M->name && locked) maildir_unlock(M->name);
+        mailbox_delete(M);
     }
     return failM;
 }
@@ -409,17 +459,19 @@ void maildir_delete(mailbox M) {
     mailbox_delete(M);
 }
 
-/* maildir_open_message_file MESSAGE
- * Return a file descriptor on the file associated with MESSAGE. If it has
- * changed name since then, we try to find the file and update MESSAGE. If we
- * can't find the MESSAGE, return -1. */
-static int open_message_file(struct indexpoint *m) {
+/* maildir_open_message_file MAILDIR MESSAGE
+ * Return a file descriptor on the file associated with MESSAGE in MAILDIR. If
+ * it has changed name since then, we try to find the file and update the
+ * index. If we can't find the MESSAGE, return -1. */
+static int open_message_file(mailbox M, const int i) {
     int fd;
     DIR *d;
     struct dirent *de;
     size_t msgnamelen;
+    const char *filename;
 
-    fd = open(m->filename, O_RDONLY);
+    filename = mailbox_msg_filename(M, i);
+    fd = open(filename, O_RDONLY);
     if (fd != -1)
         return fd;
     
@@ -429,14 +481,14 @@ static int open_message_file(struct indexpoint *m) {
     
     /* Possibility 1: message was in new/, and is now in cur/ with a :2,S
      * suffix. */
-    if (strncmp(m->filename, "new/", 4)) {
+    if (strncmp(filename, "new/", 4)) {
         char *name;
-        name = xmalloc(strlen(m->filename) + sizeof(":2,S"));
-        sprintf(name, "cur/%s:2,S", m->filename + 4);
+        name = xmalloc(strlen(filename) + sizeof(":2,S"));
+        sprintf(name, "cur/%s:2,S", filename + 4);
         if ((fd = open(name, O_RDONLY)) != -1) {
             /* We win! */
-            xfree(m->filename);
-            m->filename = name;
+            mailbox_set_filename(M, i, name);
+            xfree(name);
             return fd;
         } else if (errno != ENOENT) {
             /* Bad news. */
@@ -451,7 +503,7 @@ static int open_message_file(struct indexpoint *m) {
      * shouldn't happen very often. */
 
     /* Figure out the name of the message. */
-    msgnamelen = strcspn(m->filename + 4, ":");
+    msgnamelen = strcspn(filename + 4, ":");
     
     if (!(d = opendir("cur"))) {
         log_print(LOG_ERR, "maildir_open_message_file: cur: %m");
@@ -460,15 +512,15 @@ static int open_message_file(struct indexpoint *m) {
 
     while ((de = readdir(d))) {
         /* Compare base name of this message against the new message. */
-        if (strncmp(de->d_name, m->filename + 4, msgnamelen) == 0
+        if (strncmp(de->d_name, filename + 4, msgnamelen) == 0
             && (de->d_name[msgnamelen] == ':' || de->d_name[msgnamelen] == 0)) {
             char *name;
             name = xmalloc(strlen(de->d_name) + sizeof("cur/"));
             sprintf(name, "cur/%s", de->d_name);
             if ((fd = open(name, O_RDONLY)) != -1) {
                 closedir(d);
-                xfree(m->filename);
-                m->filename = name;
+                mailbox_set_filename(M, i, name);
+                xfree(name);
                 return fd;
             } else {
                 /* Either something's gone wrong or the message has just been
@@ -480,7 +532,9 @@ static int open_message_file(struct indexpoint *m) {
         }
     }
 
-    log_print(LOG_ERR, _("maildir_open_message_file: %s: can't find message"), m->filename);
+    closedir(d);
+
+    log_print(LOG_ERR, _("maildir_open_message_file: %s: can't find message"), filename);
 
     /* Message must have been deleted. */
     return -1;
@@ -496,10 +550,9 @@ static int open_message_file(struct indexpoint *m) {
  * obeyed. It's possible that the message will have moved or been deleted under
  * us, in which case we make some effort to find the new version. */
 int maildir_sendmessage(const mailbox M, connection c, const int i, int n) {
-    struct indexpoint *m;
     struct stat st;
     int fd, status;
-    size_t real_size;
+    size_t real_size, hdrlength;
     
     if (!M || i < 0 || i >= M->num) {
         /* Shouldn't happen. */
@@ -510,9 +563,7 @@ int maildir_sendmessage(const mailbox M, connection c, const int i, int n) {
     if (config_get_bool("maildir-exclusive-lock"))
         maildir_update_lock(M->name);
 
-    m = M->index +i;
-    
-    if ((fd = open_message_file(m)) == -1) {
+    if ((fd = open_message_file(M, i)) == -1) {
         connection_sendresponse(c, 0, _("Can't send that message; it may have been deleted by a concurrent session"));
         log_print(LOG_ERR, "maildir_sendmessage: unable to send message %d", i + 1);
         return -1;
@@ -521,53 +572,267 @@ int maildir_sendmessage(const mailbox M, connection c, const int i, int n) {
     /* fstat is cheap after open. Real size is needed in case when S= size doesn't reflect real file size. */
     if (fstat(fd, &st) != -1) {
         real_size = st.st_size;
-	if (m->msglength != st.st_size)
+	if (M->msglength[i] != st.st_size)
             log_print(LOG_ERR, _("maildir_sendmessage(%s/%s): inconsistency in mail size: index (%d) vs filesystem (%d)"),
-	        M->name, m->filename, (int)m->msglength, (int)st.st_size);
+	        M->name, mailbox_msg_filename(M, i), (int)M->msglength[i], (int)st.st_size);
     } else
-        real_size = m->msglength;
+        real_size = M->msglength[i];
     
-    status = connection_sendmessage(c, fd, 0 /* offset */, 0 /* skip */, real_size, n);
+    /* The length of the headers is found, and recorded for use by any
+     * subsequent TOP command, the first time the message is sent. */
+    hdrlength = M->hdrlength[i];
+    status = connection_sendmessage(c, fd, 0 /* offset */, 0 /* skip */, real_size, n, &hdrlength);
+    M->hdrlength[i] = (unsigned int)hdrlength;
     close(fd);
 
     return status;
 }
 
+/*
+ * Maildir++ quota support. Compliant MDAs maintain a file called maildirsize
+ * in the root of the maildir, whose first line gives the quota definition and
+ * each subsequent line of which gives a change, in bytes and messages, to the
+ * size of the maildir. When we delete messages we append a line with negative
+ * values, rather than removing the file and forcing the next delivery to scan
+ * the whole maildir. When the file grows beyond MAILDIRSIZE_MAX_LENGTH bytes
+ * the specification requires that it be recalculated from scratch.
+ */
+
+/* MAILDIRSIZE_MAX_LENGTH
+ * Size above which maildirsize must be recalculated. */
+#define MAILDIRSIZE_MAX_LENGTH  5120
+
+/* maildirsize_scan_subdir DIRECTORY BYTES COUNT
+ * Add the total size and number of the messages in DIRECTORY, which is a new
+ * or cur subdirectory of a maildir or folder, to BYTES and COUNT. Sizes are
+ * taken from the message file name where available and from stat(2)
+ * otherwise. Returns 0 on success or -1 on failure. */
+static int maildirsize_scan_subdir(const char *dirname, off_t *bytes, int *count) {
+    DIR *dir;
+    struct dirent *d;
+    char *seq;
+    size_t seql;
+
+    if (!(dir = opendir(dirname)))
+        return errno == ENOENT ? 0 : -1;
+
+    if (!(seq = config_get_string("maildir-size-string")))
+        seq = ",S=";
+    seql = strlen(seq);
+
+    while ((d = readdir(dir))) {
+        char *p;
+        off_t len = 0;
+
+        if (d->d_name[0] == '.') continue;
+
+        if ((p = strstr(d->d_name, seq)))
+            len = (off_t)strtoul(p + seql, NULL, 10);
+
+        if (!len) {
+            struct stat st;
+            char *filename;
+            filename = xmalloc(strlen(dirname) + strlen(d->d_name) + 2);
+            sprintf(filename, "%s/%s", dirname, d->d_name);
+            if (stat(filename, &st) == 0)
+                len = st.st_size;
+            else if (errno != ENOENT) {
+                /* ENOENT means a concurrent session has removed it. */
+                log_print(LOG_ERR, "maildirsize_scan_subdir: stat(%s): %m", filename);
+                xfree(filename);
+                closedir(dir);
+                return -1;
+            }
+            xfree(filename);
+            if (!len) continue;
+        }
+
+        *bytes += len;
+        ++*count;
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/* maildirsize_scan DIRECTORY BYTES COUNT
+ * Add the total size and number of the messages in the maildir folder
+ * DIRECTORY to BYTES and COUNT. Returns 0 on success or -1 on failure. */
+static int maildirsize_scan(const char *dirname, off_t *bytes, int *count) {
+    char *sub;
+    int ret;
+
+    sub = xmalloc(strlen(dirname) + sizeof "/new");
+    sprintf(sub, "%s/new", dirname);
+    ret = maildirsize_scan_subdir(sub, bytes, count);
+    if (ret == 0) {
+        sprintf(sub, "%s/cur", dirname);
+        ret = maildirsize_scan_subdir(sub, bytes, count);
+    }
+    xfree(sub);
+
+    return ret;
+}
+
+/* maildirsize_recalculate MAILDIR FD
+ * Recalculate the size of MAILDIR and all of its folders, and atomically
+ * replace its maildirsize file, which is open as FD, with one containing the
+ * same quota definition and a single line giving the current size. Returns 0
+ * on success or -1 on failure. */
+static int maildirsize_recalculate(mailbox M, int fd) {
+    char quota[256], line[64], hostname[256], *tmpname = NULL, *name = NULL;
+    ssize_t n;
+    size_t l;
+    off_t bytes = 0;
+    int count = 0, tmpfd = -1, ret = -1;
+    DIR *dir;
+    struct dirent *d;
+
+    /* The first line is the quota definition, which we must preserve. */
+    if ((n = pread(fd, quota, sizeof(quota) - 1, 0)) <= 0)
+        return -1;
+    quota[n] = 0;
+    if ((l = strcspn(quota, "\n")) == (size_t)n)
+        return -1;  /* no complete quota definition line */
+    quota[l + 1] = 0;
+
+    /* The maildir itself, and then each of its folders. */
+    if (maildirsize_scan(M->name, &bytes, &count) == -1)
+        return -1;
+
+    if (!(dir = opendir(M->name)))
+        return -1;
+    while ((d = readdir(dir))) {
+        struct stat st;
+        char *folder;
+
+        if (d->d_name[0] != '.' || !strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+
+        folder = xmalloc(strlen(M->name) + strlen(d->d_name) + 2);
+        sprintf(folder, "%s/%s", M->name, d->d_name);
+        if (stat(folder, &st) == 0 && S_ISDIR(st.st_mode)
+            && maildirsize_scan(folder, &bytes, &count) == -1) {
+            xfree(folder);
+            closedir(dir);
+            return -1;
+        }
+        xfree(folder);
+    }
+    closedir(dir);
+
+    /* Write the new file into tmp/ and rename it over the old one. */
+    if (gethostname(hostname, sizeof(hostname)) == -1)
+        strcpy(hostname, "localhost");
+    hostname[sizeof(hostname) - 1] = 0;
+    tmpname = xmalloc(strlen(M->name) + strlen(hostname) + 64);
+    sprintf(tmpname, "%s/tmp/%lu.%lu_maildirsize.%s", M->name, (unsigned long)time(NULL), (unsigned long)getpid(), hostname);
+    name = xmalloc(strlen(M->name) + sizeof "/maildirsize");
+    sprintf(name, "%s/maildirsize", M->name);
+
+    if ((tmpfd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+        log_print(LOG_ERR, "maildirsize_recalculate: %s: %m", tmpname);
+        goto fail;
+    }
+
+    sprintf(line, "%lu %d\n", (unsigned long)bytes, count);
+    if (!try_write(tmpfd, quota, strlen(quota))
+        || !try_write(tmpfd, line, strlen(line))
+        || close(tmpfd) == -1) {
+        log_print(LOG_ERR, "maildirsize_recalculate: %s: %m", tmpname);
+        tmpfd = -1;
+        unlink(tmpname);
+        goto fail;
+    }
+    tmpfd = -1;
+
+    if (rename(tmpname, name) == -1) {
+        log_print(LOG_ERR, "maildirsize_recalculate: rename(%s, %s): %m", tmpname, name);
+        unlink(tmpname);
+        goto fail;
+    }
+
+    ret = 0;
+
+fail:
+    if (tmpfd != -1) close(tmpfd);
+    xfree(tmpname);
+    xfree(name);
+    return ret;
+}
+
+/* maildirsize_update MAILDIR BYTES COUNT
+ * Record in the maildirsize file of MAILDIR, if it has one, that BYTES bytes
+ * in COUNT messages have been removed. If anything goes wrong we delete the
+ * file, so that the next delivery by a compliant MDA will recreate it. */
+static void maildirsize_update(mailbox M, off_t bytes, int count) {
+    char *name, line[64];
+    struct stat st;
+    int fd;
+
+    name = xmalloc(strlen(M->name) + sizeof "/maildirsize");
+    sprintf(name, "%s/maildirsize", M->name);
+
+    if ((fd = open(name, O_RDWR | O_APPEND)) == -1) {
+        /* Not a Maildir++ mailbox, or not one with a quota. */
+        if (errno != ENOENT) {
+            log_print(LOG_ERR, "maildirsize_update: %s: %m", name);
+            unlink(name);
+        }
+        xfree(name);
+        return;
+    }
+
+    /* The line must be written in a single write(2) so that it is not
+     * interleaved with those of a concurrent delivery. */
+    sprintf(line, "%ld %d\n", -(long)bytes, -count);
+    if (!try_write(fd, line, strlen(line))) {
+        log_print(LOG_ERR, "maildirsize_update: %s: %m", name);
+        unlink(name);
+    } else if (fstat(fd, &st) == 0 && st.st_size >= MAILDIRSIZE_MAX_LENGTH
+               && maildirsize_recalculate(M, fd) == -1) {
+        log_print(LOG_WARNING, _("maildirsize_update: %s: unable to recalculate quota usage; removing file"), name);
+        unlink(name);
+    }
+
+    close(fd);
+    xfree(name);
+}
+
 /* maildir_apply_changes MAILDIR
  * Apply deletions to a maildir. */
 int maildir_apply_changes(mailbox M) {
-    struct indexpoint *m;
-    int did_deletions = 0;
+    int i;
+    off_t bytesdeleted = 0;
+    int numdeleted = 0;
     if (!M) return 1;
 
-    for (m = M->index; m < M->index + M->num; ++m) {
-        if (m->deleted) {
-            if (unlink(m->filename) == -1)
+    for (i = 0; i < M->num; ++i) {
+        const char *filename;
+        filename = mailbox_msg_filename(M, i);
+        if (mailbox_msg_deleted(M, i)) {
+            if (unlink(filename) == -1)
                 /* Warn but proceed anyway. */
-                log_print(LOG_ERR, "maildir_apply_changes: unlink(%s): %m", m->filename);
-            else
-                did_deletions = 1;
+                log_print(LOG_ERR, "maildir_apply_changes: unlink(%s): %m", filename);
+            else {
+                bytesdeleted += M->msglength[i];
+                ++numdeleted;
+            }
         } else {
             /* Mark message read. */
-            if (strncmp(m->filename, "new/", 4) == 0) {
+            if (strncmp(filename, "new/", 4) == 0) {
                 char *cur;
-                cur = xmalloc(strlen(m->filename) + 5);
-                sprintf(cur, "cur/%s:2,S", m->filename + 4); /* Set seen flag */
-                rename(m->filename, cur);    /* doesn't matter if it can't */
+                cur = xmalloc(strlen(filename) + 5);
+                sprintf(cur, "cur/%s:2,S", filename + 4); /* Set seen flag */
+                rename(filename, cur);    /* doesn't matter if it can't */
                 xfree(cur);
             }
         }
     }
 
-    /* This handles the maildirsize file which appears in Maildir++ mailboxes.
-     * We delete it; a later delivery by a compliant MDA will recreate it. */
-    if (did_deletions) {
-        char *name;
-        name = xmalloc(strlen(M->name) + sizeof "/maildirsize");
-        sprintf(name, "%s/maildirsize", M->name);
-        unlink(name);
-        xfree(name);
-    }
+    /* This handles the maildirsize file which appears in Maildir++ mailboxes. */
+    if (numdeleted)
+        maildirsize_update(M, bytesdeleted, numdeleted);
 
     return 1;
 }
@@ -141,16 +141,19 @@ fail:
     return 0;
 }
 
-/* mailspool_make_indexpoint INDEXPOINT OFFSET LENGTH MESSAGELENGTH HASH
- * Save in INDEXPOINT the OFFSET, header LENGTH, MESSAGELENGTH and 16-byte
- * HASH of a message. */
-void mailspool_make_indexpoint(struct indexpoint *x, const size_t offset, const size_t length, const size_t msglength, const unsigned char *hash) {
-    memset(x, 0, sizeof(struct indexpoint));
-
-    x->offset = offset;
-    x->length = length;
-    x->msglength = msglength;
-    if (hash) memcpy(x->hash, hash, 16);
+/* MAILSPOOL_HASH_LENGTH
+ * We generate "unique" IDs by hashing the first this-many bytes of the data
+ * in each message. */
+#define MAILSPOOL_HASH_LENGTH   512
+
+/* mailspool_hash_message MAILBOX I DATA
+ * Compute the hash of message I in MAILBOX, whose first bytes are at DATA. */
+static void mailspool_hash_message(mailbox M, const int i, const char *data) {
+    unsigned char hash[16];
+    size_t n = MAILSPOOL_HASH_LENGTH;
+    if (n > M->msglength[i]) n = M->msglength[i];
+    md5_digest((void*)data, n, hash);
+    mailbox_set_hash(M, i, hash);
 }
 
 /* mailspool_new_from_file FILENAME
@@ -166,10 +169,11 @@ mailbox mailspool_new_from_file(const char *filename) {
     M->delete = mailspool_delete;
     M->apply_changes = mailspool_apply_changes;
     M->sendmessage = mailspool_sendmessage;
+    M->make_hashes = mailspool_make_hashes;
+    M->prefetch = mailspool_prefetch;
 
     /* Allocate space for the index. */
-    M->index = (struct indexpoint*)xcalloc(32, sizeof(struct indexpoint));
-    M->size = 32;
+    mailbox_init_index(M, MBOX_INDEX_OFFSETS);
     
     if (stat(filename, &(M->st)) == -1) {
         /* If the mailspool doesn't exist, fail silently, since this may be
@@ -222,7 +226,7 @@ mailbox mailspool_new_from_file(const char *filename) {
     
     /* OK, now go through the mailspool and accumulate statistics. */
     for (i = 0, M->totalsize = 0; i < M->num; ++i)
-        M->totalsize += M->index[i].msglength;
+        M->totalsize += M->msglength[i];
     
     return M;
 
@@ -294,8 +298,8 @@ int mailspool_build_index(mailbox M, char *filemem) {
     if (M->num > 0) {
         /* Perhaps we are parsing the tail of the file, after reading a
          * partial index? */
-        struct indexpoint *P = M->index + M->num - 1;
-        p = filemem + P->offset + P->msglength - 2;
+        int last = M->num - 1;
+        p = filemem + M->offset[last] + M->msglength[last] - 2;
         first = M->num;
         log_print(LOG_DEBUG, _("mailspool_build_index(%s): first %d messages indexed from cached metadata"), M->name, first);
     } else
@@ -309,32 +313,42 @@ int mailspool_build_index(mailbox M, char *filemem) {
 
         if (q) {
             size_t o, l;
-            struct indexpoint pt;
+            char *h;
+            int i;
             o = p - filemem;
             l = q - p;
 
-            mailspool_make_indexpoint(&pt, o, l, 0, NULL);
-            mailbox_add_indexpoint(M, &pt);
-
-            p = memstr(q, filelen - (q - filemem), "\n\nFrom ", 7);
+            i = mailbox_add_message(M, o, l, 0, NULL, 0);
+
+            /* Record where the headers end, for the benefit of TOP. The next
+             * message can't begin before that point, so resume the search
+             * for it from there. */
+            if ((h = (char*)memstr((unsigned char*)q, filelen - (q - filemem), (const unsigned char*)"\n\n", 2))) {
+                M->hdrlength[i] = h + 2 - (q + 1);
+                p = (char*)memstr((unsigned char*)h, filelen - (h - filemem), (const unsigned char*)"\n\nFrom ", 7);
+            } else {
+                M->hdrlength[i] = filelen - (q + 1 - filemem);
+                p = NULL;
+            }
         } else break;
     } while (p && p < filemem + filelen);
 
     if (first < M->num) {
-        struct indexpoint *t;
+        int i;
         /* OK, we're done, figure out the lengths */
-        for (t = M->index; t < M->index + M->num - 1; ++t)
-            t->msglength = (t + 1)->offset - t->offset;
-        t->msglength = M->st.st_size - t->offset;
-
-        /* We generate "unique" IDs by hashing the first 512 or so bytes of the
-         * data in each message. Only do this for newly found messages. */
-        for (t = M->index; t < M->index + M->num; ++t) {
-            size_t n = 512;
+        for (i = 0; i < M->num - 1; ++i)
+            M->msglength[i] = M->offset[i + 1] - M->offset[i];
+        M->msglength[i] = M->st.st_size - M->offset[i];
 
-            if (n > t->msglength) n = t->msglength;
-            md5_digest((void*)(filemem + t->offset), n, t->hash);
-        }
+#ifdef MBOX_BSD_SAVE_INDICES
+        /* Hashes are normally computed only when a client asks for unique
+         * IDs, but they are stored in the saved index, so if we're saving
+         * indices compute them now, while the file is mapped. Only do this
+         * for newly found messages. */
+        if (mailspool_save_indices)
+            for (i = first; i < M->num; ++i)
+                mailspool_hash_message(M, i, filemem + M->offset[i]);
+#endif /* MBOX_BSD_SAVE_INDICES */
     }
 
 #ifdef IGNORE_CCLIENT_METADATA
@@ -347,14 +361,12 @@ int mailspool_build_index(mailbox M, char *filemem) {
      *
      * The metadata message is assumed to be the first one in the mailspool. */
     if (M->num >= 1) {
-        struct indexpoint *P = M->index;
-        p = memstr(filemem + P->offset, P->msglength, "\n\n", 2);
+        p = memstr(filemem + M->offset[0], M->msglength[0], "\n\n", 2);
         if (p) {
             const char hdr1[] = "\nX-IMAP: ", hdr2[] = "Subject: DON'T DELETE THIS MESSAGE -- FOLDER INTERNAL DATA\n";
-            if (memstr(filemem + P->offset, p - filemem, hdr1, strlen(hdr1)) && memstr(filemem + P->offset, p - filemem, hdr2, strlen(hdr2))) {
+            if (memstr(filemem + M->offset[0], p - filemem, hdr1, strlen(hdr1)) && memstr(filemem + M->offset[0], p - filemem, hdr2, strlen(hdr2))) {
                 log_print(LOG_DEBUG, "mailspool_build_index(%s): skipping c-client metadata", M->name);
-                memmove((void*)M->index, (void*)(M->index + 1), sizeof(struct indexpoint) * (M->num - 1));
-                --M->num;
+                mailbox_remove_message(M, 0);
             }
         }
     }
@@ -369,7 +381,8 @@ end:
 /* mailspool_sendmessage MAILBOX CONNECTION I NLINES
  * Front-end to connection_sendmessage in util.c. */
 int mailspool_sendmessage(const mailbox M, connection c, const int i, int n) {
-    struct indexpoint *x;
+    size_t hdrlength;
+    int ret;
 
     if (!M || i < 0 || i >= M->num) {
         /* Shouldn't happen. */
@@ -377,11 +390,86 @@ int mailspool_sendmessage(const mailbox M, connection c, const int i, int n) {
         return -1;
     }
 
-    x = M->index + i;
-    
     /* XXX I think that this should send msglength - 1; that is, it's sending
      * the first \n of the `\n\nFrom '. */
-    return connection_sendmessage(c, M->fd, x->offset, x->length + 1, x->msglength, n);
+    hdrlength = M->hdrlength[i];
+    ret = connection_sendmessage(c, M->fd, M->offset[i], M->length[i] + 1, M->msglength[i], n, &hdrlength);
+    M->hdrlength[i] = (unsigned int)hdrlength;
+
+    return ret;
+}
+
+/* mailspool_prefetch MAILBOX FIRST LAST
+ * Ask the kernel to start reading messages FIRST .. LAST - 1 of MAILBOX, which
+ * we expect the client to retrieve soon. Returns 0 on success or -1 if this
+ * isn't possible. */
+int mailspool_prefetch(mailbox M, const int first, const int last) {
+#ifdef POSIX_FADV_WILLNEED
+    off_t start, end;
+    int e;
+
+    if (!M || M->fd == -1 || first < 0 || last > M->num || first >= last) return -1;
+
+    start = M->offset[first];
+    end = M->offset[last - 1] + M->msglength[last - 1];
+    if ((e = posix_fadvise(M->fd, start, end - start, POSIX_FADV_WILLNEED))) {
+        log_print(LOG_WARNING, "mailspool_prefetch(%s): posix_fadvise: %s", M->name, strerror(e));
+        return -1;
+    }
+
+    return 0;
+#else
+    return -1;
+#endif /* POSIX_FADV_WILLNEED */
+}
+
+/* mailspool_make_hashes MAILBOX FIRST LAST
+ * Compute the hashes used to form unique IDs for messages FIRST .. LAST - 1 in
+ * MAILBOX. A single message is read with pread(2); for a batch we map the
+ * relevant part of the file. Returns 0 on success or -1 on failure. */
+int mailspool_make_hashes(mailbox M, const int first, const int last) {
+    int i;
+
+    if (!M || M->fd == -1 || first < 0 || last > M->num || first >= last) return -1;
+
+    if (last - first == 1) {
+        char buf[MAILSPOOL_HASH_LENGTH];
+        size_t n = MAILSPOOL_HASH_LENGTH;
+        ssize_t r;
+
+        if (n > M->msglength[first]) n = M->msglength[first];
+        do
+            r = pread(M->fd, buf, n, M->offset[first]);
+        while (r == -1 && errno == EINTR);
+
+        if (r != n) {
+            if (r == -1)
+                log_print(LOG_ERR, "mailspool_make_hashes(%s): read: %m", M->name);
+            else
+                log_print(LOG_ERR, _("mailspool_make_hashes(%s): short read of message %d"), M->name, first + 1);
+            return -1;
+        }
+        
+        mailspool_hash_message(M, first, buf);
+    } else {
+        char *filemem;
+        size_t start, len;
+
+        start = (M->offset[first] / PAGESIZE) * PAGESIZE;
+        len = M->offset[last - 1] + M->msglength[last - 1] - start;
+        if (MAP_FAILED == (filemem = mmap(0, len, PROT_READ, MAP_PRIVATE, M->fd, start))) {
+            log_print(LOG_ERR, "mailspool_make_hashes(%s): mmap: %m", M->name);
+            return -1;
+        }
+
+        for (i = first; i < last; ++i)
+            if (!mailbox_msg_hashed(M, i))
+                mailspool_hash_message(M, i, filemem + M->offset[i] - start);
+
+        munmap(filemem, len);
+    }
+
+    return 0;
 }
 
 /* mailspool_apply_changes MAILBOX
@@ -434,7 +522,7 @@ int mailspool_sendmessage(const mailbox M, connection c, const int i, int n) {
 int mailspool_apply_changes(mailbox M) {
     char *filemem, *s, *d;
     size_t len;
-    struct indexpoint *I, *J, *K, *End;
+    int I, J, K, End;
 
     if (!M || M->fd == -1) return 1;
 
@@ -444,7 +532,7 @@ int mailspool_apply_changes(mailbox M) {
     else if (M->numdeleted == M->num) {
         /* All messages deleted, so just truncate file at the beginning of the
          * first message. */
-        if (ftruncate(M->fd, M->index->offset) == -1) {
+        if (ftruncate(M->fd, M->offset[0]) == -1) {
             log_print(LOG_ERR, "mailspool_apply_changes(%s): ftruncate: %m", M->name);
             return 0;
         } else return 1;
@@ -459,30 +547,30 @@ int mailspool_apply_changes(mailbox M) {
         return 0;
     }
 
-    I = M->index;
-    End = M->index + M->num;
+    I = 0;
+    End = M->num;
     d = filemem;
 
     /* Find the first message to be deleted. */
-    while (I < End && !I->deleted) ++I;
+    while (I < End && !mailbox_msg_deleted(M, I)) ++I;
     if (I == End) {
         if (munmap(filemem, len) == -1) log_print(LOG_ERR, "mailspool_sendmessage: munmap: %m");
         log_print(LOG_ERR, _("mailspool_apply_changes(%s): inconsistency in mailspool data"), M->name);
         return 0;
     }
-    d = filemem + I->offset;
+    d = filemem + M->offset[I];
     
     do {
         /* Find the first non-deleted message after this block. */
         J = I;
-        while (J < End && J->deleted) ++J;
+        while (J < End && mailbox_msg_deleted(M, J)) ++J;
         if (J == End) break;
         else {
             /* Find the end of this chunk. */
             size_t copylen = 0;
-            s = filemem + J->offset;
+            s = filemem + M->offset[J];
             K = J;
-            while (K < End && !K->deleted) copylen += (K++)->msglength;
+            while (K < End && !mailbox_msg_deleted(M, K)) copylen += M->msglength[K++];
 
             /* Not every machine has a working memmove(3) (allows overlapping
              * memory areas). If yours doesn't, get a better one ;) */
@@ -615,7 +703,7 @@ int mailspool_save_index(mailbox m) {
     int fd = -1;
     FILE *fp = NULL;
     int offset;
-    struct indexpoint *I, *End;
+    int i;
     int a;
     char buf[1024];
 
@@ -659,16 +747,13 @@ int mailspool_save_index(mailbox m) {
      * message sizes rather than their offsets. */
     if (m->numdeleted < m->num) {
         /* There are some remaining messages. */
-        I = m->index;
-        End = m->index + m->num;
-        offset = I->offset;    /* get first message offset to deal with cclient metadata etc. */
-
-        while (I < End) {
-            if (!I->deleted) {
-                fprintf(fp, "%08x %08x %08x %s\n", (unsigned int)offset, (unsigned int)I->length, (unsigned int)I->msglength, hex_digest(I->hash)); /* XXX error return? */
-                offset += I->msglength;
+        offset = m->offset[0];    /* get first message offset to deal with cclient metadata etc. */
+
+        for (i = 0; i < m->num; ++i) {
+            if (!mailbox_msg_deleted(m, i)) {
+                fprintf(fp, "%08x %08x %08x %s\n", (unsigned int)offset, (unsigned int)m->length[i], (unsigned int)m->msglength[i], hex_digest(m->hash[i])); /* XXX error return? */
+                offset += m->msglength[i];
             }
-            ++I;
         }
     }
 
@@ -741,24 +826,22 @@ int mailspool_load_index(mailbox m) {
     }
 
     while (fscanf(fp, "%8x %8x %8x %32[0-9a-f]", &offset, &length, &msglength, hexdigest) == 4) {
-        struct indexpoint x;
-        size_t n = 512;
-        unsigned char realhash[16];
+        size_t n = MAILSPOOL_HASH_LENGTH;
+        unsigned char hash[16], realhash[16];
 
         /* XXX check validity here. */
-        mailspool_make_indexpoint(&x, offset, length, msglength, NULL);
-        unhex_digest(hexdigest, x.hash);
+        unhex_digest(hexdigest, hash);
 
-        if (x.offset + x.msglength > m->st.st_size || memcmp(filemem + x.offset, "From ", 5) != 0)
+        if (offset + msglength > m->st.st_size || memcmp(filemem + offset, "From ", 5) != 0)
             break;
 
-        if (n > x.msglength) n = x.msglength;
+        if (n > msglength) n = msglength;
 
         /* Compute MD5 */
-        md5_digest(filemem + x.offset, n, realhash);
+        md5_digest(filemem + offset, n, realhash);
 
         /* No match; stop. */
-        if (memcmp(realhash, x.hash, 16) != 0) {
+        if (memcmp(realhash, hash, 16) != 0) {
             /* Get rid of any preceding record: we will have to re-index that
              * one, too. */
             if (m->num > 0)
@@ -767,7 +850,7 @@ int mailspool_load_index(mailbox m) {
         }
 
         /* OK, this message seems to have been indexed correctly.... */
-        mailbox_add_indexpoint(m, &x);
+        mailbox_set_hash(m, mailbox_add_message(m, offset, length, msglength, NULL, 0), hash);
     }
 
     if (!feof(fp)) {
@@ -44,12 +44,15 @@ static const char rcsid[] = "$Id$";
 #include <sys/types.h>
 #include <sys/utsname.h>
 
+#include "acl.h"
 #include "authswitch.h"
+#include "authworker.h"
 #include "config.h"
 #include "listener.h"
 #include "pidfile.h"
 #include "signals.h"
 #include "stringmap.h"
+#include "tlsworker.h"
 #include "tokenise.h"
 #include "vector.h"
 #include "util.h"
@@ -360,7 +363,7 @@ extern int mailspool_no_dotfile_locking;    /* in mailspool.c */
 int main(int argc, char **argv, char **envp) {
     int nodaemon = 0;
     char *configfile = CONFIG_DIR"/tpop3d.conf", *s;
-    int na, c;
+    int na, nacl, c;
 #ifdef USE_TLS
     extern int noreadpassphrase; /* in tls.c */
 #endif
@@ -508,6 +511,41 @@ retry_pid_file:
         EXIT_REMOVING_PIDFILE(1);
     }
 
+    /* Compile any access-control rules for the listeners. */
+    switch (nacl = acl_configure(listeners)) {
+        case -1:
+            log_print(LOG_ERR, _("%s: access-control rules do not make sense; exiting"), configfile);
+            EXIT_REMOVING_PIDFILE(1);
+
+        case 0:
+            break;
+
+        default:
+            log_print(LOG_INFO, _("%d access-control rules loaded"), nacl);
+    }
+
+#ifdef MASS_HOSTING
+    /* Find out how often to look up the domains for listeners with regexes,
+     * and look them up for the first time. */
+    switch (config_get_int("domain-refresh-interval", &domain_refresh_interval)) {
+        case -1:
+            log_print(LOG_ERR, _("%s: value given for domain-refresh-interval does not make sense; exiting"), configfile);
+            EXIT_REMOVING_PIDFILE(1);
+
+        case 1:
+            if (domain_refresh_interval < 1) {
+                log_print(LOG_ERR, _("%s: value for domain-refresh-interval must be 1 or greater; exiting"), configfile);
+                EXIT_REMOVING_PIDFILE(1);
+            }
+            break;
+
+        default:
+            domain_refresh_interval = 3600;
+    }
+
+    listener_domains_init();
+#endif /* MASS_HOSTING */
+
     /* Find out the maximum number of children we may spawn at once. */
     switch(config_get_int("max-children", &max_running_children)) {
         case -1:
@@ -561,10 +599,59 @@ retry_pid_file:
             timeout_seconds = 30;
     }
 
+    /* Find out whether the authentication drivers should run in separate
+     * worker processes. */
+    switch (config_get_int("auth-workers", &num_auth_workers)) {
+        case -1:
+            log_print(LOG_ERR, _("%s: value given for auth-workers does not make sense; exiting"), configfile);
+            EXIT_REMOVING_PIDFILE(1);
+
+        case 1:
+            if (num_auth_workers < 0) {
+                log_print(LOG_ERR, _("%s: value for auth-workers must be 0 or greater; exiting"), configfile);
+                EXIT_REMOVING_PIDFILE(1);
+            }
+            break;
+
+        default:
+            num_auth_workers = 0;
+    }
+
+#ifdef USE_TLS
+    /* Find out whether TLS handshakes should be done in worker processes. */
+    switch (config_get_int("tls-workers", &num_tls_workers)) {
+        case -1:
+            log_print(LOG_ERR, _("%s: value given for tls-workers does not make sense; exiting"), configfile);
+            EXIT_REMOVING_PIDFILE(1);
+
+        case 1:
+            if (num_tls_workers < 0) {
+                log_print(LOG_ERR, _("%s: value for tls-workers must be 0 or greater; exiting"), configfile);
+                EXIT_REMOVING_PIDFILE(1);
+            }
+            break;
+
+        default:
+            num_tls_workers = 0;
+    }
+#endif /* USE_TLS */
+
     set_signals();
 
-    /* Start the authentication drivers. */
-    na = authswitch_init();
+#ifdef USE_TLS
+    /* Start the TLS workers before the authentication drivers, so that they
+     * don't inherit whatever the drivers have open. */
+    if (num_tls_workers && !tlsworker_init()) {
+        log_print(LOG_ERR, _("could not start TLS workers; aborting."));
+        EXIT_REMOVING_PIDFILE(1);
+    }
+#endif /* USE_TLS */
+
+    /* Start the authentication drivers, either here or in the workers. */
+    if (num_auth_workers)
+        na = authworker_init();
+    else
+        na = authswitch_init();
     if (!na) {
         log_print(LOG_ERR, _("no authentication drivers were loaded; aborting."));
         log_print(LOG_ERR, _("you may wish to check your config file %s"), configfile);
@@ -574,6 +661,10 @@ retry_pid_file:
     net_loop();
 
     if (!post_fork) {
+#ifdef USE_TLS
+        tlsworker_close();
+#endif /* USE_TLS */
+        authworker_close();
         authswitch_close();
         authcache_close();
     }
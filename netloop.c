@@ -46,6 +46,8 @@ static const char rcsid[] = "$Id$";
 
 #include "poll.h"
 
+#include "acl.h"
+#include "authworker.h"
 #include "config.h"
 #include "connection.h"
 #include "listener.h"
@@ -53,11 +55,23 @@ static const char rcsid[] = "$Id$";
 #include "stringmap.h"
 #include "util.h"
 
+#ifdef USE_TLS
+#include <openssl/ssl.h>
+#include "tls.h"
+#include "tlsworker.h"
+#endif /* USE_TLS */
+
 /* The socket send buffer is set to this, so that we don't end up in a
  * position that we send so much data that the client will not have received
  * all of it before we time them out. */
 #define DEFAULT_TCP_SEND_BUFFER     16384
 
+/* Connections refused by access rules are logged at most once in this many
+ * seconds, so that a scan from a denied network does not flood the log. */
+#define REFUSED_LOG_INTERVAL        60
+
+int tcp_send_buf = -1;                  /* Send buffer size; 0 means leave alone. */
+
 int max_running_children = 16;          /* How many children may exist at once. */
 volatile int num_running_children = 0;  /* How many children are active. */
 
@@ -143,7 +157,6 @@ static void listeners_post_select(struct pollfd *pfds) {
        if (pfds[L->s_index].revents & (POLLIN | POLLHUP)) {
             struct sockaddr_in sin, sinlocal;
             size_t l = sizeof(sin);
-            static int tcp_send_buf = -1;
             int s;
             time_t start;
 
@@ -166,6 +179,21 @@ static void listeners_post_select(struct pollfd *pfds) {
                 if (-1 == getsockname(s, (struct sockaddr*)&sinlocal, (int*)&l)) {
                     log_print(LOG_ERR, "net_loop: getsockname: %m");
                     close(s);
+                } else if (!acl_permits(L->acl, sin.sin_addr)) {
+                    static time_t lastrefused;
+                    static unsigned long nrefused;
+                    if (time(NULL) >= lastrefused + REFUSED_LOG_INTERVAL) {
+                        char remote[16];
+                        strcpy(remote, inet_ntoa(sin.sin_addr));
+                        if (nrefused)
+                            log_print(LOG_WARNING, _("listeners_post_select: connection from %s to local address %s:%d refused by access rules; %lu others refused since last logged"), remote, inet_ntoa(sinlocal.sin_addr), htons(sinlocal.sin_port), nrefused);
+                        else
+                            log_print(LOG_WARNING, _("listeners_post_select: connection from %s to local address %s:%d refused by access rules"), remote, inet_ntoa(sinlocal.sin_addr), htons(sinlocal.sin_port));
+                        time(&lastrefused);
+                        nrefused = 0;
+                    } else
+                        ++nrefused;
+                    close(s);
                 }
 
 #ifdef USE_TCP_WRAPPERS
@@ -280,6 +308,14 @@ static int fork_child(connection c) {
             /* Do any post-fork cleanup defined by authenticators, and drop any
              * cached data. */
             authswitch_postfork();
+            authworker_postfork();
+#ifdef USE_TLS
+            tlsworker_postfork();
+            tls_postfork();
+#endif /* USE_TLS */
+#ifdef MASS_HOSTING
+            listener_domains_postfork();
+#endif /* MASS_HOSTING */
             authcache_close();
 
             /* We never access mailspools as root. */
@@ -359,16 +395,22 @@ static int fork_child(connection c) {
              * into the authentication drivers in case they want to do
              * something with the information for POP-before-SMTP relaying. */
             log_print(LOG_NOTICE, _("fork_child: %s: began session for `%s' with %s; child PID is %d"), c->idstr, c->a->user, c->a->auth, (int)ch);
-            authswitch_onlogin(c->a, c->remote_ip, c->local_ip);
-
-            if (childwait) {
-                close(pp[0]);
-                if (xwrite(pp[1], "\0", 1) == -1)
-                    /* Not much we can do here. Hopefully the child will get
-                     * an error from read. If not it will hang, which is
-                     * very bad news. But that shouldn't happen. */
-                    log_print(LOG_ERR, "fork_child: write: %m");
-                close(pp[1]);
+            if (authworker_onlogin(c->a, c->remote_ip, c->local_ip, childwait ? pp[1] : -1)) {
+                /* The child is released once a worker has run the handlers. */
+                if (childwait)
+                    close(pp[0]);
+            } else {
+                authswitch_onlogin(c->a, c->remote_ip, c->local_ip);
+
+                if (childwait) {
+                    close(pp[0]);
+                    if (xwrite(pp[1], "\0", 1) == -1)
+                        /* Not much we can do here. Hopefully the child will
+                         * get an error from read. If not it will hang, which
+                         * is very bad news. But that shouldn't happen. */
+                        log_print(LOG_ERR, "fork_child: write: %m");
+                    close(pp[1]);
+                }
             }
 
             /* Dispose of our copy of this connection. */
@@ -425,18 +467,25 @@ static void connections_post_select(struct pollfd *pfds) {
         /* Handle all post-select I/O. */
         r = c->io->post_select(c, pfds);
 
-        if (r && !connection_isfrozen(c)) {
+        if ((r || c->authdone) && !connection_isfrozen(c)) {
             /*
              * Handling of POP3 commands, and forking children to handle
              * authenticated connections.
              */
             pop3command p;
-            /* Process as many commands as we can.... */
-            while (c->cstate == running && (p = connection_parsecommand(c))) {
+            /* Process as many commands as we can, starting with the result of
+             * any authentication which an authentication worker has finished.... */
+            while (c->cstate == running) {
                 enum connection_action act;
 
-                act = connection_do(c, p);
-                pop3command_delete(p);
+                if (c->authdone)
+                    act = connection_auth_done(c);
+                else if ((p = connection_parsecommand(c))) {
+                    act = connection_do(c, p);
+                    pop3command_delete(p);
+                } else
+                    break;
+
                 switch (act) {
                     case close_connection:
                         c->do_shutdown = 1;
@@ -459,7 +508,7 @@ static void connections_post_select(struct pollfd *pfds) {
                     default:;
                 }
 
-                if (!c || c->do_shutdown)
+                if (!c || c->do_shutdown || c->authpending)
                     break;
             }
 
@@ -519,6 +568,8 @@ static void connections_post_select(struct pollfd *pfds) {
                         c->m->apply_changes(c->m);
                 }
                 log_print(LOG_INFO, _("connections_post_select: client %s: finished session for `%s' with %s"), c->idstr, c->a->user, c->a->auth);
+                if (c->m)
+                    mailbox_prefetch_report(c->m, c->idstr);
             }
             log_print(LOG_NOTICE, _("connections_post_select: client %s: disconnected; %d/%d bytes read/written"), c->idstr, c->nrd, c->nwr);
 
@@ -552,7 +603,7 @@ void net_loop(void) {
     extern int child_died_signal;
     sigset_t chmask;
     struct pollfd *pfds;
-    int max_listeners;
+    int max_listeners, max_pfds;
     item *t;
     
     sigemptyset(&chmask);
@@ -567,7 +618,9 @@ void net_loop(void) {
     vector_iterate(listeners, t)
 	    max_listeners++;
 
-    pfds = xmalloc((max_listeners + max_connections) * sizeof *pfds);
+    /* One more for the pipe from the process which looks up local addresses. */
+    max_pfds = max_listeners + max_connections + num_auth_workers + 1;
+    pfds = xmalloc(max_pfds * sizeof *pfds);
 
     log_print(LOG_INFO, _("net_loop: tpop3d version %s successfully started"), TPOP3D_VERSION);
     
@@ -576,12 +629,18 @@ void net_loop(void) {
         int n = 0; /* number of pfds elements in use */
         int e, i;
 
-        for (i = 0; i < (max_listeners + max_connections); ++i) {
+        for (i = 0; i < max_pfds; ++i) {
             pfds[i].fd = -1;
             pfds[i].events = pfds[i].revents = 0;
         }
 
-        if (!post_fork) listeners_pre_select(&n, pfds);
+        if (!post_fork) {
+            listeners_pre_select(&n, pfds);
+            authworker_pre_select(&n, pfds);
+#ifdef MASS_HOSTING
+            listener_domains_pre_select(&n, pfds);
+#endif /* MASS_HOSTING */
+        }
 
         connections_pre_select(&n, pfds);
 
@@ -589,13 +648,36 @@ void net_loop(void) {
         if (e == -1 && errno != EINTR) {
             log_print(LOG_WARNING, "net_loop: poll: %m");
         } else if (e >= 0) {
-            /* Check for new incoming connections */
-            if (!post_fork) listeners_post_select(pfds);
+            /* Check for new incoming connections, and replies from
+             * authentication workers. */
+            if (!post_fork) {
+                listeners_post_select(pfds);
+                authworker_post_select(pfds);
+#ifdef USE_TLS
+                tlsworker_post_select();
+#endif /* USE_TLS */
+#ifdef MASS_HOSTING
+                listener_domains_post_select(pfds);
+#endif /* MASS_HOSTING */
+            }
 
             /* Monitor existing connections */
             connections_post_select(pfds);
         }
 
+        /* Discard old entries from the authentication cache. */
+        if (!post_fork) authcache_expire();
+
+#ifdef USE_TLS
+        /* Make a new session ticket key when it is time, and give it to the
+         * TLS workers. */
+        if (!post_fork) {
+            if (tls_rotate_ticket_keys())
+                tlsworker_send_ticket_key();
+            tls_report_stats();
+        }
+#endif /* USE_TLS */
+
         sigprocmask(SIG_BLOCK, &chmask, NULL);
         
 #ifdef AUTH_OTHER
@@ -84,15 +84,17 @@ static void to64(char *s, unsigned long v, int n)
     }
 }
 
-/* crypt_md5 PASSWORD SALT
- * Poul-Henning Kamp's crypt(3)-alike using MD5. */
-static char *crypt_md5(const char *pw, const char *salt)
+/* crypt_md5 PASSWORD SALT BUFFER
+ * Poul-Henning Kamp's crypt(3)-alike using MD5. The result is written into
+ * BUFFER, which must be at least CRYPT_MD5_LEN bytes long, and returned. */
+#define CRYPT_MD5_LEN   120
+static char *crypt_md5(const char *pw, const char *salt, char *passwd)
 {
     const char *magic = "$1$";
     /* This string is magic for this algorithm.  Having
      * it this way, we can get get better later on */
-    static char passwd[120], *p;
-    static const char *sp,*ep;
+    char *p;
+    const char *sp,*ep;
     unsigned char   final[16];
     int sl,pl,i,j;
     md5_ctx ctx,ctx1;
@@ -192,6 +194,32 @@ static char *crypt_md5(const char *pw, const char *salt)
 
 /* MD5 crypt(3) routines end. */
 
+/* hash_matches HASH KNOWN
+ * Does the newly-computed HASH, which may be NULL if hashing failed, match the
+ * KNOWN hash? */
+static int hash_matches(const char *hash, const char *known) {
+    return hash && strcmp(hash, known) == 0;
+}
+
+/* crypt_system_matches PASSWORD KNOWN
+ * Does PASSWORD, hashed by the system crypt(3) function with the salt taken
+ * from the KNOWN hash, match it? Uses crypt_r where it is available, with
+ * state private to this call. A locked hash such as `!' or `*' never
+ * matches, even where crypt returns NULL for it. */
+static int crypt_system_matches(const char *pass, const char *known) {
+#ifdef HAVE_CRYPT_R
+    /* This is large, so don't put it on the stack; it must start zeroed. */
+    struct crypt_data *cd;
+    int r;
+    cd = xcalloc(1, sizeof *cd);
+    r = hash_matches(crypt_r(pass, known, cd), known);
+    xfree(cd);
+    return r;
+#else
+    return hash_matches(crypt(pass, known), known);
+#endif /* HAVE_CRYPT_R */
+}
+
 
 /* 
  * MySQL PASSWORD() routines. This is here so that you can use the MySQL
@@ -262,11 +290,15 @@ int check_password(const char *who, const char *pwhash, const char *pass, const
          || (*hash != '{' && strcmp(scheme, def) == 0))
     
     if (IS_SCHEME(pwhash, "{crypt}", default_crypt_scheme)) {
-        /* Password hashed by system crypt function. */
-        return strcmp(crypt(pass, realhash), realhash) == 0;
+        /* Password hashed by system crypt function. Modern systems
+         * understand $1$ (MD5), $5$ and $6$ (SHA-2) and perhaps $2b$
+         * (bcrypt) hashes as well as traditional DES ones; some of these are
+         * deliberately slow, so see hashbench.c. */
+        return crypt_system_matches(pass, realhash);
     } else if (IS_SCHEME(pwhash, "{crypt_md5}", default_crypt_scheme)) {
         /* Password hashed by crypt_md5. */
-        return strcmp(crypt_md5(pass, realhash), realhash) == 0;
+        char buf[CRYPT_MD5_LEN];
+        return hash_matches(crypt_md5(pass, realhash, buf), realhash);
     } else if (IS_SCHEME(pwhash, "{plaintext}", default_crypt_scheme)) {
         /* Plain text password, as used for APOP. */
         return strcmp(pass, realhash) == 0;
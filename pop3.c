@@ -38,7 +38,9 @@ static const char rcsid[] = "$Id$";
 #include <ctype.h>
 
 #include "authswitch.h"
+#include "authworker.h"
 #include "connection.h"
+#include "tlsworker.h"
 #include "util.h"
 #include "config.h"
 
@@ -125,6 +127,145 @@ static int do_pass(connection c, const pop3command p) {
     }
 }
 
+/* authenticate_user_pass USER DOMAIN PASS CLIENTHOST SERVERHOST
+ * Attempt to authenticate USER with PASS, retrying with an added or removed
+ * domain name if so configured. Returns an authentication context on success
+ * or NULL on failure. */
+authcontext authenticate_user_pass(const char *user, const char *domain, const char *pass, const char *clienthost, const char *serverhost) {
+    authcontext a;
+
+    a = authcontext_new_user_pass(user, NULL, domain, pass, clienthost, serverhost);
+            
+    /* Maybe retry authentication with an added or removed domain name. */
+    if (!a && (append_domain || strip_domain)) {
+        int n, len;
+        char *domsep;
+        len = strlen(user);
+        if (!(domsep = config_get_string("domain-separators")))
+            domsep = DOMAIN_SEPARATORS;
+        n = strcspn(user, domsep);
+        if (append_domain && domain && n == len)
+            /* OK, if we have a domain name, try appending that. */
+            a = authcontext_new_user_pass(user, user, domain, pass, clienthost, serverhost);
+        else if (strip_domain && n != len) {
+            /* Try stripping off the supplied domain name. */
+            char *u;
+            u = xstrdup(user);
+            u[n] = 0;
+            a = authcontext_new_user_pass(u, NULL, NULL, pass, clienthost, serverhost);
+            xfree(u);
+        }
+    }
+
+    return a;
+}
+
+/* authenticate_apop NAME DOMAIN TIMESTAMP DIGEST CLIENTHOST SERVERHOST
+ * Attempt to authenticate NAME with an APOP DIGEST of TIMESTAMP, retrying as
+ * above. */
+authcontext authenticate_apop(const char *name, const char *domain, const char *timestamp, const unsigned char *digest, const char *clienthost, const char *serverhost) {
+    authcontext a;
+
+    a = authcontext_new_apop(name, NULL, domain, timestamp, digest, clienthost, serverhost);
+
+    /* Maybe retry authentication with an added or removed domain name. */
+    if (!a && (strip_domain || append_domain)) {
+        int n, len;
+        char *domsep;
+        len = strlen(name);
+        if (!(domsep = config_get_string("domain-separators")))
+            domsep = DOMAIN_SEPARATORS;
+        n = strcspn(name, domsep);
+        if (append_domain && domain && n == len)
+            /* OK, if we have a domain name, try appending that. */
+            a = authcontext_new_apop(name, name, domain, timestamp, digest, clienthost, serverhost);
+        else if (strip_domain && n != len) {
+            /* Try stripping off the supplied domain name. */
+            char *u;
+            u = xstrdup(name);
+            u[n] = 0;
+            a = authcontext_new_apop(u, NULL, NULL, timestamp, digest, clienthost, serverhost);
+            xfree(u);
+        }
+    }
+
+    return a;
+}
+
+/* connection_auth_done CONNECTION
+ * Act on the result, in c->a, of an APOP or USER/PASS authentication attempt
+ * by CONNECTION. This is called either directly from connection_do, or from
+ * the main loop once an authentication worker has replied. Returns a code
+ * indicating what the caller should do. */
+enum connection_action connection_auth_done(connection c) {
+    enum connection_action act;
+    const char *name;
+
+    c->authdone = 0;
+    name = c->apopname ? c->apopname : c->user;
+
+    if (c->a && c->do_shutdown) {
+        /* Client was timed out while we were waiting. */
+        authcontext_delete(c->a);
+        c->a = NULL;
+        act = close_connection;
+    } else if (c->a) {
+        /* Now save a new ID string for this client. */
+        xfree(c->idstr);
+        c->idstr =xmalloc(strlen(c->a->user) + 2 + strlen(inet_ntoa(c->sin.sin_addr)) + 16);
+        sprintf(c->idstr, "[%d]%s(%s)", c->s, c->a->user, inet_ntoa(c->sin.sin_addr));
+
+        if (c->pass)
+            memset(c->pass, 0, strlen(c->pass));
+        c->state = transaction;
+        act = fork_and_setuid; /* Code in main.c sends response in case of error. */
+    } else {
+        /*
+         * It is useful for ISPs to be able to log failing passwords
+         * sent by misconfigured clients. This is an invasion of
+         * privacy, but there we go.
+         */
+        if (!c->apopname) {
+            if (log_bad_pass)
+                log_print(LOG_INFO, _("connection_do: client `%s': username `%s': failing password is `%s'"), c->idstr, c->user, c->pass);
+            ++c->n_auth_tries;  /* APOP counts tries as they are made */
+        }
+                    
+        connection_freeze(c);
+        if (c->n_auth_tries == MAX_AUTH_TRIES) {
+#ifndef NO_SNIDE_COMMENTS
+            connection_sendresponse(c, 0, _("This is ridiculous. I give up."));
+#else
+            connection_sendresponse(c, 0, _("Too many authentication attempts."));
+#endif
+            log_print(LOG_ERR, _("connection_do: client `%s': username `%s': failed to log in after %d attempts"), c->idstr, name, MAX_AUTH_TRIES);
+            act = close_connection;
+        } else {
+#ifndef NO_SNIDE_COMMENTS
+            connection_sendresponse(c, 0, _("Lies! Try again!"));
+#else
+            connection_sendresponse(c, 0, _("Authentication failed."));
+#endif
+            log_print(LOG_ERR, _("connection_do: client `%s': username `%s': %d authentication failures"), c->idstr, name, c->n_auth_tries);
+            act = do_nothing;
+        }
+
+        if (!c->apopname) {
+            memset(c->pass, 0, strlen(c->pass));
+            xfree(c->pass);
+            c->pass = NULL;
+
+            xfree(c->user);
+            c->user = NULL;
+        }
+    }
+
+    xfree(c->apopname);
+    c->apopname = NULL;
+
+    return act;
+}
+
 /* do_apop CONNECTION COMMAND
  * APOP command; supply MD5 authentication data. */
 static enum connection_action do_apop(connection c, const pop3command p) {
@@ -174,59 +315,13 @@ static enum connection_action do_apop(connection c, const pop3command p) {
         return do_nothing;
     }
 
-    c->a = authcontext_new_apop(name, NULL, c->domain, c->timestamp, digest, c->remote_ip, c->local_ip);
-
-    /* Maybe retry authentication with an added or removed domain name. */
-    if (!c->a && (strip_domain || append_domain)) {
-        int n, len;
-        char *domsep;
-        len = strlen(name);
-        if (!(domsep = config_get_string("domain-separators")))
-            domsep = DOMAIN_SEPARATORS;
-        n = strcspn(name, domsep);
-        if (append_domain && c->domain && n == len)
-            /* OK, if we have a domain name, try appending that. */
-            c->a = authcontext_new_apop(name, name, c->domain, c->timestamp, digest, c->remote_ip, c->local_ip);
-        else if (strip_domain && n != len) {
-            /* Try stripping off the supplied domain name. */
-            char *u;
-            u = xstrdup(name);
-            u[n] = 0;
-            c->a = authcontext_new_apop(u, NULL, NULL, c->timestamp, digest, c->remote_ip, c->local_ip);
-            xfree(u);
-        }
-    }
-
-    if (c->a) {
-        /* Now save a new ID string for this client. */
-        xfree(c->idstr);
-        c->idstr =xmalloc(strlen(c->a->user) + 2 + strlen(inet_ntoa(c->sin.sin_addr)) + 16);
-        sprintf(c->idstr, "[%d]%s(%s)", c->s, c->a->user, inet_ntoa(c->sin.sin_addr));
-
-        c->state = transaction;
-        return fork_and_setuid;
-    } else {
-        /* Authentication failed. */
-        connection_freeze(c);
-        if (c->n_auth_tries == MAX_AUTH_TRIES) {
-#ifndef NO_SNIDE_COMMENTS
-            connection_sendresponse(c, 0, _("This is ridiculous. I give up."));
-#else
-            connection_sendresponse(c, 0, _("Too many authentication attempts."));
-#endif
+    xfree(c->apopname);
+    c->apopname = xstrdup(name);
+    if (authworker_apop(c, digest))
+        return do_nothing;  /* connection_auth_done is called on the reply */
 
-            log_print(LOG_ERR, _("connection_do: client `%s': username `%s': failed to log in after %d attempts"), c->idstr, name, MAX_AUTH_TRIES);
-            return close_connection;
-        } else {
-#ifndef NO_SNIDE_COMMENTS
-            connection_sendresponse(c, 0, _("Lies! Try again!"));
-#else
-            connection_sendresponse(c, 0, _("Authentication failed."));
-#endif
-            log_print(LOG_ERR, _("connection_do: client `%s': username `%s': %d authentication failures"), c->idstr, name, c->n_auth_tries);
-            return do_nothing;
-        }
-    }
+    c->a = authenticate_apop(name, c->domain, c->timestamp, digest, c->remote_ip, c->local_ip);
+    return connection_auth_done(c);
 }
 
 /* do_list CONNECTION MSGNUM
@@ -234,24 +329,21 @@ static enum connection_action do_apop(connection c, const pop3command p) {
 void do_list(connection c, const int msg_num) {
     /* Gives exact sizes taking account of the "From " lines. */
     if (msg_num != -1) {
-        struct indexpoint *curmsg;
-        curmsg = c->m->index + msg_num;
-        if (curmsg->deleted)
+        if (mailbox_msg_deleted(c->m, msg_num))
             connection_sendresponse(c, 0, _("That message is no more."));
         else {
             char response[32] = {0};
-            snprintf(response, 31, "%d %d", 1 + msg_num, (int)(curmsg->msglength - curmsg->length - 1));
+            snprintf(response, 31, "%d %d", 1 + msg_num, (int)(c->m->msglength[msg_num] - mailbox_msg_fromlength(c->m, msg_num) - 1));
             connection_sendresponse(c, 1, response);
         }
     } else {
-        struct indexpoint *m;
-        int nn = 0;
+        int i, nn = 0;
         if (!(connection_sendresponse(c, 1, _("Scan list follows:"))))
             return;
-        for (m = c->m->index; m < c->m->index + c->m->num; ++m) {
-            if (!m->deleted) {
+        for (i = 0; i < c->m->num; ++i) {
+            if (!mailbox_msg_deleted(c->m, i)) {
                 char response[32] = {0};
-                snprintf(response, 31, "%d %d", 1 + m - c->m->index, (int)(m->msglength - m->length - 1));
+                snprintf(response, 31, "%d %d", 1 + i, (int)(c->m->msglength[i] - mailbox_msg_fromlength(c->m, i) - 1));
                 if (!(connection_sendline(c, response)))
                     return;
                 ++nn;
@@ -269,9 +361,7 @@ void do_list(connection c, const int msg_num) {
  * UIDL command: MSGNUM is the argument or -1 if none was specified. */
 static void do_uidl(connection c, const int msg_num) {
     if (msg_num != -1) {
-        struct indexpoint *curmsg;
-        curmsg = c->m->index + msg_num;
-        if (curmsg->deleted)
+        if (mailbox_msg_deleted(c->m, msg_num))
             connection_sendresponse(c, 0, _("That message is no more."));
         else {
             char *idstyle;
@@ -299,7 +389,7 @@ static void do_uidl(connection c, const int msg_num) {
                  * Then we omit the suffixes by zero-terminating the string at the
                  * first ':' we find, if any. (That's what qmail-pop3d does too.)
                  */
-                snprintf(response, 127, "%d %s", 1 + msg_num, 1 + strrchr(curmsg->filename, '/'));
+                snprintf(response, 127, "%d %s", 1 + msg_num, 1 + strrchr(mailbox_msg_filename(c->m, msg_num), '/'));
                 response[strcspn(response, ":")] = '\0';
 
             /*
@@ -308,24 +398,26 @@ static void do_uidl(connection c, const int msg_num) {
 
             /* "tpop3d" and fallback for unknown uidl formats */
             } else {
+                const unsigned char *hash;
+
                 if(strcmp(idstyle, "tpop3d") != 0)
                     log_print(LOG_WARNING, _("do_uidl: '%s' UIDLs not implemented, or not supported with '%s' mailbox, using fallback."), idstyle, c->a->mboxdrv);
 
                 /* It isn't guaranteed that these IDs are unique; it is likely, though.
-                 * See RFC1939. */
-                snprintf(response, 63, "%d %s", 1 + msg_num, hex_digest(curmsg->hash));
+                 * See RFC1939. Only the hash of this message is computed. */
+                if (!(hash = mailbox_message_hash(c->m, msg_num))) {
+                    connection_sendresponse(c, 0, _("Unable to compute unique ID for that message"));
+                    return;
+                }
+                snprintf(response, 63, "%d %s", 1 + msg_num, hex_digest(hash));
             }
 
             connection_sendresponse(c, 1, response);
         }
     } else {
-        struct indexpoint *m;
-        int nn = 0;
+        int i, nn = 0;
         char *idstyle;
 
-        if (!(connection_sendresponse(c, 1, _("ID list follows:"))))
-            return;
-
         if (!(idstyle = config_get_string("uidl-style")))
             idstyle = "tpop3d";
 
@@ -333,9 +425,13 @@ static void do_uidl(connection c, const int msg_num) {
            && strcmp(c->a->mboxdrv, "maildir") == 0)
         {
             char response[128] = {0};
-            for (m = c->m->index; m < c->m->index + c->m->num; ++m) {
-                if (!m->deleted) {
-                    snprintf(response, 127, "%d %s", 1 + m - c->m->index, 1 + strrchr(m->filename, '/'));
+
+            if (!(connection_sendresponse(c, 1, _("ID list follows:"))))
+                return;
+
+            for (i = 0; i < c->m->num; ++i) {
+                if (!mailbox_msg_deleted(c->m, i)) {
+                    snprintf(response, 127, "%d %s", 1 + i, 1 + strrchr(mailbox_msg_filename(c->m, i), '/'));
                     response[strcspn(response, ":")] = '\0';
                     if (!connection_sendline(c, response))
                         return;
@@ -354,9 +450,18 @@ static void do_uidl(connection c, const int msg_num) {
             if(strcmp(idstyle, "tpop3d") != 0)
                 log_print(LOG_WARNING, _("do_uidl: '%s' UIDLs not implemented, or not supported with '%s' mailbox, using fallback."), idstyle, c->a->mboxdrv);
 
-            for (m = c->m->index; m < c->m->index + c->m->num; ++m) {
-                if (!m->deleted) {
-                    snprintf(response, 63, "%d %s", 1 + m - c->m->index, hex_digest(m->hash));
+            /* Hashes are computed on demand; do all of them at once. */
+            if (mailbox_make_hashes(c->m) == -1) {
+                connection_sendresponse(c, 0, _("Unable to compute unique IDs"));
+                return;
+            }
+
+            if (!(connection_sendresponse(c, 1, _("ID list follows:"))))
+                return;
+
+            for (i = 0; i < c->m->num; ++i) {
+                if (!mailbox_msg_deleted(c->m, i)) {
+                    snprintf(response, 63, "%d %s", 1 + i, hex_digest(c->m->hash[i]));
                     if (!connection_sendline(c, response))
                         return;
                     ++nn;
@@ -376,17 +481,17 @@ static void do_uidl(connection c, const int msg_num) {
  * RETR command; send whole of message MSGNUM. */
 static enum connection_action do_retr(connection c, const int msg_num) {
     if (msg_num != -1) {
-        struct indexpoint *curmsg;
-        curmsg = c->m->index + msg_num;
-        if (curmsg->deleted)
+        if (mailbox_msg_deleted(c->m, msg_num))
             connection_sendresponse(c, 0, _("That message is no more."));
         else {
             int n;
             
             if (verbose)
                 log_print(LOG_DEBUG, _("do_retr: client %s: sending message %d (%d bytes)"),
-                        c->idstr, msg_num + 1, (int)curmsg->msglength);
+                        c->idstr, msg_num + 1, (int)c->m->msglength[msg_num]);
             
+            mailbox_prefetch_retr(c->m, msg_num);
+
             if ((n = c->m->sendmessage(c->m, c, msg_num, -1)) == -2)
                 return close_connection;
 
@@ -407,21 +512,18 @@ static enum connection_action do_retr(connection c, const int msg_num) {
 /* do_top CONNECTION MSGNUM NUM
  * TOP command; send headers and first NUM lines of message MSGNUM. */
 static enum connection_action do_top(connection c, const int msg_num, const int nlines) {
-    struct indexpoint *curmsg;
-    curmsg = c->m->index + msg_num;
-
     if (msg_num == -1)
         connection_sendresponse(c, 0, _("What do you want to see?"));
     else if (nlines == -1)
         connection_sendresponse(c, 0, _("But how much do you want to see?"));
-    else if (curmsg->deleted)
+    else if (mailbox_msg_deleted(c->m, msg_num))
         connection_sendresponse(c, 0, _("That message is no more."));
     else {
         int n;
         
         if (verbose)
             log_print(LOG_DEBUG, _("do_top: client %s: sending headers and up to %d lines of message %d (< %d bytes)"),
-                    c->idstr, nlines, msg_num + 1, (int)curmsg->msglength);
+                    c->idstr, nlines, msg_num + 1, (int)c->m->msglength[msg_num]);
         
         if ((n = c->m->sendmessage(c->m, c, msg_num, nlines)) == -2)
             return close_connection;
@@ -442,15 +544,12 @@ static enum connection_action do_top(connection c, const int msg_num, const int
 /* do_dele
  * DELE command; delete message. */
 void do_dele(connection c, const int msg_num) {
-    struct indexpoint *curmsg;
-    curmsg = c->m->index + msg_num;
-
     if (msg_num == -1)
         connection_sendresponse(c, 0, _("But which message do you want to delete?"));
     else {
-        curmsg->deleted = 1;
+        c->m->flags[msg_num] |= MSG_DELETED;
         ++c->m->numdeleted;
-        c->m->sizedeleted += curmsg->msglength;
+        c->m->sizedeleted += c->m->msglength[msg_num];
         connection_sendresponse(c, 1, _("Done."));
     }
 }
@@ -504,7 +603,12 @@ enum connection_action connection_do(connection c, const pop3command p) {
                     struct ioabs_tls *newio;
                     if (!(connection_sendresponse(c, 1, _("Begin TLS negotiation"))))
                         return close_connection;
-                    if ((newio = ioabs_tls_create(c, c->l))) {
+                    /* The response must have gone before the socket is
+                     * passed to a TLS worker. */
+                    if (buffer_available(c->wrb) == 0 && tlsworker_handoff(c, c->l)) {
+                        log_print(LOG_INFO, _("connection_do: client %s: negotiating TLS connection in worker"), c->idstr);
+                        return do_nothing;
+                    } else if ((newio = ioabs_tls_create(c, c->l))) {
                         log_print(LOG_INFO, _("connection_do: client %s: negotiating TLS connection"), c->idstr);
                         c->io->destroy(c);
                         c->io = (struct ioabs*)newio;
@@ -536,78 +640,11 @@ enum connection_action connection_do(connection c, const pop3command p) {
 
         /* Do we now have enough information to authenticate using USER/PASS? */
         if (!c->a && c->user && c->pass) {
-            c->a = authcontext_new_user_pass(c->user, NULL, c->domain, c->pass, c->remote_ip, c->local_ip);
-            
-            /* Maybe retry authentication with an added or removed domain name. */
-            if (!c->a && (append_domain || strip_domain)) {
-                int n, len;
-                char *domsep;
-                len = strlen(c->user);
-                if (!(domsep = config_get_string("domain-separators")))
-                    domsep = DOMAIN_SEPARATORS;
-                n = strcspn(c->user, domsep);
-                if (append_domain && c->domain && n == len)
-                    /* OK, if we have a domain name, try appending that. */
-                    c->a = authcontext_new_user_pass(c->user, c->user, c->domain, c->pass, c->remote_ip, c->local_ip);
-                else if (strip_domain && n != len) {
-                    /* Try stripping off the supplied domain name. */
-                    char *u;
-                    u = xstrdup(c->user);
-                    u[n] = 0;
-                    c->a = authcontext_new_user_pass(u, NULL, NULL, c->pass, c->remote_ip, c->local_ip);
-                    xfree(u);
-                }
-            }
-
-            if (c->a) {
-                /* Now save a new ID string for this client. */
-                xfree(c->idstr);
-                c->idstr =xmalloc(strlen(c->a->user) + 2 + strlen(inet_ntoa(c->sin.sin_addr)) + 16);
-                sprintf(c->idstr, "[%d]%s(%s)", c->s, c->a->user, inet_ntoa(c->sin.sin_addr));
-
-                memset(c->pass, 0, strlen(c->pass));
-                c->state = transaction;
-                return fork_and_setuid; /* Code in main.c sends response in case of error. */
-            } else {
-                enum connection_action act;
-
-                /*
-                 * It is useful for ISPs to be able to log failing passwords
-                 * sent by misconfigured clients. This is an invasion of
-                 * privacy, but there we go.
-                 */
-                if (log_bad_pass)
-                    log_print(LOG_INFO, _("connection_do: client `%s': username `%s': failing password is `%s'"), c->idstr, c->user, c->pass);
-                            
-                connection_freeze(c);
-                ++c->n_auth_tries;
-                if (c->n_auth_tries == MAX_AUTH_TRIES) {
-#ifndef NO_SNIDE_COMMENTS
-                    connection_sendresponse(c, 0, _("This is ridiculous. I give up."));
-#else
-                    connection_sendresponse(c, 0, _("Too many authentication attempts."));
-#endif
-                    log_print(LOG_ERR, _("connection_do: client `%s': username `%s': failed to log in after %d attempts"), c->idstr, c->user, MAX_AUTH_TRIES);
-                    act = close_connection;
-                } else {
-#ifndef NO_SNIDE_COMMENTS
-                    connection_sendresponse(c, 0, _("Lies! Try again!"));
-#else
-                    connection_sendresponse(c, 0, _("Authentication failed."));
-#endif
-                    log_print(LOG_ERR, _("connection_do: client `%s': username `%s': %d authentication failures"), c->idstr, c->user, c->n_auth_tries);
-                    act = do_nothing;
-                }
+            if (authworker_user_pass(c))
+                return do_nothing;  /* connection_auth_done is called on the reply */
 
-                memset(c->pass, 0, strlen(c->pass));
-                xfree(c->pass);
-                c->pass = NULL;
-
-                xfree(c->user);
-                c->user = NULL;
-                
-                return act;
-            }
+            c->a = authenticate_user_pass(c->user, c->domain, c->pass, c->remote_ip, c->local_ip);
+            return connection_auth_done(c);
         } else {
             connection_sendresponse(c, 1, c->pass ? _("What's your name?") : _("Tell me your password."));
             return do_nothing;
@@ -615,8 +652,7 @@ enum connection_action connection_do(connection c, const pop3command p) {
     } else if (c->state == transaction) { 
         /* Transaction state: do things to mailbox. */
         char *a = NULL;
-        int num_args, msg_num = -1, nlines = -1;
-        struct indexpoint *i, *curmsg;
+        int num_args, msg_num = -1, nlines = -1, i;
         mailbox curmbox;
         char response[32] = {0};
 
@@ -649,7 +685,6 @@ enum connection_action connection_do(connection c, const pop3command p) {
 #endif
                     return do_nothing;
                 }
-                curmsg = c->m->index + msg_num;
             }
         }
 
@@ -704,7 +739,7 @@ enum connection_action connection_do(connection c, const pop3command p) {
                 break;
 
             case RSET:
-                for (i = curmbox->index; i < curmbox->index + curmbox->num; ++i) i->deleted = 0;
+                for (i = 0; i < curmbox->num; ++i) curmbox->flags[i] &= ~MSG_DELETED;
                 curmbox->numdeleted = 0;
                 curmbox->sizedeleted = 0;
                 connection_sendresponse(c, 1, _("Done."));
@@ -31,9 +31,11 @@ static const char rcsid[] = "$Id$";
 
 #include <sys/wait.h>
 
+#include "authworker.h"
 #include "connection.h"
 #include "pidfile.h"
 #include "signals.h"
+#include "tlsworker.h"
 #include "util.h"
 
 #ifdef APPALLING_BACKTRACE_HACK
@@ -176,7 +178,13 @@ void child_signal_handler(const int i) {
                 close(auth_other_childrd);
             } else
 #endif /* AUTH_OTHER */
-            {
+            if (authworker_child_died(pid, status))
+                ; /* Dealt with in the main loop. */
+#ifdef USE_TLS
+            else if (tlsworker_child_died(pid, status))
+                ; /* Likewise. */
+#endif /* USE_TLS */
+            else {
                 --num_running_children;
                 /* If the child process was killed by a signal, save its PID
                  * so that the main daemon can report it. Note that we dont't
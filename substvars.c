@@ -151,6 +151,71 @@ fail:
 
 #undef SET_ERR
 
+/* parameterise_query SPEC STYLE NVARS NAMES PARAMS NPARAMS MAXPARAMS
+ * Turn an SQL query template SPEC, containing variables of the form $(foo)
+ * which would be substituted by substitute_variables, into a query with
+ * placeholders for use as a prepared statement. STYLE is `?' for `?'
+ * placeholders, or `$' for `$1', `$2', .... NAMES gives the NVARS variable
+ * names; the index into NAMES of the variable for each placeholder is saved in
+ * PARAMS, and the number of placeholders in *NPARAMS. A variable may be quoted
+ * by itself, as in '$(foo)', or appear unquoted. Returns a new string, or
+ * NULL if the template can't be turned into a prepared statement, for
+ * instance because a variable appears within a longer string constant or
+ * with a character index. */
+char *parameterise_query(const char *spec, const char style, const int nvars, const char **names, int *params, int *nparams, const int maxparams) {
+    const char *s;
+    char *res, *r, quote = 0;
+
+    /* A `$n' placeholder is at most 11 characters, and replaces at least 4. */
+    res = r = xmalloc(strlen(spec) * 3 + 1);
+    *nparams = 0;
+
+    for (s = spec; *s; ) {
+        const char *t;
+        int n, q;
+
+        /* Is there a variable here, perhaps quoted? */
+        q = (*s == '\'' && !quote);
+        t = s + q;
+        if (strncmp(t, "$(", 2) == 0) {
+            for (n = 0; n < nvars; ++n)
+                if (strncmp(t + 2, names[n], strlen(names[n])) == 0 && t[2 + strlen(names[n])] == ')')
+                    break;
+            if (n == nvars || quote || *nparams == maxparams)
+                goto fail;  /* unknown, indexed, within a string, or too many */
+            t += 2 + strlen(names[n]) + 1;
+            if (q) {
+                if (*t != '\'')
+                    goto fail;
+                ++t;
+            }
+            params[(*nparams)++] = n;
+            if (style == '$')
+                r += sprintf(r, "$%d", *nparams);
+            else
+                *r++ = '?';
+            s = t;
+            continue;
+        }
+
+        /* Keep track of string constants. */
+        if (quote && *s == '\\' && s[1])
+            *r++ = *s++;
+        else if (quote && *s == quote)
+            quote = 0;
+        else if (!quote && (*s == '\'' || *s == '"'))
+            quote = *s;
+        *r++ = *s++;
+    }
+
+    *r = 0;
+    return res;
+
+fail:
+    xfree(res);
+    return NULL;
+}
+
 
 #if 0
 /* Simple test program. */
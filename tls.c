@@ -31,10 +31,19 @@ static const char rcsid[] = "$Id$";
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <openssl/crypto.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 #include "config.h"
 #include "tls.h"
@@ -77,6 +86,308 @@ int tls_init(void) {
     return 1;
 }
 
+/*
+ * Session resumption. Handshakes happen either in the main server process,
+ * before the session child is forked, or in TLS workers (see tlsworker.c).
+ * The session cache which OpenSSL keeps in each SSL_CTX is private to the
+ * process doing the handshake: without workers every handshake sees the same
+ * cache; with them each worker has its own, and a client is always sent to
+ * the same worker, so no cache is shared between processes. We just make it
+ * last long enough to be useful to clients which reconnect every few minutes.
+ *
+ * We also issue RFC 5077 session tickets, encrypted under keys of our own
+ * rather than OpenSSL's default ones, so that the keys can be rotated: the
+ * main process makes a new random key every tls-ticket-key-rotation seconds,
+ * and tickets made under the previous key are accepted, and replaced, for one
+ * further period, after which that key is wiped. Only the main process makes
+ * keys; it sends each new one to the TLS workers (see tlsworker.c), so that a
+ * ticket issued by one worker can be used with any other. Session children and
+ * authentication workers, which never do handshakes, wipe the keys they
+ * inherit, so that no process keeps a key after its period is over.
+ */
+#define DEFAULT_SESSION_TIMEOUT         3600    /* seconds */
+#define DEFAULT_TICKET_KEY_ROTATION     3600    /* seconds */
+#define TLS_REPORT_INTERVAL             3600    /* seconds */
+
+static struct ticketkey {
+    unsigned char name[16], aeskey[32], mackey[32];
+    int valid;
+} ticketkeys[2];    /* current and previous */
+static int ticket_key_rotation = -1;
+static long ticket_key_period = -1;  /* when the current key was made */
+
+/* Each context we have made, and its counters at the last report. */
+static struct tlsctx {
+    SSL_CTX *ctx;
+    char *name;
+    long accept, hits, misses, timeouts;
+} *contexts;
+static int ncontexts;
+static unsigned long tickets_accepted, tickets_renewed;
+static time_t lastreport;
+
+/* install_ticket_key KEY
+ * Make KEY the current ticket key, keeping the current one as the previous
+ * and wiping the one before that. */
+static void install_ticket_key(const struct ticketkey *K) {
+    OPENSSL_cleanse(ticketkeys + 1, sizeof ticketkeys[1]);
+    if (ticketkeys[0].valid)
+        ticketkeys[1] = ticketkeys[0];
+    ticketkeys[0] = *K;
+    ticketkeys[0].valid = 1;
+}
+
+/* tls_rotate_ticket_keys
+ * In the main process, make a new ticket key if a new rotation period has
+ * begun. Returns 1 if it did, in which case the TLS workers should be sent the
+ * new key, or 0 otherwise. Call this from the main loop. */
+int tls_rotate_ticket_keys(void) {
+    struct ticketkey K;
+    long period;
+
+    if (ticket_key_rotation <= 0)
+        return 0;   /* not issuing tickets */
+
+    period = (long)time(NULL) / ticket_key_rotation;
+    if (ticket_key_period == period)
+        return 0;
+    ticket_key_period = period;
+
+    if (RAND_bytes(K.name, sizeof K.name) <= 0
+        || RAND_bytes(K.aeskey, sizeof K.aeskey) <= 0
+        || RAND_bytes(K.mackey, sizeof K.mackey) <= 0) {
+        /* Try again next period; until then the current key stays in use. */
+        log_print(LOG_ERR, "tls_rotate_ticket_keys: RAND_bytes: %s", tls_errorstr());
+        OPENSSL_cleanse(&K, sizeof K);
+        return 0;
+    }
+
+    install_ticket_key(&K);
+    OPENSSL_cleanse(&K, sizeof K);
+    return 1;
+}
+
+/* tls_get_ticket_key BUF
+ * Copy the current ticket key into BUF, which must have room for
+ * TLS_TICKET_KEY_LEN bytes. Returns 1 on success or 0 if there is no key. */
+int tls_get_ticket_key(unsigned char *buf) {
+    const struct ticketkey *K = ticketkeys;
+    if (!K->valid)
+        return 0;
+    memcpy(buf, K->name, sizeof K->name);
+    memcpy(buf + sizeof K->name, K->aeskey, sizeof K->aeskey);
+    memcpy(buf + sizeof K->name + sizeof K->aeskey, K->mackey, sizeof K->mackey);
+    return 1;
+}
+
+/* tls_set_ticket_key BUF
+ * In a TLS worker, make the TLS_TICKET_KEY_LEN bytes at BUF, sent by the main
+ * process, the current ticket key. */
+void tls_set_ticket_key(const unsigned char *buf) {
+    struct ticketkey K;
+
+    memcpy(K.name, buf, sizeof K.name);
+    if (ticketkeys[0].valid && memcmp(K.name, ticketkeys[0].name, sizeof K.name) == 0)
+        return; /* already have it */
+    memcpy(K.aeskey, buf + sizeof K.name, sizeof K.aeskey);
+    memcpy(K.mackey, buf + sizeof K.name + sizeof K.aeskey, sizeof K.mackey);
+
+    install_ticket_key(&K);
+    OPENSSL_cleanse(&K, sizeof K);
+}
+
+/* tls_postfork
+ * In a session child or authentication worker, which does no handshakes,
+ * wipe the ticket keys. */
+void tls_postfork(void) {
+    OPENSSL_cleanse(ticketkeys, sizeof ticketkeys);
+    ticket_key_rotation = -1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#   define TICKET_MAC_CTX   EVP_MAC_CTX
+#else
+#   define TICKET_MAC_CTX   HMAC_CTX
+#endif
+
+/* set_mac_key MACCTX KEY
+ * Set up MACCTX to compute an HMAC-SHA256 under KEY. */
+static int set_mac_key(TICKET_MAC_CTX *hctx, const struct ticketkey *K) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void*)K->mackey, sizeof K->mackey);
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+#else
+    return HMAC_Init_ex(hctx, K->mackey, sizeof K->mackey, EVP_sha256(), NULL);
+#endif
+}
+
+/* ticket_key_callback SSL NAME IV CIPHERCTX MACCTX ENCRYPT
+ * Called by OpenSSL to set up the encryption of a new session ticket, if
+ * ENCRYPT is nonzero, or the decryption of one presented by the client. See
+ * SSL_CTX_set_tlsext_ticket_key_cb(3). */
+static int ticket_key_callback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cctx, TICKET_MAC_CTX *hctx, int enc) {
+    struct ticketkey *K;
+
+    if (enc) {
+        K = ticketkeys;
+        if (!K->valid)
+            return 0;   /* no key; don't issue a ticket */
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+            return -1;
+        memcpy(name, K->name, sizeof K->name);
+        if (!EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, K->aeskey, iv) || !set_mac_key(hctx, K))
+            return -1;
+        return 1;
+    }
+
+    for (K = ticketkeys; K < ticketkeys + 2; ++K)
+        if (K->valid && memcmp(name, K->name, sizeof K->name) == 0)
+            break;
+    if (K == ticketkeys + 2)
+        return 0;   /* unknown or expired key; do a full handshake */
+
+    if (!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, K->aeskey, iv) || !set_mac_key(hctx, K))
+        return -1;
+
+    ++tickets_accepted;
+    if (K == ticketkeys)
+        return 1;
+    else {
+        /* Accept it, but give the client a ticket under the current key. */
+        ++tickets_renewed;
+        return 2;
+    }
+}
+
+/* setup_session_resumption CONTEXT
+ * Configure session caching and tickets on CONTEXT. */
+static void setup_session_resumption(SSL_CTX *ctx) {
+    static const unsigned char sid_ctx[] = "tpop3d";
+    int n;
+
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof sid_ctx - 1);
+
+    switch (config_get_int("tls-session-cache-size", &n)) {
+        case -1:
+            log_print(LOG_ERR, _("tls_create_context: value given for tls-session-cache-size does not make sense; using default"));
+            break;
+        case 1:
+            if (n < 0)
+                log_print(LOG_ERR, _("tls_create_context: value given for tls-session-cache-size must be zero or positive; using default"));
+            else if (n == 0)
+                SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+            else
+                SSL_CTX_sess_set_cache_size(ctx, n);
+            break;
+    }
+
+    switch (config_get_int("tls-session-timeout", &n)) {
+        case -1:
+            log_print(LOG_ERR, _("tls_create_context: value given for tls-session-timeout does not make sense; using default"));
+            /* fall through */
+        case 0:
+            n = DEFAULT_SESSION_TIMEOUT;
+            break;
+        case 1:
+            if (n <= 0) {
+                log_print(LOG_ERR, _("tls_create_context: value given for tls-session-timeout must be positive; using default"));
+                n = DEFAULT_SESSION_TIMEOUT;
+            }
+            break;
+    }
+    SSL_CTX_set_timeout(ctx, n);
+
+    if (config_get_bool("tls-no-session-tickets")) {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        return;
+    }
+
+    if (ticket_key_rotation == -1) {
+        switch (config_get_int("tls-ticket-key-rotation", &ticket_key_rotation)) {
+            case -1:
+                log_print(LOG_ERR, _("tls_create_context: value given for tls-ticket-key-rotation does not make sense; using default"));
+                /* fall through */
+            case 0:
+                ticket_key_rotation = DEFAULT_TICKET_KEY_ROTATION;
+                break;
+            case 1:
+                if (ticket_key_rotation <= 0) {
+                    log_print(LOG_ERR, _("tls_create_context: value given for tls-ticket-key-rotation must be positive; using default"));
+                    ticket_key_rotation = DEFAULT_TICKET_KEY_ROTATION;
+                }
+                break;
+        }
+
+        /* Make the first key now, so that TLS workers start with it. */
+        tls_rotate_ticket_keys();
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_callback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_callback);
+#endif
+}
+
+/* tls_describe_session SSL
+ * Return a description of the protocol and cipher used by SSL, whether it
+ * resumed an earlier session and whether the kernel is doing the encryption,
+ * in a static buffer. */
+const char *tls_describe_session(SSL *ssl) {
+    static char buf[128];
+    int ktls = 0;
+#ifdef SSL_OP_ENABLE_KTLS
+    ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+#endif /* SSL_OP_ENABLE_KTLS */
+    snprintf(buf, sizeof buf, _("%s session using %s%s%s"),
+                SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+                SSL_session_reused(ssl) ? _(", resumed") : "",
+                ktls ? _(", kernel TLS") : "");
+    return buf;
+}
+
+/* tls_report_stats
+ * Every TLS_REPORT_INTERVAL seconds, log how many handshakes each context has
+ * done and how many of them resumed an earlier session. Call this from the
+ * main loop. */
+void tls_report_stats(void) {
+    struct tlsctx *T;
+    time_t now;
+
+    time(&now);
+    if (!lastreport)
+        lastreport = now;
+    if (now < lastreport + TLS_REPORT_INTERVAL && now >= lastreport)
+        return;
+
+    for (T = contexts; T < contexts + ncontexts; ++T) {
+        long accept, hits, misses, timeouts;
+
+        accept = SSL_CTX_sess_accept(T->ctx) - T->accept;
+        hits = SSL_CTX_sess_hits(T->ctx) - T->hits;
+        misses = SSL_CTX_sess_misses(T->ctx) - T->misses;
+        timeouts = SSL_CTX_sess_timeouts(T->ctx) - T->timeouts;
+
+        if (accept > 0)
+            log_print(LOG_INFO, _("tls_report_stats: %s: %ld handshakes, %ld (%.0f%%) resumed; %ld sessions not found, %ld expired; %ld sessions cached"),
+                        T->name, accept, hits, 100. * hits / accept, misses, timeouts, SSL_CTX_sess_number(T->ctx));
+
+        T->accept += accept;
+        T->hits += hits;
+        T->misses += misses;
+        T->timeouts += timeouts;
+    }
+
+    if (tickets_accepted)
+        log_print(LOG_INFO, _("tls_report_stats: %lu sessions resumed from tickets, %lu of them under the previous key"), tickets_accepted, tickets_renewed);
+    tickets_accepted = tickets_renewed = 0;
+
+    lastreport = now;
+}
+
 /* tls_create_context CERTFILE PKEYFILE
  * Create a new SSL_CTX, reading the certificate and private key from CERTFILE
  * and PKEYFILE. If PKEYFILE is NULL, then we attempt to read the private key
@@ -121,12 +432,38 @@ SSL_CTX *tls_create_context(const char *certfile, const char *pkeyfile) {
     if (!config_get_bool("tls-no-bug-workarounds"))
         SSL_CTX_set_options(ctx, SSL_OP_ALL);   /* bug workarounds */
 
+    /* Once the handshake is done, have the kernel encrypt and decrypt records
+     * where it can, so that SSL_write and SSL_read become plain write(2) and
+     * read(2) calls. OpenSSL falls back to doing the work itself if the
+     * kernel or the negotiated cipher does not support this. */
+    if (config_get_bool("tls-kernel-offload")) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+        log_print(LOG_WARNING, _("tls_create_context: tls-kernel-offload specified, but this version of OpenSSL does not support kernel TLS"));
+#endif /* SSL_OP_ENABLE_KTLS */
+    }
+
+    setup_session_resumption(ctx);
+
+    contexts = xrealloc(contexts, (ncontexts + 1) * sizeof *contexts);
+    memset(contexts + ncontexts, 0, sizeof *contexts);
+    contexts[ncontexts].ctx = ctx;
+    contexts[ncontexts++].name = xstrdup(certfile);
+
     return ctx;
 }
 
 /* tls_close:
  * Shut down TLS stuff. */
 void tls_close(SSL_CTX *ctx) {
+    int i;
+    for (i = 0; i < ncontexts; ++i)
+        if (contexts[i].ctx == ctx) {
+            xfree(contexts[i].name);
+            contexts[i] = contexts[--ncontexts];
+            break;
+        }
     SSL_CTX_free(ctx);
 }
 
@@ -27,5 +27,14 @@
 int tls_init(void);
 SSL_CTX *tls_create_context(const char *certfile, const char *pkeyfile);
 void tls_close(SSL_CTX *ctx);
+const char *tls_describe_session(SSL *ssl);
+void tls_report_stats(void);
+
+#define TLS_TICKET_KEY_LEN  80      /* name, AES key and HMAC key */
+
+int tls_rotate_ticket_keys(void);
+int tls_get_ticket_key(unsigned char *buf);
+void tls_set_ticket_key(const unsigned char *buf);
+void tls_postfork(void);
 
 #endif /* __TLS_H_ */
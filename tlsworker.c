@@ -0,0 +1,761 @@
+/*
+ * tlsworker.c:
+ * Do TLS handshakes, and the encryption for the rest of each session, in a
+ * pool of worker processes, so that they can use more than one processor.
+ *
+ * Copyright (c) 2026 the tpop3d contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+static const char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#include "configuration.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifdef USE_TLS
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "poll.h"
+
+#include "authswitch.h"
+#include "authworker.h"
+#include "buffer.h"
+#include "connection.h"
+#include "listener.h"
+#include "tls.h"
+#include "tlsworker.h"
+#include "util.h"
+#include "vector.h"
+
+/*
+ * Theory of operation:
+ *
+ * All connections are accepted, and their POP3 sessions run, in the main
+ * process or in the session children forked from it, as usual. But when
+ * tls-workers is set, a connection which is about to start a TLS handshake --
+ * a new connection to a listener in immediate mode, or one which has just
+ * been told to go ahead after STLS -- is handed to one of that many worker
+ * processes. The main process makes a socketpair, sends the client's socket
+ * and one end of the pair to the worker over a UNIX socket, and puts the
+ * other end of the pair in place of the client's socket, so that from then
+ * on the connection looks to the rest of the server just like a plain TCP
+ * one. The worker does the handshake and then, for as long as the session
+ * lasts, decrypts what the client sends and passes it on through the
+ * socketpair, and encrypts what comes back.
+ *
+ * OpenSSL has no way to move an established session from one process to
+ * another, so the worker must keep the session to the end; each byte of a
+ * session passes through one more process than it otherwise would. In
+ * return, handshakes, which are expensive and were done one at a time in the
+ * main process, can use as many processors as there are workers.
+ *
+ * A client is sent to the worker chosen by its address, so that a client
+ * which reconnects finds its session in the same worker's cache. Session
+ * tickets can be decrypted by any worker: the main process sends each new
+ * ticket key to all of them over the same UNIX socket.
+ *
+ * If the main process goes away, or re-executes itself on SIGHUP, a worker
+ * sees end-of-file on its socket and exits once its existing sessions have
+ * finished; a worker which dies is replaced from the main loop, though its
+ * sessions are lost. If no worker can take a connection the handshake is done
+ * in the main process as it would be without workers.
+ */
+
+#define WORKER_RESPAWN_INTERVAL 1       /* seconds */
+#define PROXY_BUFFER_SIZE       16384
+
+int num_tls_workers = 0;
+
+extern int post_fork;                   /* in netloop.c */
+extern int tcp_send_buf;                /* in netloop.c */
+extern vector listeners;
+extern connection *connections;
+extern size_t max_connections;
+
+static struct tlsworker {
+    volatile pid_t pid;
+    volatile sig_atomic_t died;
+    volatile int status;
+    int fd;
+    time_t spawned;
+    int key_pending;            /* new ticket key not yet sent */
+} *workers;
+
+/* struct proxy:
+ * In a worker, a connection whose traffic is being passed between the client
+ * and the main process or session child. */
+struct proxy {
+    int s, s_index;             /* TLS socket to the client */
+    int p, p_index;             /* plaintext socket to the server */
+    SSL *ssl;
+    char *idstr;
+    int handshaking, failed;
+    short read_wants, write_wants;  /* what SSL_read/SSL_write are waiting for */
+    int client_eof, server_eof;
+    buffer up;                  /* from client, to be written to server */
+    buffer down;                /* from server, to be sent to client */
+};
+
+static struct proxy **proxies;
+static size_t nproxies, proxies_size;
+
+/* struct ctlmsg:
+ * A message from the main process to a worker: either a connection to take
+ * over, whose two sockets come with the message, or a new session ticket
+ * key. */
+struct ctlmsg {
+    enum { ctl_handoff, ctl_ticketkey } type;
+    unsigned int idx;                           /* listener, for ctl_handoff */
+    unsigned char key[TLS_TICKET_KEY_LEN];      /* for ctl_ticketkey */
+};
+
+/* proxy_new CLIENT SERVER CONTEXT
+ * Start a TLS handshake on the socket CLIENT, using CONTEXT, and pass the
+ * plaintext to and from the socket SERVER. Returns the new proxy or NULL on
+ * failure, in which case both sockets are closed. */
+static struct proxy *proxy_new(int s, int p, SSL_CTX *ctx) {
+    struct proxy *P;
+    struct sockaddr_in sin;
+    socklen_t l;
+    const char *addr = "unknown";
+
+    l = sizeof sin;
+    if (getpeername(s, (struct sockaddr*)&sin, &l) == 0)
+        addr = inet_ntoa(sin.sin_addr);
+
+    alloc_struct(proxy, P);
+    P->s = s;
+    P->p = p;
+    P->idstr = xmalloc(strlen(addr) + 16);
+    sprintf(P->idstr, "[%d]%s", s, addr);
+
+    if (fcntl(s, F_SETFL, O_NONBLOCK) == -1 || fcntl(p, F_SETFL, O_NONBLOCK) == -1) {
+        log_print(LOG_ERR, "proxy_new: client %s: fcntl: %m", P->idstr);
+        goto fail;
+    } else if (!(P->ssl = SSL_new(ctx))) {
+        log_print(LOG_ERR, _("proxy_new: client %s: %s"), P->idstr, ERR_reason_error_string(ERR_get_error()));
+        goto fail;
+    }
+
+    SSL_set_mode(P->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* Many clients just drop the connection after QUIT. POP3 has its own way
+     * of saying that it has finished, so don't treat that as an error, which
+     * would also throw away the session. */
+    SSL_set_options(P->ssl, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    SSL_set_fd(P->ssl, s);
+
+    P->handshaking = 1;
+    P->read_wants = POLLIN;
+    P->write_wants = POLLOUT;
+    P->up = buffer_new(PROXY_BUFFER_SIZE);
+    P->down = buffer_new(PROXY_BUFFER_SIZE);
+
+    return P;
+
+fail:
+    close(s);
+    close(p);
+    xfree(P->idstr);
+    xfree(P);
+    return NULL;
+}
+
+/* proxy_delete PROXY
+ * Close the sockets of PROXY and free it. */
+static void proxy_delete(struct proxy *P) {
+    /* Unless something went wrong, keep the session for resumption, which
+     * SSL_free would not do if we haven't sent a close alert. */
+    if (P->ssl && !P->handshaking && !P->failed)
+        SSL_set_shutdown(P->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    if (P->ssl) SSL_free(P->ssl);
+    close(P->s);
+    close(P->p);
+    if (P->up) buffer_delete(P->up);
+    if (P->down) buffer_delete(P->down);
+    xfree(P->idstr);
+    xfree(P);
+}
+
+/* proxy_ssl_error PROXY WHAT RESULT WANTS
+ * Deal with a RESULT of zero or less from the SSL_... function WHAT on PROXY.
+ * If it needs to wait for the socket, save the event it is waiting for in
+ * *WANTS and return 1; otherwise log any error and return 0. */
+static int proxy_ssl_error(struct proxy *P, const char *what, int r, short *wants) {
+    unsigned long e;
+    switch (SSL_get_error(P->ssl, r)) {
+        case SSL_ERROR_WANT_READ:
+            *wants = POLLIN;
+            return 1;
+
+        case SSL_ERROR_WANT_WRITE:
+            *wants = POLLOUT;
+            return 1;
+
+        case SSL_ERROR_ZERO_RETURN:
+            break;  /* closed by peer */
+
+        case SSL_ERROR_SYSCALL:
+            if ((e = ERR_get_error())) {
+                log_print(LOG_ERR, _("proxy_run: client %s: %s: %s"), P->idstr, what, ERR_reason_error_string(e));
+                P->failed = 1;
+            } else if (r == -1 && errno != ECONNRESET && errno != EPIPE)
+                log_print(LOG_ERR, _("proxy_run: client %s: %s: %m"), P->idstr, what);
+            break;
+
+        case SSL_ERROR_SSL:
+        default:
+            log_print(LOG_ERR, _("proxy_run: client %s: %s: %s"), P->idstr, what, ERR_reason_error_string(ERR_get_error()));
+            P->failed = 1;
+            break;
+    }
+    return 0;
+}
+
+/* proxy_pre_select PROXY N PFDS
+ * Add the sockets of PROXY to PFDS, with the events we are waiting for. */
+static void proxy_pre_select(struct proxy *P, int *n, struct pollfd *pfds) {
+    short sev = 0, pev = 0;
+
+    if (P->handshaking)
+        sev = P->read_wants;    /* SSL_accept's wants are kept here */
+    else {
+        if (!P->client_eof && buffer_available(P->up) < PROXY_BUFFER_SIZE)
+            sev |= P->read_wants;
+        if (buffer_available(P->down) > 0)
+            sev |= P->write_wants;
+        if (!P->server_eof && buffer_available(P->down) < PROXY_BUFFER_SIZE)
+            pev |= POLLIN;
+        if (buffer_available(P->up) > 0)
+            pev |= POLLOUT;
+    }
+
+    /* Even with no events requested we are told if the server closes its end
+     * of the socketpair, say because the session timed out. A socket which
+     * has reached end-of-file is left out, since poll would report it every
+     * time. */
+    pfds[*n].fd = P->client_eof ? -1 : P->s;
+    pfds[*n].events = sev;
+    P->s_index = (*n)++;
+    pfds[*n].fd = P->server_eof ? -1 : P->p;
+    pfds[*n].events = pev;
+    P->p_index = (*n)++;
+}
+
+/* proxy_run PROXY PFDS
+ * Move data through PROXY in whichever directions it can go. Returns 1 if
+ * the proxy should continue, or 0 if it has finished. */
+static int proxy_run(struct proxy *P, struct pollfd *pfds) {
+    short srev, prev;
+    int scanread, scanwrite, pcanread, pcanwrite, progress;
+
+    srev = pfds[P->s_index].revents;
+    prev = pfds[P->p_index].revents;
+    scanread  = srev & (POLLIN | POLLHUP | POLLERR);
+    scanwrite = srev & (POLLOUT | POLLERR);
+    pcanread  = prev & (POLLIN | POLLHUP | POLLERR);
+    pcanwrite = prev & (POLLOUT | POLLERR);
+
+    if (P->handshaking) {
+        int r;
+        if (prev & (POLLHUP | POLLERR))
+            return 0;   /* server gave up on the connection */
+        else if (!(P->read_wants == POLLIN ? scanread : scanwrite))
+            return 1;
+        else if ((r = SSL_accept(P->ssl)) <= 0)
+            return proxy_ssl_error(P, "SSL_accept", r, &P->read_wants);
+        P->handshaking = 0;
+        P->read_wants = POLLIN;
+        log_print(LOG_DEBUG, _("proxy_run: client %s: %s"), P->idstr, tls_describe_session(P->ssl));
+        /* Anything the server has already sent (the greeting) can go now. */
+        pcanread = 1;
+    }
+
+    do {
+        ssize_t n;
+        size_t len;
+        char *b;
+
+        progress = 0;
+
+        /* Client to us. OpenSSL may hold decrypted data we haven't had. */
+        if (!P->client_eof && buffer_available(P->up) < PROXY_BUFFER_SIZE
+            && ((P->read_wants == POLLIN ? scanread : scanwrite) || SSL_pending(P->ssl))) {
+            buffer_expand(P->up, PROXY_BUFFER_SIZE);
+            b = buffer_get_push_ptr(P->up, &len);
+            if ((n = SSL_read(P->ssl, b, len)) > 0) {
+                buffer_push_bytes(P->up, n);
+                P->read_wants = POLLIN;
+                progress = 1;
+            } else if (proxy_ssl_error(P, "SSL_read", n, &P->read_wants)) {
+                if (P->read_wants == POLLIN) scanread = 0;
+                else scanwrite = 0;
+            } else
+                P->client_eof = 1;
+        }
+
+        /* Us to server. */
+        if (pcanwrite && (b = buffer_get_consume_ptr(P->up, &len))) {
+            if ((n = write(P->p, b, len)) > 0) {
+                buffer_consume_bytes(P->up, n);
+                progress = 1;
+            } else if (n == -1 && errno == EAGAIN)
+                pcanwrite = 0;
+            else if (n == -1 && errno != EINTR)
+                return 0;   /* server has gone away */
+        }
+
+        /* Server to us. */
+        if (!P->server_eof && pcanread && buffer_available(P->down) < PROXY_BUFFER_SIZE) {
+            buffer_expand(P->down, PROXY_BUFFER_SIZE);
+            b = buffer_get_push_ptr(P->down, &len);
+            if ((n = read(P->p, b, len)) > 0) {
+                buffer_push_bytes(P->down, n);
+                progress = 1;
+            } else if (n == 0)
+                P->server_eof = 1;
+            else if (errno == EAGAIN)
+                pcanread = 0;
+            else if (errno != EINTR)
+                P->server_eof = 1;
+        }
+
+        /* Us to client. SSL_write must be retried with the same data, which
+         * is why the buffer is made contiguous. */
+        if (!P->client_eof && buffer_available(P->down) > 0
+            && (P->write_wants == POLLIN ? scanread : scanwrite)) {
+            buffer_make_contiguous(P->down);
+            b = buffer_get_consume_ptr(P->down, &len);
+            if ((n = SSL_write(P->ssl, b, len)) > 0) {
+                buffer_consume_bytes(P->down, n);
+                P->write_wants = POLLOUT;
+                progress = 1;
+            } else if (proxy_ssl_error(P, "SSL_write", n, &P->write_wants)) {
+                if (P->write_wants == POLLIN) scanread = 0;
+                else scanwrite = 0;
+            } else
+                P->client_eof = 1;
+        }
+    } while (progress);
+
+    /* Once the client has gone and everything it sent has been passed on, or
+     * the server has finished and everything it sent has been encrypted, we
+     * are done. In the latter case we try to say goodbye properly, which also
+     * keeps the session in the cache. */
+    if (P->client_eof && buffer_available(P->up) == 0)
+        return 0;
+    else if (P->server_eof && buffer_available(P->down) == 0) {
+        SSL_shutdown(P->ssl);
+        return 0;
+    } else
+        return 1;
+}
+
+/* receive_message FD
+ * Receive a message from the main process on *FD; start proxying the
+ * connection it hands over or install the ticket key it carries. If the main
+ * process has gone away, close *FD and set it to -1. */
+static void receive_message(int *fd) {
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    int fds[2] = {-1, -1}, nfds = 0;
+    struct ctlmsg m;
+    ssize_t n;
+    struct proxy *P;
+
+    iov.iov_base = &m;
+    iov.iov_len = sizeof m;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+
+    if ((n = recvmsg(*fd, &msg, 0)) == 0) {
+        close(*fd);
+        *fd = -1;
+        return;
+    } else if (n == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+            log_print(LOG_ERR, "receive_message: recvmsg: %m");
+            close(*fd);
+            *fd = -1;
+        }
+        return;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (nfds > 2) nfds = 2;
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+
+    if (n == sizeof m && nfds == 0 && m.type == ctl_ticketkey) {
+        tls_set_ticket_key(m.key);
+        OPENSSL_cleanse(&m, sizeof m);
+        return;
+    } else if (n != sizeof m || nfds != 2 || (msg.msg_flags & MSG_CTRUNC) || m.type != ctl_handoff || m.idx >= listeners->n_used) {
+        log_print(LOG_ERR, _("receive_message: malformed message from main process"));
+        if (fds[0] != -1) close(fds[0]);
+        if (fds[1] != -1) close(fds[1]);
+        OPENSSL_cleanse(&m, sizeof m);
+        return;
+    }
+
+    if (!(P = proxy_new(fds[0], fds[1], ((listener)listeners->ary[m.idx].v)->tls.ctx)))
+        return;
+
+    if (nproxies == proxies_size)
+        proxies = xrealloc(proxies, (proxies_size = 2 * proxies_size + 16) * sizeof *proxies);
+    proxies[nproxies++] = P;
+}
+
+/* worker_main FD
+ * Main loop of a worker, which receives connections from the main process on
+ * FD. Does not return. */
+static NORETURN void worker_main(int fd) {
+    struct pollfd *pfds = NULL;
+    size_t pfds_size = 0;
+
+    post_fork = 1;  /* Don't remove the PID file if we crash. */
+    xsignal(SIGINT, SIG_DFL);
+    xsignal(SIGTERM, SIG_DFL);
+    xsignal(SIGHUP, SIG_IGN);
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    while (fd != -1 || nproxies > 0) {
+        size_t i, j;
+        int n = 0, ctl_index = -1;
+
+        if (pfds_size < 1 + 2 * nproxies)
+            pfds = xrealloc(pfds, (pfds_size = 2 * (1 + 2 * nproxies)) * sizeof *pfds);
+        memset(pfds, 0, pfds_size * sizeof *pfds);
+
+        if (fd != -1) {
+            pfds[n].fd = fd;
+            pfds[n].events = POLLIN;
+            ctl_index = n++;
+        }
+        for (i = 0; i < nproxies; ++i)
+            proxy_pre_select(proxies[i], &n, pfds);
+
+        if (poll(pfds, n, 1000) == -1) {
+            if (errno != EINTR) {
+                log_print(LOG_ERR, "worker_main: poll: %m");
+                break;
+            }
+            continue;
+        }
+
+        /* Run the existing proxies before adding any new ones, which have no
+         * slots in pfds yet. */
+        for (i = j = 0; i < nproxies; ++i)
+            if (proxy_run(proxies[i], pfds))
+                proxies[j++] = proxies[i];
+            else
+                proxy_delete(proxies[i]);
+        nproxies = j;
+
+        if (ctl_index != -1 && (pfds[ctl_index].revents & (POLLIN | POLLHUP | POLLERR)))
+            receive_message(&fd);
+
+        tls_report_stats();
+    }
+
+    _exit(0);
+}
+
+/* discard_master_state
+ * In a new TLS worker, drop the authentication drivers and cache, which it has
+ * no use for. The listeners are kept for their TLS contexts. */
+static void discard_master_state(void) {
+    authswitch_postfork();
+    authcache_close();
+}
+
+/* spawn_worker WORKER
+ * Start a new process for WORKER. Returns 1 on success or 0 on failure. */
+static int spawn_worker(struct tlsworker *w) {
+    time(&w->spawned);
+    w->died = 0;
+    w->key_pending = 0;     /* it inherits the keys we have now */
+
+    if (!fork_worker(&w->pid, &w->fd, discard_master_state, worker_main))
+        return 0;
+
+    log_print(LOG_DEBUG, _("spawn_worker: started TLS worker %d"), (int)w->pid);
+    return 1;
+}
+
+/* tlsworker_init:
+ * Start the worker processes. Returns 1 on success or 0 on failure. */
+int tlsworker_init(void) {
+    struct tlsworker *w;
+    item *t;
+    int ntls = 0;
+
+    vector_iterate(listeners, t)
+        if (((listener)t->v)->tls.mode != none)
+            ++ntls;
+    if (!ntls) {
+        log_print(LOG_WARNING, _("tlsworker_init: tls-workers specified, but no listeners use TLS; not starting workers"));
+        num_tls_workers = 0;
+        return 1;
+    }
+
+    workers = xcalloc(num_tls_workers, sizeof *workers);
+    for (w = workers; w < workers + num_tls_workers; ++w) {
+        w->fd = -1;
+        if (!spawn_worker(w))
+            return 0;
+    }
+
+    log_print(LOG_INFO, _("tlsworker_init: started %d TLS workers"), num_tls_workers);
+
+    return 1;
+}
+
+/* tlsworker_handoff CONNECTION LISTENER
+ * CONNECTION is about to start a TLS handshake using the context of
+ * LISTENER. Pass its socket to a worker, and replace it with a socket on
+ * which the worker will exchange the plaintext of the session. Returns 1 on
+ * success, or 0 if no worker could take the connection, in which case the
+ * handshake should be done here. */
+int tlsworker_handoff(connection c, listener L) {
+    struct tlsworker *w;
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(2 * sizeof(int))];
+    struct ctlmsg m = {0};
+    int sv[2], i;
+    ssize_t n;
+    item *t;
+
+    if (!num_tls_workers)
+        return 0;
+
+    /* Choose a worker by the client's address, so that the client finds its
+     * session in the same cache if it reconnects. */
+    w = workers + ntohl(c->sin.sin_addr.s_addr) % num_tls_workers;
+    for (i = 0; w->fd == -1 && i < num_tls_workers; ++i)
+        if (++w == workers + num_tls_workers)
+            w = workers;
+    if (w->fd == -1)
+        return 0;
+
+    m.type = ctl_handoff;
+    vector_iterate(listeners, t) {
+        if ((listener)t->v == L)
+            break;
+        ++m.idx;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        log_print(LOG_ERR, "tlsworker_handoff: socketpair: %m");
+        return 0;
+    }
+
+    iov.iov_base = &m;
+    iov.iov_len = sizeof m;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &c->s, sizeof(int));
+    memcpy(CMSG_DATA(cmsg) + sizeof(int), &sv[1], sizeof(int));
+
+    if ((n = sendmsg(w->fd, &msg, 0)) != sizeof m) {
+        /* A full socket means the worker is not keeping up. Otherwise it has
+         * probably died; a short write, which shouldn't happen, would leave
+         * the stream out of step, so we stop using it either way. */
+        if (n == -1 && errno == EAGAIN)
+            log_print(LOG_WARNING, _("tlsworker_handoff: client %s: worker %d is busy; doing handshake here"), c->idstr, (int)w->pid);
+        else {
+            if (n == -1)
+                log_print(LOG_ERR, "tlsworker_handoff: sendmsg: %m");
+            else
+                log_print(LOG_ERR, _("tlsworker_handoff: short write to worker %d"), (int)w->pid);
+            close(w->fd);
+            w->fd = -1;
+        }
+        close(sv[0]);
+        close(sv[1]);
+        return 0;
+    }
+
+    /* Put our end of the socketpair in place of the client's socket, keeping
+     * the same descriptor number, which appears in c->idstr. */
+    close(sv[1]);
+    if (dup2(sv[0], c->s) == -1) {
+        log_print(LOG_ERR, "tlsworker_handoff: dup2: %m");
+        close(sv[0]);
+        close(c->s);
+        c->s = -1;
+        c->cstate = closed;
+        return 1;   /* the client's socket is gone, so the connection is too */
+    }
+    close(sv[0]);
+    fcntl(c->s, F_SETFL, O_NONBLOCK);
+
+    /* The send buffer size set on the client's socket in
+     * listeners_post_select is a property of that socket, not of the
+     * descriptor, so set it again on ours. */
+    if (tcp_send_buf > 0 && setsockopt(c->s, SOL_SOCKET, SO_SNDBUF, &tcp_send_buf, sizeof tcp_send_buf) == -1)
+        log_print(LOG_WARNING, "tlsworker_handoff: setsockopt: %m");
+
+    c->secured = 1;
+
+    return 1;
+}
+
+/* send_ticket_key WORKER
+ * Send the current session ticket key to WORKER. If its socket is full, leave
+ * the key pending, to be sent from tlsworker_post_select. */
+static void send_ticket_key(struct tlsworker *w) {
+    struct ctlmsg m = {0};
+    ssize_t n;
+
+    m.type = ctl_ticketkey;
+    if (w->fd == -1 || !tls_get_ticket_key(m.key)) {
+        w->key_pending = 0;
+        return;
+    }
+
+    if ((n = send(w->fd, &m, sizeof m, 0)) == sizeof m)
+        w->key_pending = 0;
+    else if (n == -1 && errno == EAGAIN)
+        w->key_pending = 1;
+    else {
+        /* As in tlsworker_handoff, stop using the worker; it exits once its
+         * sessions are over, and is then replaced. */
+        if (n == -1)
+            log_print(LOG_ERR, "send_ticket_key: send: %m");
+        else
+            log_print(LOG_ERR, _("send_ticket_key: short write to worker %d"), (int)w->pid);
+        close(w->fd);
+        w->fd = -1;
+        w->key_pending = 0;
+    }
+
+    OPENSSL_cleanse(&m, sizeof m);
+}
+
+/* tlsworker_send_ticket_key:
+ * Send a new session ticket key, just made by tls_rotate_ticket_keys, to all
+ * the workers. */
+void tlsworker_send_ticket_key(void) {
+    struct tlsworker *w;
+    for (w = workers; w < workers + num_tls_workers; ++w)
+        send_ticket_key(w);
+}
+
+/* tlsworker_post_select:
+ * Called from the main loop to replace workers which have died, and to send
+ * any ticket key which a busy worker could not be sent before. */
+void tlsworker_post_select(void) {
+    struct tlsworker *w;
+    time_t now;
+
+    time(&now);
+    for (w = workers; w < workers + num_tls_workers; ++w) {
+        if (w->died) {
+            if (WIFSIGNALED(w->status))
+                log_print(LOG_ERR, _("tlsworker_post_select: worker %d killed by signal %d"), (int)w->pid, WTERMSIG(w->status));
+            else
+                log_print(LOG_ERR, _("tlsworker_post_select: worker %d exited with status %d"), (int)w->pid, WEXITSTATUS(w->status));
+            w->pid = 0;
+            w->died = 0;
+            if (w->fd != -1) close(w->fd);
+            w->fd = -1;
+        }
+
+        if (!w->pid && now >= w->spawned + WORKER_RESPAWN_INTERVAL)
+            spawn_worker(w);
+        else if (w->key_pending)
+            send_ticket_key(w);
+    }
+}
+
+/* tlsworker_child_died PID STATUS
+ * Called from the SIGCHLD handler; if PID is a worker, note that it has died
+ * and return 1, otherwise return 0. */
+int tlsworker_child_died(pid_t pid, int status) {
+    struct tlsworker *w;
+    for (w = workers; w < workers + num_tls_workers; ++w)
+        if (w->pid == pid) {
+            w->status = status;
+            w->died = 1;
+            return 1;
+        }
+    return 0;
+}
+
+/* tlsworker_postfork:
+ * In a session child or authentication worker, close our ends of the
+ * workers' sockets. */
+void tlsworker_postfork(void) {
+    struct tlsworker *w;
+    if (workers)
+        for (w = workers; w < workers + num_tls_workers; ++w)
+            if (w->fd != -1) close(w->fd);
+    workers = NULL;
+    num_tls_workers = 0;
+}
+
+/* tlsworker_close:
+ * Stop handing connections to the workers. Each exits once the sessions it
+ * is handling have finished. */
+void tlsworker_close(void) {
+    struct tlsworker *w;
+    for (w = workers; w < workers + num_tls_workers; ++w)
+        if (w->fd != -1) close(w->fd);
+    xfree(workers);
+    workers = NULL;
+    num_tls_workers = 0;
+}
+
+#endif /* USE_TLS */
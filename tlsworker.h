@@ -0,0 +1,41 @@
+/*
+ * tlsworker.h:
+ * pool of processes which do TLS handshakes and encryption
+ *
+ * Copyright (c) 2026 the tpop3d contributors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __TLSWORKER_H_ /* include guard */
+#define __TLSWORKER_H_
+
+#include <sys/types.h>
+
+#include "connection.h"
+#include "listener.h"
+
+extern int num_tls_workers;     /* Number of workers; 0 means none. */
+
+/* tlsworker.c */
+int tlsworker_init(void);
+int tlsworker_handoff(connection c, listener L);
+void tlsworker_send_ticket_key(void);
+void tlsworker_post_select(void);
+int tlsworker_child_died(pid_t pid, int status);
+void tlsworker_postfork(void);
+void tlsworker_close(void);
+
+#endif /* __TLSWORKER_H_ */
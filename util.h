@@ -43,6 +43,13 @@
 #   define DOMAIN_SEPARATORS    "@%!:"
 #endif
 
+/* For functions which never return, such as the main loops of workers. */
+#ifdef __GNUC__
+#   define NORETURN    __attribute__((noreturn))
+#else
+#   define NORETURN
+#endif
+
 #if 0
 /* Primitive memory-leak debugging. */
 char *mystrdup(char *f, int l, const char *s);
@@ -73,6 +80,9 @@ struct sverr {
 
 char *substitute_variables(const char *spec, struct sverr *err, const int nvars, ...);
 
+/* Function for turning $(...) in SQL into placeholders. */
+char *parameterise_query(const char *spec, const char style, const int nvars, const char **names, int *params, int *nparams, const int maxparams);
+
 /* Replacement logging functions. */
 void log_init(void);
 void log_print(int priority, const char *fmt, ...);